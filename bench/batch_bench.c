@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Compare static partitioning of a skewed batch across threads with
+ * the work-stealing batch interface. The batch is mostly 64-byte
+ * tokens with a few large blobs; with static partitioning, whichever
+ * threads are handed the blobs are still working long after the rest
+ * have finished. Prints the wall time of each approach and how busy
+ * each worker was, and the throughput of each NUMA node. The blobs
+ * are spread over the nodes, each allocated by a thread running on
+ * its node.
+ *
+ * usage: batch_bench [workers [blob size in MB]]
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+
+#include "scheduler.h"
+#include "topology.h"
+#include <cryptobox/batch.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+
+
+#define BENCH_TOKENS    20000
+#define BENCH_TOKEN     64
+#define BENCH_BLOBS     4
+#define BENCH_MAX       256
+
+
+struct bench_blob {
+        unsigned char           *data;
+        size_t                   size;
+        int                      node;
+};
+
+struct bench_slice {
+        pthread_t                thread;
+        struct secretbox_ctx    *ctx;
+        struct cryptobox_msg    *msgs;
+        int                      n;
+        uint64_t                 busy_ns;
+};
+
+
+static uint64_t
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+static void *
+seal_slice(void *arg)
+{
+        struct bench_slice      *slice = arg;
+        uint64_t                 start = now();
+        int                      i;
+
+        for (i = 0; i < slice->n; i++)
+                slice->msgs[i].out = secretbox_ctx_seal(slice->ctx,
+                    slice->msgs[i].in, slice->msgs[i].in_len,
+                    &slice->msgs[i].out_len);
+        slice->busy_ns = now() - start;
+        return NULL;
+}
+
+
+/*
+ * Allocate and fill a blob from a thread bound to its node, so that
+ * its pages are placed there.
+ */
+static void *
+place_blob(void *arg)
+{
+        struct bench_blob       *blob = arg;
+
+        topo_bind(blob->node);
+        if (NULL != (blob->data = malloc(blob->size)))
+                memset(blob->data, 0x5a, blob->size);
+        return NULL;
+}
+
+
+static void
+release(struct cryptobox_msg *msgs, int n)
+{
+        int     i;
+
+        for (i = 0; i < n; i++) {
+                free(msgs[i].out);
+                msgs[i].out = NULL;
+        }
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct bench_slice       slices[BENCH_MAX];
+        struct sched_stats       stats[BENCH_MAX];
+        struct bench_blob        blobs[BENCH_BLOBS];
+        struct cryptobox_msg    *msgs;
+        struct secretbox_ctx    *ctx;
+        unsigned char            key[SECRETBOX_KEY_SIZE];
+        unsigned char            token[BENCH_TOKEN];
+        pthread_t                placer;
+        uint64_t                 start, wall, bytes, busy;
+        size_t                   blob;
+        int                      workers = 8;
+        int                      n = BENCH_TOKENS + BENCH_BLOBS;
+        int                      per, nodes, node, count, i;
+
+        if (argc > 1)
+                workers = atoi(argv[1]);
+        blob = (size_t)(argc > 2 ? atoi(argv[2]) : 32) * 1024 * 1024;
+        if (workers < 1 || workers > BENCH_MAX || 0 == blob)
+                errx(EX_USAGE, "usage: batch_bench [workers [blob MB]]");
+
+        if (!secretbox_generate_key(key))
+                errx(EX_SOFTWARE, "failed to generate key");
+        if (NULL == (msgs = calloc(n, sizeof(struct cryptobox_msg))))
+                errx(EX_OSERR, "out of memory");
+        memset(token, 0x5a, sizeof token);
+        nodes = topo_nodes();
+        for (i = 0; i < BENCH_BLOBS; i++) {
+                blobs[i].size = blob;
+                blobs[i].node = i % nodes;
+                if (0 != pthread_create(&placer, NULL, place_blob, &blobs[i]))
+                        errx(EX_OSERR, "failed to start thread");
+                pthread_join(placer, NULL);
+                if (NULL == blobs[i].data)
+                        errx(EX_OSERR, "out of memory");
+        }
+
+        /*
+         * The blobs are bunched together, as they tend to be when a
+         * batch is built from a directory listing or a queue.
+         */
+        for (i = 0; i < n; i++) {
+                if (i < BENCH_BLOBS) {
+                        msgs[i].in = blobs[i].data;
+                        msgs[i].in_len = (int)blob;
+                } else {
+                        msgs[i].in = token;
+                        msgs[i].in_len = BENCH_TOKEN;
+                }
+        }
+        printf("%d messages: %d x %d bytes, %d x %lu MB, %d workers, "
+               "%d NUMA nodes\n", n, BENCH_TOKENS, BENCH_TOKEN, BENCH_BLOBS,
+               (unsigned long)(blob >> 20), workers, nodes);
+
+        if (NULL == (ctx = secretbox_ctx_new(key)))
+                errx(EX_SOFTWARE, "failed to set up key");
+        per = (n + workers - 1) / workers;
+        start = now();
+        for (i = 0; i < workers; i++) {
+                slices[i].ctx = ctx;
+                slices[i].msgs = msgs + i * per;
+                slices[i].n = i * per >= n ? 0 :
+                              (n - i * per < per ? n - i * per : per);
+                if (0 != pthread_create(&slices[i].thread, NULL, seal_slice,
+                                        &slices[i]))
+                        errx(EX_OSERR, "failed to start thread");
+        }
+        for (i = 0; i < workers; i++)
+                pthread_join(slices[i].thread, NULL);
+        wall = now() - start;
+        printf("static partitioning: %.3f s\n", wall / 1e9);
+        for (i = 0; i < workers; i++)
+                printf("  worker %3d: busy %5.1f%%\n", i,
+                       100.0 * slices[i].busy_ns / wall);
+        release(msgs, n);
+        secretbox_ctx_free(ctx);
+
+        if (!sched_start(workers))
+                errx(EX_OSERR, "failed to start workers");
+        sched_reset_stats();
+        start = now();
+        if (n != cryptobox_seal_batch(CRYPTOBOX_SECRETBOX, msgs, n, key))
+                errx(EX_SOFTWARE, "batch seal failed");
+        wall = now() - start;
+        sched_stats(stats, workers);
+        printf("work stealing: %.3f s\n", wall / 1e9);
+        for (i = 0; i < workers; i++)
+                printf("  worker %3d: node %d, busy %5.1f%%, %llu tasks, "
+                       "%llu steals\n", i, stats[i].node,
+                       100.0 * stats[i].busy_ns / wall,
+                       (unsigned long long)stats[i].tasks,
+                       (unsigned long long)stats[i].steals);
+        for (node = 0; node < sched_nodes(); node++) {
+                bytes = busy = 0;
+                count = 0;
+                for (i = 0; i < workers; i++) {
+                        if (stats[i].node != node)
+                                continue;
+                        bytes += stats[i].bytes;
+                        busy += stats[i].busy_ns;
+                        count++;
+                }
+                printf("  node %d: %d workers, %.1f MB, %.1f MB/s overall, "
+                       "%.1f MB/s per busy worker\n", node, count,
+                       bytes / 1e6, bytes / 1e6 / (wall / 1e9),
+                       busy ? bytes / 1e6 / (busy / 1e9) : 0.0);
+        }
+        release(msgs, n);
+        sched_stop();
+
+        for (i = 0; i < BENCH_BLOBS; i++)
+                free(blobs[i].data);
+        free(msgs);
+        return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Compare compact boxes with secretboxes and strongboxes for small
+ * messages. For each message size, prints the bytes each kind of box
+ * puts on the wire, the share of that which is the message itself,
+ * the bandwidth a compact box saves over a secretbox, and the time to
+ * seal one message through a context.
+ *
+ * usage: compact_bench [seals per size]
+ */
+
+#include <sys/types.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+
+#include <cryptobox/compactbox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+static const int        bench_sizes[] = { 8, 16, 20, 24, 32, 40, 64, 128,
+                                          256, 1024 };
+
+
+static uint64_t
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct secretbox_ctx    *sctx;
+        struct compactbox_ctx   *cctx;
+        unsigned char            skey[SECRETBOX_KEY_SIZE];
+        unsigned char            ckey[COMPACTBOX_KEY_SIZE];
+        unsigned char            m[1024];
+        unsigned char           *box;
+        uint64_t                 start, secret_ns, compact_ns;
+        size_t                   size, secret, strong, compact;
+        int                      n = 200000;
+        int                      blen, i, j;
+
+        if (argc > 1)
+                n = atoi(argv[1]);
+        if (n < 1)
+                errx(EX_USAGE, "usage: compact_bench [seals per size]");
+        if (!secretbox_generate_key(skey) || !compactbox_generate_key(ckey))
+                errx(EX_SOFTWARE, "failed to generate key");
+        if (NULL == (sctx = secretbox_ctx_new(skey)) ||
+            NULL == (cctx = compactbox_ctx_new(ckey)))
+                errx(EX_SOFTWARE, "failed to set up key");
+        memset(m, 0x5a, sizeof m);
+
+        printf("%6s %11s %11s %11s %8s %12s %12s\n", "size", "secretbox",
+               "strongbox", "compact", "saved", "secret ns", "compact ns");
+        for (i = 0; i < (int)(sizeof bench_sizes / sizeof bench_sizes[0]);
+             i++) {
+                size = (size_t)bench_sizes[i];
+                secret = size + SECRETBOX_OVERHEAD;
+                strong = size + STRONGBOX_OVERHEAD;
+                compact = size + COMPACTBOX_OVERHEAD;
+
+                start = now();
+                for (j = 0; j < n; j++) {
+                        box = secretbox_ctx_seal(sctx, m, (int)size, &blen);
+                        if (NULL == box)
+                                errx(EX_SOFTWARE, "seal failed");
+                        free(box);
+                }
+                secret_ns = now() - start;
+                start = now();
+                for (j = 0; j < n; j++) {
+                        box = compactbox_ctx_seal(cctx, m, (int)size, &blen);
+                        if (NULL == box)
+                                errx(EX_SOFTWARE, "seal failed");
+                        free(box);
+                }
+                compact_ns = now() - start;
+
+                printf("%6zu %6zu %3.0f%% %6zu %3.0f%% %6zu %3.0f%% "
+                       "%7.1f%% %12.0f %12.0f\n", size,
+                       secret, 100.0 * size / secret,
+                       strong, 100.0 * size / strong,
+                       compact, 100.0 * size / compact,
+                       100.0 * (secret - compact) / secret,
+                       (double)secret_ns / n, (double)compact_ns / n);
+        }
+
+        secretbox_ctx_free(sctx);
+        compactbox_ctx_free(cctx);
+        memset(skey, 0, sizeof skey);
+        memset(ckey, 0, sizeof ckey);
+        return EX_OK;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Compare sealing small messages in-process with sealing them through
+ * cryptoboxd, one call at a time and in batches. A daemon is forked
+ * to serve the key over a socket in /tmp, before anything starts the
+ * worker pool. Prints the cost of each approach per message.
+ *
+ * usage: daemon_bench [message size [messages]]
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "server.h"
+#include <cryptobox/batch.h>
+#include <cryptobox/client.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+
+
+#define BENCH_BATCH     256
+
+
+static volatile sig_atomic_t    bench_stop;
+
+
+static uint64_t
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+static void
+stop_daemon(int sig)
+{
+        (void)sig;
+        bench_stop = 1;
+}
+
+
+static void
+report(const char *name, uint64_t elapsed, int n)
+{
+        printf("%-24s %8.0f ns/message\n", name, (double)elapsed / n);
+}
+
+
+/*
+ * Seal n messages in batches of BENCH_BATCH, through the daemon if c is
+ * not NULL.
+ */
+static uint64_t
+seal_batches(struct cryptobox_client *c, unsigned char *key,
+             struct cryptobox_msg *msgs, int n)
+{
+        uint64_t         start;
+        int              i, j, count;
+
+        start = now();
+        for (i = 0; i < n; i += BENCH_BATCH) {
+                count = n - i < BENCH_BATCH ? n - i : BENCH_BATCH;
+                if (NULL != c)
+                        j = cryptobox_client_seal_batch(c, 0, msgs + i,
+                                                        count);
+                else
+                        j = cryptobox_seal_batch(CRYPTOBOX_SECRETBOX,
+                                                 msgs + i, count, key);
+                if (j != count)
+                        errx(EX_SOFTWARE, "batch seal failed");
+                for (j = i; j < i + count; j++)
+                        free(msgs[j].out);
+        }
+        return now() - start;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct server_key        skey;
+        struct cryptobox_client *c;
+        struct secretbox_ctx    *ctx;
+        struct cryptobox_msg    *msgs;
+        unsigned char            key[SECRETBOX_KEY_SIZE];
+        unsigned char           *m, *box;
+        char                     path[64];
+        uint64_t                 start;
+        pid_t                    pid;
+        int                      size = 64, n = 100000;
+        int                      blen, fd, i, status;
+
+        if (argc > 1)
+                size = atoi(argv[1]);
+        if (argc > 2)
+                n = atoi(argv[2]);
+        if (size < 0 || size > CRYPTOBOX_CLIENT_MAX || n < 1)
+                errx(EX_USAGE, "usage: daemon_bench [message size "
+                               "[messages]]");
+
+        if (!secretbox_generate_key(key))
+                errx(EX_SOFTWARE, "failed to generate key");
+        snprintf(path, sizeof path, "/tmp/daemon_bench.%ld", (long)getpid());
+        if (-1 == (fd = server_listen(path)))
+                err(EX_OSERR, "%s", path);
+        if (-1 == (pid = fork()))
+                err(EX_OSERR, "fork");
+        if (0 == pid) {
+                signal(SIGTERM, stop_daemon);
+                skey.type = CRYPTOBOX_SECRETBOX;
+                skey.key = key;
+                _exit(server_run(fd, &skey, 1, &bench_stop) ? 0 : 1);
+        }
+        close(fd);
+
+        if (NULL == (m = calloc(1, (size_t)size + 1)) ||
+            NULL == (msgs = calloc(n, sizeof(struct cryptobox_msg))))
+                errx(EX_OSERR, "out of memory");
+        memset(m, 0x5a, (size_t)size);
+        for (i = 0; i < n; i++) {
+                msgs[i].in = m;
+                msgs[i].in_len = size;
+        }
+        if (NULL == (ctx = secretbox_ctx_new(key)) ||
+            NULL == (c = cryptobox_client_connect(path)))
+                errx(EX_SOFTWARE, "bench setup failed");
+        printf("%d messages of %d bytes\n", n, size);
+
+        start = now();
+        for (i = 0; i < n; i++) {
+                if (NULL == (box = secretbox_ctx_seal(ctx, m, size, &blen)))
+                        errx(EX_SOFTWARE, "seal failed");
+                free(box);
+        }
+        report("in-process, per call", now() - start, n);
+        report("in-process, batched", seal_batches(NULL, key, msgs, n), n);
+
+        start = now();
+        for (i = 0; i < n; i++) {
+                if (NULL == (box = cryptobox_client_seal(c, 0, m, size,
+                                                         &blen)))
+                        errx(EX_SOFTWARE, "daemon seal failed");
+                free(box);
+        }
+        report("daemon, per call", now() - start, n);
+        report("daemon, batched", seal_batches(c, key, msgs, n), n);
+
+        cryptobox_client_close(c);
+        secretbox_ctx_free(ctx);
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+        unlink(path);
+        memset(key, 0, sizeof key);
+        free(msgs);
+        free(m);
+        return EX_OK;
+}
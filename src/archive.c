@@ -0,0 +1,922 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Archives: many boxes in one file, with a sealed index at the end so
+ * that any member can be found without scanning. The file is laid out
+ * as
+ *
+ *      header | member boxes ... | index box | trailer
+ *
+ * The header holds the box type and a random archive id. Each member
+ * is an ordinary box sealed with associated data made up of the id,
+ * the member's offset in the file and its name, so a member cannot be
+ * renamed, moved, or carried into another archive. The index is a box
+ * without associated data, whose message repeats the id, its own
+ * offset and the member count, and then lists each member's name,
+ * offset and length. The trailer only locates the index; everything
+ * it claims is checked against the index once that has been opened.
+ *
+ * Opening an archive reads the trailer and the index and builds a hash
+ * table of the names, after which a member takes one lookup and one
+ * read. Members are only ever appended: adding one reserves space at
+ * the end of the file with an atomic add, seals and writes it outside
+ * any lock, and then takes the lock only to enter it in the table, so
+ * members may be added from many threads at once. Closing a writable
+ * archive writes a new index and trailer after the last member,
+ * sealing the index on the worker pool. Until then the previous index
+ * and trailer are still intact, and a failed close truncates the file
+ * back to them.
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+
+#include "box.h"
+#include "constant_time.h"
+#include "scheduler.h"
+#include <cryptobox/archive.h>
+#include <cryptobox/batch.h>
+
+
+#define ARCHIVE_MAGIC           "CBAR"
+#define ARCHIVE_INDEX_MAGIC     "CBIX"
+#define ARCHIVE_TRAILER_MAGIC   "CBAX"
+#define ARCHIVE_VERSION         1
+#define ARCHIVE_ID_SIZE         16
+#define ARCHIVE_HEAD_SIZE       24
+#define ARCHIVE_TRAILER_SIZE    32
+#define ARCHIVE_INDEX_FIXED     40
+#define ARCHIVE_ENTRY_FIXED     18
+#define ARCHIVE_AAD_SIZE        (1 + ARCHIVE_ID_SIZE + 8)
+#define ARCHIVE_AAD_MEMBER      0x4d
+#define ARCHIVE_MAX_KEY         80
+#define ARCHIVE_MIN_TABLE       64
+
+
+/*
+ * A member in the table. name is the offset of its name in the name
+ * pool, where it is stored with a terminating NUL; len is the length
+ * of the box.
+ */
+struct archive_entry {
+        uint64_t         offset;
+        uint64_t         len;
+        size_t           name;
+        size_t           name_len;
+};
+
+/*
+ * An open archive. end is the offset the next member will be written
+ * at, and is only changed with atomic operations; base is the length
+ * the file had when it was opened, to return to if the index cannot
+ * be written. The entries, the name pool and the hash table, which
+ * holds entry numbers plus one, are guarded by lock.
+ */
+struct cryptobox_archive {
+        const struct box_ops    *ops;
+        void                    *ctx;
+        unsigned char            key[ARCHIVE_MAX_KEY];
+        unsigned char            head[ARCHIVE_HEAD_SIZE];
+        int                      fd;
+        int                      writable;
+        int                      dirty;
+        uint64_t                 base;
+        uint64_t                 end;
+
+        pthread_mutex_t          lock;
+        struct archive_entry    *entries;
+        size_t                   nentries;
+        size_t                   entries_cap;
+        char                    *names;
+        size_t                   names_len;
+        size_t                   names_cap;
+        size_t                  *table;
+        size_t                   table_size;
+};
+
+
+/*
+ * Members added as a batch are spread over the worker pool; each task
+ * takes members from next until they run out.
+ */
+struct archive_run;
+
+struct archive_task {
+        struct sched_task        task;
+        struct archive_run      *run;
+};
+
+struct archive_run {
+        struct cryptobox_archive        *ar;
+        struct cryptobox_archive_member *members;
+        size_t                           n;
+        size_t                           next;
+        size_t                           added;
+        int                              remaining;
+        sem_t                            sem;
+};
+
+
+static struct cryptobox_archive
+                        *archive_new(int, unsigned char *);
+static void              archive_free(struct cryptobox_archive *);
+static uint64_t          archive_hash(const char *, size_t);
+static size_t            archive_lookup(struct cryptobox_archive *,
+                                        const char *, size_t);
+static int               archive_grow_table(struct cryptobox_archive *);
+static int               archive_insert(struct cryptobox_archive *,
+                                        const char *, size_t, uint64_t,
+                                        uint64_t);
+static void              archive_aad(struct cryptobox_archive *, uint64_t,
+                                     unsigned char *, const char *, size_t,
+                                     struct iovec *);
+static int               archive_add_one(struct cryptobox_archive *,
+                                         const char *, unsigned char *,
+                                         size_t);
+static void              archive_worker(struct sched_task *);
+static int               archive_load_index(struct cryptobox_archive *,
+                                            uint64_t);
+static int               archive_parse_index(struct cryptobox_archive *,
+                                             unsigned char *, size_t,
+                                             uint64_t, uint64_t);
+static int               archive_write_index(struct cryptobox_archive *);
+static int               archive_pread(int, unsigned char *, size_t,
+                                       uint64_t);
+static int               archive_pwrite(int, unsigned char *, size_t,
+                                        uint64_t);
+static void              archive_put64(unsigned char *, uint64_t);
+static uint64_t          archive_get64(unsigned char *);
+
+
+/*
+ * Set up an archive, without a file, for a box type and key.
+ */
+struct cryptobox_archive *
+archive_new(int type, unsigned char *key)
+{
+        struct cryptobox_archive        *ar;
+        const struct box_ops            *ops;
+
+        if (NULL == (ops = box_ops_lookup(type)) || NULL == key)
+                return NULL;
+        if (NULL == (ar = box_malloc(sizeof(struct cryptobox_archive))))
+                return NULL;
+        memset(ar, 0, sizeof(struct cryptobox_archive));
+        ar->ops = ops;
+        ar->fd = -1;
+        memcpy(ar->key, key, ops->key_size);
+        if (0 != pthread_mutex_init(&ar->lock, NULL)) {
+                memset(ar->key, 0, ARCHIVE_MAX_KEY);
+                box_free(ar);
+                return NULL;
+        }
+        if (NULL == (ar->ctx = ops->ctx_new(key))) {
+                archive_free(ar);
+                return NULL;
+        }
+        return ar;
+}
+
+
+/*
+ * Wipe and release an archive, closing its file.
+ */
+void
+archive_free(struct cryptobox_archive *ar)
+{
+        if (NULL != ar->ctx)
+                ar->ops->ctx_free(ar->ctx);
+        if (-1 != ar->fd)
+                close(ar->fd);
+        if (NULL != ar->names)
+                memset(ar->names, 0, ar->names_cap);
+        box_free(ar->names);
+        box_free(ar->entries);
+        box_free(ar->table);
+        pthread_mutex_destroy(&ar->lock);
+        memset(ar, 0, sizeof(struct cryptobox_archive));
+        box_free(ar);
+}
+
+
+/*
+ * Create an empty archive at path, replacing any existing file, for
+ * boxes of the given type sealed under key. Returns NULL on failure.
+ */
+struct cryptobox_archive *
+cryptobox_archive_create(const char *path, int type, unsigned char *key)
+{
+        struct cryptobox_archive        *ar;
+
+        if (NULL == path || NULL == (ar = archive_new(type, key)))
+                return NULL;
+        memcpy(ar->head, ARCHIVE_MAGIC, 4);
+        ar->head[4] = ARCHIVE_VERSION;
+        ar->head[5] = (unsigned char)type;
+        ar->head[6] = ar->head[7] = 0;
+        if (!RAND_bytes(ar->head + 8, ARCHIVE_ID_SIZE) ||
+            -1 == (ar->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) ||
+            !archive_pwrite(ar->fd, ar->head, ARCHIVE_HEAD_SIZE, 0)) {
+                archive_free(ar);
+                return NULL;
+        }
+        ar->writable = 1;
+        ar->dirty = 1;
+        ar->end = ARCHIVE_HEAD_SIZE;
+        return ar;
+}
+
+
+/*
+ * Open the archive at path and load its index. If append is not 0,
+ * members may be added to it, and a new index is written when it is
+ * closed. Returns NULL if the archive cannot be read, was not made
+ * with this type and key, or has been altered.
+ */
+struct cryptobox_archive *
+cryptobox_archive_open(const char *path, int type, unsigned char *key,
+                       int append)
+{
+        struct cryptobox_archive        *ar;
+        struct stat                      st;
+
+        if (NULL == path || NULL == (ar = archive_new(type, key)))
+                return NULL;
+        ar->fd = open(path, append ? O_RDWR : O_RDONLY);
+        if (-1 == ar->fd || -1 == fstat(ar->fd, &st) ||
+            !S_ISREG(st.st_mode) ||
+            st.st_size < ARCHIVE_HEAD_SIZE + ARCHIVE_TRAILER_SIZE ||
+            !archive_pread(ar->fd, ar->head, ARCHIVE_HEAD_SIZE, 0) ||
+            0 != memcmp(ar->head, ARCHIVE_MAGIC, 4) ||
+            ARCHIVE_VERSION != ar->head[4] ||
+            (unsigned char)type != ar->head[5] ||
+            !archive_load_index(ar, (uint64_t)st.st_size)) {
+                archive_free(ar);
+                return NULL;
+        }
+        ar->writable = 0 != append;
+        ar->base = (uint64_t)st.st_size;
+        ar->end = ar->base;
+        return ar;
+}
+
+
+/*
+ * Close an archive. If it is writable and members have been added, a
+ * new index and trailer are written and the file is synced first; if
+ * that fails, the file is cut back to the archive it was opened as.
+ * Returns 1 on success and 0 on failure. No other call may be in
+ * progress on the archive.
+ */
+int
+cryptobox_archive_close(struct cryptobox_archive *ar)
+{
+        int     res = 1;
+
+        if (NULL == ar)
+                return 0;
+        if (ar->writable && ar->dirty) {
+                res = archive_write_index(ar);
+                if (!res && ar->base > 0)
+                        while (-1 == ftruncate(ar->fd, (off_t)ar->base) &&
+                               EINTR == errno)
+                                ;
+        }
+        archive_free(ar);
+        return res;
+}
+
+
+/*
+ * FNV-1a, for the name table. The names come from the index, which
+ * only the key holder can write.
+ */
+uint64_t
+archive_hash(const char *name, size_t len)
+{
+        uint64_t        h = 0xcbf29ce484222325ULL;
+        size_t          i;
+
+        for (i = 0; i < len; i++) {
+                h ^= (unsigned char)name[i];
+                h *= 0x100000001b3ULL;
+        }
+        return h;
+}
+
+
+/*
+ * Find a member by name with the lock held. Returns its entry number,
+ * or SIZE_MAX if there is none.
+ */
+size_t
+archive_lookup(struct cryptobox_archive *ar, const char *name, size_t len)
+{
+        struct archive_entry    *e;
+        size_t                   i, mask;
+
+        if (0 == ar->table_size)
+                return SIZE_MAX;
+        mask = ar->table_size - 1;
+        for (i = (size_t)archive_hash(name, len) & mask; 0 != ar->table[i];
+             i = (i + 1) & mask) {
+                e = &ar->entries[ar->table[i] - 1];
+                if (e->name_len == len &&
+                    0 == memcmp(ar->names + e->name, name, len))
+                        return ar->table[i] - 1;
+        }
+        return SIZE_MAX;
+}
+
+
+/*
+ * Double the hash table, keeping it at most half full, and re-enter
+ * every member.
+ */
+int
+archive_grow_table(struct cryptobox_archive *ar)
+{
+        struct archive_entry    *e;
+        size_t                  *table;
+        size_t                   size, mask, i, j;
+
+        size = 0 == ar->table_size ? ARCHIVE_MIN_TABLE : ar->table_size * 2;
+        if (size > SIZE_MAX / sizeof(size_t))
+                return 0;
+        if (NULL == (table = box_malloc(size * sizeof(size_t))))
+                return 0;
+        memset(table, 0, size * sizeof(size_t));
+        mask = size - 1;
+        for (i = 0; i < ar->nentries; i++) {
+                e = &ar->entries[i];
+                j = (size_t)archive_hash(ar->names + e->name, e->name_len);
+                for (j &= mask; 0 != table[j]; j = (j + 1) & mask)
+                        ;
+                table[j] = i + 1;
+        }
+        box_free(ar->table);
+        ar->table = table;
+        ar->table_size = size;
+        return 1;
+}
+
+
+/*
+ * Enter a member with the lock held. Returns 0 if the name is already
+ * taken or memory runs out.
+ */
+int
+archive_insert(struct cryptobox_archive *ar, const char *name, size_t len,
+               uint64_t offset, uint64_t box_len)
+{
+        struct archive_entry    *e;
+        size_t                   cap, i, mask;
+        void                    *p;
+
+        if (SIZE_MAX != archive_lookup(ar, name, len))
+                return 0;
+        if ((ar->nentries + 1) * 2 > ar->table_size &&
+            !archive_grow_table(ar))
+                return 0;
+        if (ar->nentries == ar->entries_cap) {
+                cap = 0 == ar->entries_cap ? 256 : ar->entries_cap * 2;
+                if (NULL == (p = box_malloc(cap *
+                                            sizeof(struct archive_entry))))
+                        return 0;
+                if (ar->nentries > 0)
+                        memcpy(p, ar->entries, ar->nentries *
+                               sizeof(struct archive_entry));
+                box_free(ar->entries);
+                ar->entries = p;
+                ar->entries_cap = cap;
+        }
+        if (ar->names_cap - ar->names_len < len + 1) {
+                cap = 0 == ar->names_cap ? 4096 : ar->names_cap;
+                while (cap - ar->names_len < len + 1)
+                        cap *= 2;
+                if (NULL == (p = box_malloc(cap)))
+                        return 0;
+                if (ar->names_len > 0)
+                        memcpy(p, ar->names, ar->names_len);
+                if (NULL != ar->names)
+                        memset(ar->names, 0, ar->names_cap);
+                box_free(ar->names);
+                ar->names = p;
+                ar->names_cap = cap;
+        }
+
+        e = &ar->entries[ar->nentries];
+        e->offset = offset;
+        e->len = box_len;
+        e->name = ar->names_len;
+        e->name_len = len;
+        memcpy(ar->names + ar->names_len, name, len);
+        ar->names[ar->names_len + len] = '\0';
+        ar->names_len += len + 1;
+
+        mask = ar->table_size - 1;
+        for (i = (size_t)archive_hash(name, len) & mask; 0 != ar->table[i];
+             i = (i + 1) & mask)
+                ;
+        ar->table[i] = ++ar->nentries;
+        return 1;
+}
+
+
+/*
+ * Lay out the associated data for the member named name at offset:
+ * a tag byte, the archive id and the offset in prefix, and the name.
+ */
+void
+archive_aad(struct cryptobox_archive *ar, uint64_t offset,
+            unsigned char *prefix, const char *name, size_t len,
+            struct iovec *iov)
+{
+        prefix[0] = ARCHIVE_AAD_MEMBER;
+        memcpy(prefix + 1, ar->head + 8, ARCHIVE_ID_SIZE);
+        archive_put64(prefix + 1 + ARCHIVE_ID_SIZE, offset);
+        iov[0].iov_base = prefix;
+        iov[0].iov_len = ARCHIVE_AAD_SIZE;
+        iov[1].iov_base = (void *)name;
+        iov[1].iov_len = len;
+}
+
+
+/*
+ * Seal a member at the end of the archive and enter it in the table.
+ * Space is reserved before the member is sealed, since its offset is
+ * part of what is authenticated; if it cannot be written or entered,
+ * the space is left unused.
+ */
+int
+archive_add_one(struct cryptobox_archive *ar, const char *name,
+                unsigned char *data, size_t len)
+{
+        unsigned char    prefix[ARCHIVE_AAD_SIZE];
+        unsigned char    empty = 0;
+        struct iovec     iov[2];
+        unsigned char   *box;
+        uint64_t         offset;
+        size_t           name_len;
+        int              box_len = 0;
+        int              res;
+
+        if (NULL == name || (NULL == data && len > 0) ||
+            len > (size_t)INT_MAX - ar->ops->overhead)
+                return 0;
+        name_len = strlen(name);
+        if (0 == name_len || name_len > CRYPTOBOX_ARCHIVE_NAME_MAX)
+                return 0;
+        if (NULL == data)
+                data = &empty;
+
+        offset = __atomic_fetch_add(&ar->end, len + ar->ops->overhead,
+                                    __ATOMIC_RELAXED);
+        archive_aad(ar, offset, prefix, name, name_len, iov);
+        box = ar->ops->ctx_seal_aadv(ar->ctx, data, (int)len, iov, 2,
+                                     &box_len);
+        if (NULL == box)
+                return 0;
+        res = archive_pwrite(ar->fd, box, (size_t)box_len, offset);
+        ar->ops->ctx_release(ar->ctx, box, (size_t)box_len);
+        if (!res)
+                return 0;
+
+        pthread_mutex_lock(&ar->lock);
+        res = archive_insert(ar, name, name_len, offset, (uint64_t)box_len);
+        if (res)
+                ar->dirty = 1;
+        pthread_mutex_unlock(&ar->lock);
+        return res;
+}
+
+
+/*
+ * Add a member under name, which must not already be in the archive.
+ * Members may be added from several threads at once. Returns 1 on
+ * success and 0 on failure.
+ */
+int
+cryptobox_archive_add(struct cryptobox_archive *ar, const char *name,
+                      unsigned char *data, size_t len)
+{
+        if (NULL == ar || !ar->writable)
+                return 0;
+        return archive_add_one(ar, name, data, len);
+}
+
+
+void
+archive_worker(struct sched_task *task)
+{
+        struct archive_task                     *t;
+        struct archive_run                      *run;
+        struct cryptobox_archive_member         *m;
+        size_t                                   i;
+
+        t = (struct archive_task *)task;
+        run = t->run;
+        for (;;) {
+                i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+                if (i >= run->n)
+                        break;
+                m = &run->members[i];
+                m->ok = archive_add_one(run->ar, m->name, m->data, m->len);
+                if (m->ok)
+                        __atomic_add_fetch(&run->added, 1, __ATOMIC_RELAXED);
+        }
+        if (0 == __atomic_sub_fetch(&run->remaining, 1, __ATOMIC_ACQ_REL))
+                sem_post(&run->sem);
+}
+
+
+/*
+ * Add n members, sealing and writing them on the worker pool. Each
+ * member's ok is set to show whether it was added. Returns 1 if every
+ * member was added and 0 otherwise.
+ */
+int
+cryptobox_archive_add_batch(struct cryptobox_archive *ar,
+                            struct cryptobox_archive_member *members,
+                            size_t n)
+{
+        struct archive_run       run;
+        struct archive_task     *tasks;
+        size_t                   i;
+        int                      ntasks;
+
+        if (NULL == ar || !ar->writable || (NULL == members && n > 0))
+                return 0;
+        for (i = 0; i < n; i++)
+                members[i].ok = 0;
+        if (0 == n)
+                return 1;
+
+        if (sched_self() < 0)
+                sched_start(0);
+        ntasks = sched_workers();
+        if (ntasks < 1)
+                ntasks = 1;
+        if ((size_t)ntasks > n)
+                ntasks = (int)n;
+        if (NULL == (tasks = box_malloc((size_t)ntasks *
+                                        sizeof(struct archive_task))))
+                return 0;
+        memset(&run, 0, sizeof run);
+        run.ar = ar;
+        run.members = members;
+        run.n = n;
+        run.remaining = ntasks;
+        if (-1 == sem_init(&run.sem, 0, 0)) {
+                box_free(tasks);
+                return 0;
+        }
+        for (i = 0; i < (size_t)ntasks; i++) {
+                tasks[i].run = &run;
+                tasks[i].task.run = archive_worker;
+                if (!sched_spawn(&tasks[i].task))
+                        archive_worker(&tasks[i].task);
+        }
+        if (sched_self() >= 0) {
+                while (__atomic_load_n(&run.remaining, __ATOMIC_ACQUIRE) > 0)
+                        if (!sched_help())
+                                sched_yield();
+        } else {
+                while (-1 == sem_wait(&run.sem) && EINTR == errno)
+                        ;
+        }
+        sem_destroy(&run.sem);
+        box_free(tasks);
+        return run.added == n;
+}
+
+
+/*
+ * Read and open the member called name, with a single read of its box.
+ * The length of the member is stored in len if it is not NULL. Returns
+ * NULL if there is no such member or it has been altered; the caller
+ * frees the member. Members may be read from several threads at once.
+ */
+unsigned char *
+cryptobox_archive_get(struct cryptobox_archive *ar, const char *name,
+                      size_t *len)
+{
+        unsigned char            prefix[ARCHIVE_AAD_SIZE];
+        struct iovec             iov[2];
+        struct archive_entry     e;
+        unsigned char           *box, *m = NULL;
+        size_t                   i, name_len;
+
+        if (NULL != len)
+                *len = 0;
+        if (NULL == ar || NULL == name)
+                return NULL;
+        name_len = strlen(name);
+        memset(&e, 0, sizeof e);
+        pthread_mutex_lock(&ar->lock);
+        if (SIZE_MAX != (i = archive_lookup(ar, name, name_len)))
+                e = ar->entries[i];
+        pthread_mutex_unlock(&ar->lock);
+        if (SIZE_MAX == i)
+                return NULL;
+
+        if (NULL == (box = box_malloc((size_t)e.len)))
+                return NULL;
+        if (archive_pread(ar->fd, box, (size_t)e.len, e.offset)) {
+                archive_aad(ar, e.offset, prefix, name, name_len, iov);
+                m = ar->ops->ctx_open_aadv(ar->ctx, box, (int)e.len, iov, 2);
+        }
+        box_free(box);
+        if (NULL != m && NULL != len)
+                *len = (size_t)e.len - ar->ops->overhead;
+        return m;
+}
+
+
+/*
+ * Return the number of members.
+ */
+size_t
+cryptobox_archive_count(struct cryptobox_archive *ar)
+{
+        size_t  n;
+
+        if (NULL == ar)
+                return 0;
+        pthread_mutex_lock(&ar->lock);
+        n = ar->nentries;
+        pthread_mutex_unlock(&ar->lock);
+        return n;
+}
+
+
+/*
+ * Return the name of member i, counting in the order the members were
+ * added, or NULL if there are not that many. The name is only valid
+ * until the next member is added or the archive is closed.
+ */
+const char *
+cryptobox_archive_name(struct cryptobox_archive *ar, size_t i)
+{
+        const char      *name = NULL;
+
+        if (NULL == ar)
+                return NULL;
+        pthread_mutex_lock(&ar->lock);
+        if (i < ar->nentries)
+                name = ar->names + ar->entries[i].name;
+        pthread_mutex_unlock(&ar->lock);
+        return name;
+}
+
+
+/*
+ * Read the trailer at the end of a file of size bytes, then read and
+ * open the index it points to. Large indexes are opened on the worker
+ * pool.
+ */
+int
+archive_load_index(struct cryptobox_archive *ar, uint64_t size)
+{
+        unsigned char            trailer[ARCHIVE_TRAILER_SIZE];
+        struct cryptobox_msg     msg;
+        uint64_t                 offset, len, count;
+        int                      res = 0;
+
+        if (!archive_pread(ar->fd, trailer, ARCHIVE_TRAILER_SIZE,
+                           size - ARCHIVE_TRAILER_SIZE) ||
+            0 != memcmp(trailer + 24, ARCHIVE_TRAILER_MAGIC, 4))
+                return 0;
+        offset = archive_get64(trailer);
+        len = archive_get64(trailer + 8);
+        count = archive_get64(trailer + 16);
+        if (offset < ARCHIVE_HEAD_SIZE || len < ar->ops->overhead ||
+            len > INT_MAX || offset > size - ARCHIVE_TRAILER_SIZE ||
+            len != size - ARCHIVE_TRAILER_SIZE - offset)
+                return 0;
+
+        memset(&msg, 0, sizeof msg);
+        msg.in_len = (int)len;
+        if (NULL == (msg.in = box_malloc((size_t)len)))
+                return 0;
+        if (archive_pread(ar->fd, msg.in, (size_t)len, offset) &&
+            1 == cryptobox_open_batch(ar->head[5], &msg, 1, ar->key)) {
+                res = archive_parse_index(ar, msg.out, (size_t)msg.out_len,
+                                          offset, count);
+                memset(msg.out, 0, (size_t)msg.out_len);
+        }
+        box_free(msg.out);
+        box_free(msg.in);
+        return res;
+}
+
+
+/*
+ * Check the fixed part of an opened index against the archive and the
+ * trailer, and enter each member it lists:
+ *
+ *      magic (4) | 0 (4) | archive id (16) | index offset (8)
+ *      member count (8) | members
+ *
+ * where each member is
+ *
+ *      name length (2) | offset (8) | box length (8) | name
+ */
+int
+archive_parse_index(struct cryptobox_archive *ar, unsigned char *ix,
+                    size_t len, uint64_t index_offset, uint64_t count)
+{
+        uint64_t        offset, box_len, i;
+        size_t          pos, name_len;
+
+        if (len < ARCHIVE_INDEX_FIXED ||
+            0 != memcmp(ix, ARCHIVE_INDEX_MAGIC, 4) ||
+            1 != constant_time_equals(ix + 8, ARCHIVE_ID_SIZE, ar->head + 8,
+                                      ARCHIVE_ID_SIZE) ||
+            archive_get64(ix + 24) != index_offset ||
+            archive_get64(ix + 32) != count ||
+            count > (len - ARCHIVE_INDEX_FIXED) / ARCHIVE_ENTRY_FIXED)
+                return 0;
+
+        pos = ARCHIVE_INDEX_FIXED;
+        for (i = 0; i < count; i++) {
+                if (len - pos < ARCHIVE_ENTRY_FIXED)
+                        return 0;
+                name_len = ((size_t)ix[pos] << 8) | ix[pos + 1];
+                offset = archive_get64(ix + pos + 2);
+                box_len = archive_get64(ix + pos + 10);
+                pos += ARCHIVE_ENTRY_FIXED;
+                if (0 == name_len || len - pos < name_len ||
+                    NULL != memchr(ix + pos, '\0', name_len) ||
+                    offset < ARCHIVE_HEAD_SIZE || offset > index_offset ||
+                    box_len < ar->ops->overhead || box_len > INT_MAX ||
+                    box_len > index_offset - offset ||
+                    !archive_insert(ar, (char *)ix + pos, name_len, offset,
+                                    box_len))
+                        return 0;
+                pos += name_len;
+        }
+        return pos == len;
+}
+
+
+/*
+ * Write the index and trailer after the last member and sync the file.
+ * The index is sealed with the batch interface, which splits a large
+ * index over the worker pool.
+ */
+int
+archive_write_index(struct cryptobox_archive *ar)
+{
+        unsigned char            trailer[ARCHIVE_TRAILER_SIZE];
+        struct cryptobox_msg     msg;
+        struct archive_entry    *e;
+        unsigned char           *ix;
+        uint64_t                 offset;
+        size_t                   len, pos, i;
+        int                      res = 0;
+
+        len = ARCHIVE_INDEX_FIXED;
+        for (i = 0; i < ar->nentries; i++) {
+                len += ARCHIVE_ENTRY_FIXED + ar->entries[i].name_len;
+                if (len > (size_t)INT_MAX - ar->ops->overhead)
+                        return 0;
+        }
+        if (NULL == (ix = box_malloc(len)))
+                return 0;
+
+        offset = ar->end;
+        memcpy(ix, ARCHIVE_INDEX_MAGIC, 4);
+        memset(ix + 4, 0, 4);
+        memcpy(ix + 8, ar->head + 8, ARCHIVE_ID_SIZE);
+        archive_put64(ix + 24, offset);
+        archive_put64(ix + 32, (uint64_t)ar->nentries);
+        pos = ARCHIVE_INDEX_FIXED;
+        for (i = 0; i < ar->nentries; i++) {
+                e = &ar->entries[i];
+                ix[pos] = (unsigned char)(e->name_len >> 8);
+                ix[pos + 1] = (unsigned char)e->name_len;
+                archive_put64(ix + pos + 2, e->offset);
+                archive_put64(ix + pos + 10, e->len);
+                memcpy(ix + pos + ARCHIVE_ENTRY_FIXED, ar->names + e->name,
+                       e->name_len);
+                pos += ARCHIVE_ENTRY_FIXED + e->name_len;
+        }
+
+        memset(&msg, 0, sizeof msg);
+        msg.in = ix;
+        msg.in_len = (int)len;
+        if (1 == cryptobox_seal_batch(ar->head[5], &msg, 1, ar->key)) {
+                archive_put64(trailer, offset);
+                archive_put64(trailer + 8, (uint64_t)msg.out_len);
+                archive_put64(trailer + 16, (uint64_t)ar->nentries);
+                memcpy(trailer + 24, ARCHIVE_TRAILER_MAGIC, 4);
+                memset(trailer + 28, 0, 4);
+                if (archive_pwrite(ar->fd, msg.out, (size_t)msg.out_len,
+                                   offset) &&
+                    archive_pwrite(ar->fd, trailer, ARCHIVE_TRAILER_SIZE,
+                                   offset + (uint64_t)msg.out_len) &&
+                    0 == ftruncate(ar->fd, (off_t)(offset +
+                                   (uint64_t)msg.out_len +
+                                   ARCHIVE_TRAILER_SIZE)) &&
+                    0 == fsync(ar->fd))
+                        res = 1;
+        }
+        memset(ix, 0, len);
+        box_free(ix);
+        box_free(msg.out);
+        return res;
+}
+
+
+int
+archive_pread(int fd, unsigned char *buf, size_t len, uint64_t off)
+{
+        ssize_t n;
+
+        if (off > (uint64_t)INT64_MAX)
+                return 0;
+        while (len > 0) {
+                n = pread(fd, buf, len, (off_t)off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+                off += (uint64_t)n;
+        }
+        return 1;
+}
+
+
+int
+archive_pwrite(int fd, unsigned char *buf, size_t len, uint64_t off)
+{
+        ssize_t n;
+
+        if (off > (uint64_t)INT64_MAX)
+                return 0;
+        while (len > 0) {
+                n = pwrite(fd, buf, len, (off_t)off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+                off += (uint64_t)n;
+        }
+        return 1;
+}
+
+
+void
+archive_put64(unsigned char *p, uint64_t v)
+{
+        int     i;
+
+        for (i = 0; i < 8; i++)
+                p[i] = (unsigned char)(v >> (56 - 8 * i));
+}
+
+
+uint64_t
+archive_get64(unsigned char *p)
+{
+        uint64_t        v = 0;
+        int             i;
+
+        for (i = 0; i < 8; i++)
+                v = (v << 8) | p[i];
+        return v;
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * The asynchronous job engine runs seal and open jobs on the library's
+ * worker pool. Jobs are handed to the workers through a bounded
+ * lock-free multi-producer, multi-consumer queue (Vyukov's
+ * sequence-numbered ring), so submission never blocks the caller; the
+ * queue is registered with the scheduler as a source of work, which
+ * workers poll when they have no tasks. A worker takes small jobs off
+ * the queue in batches and sends a single notification per file
+ * descriptor for the whole batch. Large jobs are split into segments
+ * that the other workers can steal.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "box.h"
+#include "parallel.h"
+#include "scheduler.h"
+#include <cryptobox/async.h>
+
+
+#define ASYNC_OP_SEAL           1
+#define ASYNC_OP_OPEN           2
+#define ASYNC_DEFAULT_DEPTH     1024
+#define ASYNC_BATCH             16
+#define ASYNC_SMALL_JOB         16384
+#define ASYNC_CACHE_LINE        64
+
+
+struct job_cell {
+        size_t                   seq;
+        struct cryptobox_job    *job;
+};
+
+struct notify_count {
+        int                      fd;
+        uint64_t                 count;
+};
+
+/*
+ * A large job being run in segments; the job is completed from
+ * whichever worker finishes the last segment.
+ */
+struct async_large {
+        struct par_box           pb;
+        struct cryptobox_job    *job;
+};
+
+
+static int       async_push(struct cryptobox_job *);
+static struct cryptobox_job
+                *async_pop(void);
+static int       async_take_batch(struct cryptobox_job **);
+static int       async_complete(struct cryptobox_job *);
+static void      async_notify(int, uint64_t);
+static void      async_large_done(struct par_box *);
+static int       async_start_large(struct cryptobox_job *);
+static void      async_run_batch(struct cryptobox_job **, int);
+static int       async_poll(void);
+static int       async_submit(struct cryptobox_job *, int, int,
+                              unsigned char *, int, unsigned char *);
+
+
+/*
+ * The enqueue and dequeue positions are kept on separate cache lines
+ * so that producers and consumers do not contend for the same line.
+ */
+static struct {
+        struct job_cell         *cells;
+        size_t                   mask;
+        char                     pad0[ASYNC_CACHE_LINE];
+        size_t                   enqueue_pos;
+        char                     pad1[ASYNC_CACHE_LINE];
+        size_t                   dequeue_pos;
+        char                     pad2[ASYNC_CACHE_LINE];
+        int                      inflight;
+        int                      running;
+} engine;
+
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Add a job to the queue. Returns 1 on success and 0 if the queue is
+ * full.
+ */
+int
+async_push(struct cryptobox_job *job)
+{
+        struct job_cell *cell;
+        size_t           pos;
+        intptr_t         diff;
+
+        pos = __atomic_load_n(&engine.enqueue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+                cell = &engine.cells[pos & engine.mask];
+                diff = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+                       (intptr_t)pos;
+                if (0 == diff) {
+                        if (__atomic_compare_exchange_n(&engine.enqueue_pos,
+                            &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                            __ATOMIC_RELAXED))
+                                break;
+                } else if (diff < 0) {
+                        return 0;
+                } else {
+                        pos = __atomic_load_n(&engine.enqueue_pos,
+                                              __ATOMIC_RELAXED);
+                }
+        }
+        cell->job = job;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+}
+
+
+/*
+ * Take a job off the queue, returning NULL if it is empty.
+ */
+struct cryptobox_job *
+async_pop(void)
+{
+        struct cryptobox_job    *job;
+        struct job_cell         *cell;
+        size_t                   pos;
+        intptr_t                 diff;
+
+        pos = __atomic_load_n(&engine.dequeue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+                cell = &engine.cells[pos & engine.mask];
+                diff = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+                       (intptr_t)(pos + 1);
+                if (0 == diff) {
+                        if (__atomic_compare_exchange_n(&engine.dequeue_pos,
+                            &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                            __ATOMIC_RELAXED))
+                                break;
+                } else if (diff < 0) {
+                        return NULL;
+                } else {
+                        pos = __atomic_load_n(&engine.dequeue_pos,
+                                              __ATOMIC_RELAXED);
+                }
+        }
+        job = cell->job;
+        __atomic_store_n(&cell->seq, pos + engine.mask + 1, __ATOMIC_RELEASE);
+        return job;
+}
+
+
+/*
+ * Take up to ASYNC_BATCH jobs off the queue. Small jobs are collected
+ * until the batch is full; a large job ends the batch. Returns the
+ * number of jobs taken.
+ */
+int
+async_take_batch(struct cryptobox_job **batch)
+{
+        int     n = 0;
+
+        while (n < ASYNC_BATCH) {
+                if (NULL == (batch[n] = async_pop()))
+                        break;
+                if (batch[n++]->in_len > ASYNC_SMALL_JOB)
+                        break;
+        }
+        return n;
+}
+
+
+/*
+ * Publish a job's result and call its callback. Returns the file
+ * descriptor to notify, which is read before the job is handed back.
+ */
+int
+async_complete(struct cryptobox_job *job)
+{
+        cryptobox_callback       callback = job->callback;
+        void                    *arg = job->arg;
+        int                      fd = job->notify_fd;
+
+        __atomic_store_n(&job->status, NULL == job->out ?
+                         CRYPTOBOX_JOB_FAILED : CRYPTOBOX_JOB_DONE,
+                         __ATOMIC_RELEASE);
+        if (NULL != callback)
+                callback(job, arg);
+        return fd;
+}
+
+
+void
+async_notify(int fd, uint64_t count)
+{
+        ssize_t wrote;
+
+        do {
+                wrote = write(fd, &count, sizeof(uint64_t));
+        } while (-1 == wrote && EINTR == errno);
+}
+
+
+void
+async_large_done(struct par_box *pb)
+{
+        struct async_large      *large = (struct async_large *)pb;
+        struct cryptobox_job    *job = large->job;
+        int                      fd;
+
+        job->out = pb->out;
+        job->out_len = pb->out_len;
+        pb->ops->ctx_free(pb->ctx);
+        box_free(large);
+        if (-1 != (fd = async_complete(job)))
+                async_notify(fd, 1);
+}
+
+
+/*
+ * Start a large job in segments. Returns 0 if it could not be set up,
+ * in which case the caller runs it directly.
+ */
+int
+async_start_large(struct cryptobox_job *job)
+{
+        struct async_large      *large;
+
+        if (NULL == (large = box_malloc(sizeof(struct async_large))))
+                return 0;
+        large->pb.ops = box_ops_lookup(job->type);
+        if (NULL == (large->pb.ctx = large->pb.ops->ctx_new(job->key))) {
+                box_free(large);
+                return 0;
+        }
+        large->pb.op = ASYNC_OP_SEAL == job->op ? PAR_SEAL : PAR_OPEN;
+        large->pb.in = job->in;
+        large->pb.in_len = job->in_len;
+        large->pb.done = async_large_done;
+        large->job = job;
+        par_box_start(&large->pb);
+        return 1;
+}
+
+
+/*
+ * Run a batch of jobs, publish their results, and then notify each
+ * distinct file descriptor once with the number of jobs that
+ * completed for it. Large jobs are started in segments and notify
+ * on their own when they finish.
+ */
+void
+async_run_batch(struct cryptobox_job **batch, int n)
+{
+        struct notify_count      notify[ASYNC_BATCH];
+        const struct box_ops    *ops;
+        struct cryptobox_job    *job;
+        int                      nnotify = 0;
+        int                      fd;
+        int                      i, j;
+
+        for (i = 0; i < n; i++) {
+                job = batch[i];
+                if (job->in_len >= PAR_SPLIT && async_start_large(job))
+                        continue;
+
+                ops = box_ops_lookup(job->type);
+                if (ASYNC_OP_SEAL == job->op) {
+                        job->out = ops->seal(job->in, job->in_len,
+                                             &job->out_len, job->key);
+                } else {
+                        job->out = ops->open(job->in, job->in_len, job->key);
+                        job->out_len = 0;
+                        if (NULL != job->out)
+                                job->out_len = job->in_len - (int)ops->overhead;
+                }
+                sched_account((size_t)job->in_len);
+
+                if (-1 == (fd = async_complete(job)))
+                        continue;
+                for (j = 0; j < nnotify; j++)
+                        if (notify[j].fd == fd)
+                                break;
+                if (j == nnotify) {
+                        notify[j].fd = fd;
+                        notify[j].count = 0;
+                        nnotify++;
+                }
+                notify[j].count++;
+        }
+
+        for (j = 0; j < nnotify; j++)
+                async_notify(notify[j].fd, notify[j].count);
+}
+
+
+/*
+ * The scheduler calls this from idle workers. Returns 1 if any jobs
+ * were run.
+ */
+int
+async_poll(void)
+{
+        struct cryptobox_job    *batch[ASYNC_BATCH];
+        int                      n;
+
+        if (0 == (n = async_take_batch(batch)))
+                return 0;
+        async_run_batch(batch, n);
+        return 1;
+}
+
+
+/*
+ * Start the engine with room for depth queued jobs, starting the
+ * worker pool with nworkers threads if it is not already running;
+ * zero or a negative value selects one worker per online CPU and a
+ * depth of ASYNC_DEFAULT_DEPTH. The depth is rounded up to a power of
+ * two. Returns 1 if the engine is running and 0 on failure.
+ */
+int
+cryptobox_async_start(int nworkers, int depth)
+{
+        size_t  size = 2;
+        size_t  i;
+
+        pthread_mutex_lock(&engine_lock);
+        if (engine.running) {
+                pthread_mutex_unlock(&engine_lock);
+                return 1;
+        }
+
+        if (depth <= 0)
+                depth = ASYNC_DEFAULT_DEPTH;
+        while (size < (size_t)depth)
+                size <<= 1;
+        if (NULL == (engine.cells = malloc(size * sizeof(struct job_cell)))) {
+                pthread_mutex_unlock(&engine_lock);
+                return 0;
+        }
+        if (!sched_start(nworkers)) {
+                free(engine.cells);
+                engine.cells = NULL;
+                pthread_mutex_unlock(&engine_lock);
+                return 0;
+        }
+
+        for (i = 0; i < size; i++)
+                engine.cells[i].seq = i;
+        engine.mask = size - 1;
+        engine.enqueue_pos = 0;
+        engine.dequeue_pos = 0;
+        engine.inflight = 0;
+        __atomic_store_n(&engine.running, 1, __ATOMIC_SEQ_CST);
+        sched_set_source(async_poll);
+        pthread_mutex_unlock(&engine_lock);
+        return 1;
+}
+
+
+/*
+ * Stop the engine and the worker pool. Submissions that are already
+ * under way are allowed to finish, every queued job is completed, and
+ * the workers are joined before this returns.
+ */
+void
+cryptobox_async_stop(void)
+{
+        pthread_mutex_lock(&engine_lock);
+        if (!engine.running) {
+                pthread_mutex_unlock(&engine_lock);
+                return;
+        }
+
+        __atomic_store_n(&engine.running, 0, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&engine.inflight, __ATOMIC_SEQ_CST))
+                sched_yield();
+        sched_set_source(NULL);
+        sched_stop();
+        while (async_poll())
+                ;
+
+        free(engine.cells);
+        engine.cells = NULL;
+        pthread_mutex_unlock(&engine_lock);
+}
+
+
+/*
+ * Prepare a job. When it completes, callback (if not NULL) is called
+ * from a worker thread with the job and arg, and the number of jobs
+ * completed is written as a 64-bit integer to notify_fd (if it is not
+ * -1), which suits an eventfd or a pipe. A job with a callback belongs
+ * to the library until the callback returns.
+ */
+void
+cryptobox_job_init(struct cryptobox_job *job, cryptobox_callback callback,
+                   void *arg, int notify_fd)
+{
+        memset(job, 0, sizeof(struct cryptobox_job));
+        job->callback = callback;
+        job->arg = arg;
+        job->notify_fd = notify_fd;
+}
+
+
+/*
+ * Fill in a job and queue it.
+ */
+int
+async_submit(struct cryptobox_job *job, int op, int type, unsigned char *in,
+             int in_len, unsigned char *key)
+{
+        int     res = 0;
+
+        if (NULL == box_ops_lookup(type) || NULL == in || in_len < 0)
+                return 0;
+        job->type = type;
+        job->op = op;
+        job->in = in;
+        job->in_len = in_len;
+        job->key = key;
+        job->out = NULL;
+        job->out_len = 0;
+        __atomic_store_n(&job->status, CRYPTOBOX_JOB_PENDING,
+                         __ATOMIC_RELAXED);
+
+        __atomic_add_fetch(&engine.inflight, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&engine.running, __ATOMIC_SEQ_CST))
+                res = async_push(job);
+        if (res)
+                sched_notify();
+        __atomic_sub_fetch(&engine.inflight, 1, __ATOMIC_SEQ_CST);
+        return res;
+}
+
+
+/*
+ * Queue a message to be sealed into a box of the given type. Returns 1
+ * if the job was queued, and 0 if the engine is not running, the queue
+ * is full, or the arguments are invalid.
+ */
+int
+cryptobox_submit_seal(struct cryptobox_job *job, int type, unsigned char *m,
+                      int mlen, unsigned char *key)
+{
+        return async_submit(job, ASYNC_OP_SEAL, type, m, mlen, key);
+}
+
+
+/*
+ * Queue a box of the given type to be opened. The return value is as
+ * for cryptobox_submit_seal.
+ */
+int
+cryptobox_submit_open(struct cryptobox_job *job, int type,
+                      unsigned char *box, int box_len, unsigned char *key)
+{
+        return async_submit(job, ASYNC_OP_OPEN, type, box, box_len, key);
+}
+
+
+/*
+ * Return the status of a job: CRYPTOBOX_JOB_PENDING until it has run,
+ * then CRYPTOBOX_JOB_DONE or CRYPTOBOX_JOB_FAILED.
+ */
+int
+cryptobox_job_status(struct cryptobox_job *job)
+{
+        return __atomic_load_n(&job->status, __ATOMIC_ACQUIRE);
+}
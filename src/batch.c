@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Sealing and opening batches of messages on the library's worker
+ * pool. The batch is cut into units: each message of PAR_SPLIT bytes
+ * or more is a unit of its own, split into segments by par_box_start,
+ * and runs of smaller messages are grouped into chunks of about
+ * PAR_CHUNK bytes. A single root task covering every unit is handed
+ * to the scheduler; it splits its range in half, leaving the upper
+ * half on its deque to be stolen, until it is down to one unit, so
+ * that the work spreads out across the workers however skewed the
+ * message sizes are. Verifying only computes each tag, which cannot be
+ * split, so a batch being verified is cut into chunks alone.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "box.h"
+#include "parallel.h"
+#include "scheduler.h"
+#include <cryptobox/batch.h>
+
+
+/*
+ * The cost charged to each message when grouping small messages into
+ * chunks, so that a chunk of empty messages is still bounded.
+ */
+#define BATCH_MSG_COST  256
+
+/*
+ * Verifying is a batch operation of its own, alongside PAR_SEAL and
+ * PAR_OPEN; it is never handed to par_box_start.
+ */
+#define BATCH_VERIFY    (PAR_OPEN + 1)
+
+
+struct batch;
+
+struct batch_split {
+        struct par_box           pb;
+        struct batch            *b;
+        int                      index;
+};
+
+struct batch_unit {
+        int                      first;
+        int                      count;
+        struct batch_split      *split;
+};
+
+struct batch_range {
+        struct sched_task        task;
+        struct batch            *b;
+        int                      lo;
+        int                      hi;
+};
+
+struct batch {
+        const struct box_ops    *ops;
+        void                    *ctx;
+        int                      op;
+        struct cryptobox_msg    *msgs;
+        struct batch_unit       *units;
+        int                      nunits;
+        struct batch_split      *splits;
+        struct batch_range      *ranges;
+        int                      next_range;
+        int                      remaining;
+        int                      succeeded;
+        sem_t                    done;
+};
+
+
+static void      batch_unit_done(struct batch *, int);
+static void      batch_split_done(struct par_box *);
+static void      batch_unit_run(struct batch *, int);
+static void      batch_range_run(struct sched_task *);
+static int       batch_plan(struct batch *, int);
+static int       batch_run(int, int, struct cryptobox_msg *, int,
+                           unsigned char *);
+
+
+/*
+ * Account for a finished unit, waking the caller after the last one.
+ */
+void
+batch_unit_done(struct batch *b, int succeeded)
+{
+        __atomic_add_fetch(&b->succeeded, succeeded, __ATOMIC_RELAXED);
+        if (0 == __atomic_sub_fetch(&b->remaining, 1, __ATOMIC_ACQ_REL))
+                sem_post(&b->done);
+}
+
+
+void
+batch_split_done(struct par_box *pb)
+{
+        struct batch_split      *split = (struct batch_split *)pb;
+        struct cryptobox_msg    *msg = &split->b->msgs[split->index];
+
+        msg->out = pb->out;
+        msg->out_len = pb->out_len;
+        batch_unit_done(split->b, pb->ok);
+}
+
+
+/*
+ * Run one unit: start a split message, or seal or open every message
+ * in a chunk.
+ */
+void
+batch_unit_run(struct batch *b, int n)
+{
+        struct batch_unit       *unit = &b->units[n];
+        struct cryptobox_msg    *msg;
+        int                      succeeded = 0;
+        int                      i;
+
+        if (NULL != unit->split) {
+                unit->split->pb.ops = b->ops;
+                unit->split->pb.ctx = b->ctx;
+                unit->split->pb.op = b->op;
+                unit->split->pb.in = b->msgs[unit->first].in;
+                unit->split->pb.in_len = b->msgs[unit->first].in_len;
+                unit->split->pb.done = batch_split_done;
+                unit->split->b = b;
+                unit->split->index = unit->first;
+                par_box_start(&unit->split->pb);
+                return;
+        }
+
+        for (i = unit->first; i < unit->first + unit->count; i++) {
+                msg = &b->msgs[i];
+                if (BATCH_VERIFY == b->op) {
+                        msg->out_len = b->ops->ctx_verify(b->ctx, msg->in,
+                                                          msg->in_len);
+                        succeeded += msg->out_len;
+                        sched_account((size_t)msg->in_len);
+                        continue;
+                }
+                if (PAR_SEAL == b->op) {
+                        msg->out = b->ops->ctx_seal(b->ctx, msg->in,
+                                                    msg->in_len,
+                                                    &msg->out_len);
+                } else {
+                        msg->out = b->ops->ctx_open(b->ctx, msg->in,
+                                                    msg->in_len);
+                        if (NULL != msg->out)
+                                msg->out_len = msg->in_len -
+                                               (int)b->ops->overhead;
+                }
+                if (NULL != msg->out)
+                        succeeded++;
+                sched_account((size_t)msg->in_len);
+        }
+        batch_unit_done(b, succeeded);
+}
+
+
+/*
+ * Run a range of units, giving away the upper half of the range until
+ * a single unit is left.
+ */
+void
+batch_range_run(struct sched_task *task)
+{
+        struct batch_range      *r = (struct batch_range *)task;
+        struct batch_range      *half;
+        struct batch            *b = r->b;
+        int                      lo = r->lo;
+        int                      hi = r->hi;
+        int                      mid;
+
+        while (hi - lo > 1) {
+                mid = lo + (hi - lo) / 2;
+                half = &b->ranges[__atomic_fetch_add(&b->next_range, 1,
+                                                     __ATOMIC_RELAXED)];
+                half->task.run = batch_range_run;
+                half->b = b;
+                half->lo = mid;
+                half->hi = hi;
+                if (!sched_spawn(&half->task))
+                        batch_range_run(&half->task);
+                hi = mid;
+        }
+        batch_unit_run(b, lo);
+}
+
+
+/*
+ * Divide the messages into units. Returns 0 if memory could not be
+ * allocated.
+ */
+int
+batch_plan(struct batch *b, int n)
+{
+        size_t  cost;
+        int     split = BATCH_VERIFY == b->op ? INT_MAX : PAR_SPLIT;
+        int     nsplit = 0;
+        int     i;
+
+        for (i = 0; i < n; i++)
+                if (b->msgs[i].in_len >= split)
+                        nsplit++;
+        b->units = box_malloc(n * sizeof(struct batch_unit));
+        b->ranges = box_malloc(n * sizeof(struct batch_range));
+        b->splits = box_malloc((nsplit + 1) * sizeof(struct batch_split));
+        if (NULL == b->units || NULL == b->ranges || NULL == b->splits)
+                return 0;
+
+        nsplit = 0;
+        for (i = 0; i < n; b->nunits++) {
+                b->units[b->nunits].first = i;
+                b->units[b->nunits].count = 0;
+                b->units[b->nunits].split = NULL;
+                if (b->msgs[i].in_len >= split) {
+                        b->units[b->nunits].count = 1;
+                        b->units[b->nunits].split = &b->splits[nsplit++];
+                        i++;
+                        continue;
+                }
+                for (cost = 0; i < n && b->msgs[i].in_len < split &&
+                     cost < PAR_CHUNK; i++) {
+                        cost += (size_t)b->msgs[i].in_len + BATCH_MSG_COST;
+                        b->units[b->nunits].count++;
+                }
+        }
+        return 1;
+}
+
+
+/*
+ * Seal or open a batch and wait for it. A caller that is itself one of
+ * the workers runs tasks while it waits, rather than blocking a thread
+ * the batch may need. Returns the number of messages that succeeded.
+ */
+int
+batch_run(int op, int type, struct cryptobox_msg *msgs, int n,
+          unsigned char *key)
+{
+        struct batch             b;
+        struct batch_range      *root;
+        int                      i;
+
+        if (n <= 0 || NULL == msgs)
+                return 0;
+        for (i = 0; i < n; i++) {
+                msgs[i].out = NULL;
+                msgs[i].out_len = 0;
+        }
+
+        memset(&b, 0, sizeof b);
+        if (NULL == (b.ops = box_ops_lookup(type)))
+                return 0;
+        b.op = op;
+        b.msgs = msgs;
+        if (NULL == (b.ctx = b.ops->ctx_new(key)))
+                return 0;
+        if (!batch_plan(&b, n) || -1 == sem_init(&b.done, 0, 0))
+                goto out;
+        b.remaining = b.nunits;
+
+        if (sched_self() < 0)
+                sched_start(0);
+        root = &b.ranges[b.next_range++];
+        root->task.run = batch_range_run;
+        root->b = &b;
+        root->lo = 0;
+        root->hi = b.nunits;
+        if (!sched_spawn(&root->task)) {
+                batch_range_run(&root->task);
+        } else if (sched_self() >= 0) {
+                while (__atomic_load_n(&b.remaining, __ATOMIC_ACQUIRE) > 0)
+                        if (!sched_help())
+                                sched_yield();
+        } else {
+                while (-1 == sem_wait(&b.done) && EINTR == errno)
+                        ;
+        }
+        sem_destroy(&b.done);
+
+out:
+        b.ops->ctx_free(b.ctx);
+        box_free(b.units);
+        box_free(b.ranges);
+        box_free(b.splits);
+        return __atomic_load_n(&b.succeeded, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Seal every message in a batch into a box of the given type, using
+ * the library's worker pool, which is started if it is not already
+ * running. Returns the number of messages that were sealed.
+ */
+int
+cryptobox_seal_batch(int type, struct cryptobox_msg *msgs, int n,
+                     unsigned char *key)
+{
+        return batch_run(PAR_SEAL, type, msgs, n, key);
+}
+
+
+/*
+ * Open every box in a batch; boxes that fail to open are left with a
+ * NULL out. Returns the number of boxes that were opened.
+ */
+int
+cryptobox_open_batch(int type, struct cryptobox_msg *msgs, int n,
+                     unsigned char *key)
+{
+        return batch_run(PAR_OPEN, type, msgs, n, key);
+}
+
+
+/*
+ * Check the tag on every box in a batch without decrypting anything.
+ * Each out is left NULL, and out_len is set to 1 for an authentic box
+ * and 0 otherwise. Returns the number of authentic boxes.
+ */
+int
+cryptobox_verify_batch(int type, struct cryptobox_msg *msgs, int n,
+                       unsigned char *key)
+{
+        return batch_run(BATCH_VERIFY, type, msgs, n, key);
+}
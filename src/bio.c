@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * A BIO filter over the streaming format. Data written to the filter
+ * is sealed, a chunk at a time, and passed on to the next BIO in the
+ * chain; data read from the filter is read from the next BIO, checked
+ * and opened. Each chunk is sealed or opened in place in a single
+ * buffer of one chunk and tag, so memory use does not depend on the
+ * length of the stream. As with the cipher filter, BIO_flush must be
+ * called once the last of the data has been written to seal the final
+ * chunk.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/bio.h>
+
+#include "box.h"
+#include <cryptobox/bio.h>
+#include <cryptobox/stream.h>
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define BIO_get_data(b)         ((b)->ptr)
+#define BIO_set_data(b, p)      ((b)->ptr = (p))
+#define BIO_set_init(b, v)      ((b)->init = (v))
+#define BIO_next(b)             ((b)->next_bio)
+#endif
+
+#define BIO_TYPE_CRYPTOBOX      (120 | BIO_TYPE_FILTER)
+
+
+/*
+ * The state of a filter. buf holds either plaintext being gathered
+ * into a chunk (fill bytes), or sealed data waiting to be written
+ * (from out to len); when reading, it holds the sealed chunk being
+ * read in (fill bytes), then the opened message (from out to len).
+ */
+struct bio_cryptobox {
+        struct cryptobox_stream *s;
+        struct box_allocator     mem;
+        int                      type;
+        size_t                   chunk_size;
+        unsigned char            head[64];
+        unsigned char           *buf;
+        size_t                   buf_size;
+        size_t                   fill;
+        size_t                   out;
+        size_t                   len;
+        uint64_t                 index;
+        int                      reading;
+        int                      started;
+        int                      finished;
+        int                      failed;
+};
+
+
+static int       bio_cryptobox_write(BIO *, const char *, int);
+static int       bio_cryptobox_read(BIO *, char *, int);
+static long      bio_cryptobox_ctrl(BIO *, int, long, void *);
+static int       bio_cryptobox_new(BIO *);
+static int       bio_cryptobox_free(BIO *);
+static int       bio_cryptobox_buffer(struct bio_cryptobox *);
+static int       bio_cryptobox_start(struct bio_cryptobox *);
+static int       bio_cryptobox_drain(BIO *, struct bio_cryptobox *);
+static int       bio_cryptobox_seal(struct bio_cryptobox *);
+static int       bio_cryptobox_finish(BIO *, struct bio_cryptobox *);
+static int       bio_cryptobox_fill(BIO *, struct bio_cryptobox *, size_t);
+static int       bio_cryptobox_next(BIO *, struct bio_cryptobox *);
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static BIO_METHOD bio_cryptobox_method = {
+        BIO_TYPE_CRYPTOBOX,
+        "cryptobox",
+        bio_cryptobox_write,
+        bio_cryptobox_read,
+        NULL,
+        NULL,
+        bio_cryptobox_ctrl,
+        bio_cryptobox_new,
+        bio_cryptobox_free,
+        NULL
+};
+#else
+static BIO_METHOD       *bio_cryptobox_method = NULL;
+static pthread_once_t    bio_cryptobox_once = PTHREAD_ONCE_INIT;
+
+static void      bio_cryptobox_make_method(void);
+#endif
+
+
+/*
+ * Return the method for the cryptobox filter.
+ */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+BIO_METHOD *
+BIO_f_cryptobox(void)
+{
+        return &bio_cryptobox_method;
+}
+#else
+void
+bio_cryptobox_make_method(void)
+{
+        BIO_METHOD      *m;
+
+        m = BIO_meth_new(BIO_TYPE_CRYPTOBOX, "cryptobox");
+        if (NULL == m)
+                return;
+        if (!BIO_meth_set_write(m, bio_cryptobox_write) ||
+            !BIO_meth_set_read(m, bio_cryptobox_read) ||
+            !BIO_meth_set_ctrl(m, bio_cryptobox_ctrl) ||
+            !BIO_meth_set_create(m, bio_cryptobox_new) ||
+            !BIO_meth_set_destroy(m, bio_cryptobox_free)) {
+                BIO_meth_free(m);
+                return;
+        }
+        bio_cryptobox_method = m;
+}
+
+
+BIO_METHOD *
+BIO_f_cryptobox(void)
+{
+        pthread_once(&bio_cryptobox_once, bio_cryptobox_make_method);
+        return bio_cryptobox_method;
+}
+#endif
+
+
+/*
+ * Give a filter its box type and key, and the chunk size to seal
+ * with; 0 selects CRYPTOBOX_STREAM_CHUNK. When opening, the chunk size
+ * is taken from the stream. This must be done before any data passes
+ * through the filter. Returns 1 on success and 0 on failure.
+ */
+int
+BIO_set_cryptobox(BIO *b, int type, unsigned char *key, size_t chunk_size)
+{
+        struct bio_cryptobox    *ctx = BIO_get_data(b);
+        struct cryptobox_stream *s;
+
+        if (NULL == ctx || ctx->started)
+                return 0;
+        if (0 == chunk_size)
+                chunk_size = CRYPTOBOX_STREAM_CHUNK;
+        if (0 != chunk_size % 16 || chunk_size > CRYPTOBOX_STREAM_MAX_CHUNK)
+                return 0;
+        if (NULL == (s = cryptobox_stream_new(type, key)))
+                return 0;
+        cryptobox_stream_free(ctx->s);
+        ctx->s = s;
+        ctx->type = type;
+        ctx->chunk_size = chunk_size;
+        BIO_set_init(b, 1);
+        return 1;
+}
+
+
+int
+bio_cryptobox_new(BIO *b)
+{
+        struct bio_cryptobox    *ctx;
+
+        if (NULL == (ctx = box_malloc(sizeof(struct bio_cryptobox))))
+                return 0;
+        memset(ctx, 0, sizeof(struct bio_cryptobox));
+        box_allocator_get(&ctx->mem);
+        BIO_set_data(b, ctx);
+        BIO_set_init(b, 0);
+        return 1;
+}
+
+
+int
+bio_cryptobox_free(BIO *b)
+{
+        struct bio_cryptobox    *ctx;
+
+        if (NULL == b || NULL == (ctx = BIO_get_data(b)))
+                return 0;
+        if (NULL != ctx->buf)
+                box_release(&ctx->mem, ctx->buf, ctx->buf_size);
+        cryptobox_stream_free(ctx->s);
+        box_free(ctx);
+        BIO_set_data(b, NULL);
+        BIO_set_init(b, 0);
+        return 1;
+}
+
+
+/*
+ * Allocate the chunk buffer once the chunk size is known. The buffer
+ * holds plaintext, so it is wiped when it is released.
+ */
+int
+bio_cryptobox_buffer(struct bio_cryptobox *ctx)
+{
+        if (NULL != ctx->buf)
+                return 1;
+        ctx->buf_size = ctx->chunk_size +
+                        cryptobox_stream_tag_size(ctx->type);
+        ctx->buf = box_alloc(&ctx->mem, ctx->buf_size);
+        return NULL != ctx->buf;
+}
+
+
+/*
+ * Begin sealing, leaving the header in the buffer to be written out.
+ */
+int
+bio_cryptobox_start(struct bio_cryptobox *ctx)
+{
+        if (!bio_cryptobox_buffer(ctx) ||
+            !cryptobox_stream_seal_head(ctx->s, ctx->chunk_size, ctx->buf)) {
+                ctx->failed = 1;
+                return 0;
+        }
+        ctx->out = 0;
+        ctx->len = cryptobox_stream_head_size(ctx->type);
+        ctx->started = 1;
+        return 1;
+}
+
+
+/*
+ * Write out any sealed data waiting in the buffer. Returns 1 once the
+ * buffer is empty, and otherwise the next BIO's result, with its retry
+ * flags copied.
+ */
+int
+bio_cryptobox_drain(BIO *b, struct bio_cryptobox *ctx)
+{
+        int     n;
+
+        while (ctx->out < ctx->len) {
+                n = BIO_write(BIO_next(b), ctx->buf + ctx->out,
+                              (int)(ctx->len - ctx->out));
+                if (n <= 0) {
+                        BIO_copy_next_retry(b);
+                        return n < 0 ? n : -1;
+                }
+                ctx->out += (size_t)n;
+        }
+        ctx->out = ctx->len = 0;
+        return 1;
+}
+
+
+/*
+ * Seal the gathered plaintext as the next chunk, leaving it in the
+ * buffer to be written out.
+ */
+int
+bio_cryptobox_seal(struct bio_cryptobox *ctx)
+{
+        if (!cryptobox_stream_seal_chunk(ctx->s, ctx->index, ctx->buf,
+                                         ctx->fill, ctx->buf)) {
+                ctx->failed = 1;
+                return 0;
+        }
+        ctx->index++;
+        ctx->out = 0;
+        ctx->len = ctx->fill + cryptobox_stream_tag_size(ctx->type);
+        ctx->fill = 0;
+        return 1;
+}
+
+
+int
+bio_cryptobox_write(BIO *b, const char *in, int inl)
+{
+        struct bio_cryptobox    *ctx = BIO_get_data(b);
+        size_t                   n, done = 0;
+        int                      res;
+
+        if (NULL == ctx || NULL == ctx->s || NULL == in || inl < 0 ||
+            NULL == BIO_next(b))
+                return -1;
+        BIO_clear_retry_flags(b);
+        if (ctx->failed || ctx->finished || ctx->reading)
+                return -1;
+        if (!ctx->started && !bio_cryptobox_start(ctx))
+                return -1;
+
+        while (done < (size_t)inl) {
+                if (1 != (res = bio_cryptobox_drain(b, ctx)))
+                        return done > 0 ? (int)done : res;
+                n = ctx->chunk_size - ctx->fill;
+                if (n > (size_t)inl - done)
+                        n = (size_t)inl - done;
+                memcpy(ctx->buf + ctx->fill, in + done, n);
+                ctx->fill += n;
+                done += n;
+                if (ctx->fill == ctx->chunk_size && !bio_cryptobox_seal(ctx))
+                        return -1;
+        }
+        if (1 != (res = bio_cryptobox_drain(b, ctx)) && 0 == done)
+                return res;
+        return (int)done;
+}
+
+
+/*
+ * Seal and write out the final chunk, which is shorter than a full
+ * chunk and may be empty. Returns 1 once everything has been written.
+ */
+int
+bio_cryptobox_finish(BIO *b, struct bio_cryptobox *ctx)
+{
+        int     res;
+
+        if (ctx->failed)
+                return 0;
+        if (!ctx->started && !bio_cryptobox_start(ctx))
+                return 0;
+        if (1 != (res = bio_cryptobox_drain(b, ctx)))
+                return res;
+        if (!ctx->finished) {
+                if (!bio_cryptobox_seal(ctx))
+                        return 0;
+                ctx->finished = 1;
+                if (1 != (res = bio_cryptobox_drain(b, ctx)))
+                        return res;
+        }
+        return 1;
+}
+
+
+/*
+ * Read from the next BIO until the buffer holds want bytes or the end
+ * of its data. Returns 1 when the buffer is full, 0 at the end of the
+ * data, and the next BIO's result if it has to be retried.
+ */
+int
+bio_cryptobox_fill(BIO *b, struct bio_cryptobox *ctx, size_t want)
+{
+        int     n;
+
+        while (ctx->fill < want) {
+                n = BIO_read(BIO_next(b), ctx->buf + ctx->fill,
+                             (int)(want - ctx->fill));
+                if (n <= 0) {
+                        if (BIO_should_retry(BIO_next(b))) {
+                                BIO_copy_next_retry(b);
+                                return n < 0 ? n : -1;
+                        }
+                        return 0;
+                }
+                ctx->fill += (size_t)n;
+        }
+        return 1;
+}
+
+
+/*
+ * Read and open the next chunk, or the header if it has not been read
+ * yet. Returns 1 when there is plaintext in the buffer or the stream
+ * has ended, 0 if the stream is damaged, and a negative value if the
+ * next BIO has to be retried.
+ */
+int
+bio_cryptobox_next(BIO *b, struct bio_cryptobox *ctx)
+{
+        size_t  head_size = cryptobox_stream_head_size(ctx->type);
+        size_t  ts = cryptobox_stream_tag_size(ctx->type);
+        int     res;
+
+        if (!ctx->started) {
+                while (ctx->fill < head_size) {
+                        res = BIO_read(BIO_next(b), ctx->head + ctx->fill,
+                                       (int)(head_size - ctx->fill));
+                        if (res <= 0) {
+                                if (!BIO_should_retry(BIO_next(b)))
+                                        return 0;
+                                BIO_copy_next_retry(b);
+                                return res < 0 ? res : -1;
+                        }
+                        ctx->fill += (size_t)res;
+                }
+                if (!cryptobox_stream_open_head(ctx->s, ctx->head))
+                        return 0;
+                ctx->chunk_size = cryptobox_stream_chunk_size(ctx->s);
+                ctx->fill = 0;
+                ctx->started = 1;
+                if (!bio_cryptobox_buffer(ctx))
+                        return 0;
+        }
+
+        if ((res = bio_cryptobox_fill(b, ctx, ctx->buf_size)) < 0)
+                return res;
+        if (!cryptobox_stream_open_chunk(ctx->s, ctx->index, ctx->buf,
+                                         ctx->fill, ctx->buf))
+                return 0;
+        ctx->index++;
+        ctx->out = 0;
+        ctx->len = ctx->fill - ts;
+        ctx->fill = 0;
+        if (ctx->len < ctx->chunk_size)
+                ctx->finished = 1;
+        return 1;
+}
+
+
+int
+bio_cryptobox_read(BIO *b, char *out, int outl)
+{
+        struct bio_cryptobox    *ctx = BIO_get_data(b);
+        size_t                   n, done = 0;
+        int                      res;
+
+        if (NULL == ctx || NULL == ctx->s || NULL == out || outl < 0 ||
+            NULL == BIO_next(b))
+                return -1;
+        BIO_clear_retry_flags(b);
+        if (ctx->failed || (ctx->started && !ctx->reading))
+                return -1;
+        ctx->reading = 1;
+
+        while (done < (size_t)outl) {
+                if (ctx->out < ctx->len) {
+                        n = ctx->len - ctx->out;
+                        if (n > (size_t)outl - done)
+                                n = (size_t)outl - done;
+                        memcpy(out + done, ctx->buf + ctx->out, n);
+                        ctx->out += n;
+                        done += n;
+                        continue;
+                }
+                if (ctx->finished)
+                        break;
+                if ((res = bio_cryptobox_next(b, ctx)) <= 0) {
+                        if (0 == res)
+                                ctx->failed = 1;
+                        if (done > 0)
+                                break;
+                        return -1;
+                }
+        }
+        return (int)done;
+}
+
+
+long
+bio_cryptobox_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+        struct bio_cryptobox    *ctx = BIO_get_data(b);
+        long                     res;
+
+        if (NULL == ctx)
+                return 0;
+        switch (cmd) {
+        case BIO_CTRL_FLUSH:
+                if (ctx->reading)
+                        break;
+                if (NULL == BIO_next(b) || NULL == ctx->s)
+                        return 0;
+                BIO_clear_retry_flags(b);
+                if (1 != (res = bio_cryptobox_finish(b, ctx)))
+                        return res;
+                break;
+        case BIO_CTRL_EOF:
+                if (ctx->failed)
+                        return 1;
+                return ctx->finished && ctx->out == ctx->len;
+        case BIO_CTRL_PENDING:
+                if (ctx->reading && ctx->out < ctx->len)
+                        return (long)(ctx->len - ctx->out);
+                break;
+        case BIO_CTRL_WPENDING:
+                if (!ctx->reading && ctx->len - ctx->out + ctx->fill > 0)
+                        return (long)(ctx->len - ctx->out + ctx->fill);
+                break;
+        case BIO_CTRL_RESET:
+                ctx->fill = ctx->out = ctx->len = 0;
+                ctx->index = 0;
+                ctx->reading = ctx->started = 0;
+                ctx->finished = ctx->failed = 0;
+                break;
+        default:
+                break;
+        }
+        if (NULL == BIO_next(b))
+                return BIO_CTRL_RESET == cmd;
+        return BIO_ctrl(BIO_next(b), cmd, num, ptr);
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "box.h"
+#include "hmac_sha2.h"
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secmem.h>
+
+
+static void     *box_default_alloc(size_t, void *);
+static void      box_default_free(void *, void *);
+static void     *box_secure_alloc(size_t, void *);
+static void      box_secure_free(void *, void *);
+
+
+/*
+ * The allocator used for boxes, messages, contexts and the library's
+ * per-call buffers. Long-lived state, such as the worker pool and the
+ * secure arena, is always allocated with malloc.
+ */
+static struct box_allocator box_allocator = {
+        box_default_alloc,
+        box_default_free,
+        NULL
+};
+
+
+/*
+ * Return the operations for a box type, or NULL if the type is not
+ * known.
+ */
+const struct box_ops *
+box_ops_lookup(int type)
+{
+        switch (type) {
+        case CRYPTOBOX_SECRETBOX:
+                return &secretbox_ops;
+        case CRYPTOBOX_STRONGBOX:
+                return &strongbox_ops;
+        default:
+                return NULL;
+        }
+}
+
+
+/*
+ * Compute the CTR counter block that is block blocks past iv. The
+ * counter is the whole 128-bit block taken as a big-endian integer,
+ * which is how the EVP CTR mode increments it.
+ */
+void
+box_ctr_offset(unsigned char *ctr, unsigned char *iv, size_t block)
+{
+        unsigned int    carry = 0;
+        int             i;
+
+        for (i = BOX_BLOCK_SIZE - 1; i >= 0; i--) {
+                carry += iv[i] + (unsigned int)(block & 0xff);
+                ctr[i] = (unsigned char)(carry & 0xff);
+                carry >>= 8;
+                block >>= 8;
+        }
+}
+
+
+/*
+ * Set up associated data from an I/O vector, totalling its length.
+ * Returns 0 if the vector is malformed or its total overflows.
+ */
+int
+box_aad_init(struct box_aad *aad, const struct iovec *iov, int iovcnt)
+{
+        int     i;
+
+        aad->iov = iov;
+        aad->iovcnt = iovcnt;
+        aad->len = 0;
+        if (iovcnt < 0 || (NULL == iov && iovcnt > 0))
+                return 0;
+        for (i = 0; i < iovcnt; i++) {
+                if (NULL == iov[i].iov_base && iov[i].iov_len > 0)
+                        return 0;
+                if (aad->len + iov[i].iov_len < aad->len)
+                        return 0;
+                aad->len += iov[i].iov_len;
+        }
+        return 1;
+}
+
+
+/*
+ * Encode the length of the associated data and of the IV and
+ * ciphertext as big-endian 64-bit integers. These end the input to a
+ * tag over associated data, so that the split between the two is
+ * unambiguous.
+ */
+void
+box_aad_trailer(unsigned char *out, size_t aadlen, size_t bodylen)
+{
+        uint64_t        v[2];
+        int             i, j;
+
+        v[0] = (uint64_t)aadlen;
+        v[1] = (uint64_t)bodylen;
+        for (i = 0; i < 2; i++)
+                for (j = 0; j < 8; j++)
+                        out[i*8 + j] = (unsigned char)(v[i] >> (56 - 8*j));
+}
+
+
+/*
+ * Start and finish a tag under a derived MAC key, fed in between with
+ * the box type's tag_update. The state is wiped by box_mac_finish.
+ */
+void
+box_mac_start(struct box_mac_key *mk, union box_mac_state *state)
+{
+        if (CRYPTOBOX_STRONGBOX == mk->type)
+                hmac_sha384_start(&mk->key.sha384, &state->sha512);
+        else
+                hmac_sha256_start(&mk->key.sha256, &state->sha256);
+}
+
+
+int
+box_mac_finish(struct box_mac_key *mk, union box_mac_state *state,
+               unsigned char *tag)
+{
+        if (CRYPTOBOX_STRONGBOX == mk->type)
+                return hmac_sha384_finish(&mk->key.sha384, &state->sha512,
+                                          tag);
+        return hmac_sha256_finish(&mk->key.sha256, &state->sha256, tag);
+}
+
+
+/*
+ * Wipe a derived MAC key.
+ */
+void
+box_mac_zero(struct box_mac_key *mk)
+{
+        memset(mk, 0x0, sizeof(struct box_mac_key));
+}
+
+
+void *
+box_default_alloc(size_t len, void *opaque)
+{
+        (void)opaque;
+        return malloc(len);
+}
+
+
+void
+box_default_free(void *p, void *opaque)
+{
+        (void)opaque;
+        free(p);
+}
+
+
+void *
+box_secure_alloc(size_t len, void *opaque)
+{
+        (void)opaque;
+        return cryptobox_secmem_alloc(len);
+}
+
+
+void
+box_secure_free(void *p, void *opaque)
+{
+        (void)opaque;
+        cryptobox_secmem_free(p);
+}
+
+
+/*
+ * Route the library's allocations through alloc and free; passing
+ * NULL for either restores malloc and free. This should be called
+ * before the library is in use, and every block allocated through a
+ * set of hooks must be freed before they are replaced.
+ */
+void
+cryptobox_set_allocator(cryptobox_alloc_fn alloc, cryptobox_free_fn release,
+                        void *opaque)
+{
+        if (NULL == alloc || NULL == release) {
+                box_allocator.alloc = box_default_alloc;
+                box_allocator.free = box_default_free;
+                box_allocator.opaque = NULL;
+                return;
+        }
+        box_allocator.alloc = alloc;
+        box_allocator.free = release;
+        box_allocator.opaque = opaque;
+}
+
+
+/*
+ * Copy the library-wide allocator.
+ */
+void
+box_allocator_get(struct box_allocator *a)
+{
+        memcpy(a, &box_allocator, sizeof(struct box_allocator));
+}
+
+
+/*
+ * Fill in an allocator that serves blocks from the secure arena.
+ */
+void
+box_allocator_secure(struct box_allocator *a)
+{
+        a->alloc = box_secure_alloc;
+        a->free = box_secure_free;
+        a->opaque = NULL;
+}
+
+
+void *
+box_alloc(const struct box_allocator *a, size_t len)
+{
+        return a->alloc(len, a->opaque);
+}
+
+
+/*
+ * Wipe and release a block of len bytes.
+ */
+void
+box_release(const struct box_allocator *a, void *p, size_t len)
+{
+        if (NULL == p)
+                return;
+        memset(p, 0, len);
+        a->free(p, a->opaque);
+}
+
+
+/*
+ * Allocate and free the library's own per-call buffers with the
+ * library-wide allocator; these hold no secrets and are not wiped.
+ */
+void *
+box_malloc(size_t len)
+{
+        return box_allocator.alloc(len, box_allocator.opaque);
+}
+
+
+void
+box_free(void *p)
+{
+        if (NULL != p)
+                box_allocator.free(p, box_allocator.opaque);
+}
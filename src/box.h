@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __BOX_H__
+#define __BOX_H__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/sha.h>
+
+#include "hmac_sha2.h"
+#include <cryptobox/cryptobox.h>
+
+
+#define BOX_BLOCK_SIZE  16
+#define BOX_AAD_TRAILER 16
+
+
+/*
+ * The running state of a tag computation, for either box type.
+ */
+union box_mac_state {
+        SHA256_CTX      sha256;
+        SHA512_CTX      sha512;
+};
+
+
+/*
+ * A MAC key derived from a box key for one format built on boxes, such
+ * as Merkle trees or streams. Tags made under the box's own tag key
+ * over bytes an attacker can arrange would be boxes nobody sealed, so
+ * each format tags under a key of its own, expanded from the tag key
+ * under a label naming the format. type is the box type the key was
+ * derived for, CRYPTOBOX_SECRETBOX or CRYPTOBOX_STRONGBOX.
+ */
+struct box_mac_key {
+        int                      type;
+        union {
+                struct hmac_sha256       sha256;
+                struct hmac_sha384       sha384;
+        }                        key;
+};
+
+
+/*
+ * Associated data for a box: authenticated along with it but neither
+ * encrypted nor stored in it. len is the total over the vector.
+ */
+struct box_aad {
+        const struct iovec      *iov;
+        int                      iovcnt;
+        size_t                   len;
+};
+
+
+/*
+ * A set of allocator hooks, as given to cryptobox_set_allocator or to
+ * a context.
+ */
+struct box_allocator {
+        cryptobox_alloc_fn       alloc;
+        cryptobox_free_fn        free;
+        void                    *opaque;
+};
+
+
+/*
+ * The operations common to both box types, for the parts of the
+ * library that work on either kind of box. The context pointers are
+ * the box type's own context. A box is laid out as the IV, the
+ * ciphertext, and the tag over the IV and ciphertext; crypt applies
+ * the CTR key stream for an IV starting a given number of blocks in,
+ * so that pieces of a box can be processed separately.
+ */
+struct box_ops {
+        int              type;
+        size_t           key_size;
+        size_t           overhead;
+        size_t           iv_size;
+        size_t           tag_size;
+        unsigned char   *(*seal)(unsigned char *, int, int *, unsigned char *);
+        unsigned char   *(*open)(unsigned char *, int, unsigned char *);
+        void            *(*ctx_new)(unsigned char *);
+        void             (*ctx_free)(void *);
+        unsigned char   *(*ctx_seal)(void *, unsigned char *, int, int *);
+        unsigned char   *(*ctx_open)(void *, unsigned char *, int);
+        int              (*ctx_verify)(void *, unsigned char *, int);
+        unsigned char   *(*ctx_seal_aadv)(void *, unsigned char *, int,
+                                          const struct iovec *, int, int *);
+        unsigned char   *(*ctx_open_aadv)(void *, unsigned char *, int,
+                                          const struct iovec *, int);
+        int              (*ctx_verify_aadv)(void *, unsigned char *, int,
+                                            const struct iovec *, int);
+        unsigned char   *(*ctx_alloc)(void *, size_t);
+        void             (*ctx_release)(void *, unsigned char *, size_t);
+        int              (*crypt)(void *, unsigned char *, size_t,
+                                  unsigned char *, unsigned char *, size_t);
+        int              (*mac_key)(void *, const char *,
+                                    struct box_mac_key *);
+        void             (*tag_start)(void *, union box_mac_state *);
+        int              (*tag_update)(union box_mac_state *, unsigned char *,
+                                       size_t);
+        int              (*tag_finish)(void *, union box_mac_state *,
+                                       unsigned char *);
+};
+
+
+extern const struct box_ops     secretbox_ops;
+extern const struct box_ops     strongbox_ops;
+
+
+const struct box_ops    *box_ops_lookup(int);
+void                     box_ctr_offset(unsigned char *, unsigned char *,
+                                        size_t);
+int                      box_aad_init(struct box_aad *,
+                                      const struct iovec *, int);
+void                     box_aad_trailer(unsigned char *, size_t, size_t);
+void                     box_mac_start(struct box_mac_key *,
+                                      union box_mac_state *);
+int                      box_mac_finish(struct box_mac_key *,
+                                       union box_mac_state *,
+                                       unsigned char *);
+void                     box_mac_zero(struct box_mac_key *);
+void                     box_allocator_get(struct box_allocator *);
+void                     box_allocator_secure(struct box_allocator *);
+void                    *box_alloc(const struct box_allocator *, size_t);
+void                     box_release(const struct box_allocator *, void *,
+                                     size_t);
+void                    *box_malloc(size_t);
+void                     box_free(void *);
+
+
+#endif
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * The client side of cryptoboxd. Requests are copied into free slots
+ * in the region the daemon handed over when the client connected, and
+ * queued; results come back in the same slots. A batch keeps every
+ * slot busy, refilling each as soon as its result has been collected.
+ * While waiting, the client spins briefly before sleeping on its
+ * response notifier and its socket, which the daemon only closes when
+ * it goes away, so that a dead daemon fails calls rather than hanging
+ * them. A client handle must not be used by more than one thread at
+ * a time.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "box.h"
+#include "shmring.h"
+#include <cryptobox/client.h>
+
+
+#define CLIENT_SPIN     256
+
+
+struct cryptobox_client {
+        int                      sock;
+        struct shmring          *ring;
+        int                      req_fd;
+        int                      resp_fd;
+        uint32_t                 free[SHMRING_SLOTS];
+        int                      nfree;
+        int                      owner[SHMRING_SLOTS];
+        int                      dead;
+};
+
+
+static int       client_wait(struct cryptobox_client *);
+static int       client_result(uint32_t, struct shmring_slot *,
+                               struct cryptobox_msg *);
+static int       client_run(struct cryptobox_client *, uint32_t, int,
+                            struct cryptobox_msg *, int);
+
+
+/*
+ * Connect to the daemon listening at path. Returns NULL on failure.
+ */
+struct cryptobox_client *
+cryptobox_client_connect(const char *path)
+{
+        struct cryptobox_client *c;
+        struct sockaddr_un       addr;
+        int                      fds[SHMRING_NFDS];
+        int                      i, r;
+
+        if (NULL == path || strlen(path) >= sizeof addr.sun_path)
+                return NULL;
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+
+        if (NULL == (c = box_malloc(sizeof(struct cryptobox_client))))
+                return NULL;
+        memset(c, 0, sizeof(struct cryptobox_client));
+        c->req_fd = c->resp_fd = -1;
+        if (-1 == (c->sock = socket(AF_UNIX, SOCK_STREAM, 0)))
+                goto fail;
+        do {
+                r = connect(c->sock, (struct sockaddr *)&addr, sizeof addr);
+        } while (-1 == r && EINTR == errno);
+        if (-1 == r || !shmring_recv_fds(c->sock, fds, SHMRING_NFDS))
+                goto fail;
+
+        c->ring = shmring_map(fds[SHMRING_FD_SHM]);
+        c->req_fd = fds[SHMRING_FD_REQ_W];
+        c->resp_fd = fds[SHMRING_FD_RESP_R];
+        close(fds[SHMRING_FD_SHM]);
+        close(fds[SHMRING_FD_REQ_R]);
+        close(fds[SHMRING_FD_RESP_W]);
+        if (NULL == c->ring ||
+            SHMRING_MAGIC != __atomic_load_n(&c->ring->magic,
+                                             __ATOMIC_ACQUIRE) ||
+            SHMRING_SLOTS != c->ring->nslots ||
+            c->ring->nkeys > SHMRING_MAX_KEYS)
+                goto fail;
+        fcntl(c->sock, F_SETFD, FD_CLOEXEC);
+        fcntl(c->req_fd, F_SETFD, FD_CLOEXEC);
+        fcntl(c->resp_fd, F_SETFD, FD_CLOEXEC);
+
+        for (i = 0; i < SHMRING_SLOTS; i++)
+                c->free[c->nfree++] = (uint32_t)(SHMRING_SLOTS - 1 - i);
+        return c;
+
+fail:
+        cryptobox_client_close(c);
+        return NULL;
+}
+
+
+/*
+ * Disconnect from the daemon and release the client.
+ */
+void
+cryptobox_client_close(struct cryptobox_client *c)
+{
+        if (NULL == c)
+                return;
+        if (-1 != c->sock)
+                close(c->sock);
+        if (-1 != c->req_fd)
+                close(c->req_fd);
+        if (-1 != c->resp_fd)
+                close(c->resp_fd);
+        shmring_unmap(c->ring);
+        box_free(c);
+}
+
+
+/*
+ * Return the number of keys the daemon holds; keys are numbered from
+ * zero.
+ */
+int
+cryptobox_client_keys(struct cryptobox_client *c)
+{
+        return NULL == c ? 0 : (int)c->ring->nkeys;
+}
+
+
+/*
+ * Return the box type of a key, or 0 if there is no such key.
+ */
+int
+cryptobox_client_key_type(struct cryptobox_client *c, int key)
+{
+        if (NULL == c || key < 0 || key >= (int)c->ring->nkeys)
+                return 0;
+        return c->ring->key_types[key];
+}
+
+
+/*
+ * Sleep until the daemon queues a response. Returns 0 if the daemon
+ * has gone away.
+ */
+int
+client_wait(struct cryptobox_client *c)
+{
+        struct pollfd   pfd[2];
+        int             n;
+
+        if (!shmring_sleep(&c->ring->resp))
+                return 1;
+        pfd[0].fd = c->resp_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = c->sock;
+        pfd[1].events = POLLIN;
+        do {
+                n = poll(pfd, 2, -1);
+        } while (-1 == n && EINTR == errno);
+        shmring_awake(&c->ring->resp);
+        if (-1 == n ||
+            (pfd[1].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))) {
+                c->dead = 1;
+                return 0;
+        }
+        if (pfd[0].revents & POLLIN)
+                shmring_drain(c->resp_fd);
+        return 1;
+}
+
+
+/*
+ * Copy the result in a slot out to its message. Returns 1 if the
+ * request succeeded.
+ */
+int
+client_result(uint32_t op, struct shmring_slot *s, struct cryptobox_msg *m)
+{
+        uint32_t        len = s->len;
+
+        if (SHMRING_VERIFY == op) {
+                m->out_len = 1 == s->status;
+                return m->out_len;
+        }
+        if (1 != s->status || len > SHMRING_SLOT_DATA)
+                return 0;
+        if (NULL == (m->out = box_malloc(0 == len ? 1 : len)))
+                return 0;
+        memcpy(m->out, s->data, len);
+        m->out_len = (int)len;
+        return 1;
+}
+
+
+/*
+ * Send every message through the daemon, keeping as many slots in
+ * flight as there are. Messages too large for a slot are failed
+ * without being sent. Returns the number of requests that succeeded.
+ */
+int
+client_run(struct cryptobox_client *c, uint32_t op, int key,
+           struct cryptobox_msg *msgs, int n)
+{
+        struct shmring_slot     *s;
+        struct cryptobox_msg    *m;
+        uint32_t                 slot;
+        size_t                   limit;
+        int                      next = 0, inflight = 0, done = 0;
+        int                      spin = 0, wake, i;
+
+        if (NULL == msgs || n <= 0)
+                return 0;
+        for (i = 0; i < n; i++) {
+                msgs[i].out = NULL;
+                msgs[i].out_len = 0;
+        }
+        if (NULL == c || c->dead || key < 0 || key >= (int)c->ring->nkeys)
+                return 0;
+        limit = SHMRING_SEAL == op ? SHMRING_MAX_MSG : SHMRING_SLOT_DATA;
+
+        while (next < n || inflight > 0) {
+                wake = 0;
+                while (next < n && c->nfree > 0) {
+                        m = &msgs[next++];
+                        if (m->in_len < 0 || (size_t)m->in_len > limit ||
+                            (NULL == m->in && m->in_len > 0))
+                                continue;
+                        slot = c->free[--c->nfree];
+                        s = &c->ring->slots[slot];
+                        s->op = op;
+                        s->key = (uint32_t)key;
+                        s->len = (uint32_t)m->in_len;
+                        if (m->in_len > 0)
+                                memcpy(s->data, m->in, (size_t)m->in_len);
+                        c->owner[slot] = (int)(m - msgs);
+                        inflight++;
+                        if (shmring_push(&c->ring->req, slot))
+                                wake = 1;
+                }
+                if (wake)
+                        shmring_notify(c->req_fd);
+                if (0 == inflight)
+                        break;
+
+                if (!shmring_pop(&c->ring->resp, &slot)) {
+                        if (spin++ < CLIENT_SPIN)
+                                sched_yield();
+                        else if (!client_wait(c))
+                                break;
+                        continue;
+                }
+                spin = 0;
+                if (slot >= SHMRING_SLOTS)
+                        continue;
+                inflight--;
+                c->free[c->nfree++] = slot;
+                done += client_result(op, &c->ring->slots[slot],
+                                      &msgs[c->owner[slot]]);
+        }
+        return done;
+}
+
+
+/*
+ * Seal a message under one of the daemon's keys, returning a box
+ * allocated with the library allocator and storing its length in
+ * blen. Returns NULL on failure.
+ */
+unsigned char *
+cryptobox_client_seal(struct cryptobox_client *c, int key, unsigned char *m,
+                      int mlen, int *blen)
+{
+        struct cryptobox_msg    msg;
+
+        msg.in = m;
+        msg.in_len = mlen;
+        if (NULL == blen || 1 != client_run(c, SHMRING_SEAL, key, &msg, 1))
+                return NULL;
+        *blen = msg.out_len;
+        return msg.out;
+}
+
+
+/*
+ * Open a box under one of the daemon's keys, storing the message
+ * length in mlen. Returns NULL if the box is not authentic.
+ */
+unsigned char *
+cryptobox_client_open(struct cryptobox_client *c, int key,
+                      unsigned char *box, int blen, int *mlen)
+{
+        struct cryptobox_msg    msg;
+
+        msg.in = box;
+        msg.in_len = blen;
+        if (NULL == mlen || 1 != client_run(c, SHMRING_OPEN, key, &msg, 1))
+                return NULL;
+        *mlen = msg.out_len;
+        return msg.out;
+}
+
+
+/*
+ * Check a box's tag under one of the daemon's keys. Returns 1 if the
+ * box is authentic.
+ */
+int
+cryptobox_client_verify(struct cryptobox_client *c, int key,
+                        unsigned char *box, int blen)
+{
+        struct cryptobox_msg    msg;
+
+        msg.in = box;
+        msg.in_len = blen;
+        return client_run(c, SHMRING_VERIFY, key, &msg, 1);
+}
+
+
+/*
+ * The batch calls behave as cryptobox_seal_batch and its siblings,
+ * with the work done by the daemon. Returns the number of messages
+ * that succeeded.
+ */
+int
+cryptobox_client_seal_batch(struct cryptobox_client *c, int key,
+                            struct cryptobox_msg *msgs, int n)
+{
+        return client_run(c, SHMRING_SEAL, key, msgs, n);
+}
+
+
+int
+cryptobox_client_open_batch(struct cryptobox_client *c, int key,
+                            struct cryptobox_msg *msgs, int n)
+{
+        return client_run(c, SHMRING_OPEN, key, msgs, n);
+}
+
+
+int
+cryptobox_client_verify_batch(struct cryptobox_client *c, int key,
+                              struct cryptobox_msg *msgs, int n)
+{
+        return client_run(c, SHMRING_VERIFY, key, msgs, n);
+}
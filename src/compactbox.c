@@ -0,0 +1,494 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Compact boxes, for messages so short that the 48 or 64 bytes of a
+ * secretbox or strongbox would dwarf them. A box is a 96-bit nonce,
+ * the message under AES-128 in CTR mode with the nonce in the top 96
+ * bits of the counter block, and the first 96 bits of HMAC-SHA-256
+ * over the nonce and ciphertext: 24 bytes of overhead in all.
+ *
+ * A random nonce of 96 bits is too short to be safe over the life of
+ * a busy key, so each context draws a random 32-bit prefix and a
+ * random starting point for a 64-bit counter when it first seals, and
+ * every seal takes the next counter value. Nonces from one context
+ * cannot repeat, and those from different contexts only collide if
+ * two contexts with the same prefix have counter ranges that overlap.
+ * compactbox_seal sets up a context for each box, so its nonces are
+ * no better than random ones: a key that seals more than 2^32 boxes
+ * must do so through a long-lived context.
+ *
+ * The cipher and MAC keys are derived from the caller's key with
+ * HKDF-SHA-256, so that a key mistakenly shared with a secretbox can
+ * never have a box of one kind accepted as a box of the other.
+ */
+
+#include <sys/types.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "box.h"
+#include "constant_time.h"
+#include "hkdf.h"
+#include "hmac_sha2.h"
+#include <cryptobox/compactbox.h>
+#include <cryptobox/keycache.h>
+#include <cryptobox/secmem.h>
+
+
+#define COMPACTBOX_CRYPT_SIZE   16
+#define COMPACTBOX_MAC_SIZE     32
+#define COMPACTBOX_PREFIX_SIZE  4
+#define COMPACTBOX_LABEL        "cryptobox-compactbox"
+
+#define COMPACTBOX_UNSEEDED     0
+#define COMPACTBOX_SEEDING      1
+#define COMPACTBOX_SEEDED       2
+
+
+/*
+ * A compactbox context holds the derived keys and the nonce state. The
+ * nonce state is drawn by the first seal, seeded saying whether it has
+ * been, and the counter is advanced atomically, so a context may be
+ * used from several threads at once.
+ */
+struct compactbox_ctx {
+        unsigned char           cryptkey[COMPACTBOX_CRYPT_SIZE];
+        struct hmac_sha256      tagkey;
+        unsigned char           prefix[COMPACTBOX_PREFIX_SIZE];
+        uint64_t                counter;
+        int                     seeded;
+        struct box_allocator    mem;
+        struct box_allocator    self;
+};
+
+
+static int       compactbox_ctx_init(struct compactbox_ctx *,
+                                     unsigned char *);
+static void      compactbox_ctx_zero(struct compactbox_ctx *);
+static struct compactbox_ctx
+                *compactbox_ctx_temp(struct compactbox_ctx *,
+                                     unsigned char *);
+static void      compactbox_ctx_temp_free(struct compactbox_ctx *,
+                                          struct compactbox_ctx *);
+static int       compactbox_ctx_seed(struct compactbox_ctx *);
+static void      compactbox_next_nonce(struct compactbox_ctx *,
+                                       unsigned char *);
+static int       compactbox_crypt(struct compactbox_ctx *, unsigned char *,
+                                  unsigned char *, unsigned char *, int);
+static int       compactbox_check_tag(struct compactbox_ctx *,
+                                      unsigned char *, int);
+
+
+/*
+ * Generate a suitable key for use with compactbox. It is the caller's
+ * responsibility to ensure that the key has COMPACTBOX_KEY_SIZE bytes
+ * available.
+ */
+int
+compactbox_generate_key(unsigned char *key)
+{
+        return RAND_bytes(key, COMPACTBOX_KEY_SIZE);
+}
+
+
+/*
+ * Derive the context's keys from key. The nonce state is left for the
+ * first seal to draw. Returns 1 on success and 0 on failure.
+ */
+int
+compactbox_ctx_init(struct compactbox_ctx *ctx, unsigned char *key)
+{
+        struct hkdf_prk  prk;
+        unsigned char    okm[COMPACTBOX_CRYPT_SIZE + COMPACTBOX_MAC_SIZE];
+        int              res = 0;
+
+        box_allocator_get(&ctx->mem);
+        ctx->counter = 0;
+        ctx->seeded = COMPACTBOX_UNSEEDED;
+        if (hkdf_extract(&prk, CRYPTOBOX_HKDF_SHA256, NULL, 0, key,
+                         COMPACTBOX_KEY_SIZE))
+        if (hkdf_expand(&prk, (unsigned char *)COMPACTBOX_LABEL,
+                        sizeof(COMPACTBOX_LABEL) - 1, NULL, 0, okm,
+                        sizeof okm))
+        if (hmac_sha256_init(&ctx->tagkey, okm + COMPACTBOX_CRYPT_SIZE,
+                             COMPACTBOX_MAC_SIZE)) {
+                memcpy(ctx->cryptkey, okm, COMPACTBOX_CRYPT_SIZE);
+                res = 1;
+        }
+
+        hkdf_zero(&prk);
+        memset(okm, 0x0, sizeof okm);
+        if (!res)
+                compactbox_ctx_zero(ctx);
+        return res;
+}
+
+
+/*
+ * Wipe the key material in a context.
+ */
+void
+compactbox_ctx_zero(struct compactbox_ctx *ctx)
+{
+        memset(ctx->cryptkey, 0x0, COMPACTBOX_CRYPT_SIZE);
+        hmac_sha256_zero(&ctx->tagkey);
+}
+
+
+/*
+ * Allocate a context for the key, which must be COMPACTBOX_KEY_SIZE
+ * bytes. Returns NULL on failure; the context should be released with
+ * compactbox_ctx_free.
+ */
+struct compactbox_ctx *
+compactbox_ctx_new(unsigned char *key)
+{
+        struct compactbox_ctx   *ctx;
+        struct box_allocator     self;
+
+        box_allocator_get(&self);
+        if (NULL == (ctx = box_alloc(&self, sizeof(struct compactbox_ctx))))
+                return NULL;
+        if (!compactbox_ctx_init(ctx, key)) {
+                box_release(&self, ctx, sizeof(struct compactbox_ctx));
+                return NULL;
+        }
+        memcpy(&ctx->self, &self, sizeof(struct box_allocator));
+        return ctx;
+}
+
+
+/*
+ * Allocate the boxes and messages from a context with alloc and free
+ * instead of the library-wide allocator; passing NULL for either
+ * restores the library-wide allocator. This must be done before the
+ * context is shared between threads.
+ */
+void
+compactbox_ctx_set_allocator(struct compactbox_ctx *ctx,
+                             cryptobox_alloc_fn alloc,
+                             cryptobox_free_fn release, void *opaque)
+{
+        if (NULL == alloc || NULL == release) {
+                box_allocator_get(&ctx->mem);
+                return;
+        }
+        ctx->mem.alloc = alloc;
+        ctx->mem.free = release;
+        ctx->mem.opaque = opaque;
+}
+
+
+/*
+ * Wipe and release a context.
+ */
+void
+compactbox_ctx_free(struct compactbox_ctx *ctx)
+{
+        struct box_allocator     self;
+
+        if (NULL == ctx)
+                return;
+        memcpy(&self, &ctx->self, sizeof(struct box_allocator));
+        box_release(&self, ctx, sizeof(struct compactbox_ctx));
+}
+
+
+/*
+ * Set up a context for a single call to compactbox_seal, _open or
+ * _verify, in the locked arena once it is in use and on the caller's
+ * stack otherwise.
+ */
+struct compactbox_ctx *
+compactbox_ctx_temp(struct compactbox_ctx *stack, unsigned char *key)
+{
+        struct compactbox_ctx   *ctx = NULL;
+
+        if (cryptobox_secmem_enabled())
+                ctx = cryptobox_secmem_alloc(sizeof(struct compactbox_ctx));
+        if (NULL == ctx)
+                ctx = stack;
+        if (!compactbox_ctx_init(ctx, key)) {
+                if (ctx != stack)
+                        cryptobox_secmem_free(ctx);
+                return NULL;
+        }
+        return ctx;
+}
+
+
+void
+compactbox_ctx_temp_free(struct compactbox_ctx *ctx,
+                         struct compactbox_ctx *stack)
+{
+        if (ctx != stack)
+                cryptobox_secmem_free(ctx);
+        else
+                compactbox_ctx_zero(ctx);
+}
+
+
+/*
+ * Draw the nonce prefix and starting counter the first time a context
+ * seals, so that contexts which only open or verify never call on the
+ * random number generator. A thread that finds another drawing them
+ * waits for it. Returns 0 if the draw fails.
+ */
+int
+compactbox_ctx_seed(struct compactbox_ctx *ctx)
+{
+        unsigned char    seed[COMPACTBOX_PREFIX_SIZE + 8];
+        uint64_t         counter = 0;
+        int              expected;
+        int              i;
+
+        while (COMPACTBOX_SEEDED != __atomic_load_n(&ctx->seeded,
+                                                    __ATOMIC_ACQUIRE)) {
+                expected = COMPACTBOX_UNSEEDED;
+                if (!__atomic_compare_exchange_n(&ctx->seeded, &expected,
+                    COMPACTBOX_SEEDING, 0, __ATOMIC_ACQUIRE,
+                    __ATOMIC_RELAXED)) {
+                        sched_yield();
+                        continue;
+                }
+                if (!RAND_bytes(seed, sizeof seed)) {
+                        __atomic_store_n(&ctx->seeded, COMPACTBOX_UNSEEDED,
+                                         __ATOMIC_RELEASE);
+                        return 0;
+                }
+                memcpy(ctx->prefix, seed, COMPACTBOX_PREFIX_SIZE);
+                for (i = COMPACTBOX_PREFIX_SIZE; i < (int)sizeof seed; i++)
+                        counter = (counter << 8) | seed[i];
+                ctx->counter = counter;
+                memset(seed, 0x0, sizeof seed);
+                __atomic_store_n(&ctx->seeded, COMPACTBOX_SEEDED,
+                                 __ATOMIC_RELEASE);
+        }
+        return 1;
+}
+
+
+/*
+ * Take the next nonce: the prefix followed by the counter, big-endian.
+ */
+void
+compactbox_next_nonce(struct compactbox_ctx *ctx, unsigned char *nonce)
+{
+        uint64_t        n;
+        int             i;
+
+        n = __atomic_fetch_add(&ctx->counter, 1, __ATOMIC_RELAXED);
+        memcpy(nonce, ctx->prefix, COMPACTBOX_PREFIX_SIZE);
+        for (i = COMPACTBOX_NONCE_SIZE - 1; i >= COMPACTBOX_PREFIX_SIZE; i--) {
+                nonce[i] = (unsigned char)n;
+                n >>= 8;
+        }
+}
+
+
+/*
+ * Apply the key stream for nonce to len bytes. The counter block is
+ * the nonce followed by a 32-bit block counter starting at zero, which
+ * cannot carry into the nonce for any message an int can describe.
+ */
+int
+compactbox_crypt(struct compactbox_ctx *ctx, unsigned char *nonce,
+                 unsigned char *in, unsigned char *out, int len)
+{
+        EVP_CIPHER_CTX   crypt;
+        unsigned char    ctr[BOX_BLOCK_SIZE];
+        int              outlen = 0;
+        int              res = 0;
+
+        if (0 == len)
+                return 1;
+        memset(ctr, 0x0, BOX_BLOCK_SIZE);
+        memcpy(ctr, nonce, COMPACTBOX_NONCE_SIZE);
+        EVP_CIPHER_CTX_init(&crypt);
+        if (EVP_EncryptInit_ex(&crypt, EVP_aes_128_ctr(), NULL, ctx->cryptkey,
+                               ctr))
+        if (EVP_EncryptUpdate(&crypt, out, &outlen, in, len))
+        if (outlen == len)
+                res = 1;
+        EVP_CIPHER_CTX_cleanup(&crypt);
+        return res;
+}
+
+
+/*
+ * Seal a message into a box using a context.
+ */
+unsigned char *
+compactbox_ctx_seal(struct compactbox_ctx *ctx, unsigned char *m, int mlen,
+                    int *box_len)
+{
+        unsigned char   *box;
+        unsigned char    tag[COMPACTBOX_MAC_SIZE];
+        int              ctlen;
+        int              ok = 0;
+
+        if (NULL != box_len)
+                *box_len = 0;
+        if (mlen < 0 || (NULL == m && mlen > 0) ||
+            mlen > INT_MAX - (int)COMPACTBOX_OVERHEAD)
+                return NULL;
+        ctlen = mlen + (int)COMPACTBOX_NONCE_SIZE;
+        if (!compactbox_ctx_seed(ctx))
+                return NULL;
+        if (NULL == (box = box_alloc(&ctx->mem, mlen + COMPACTBOX_OVERHEAD)))
+                return NULL;
+
+        compactbox_next_nonce(ctx, box);
+        if (compactbox_crypt(ctx, box, m, box + COMPACTBOX_NONCE_SIZE, mlen))
+        if (hmac_sha256(&ctx->tagkey, box, ctlen, tag)) {
+                memcpy(box + ctlen, tag, COMPACTBOX_TAG_SIZE);
+                ok = 1;
+        }
+        memset(tag, 0x0, sizeof tag);
+        if (ok) {
+                if (NULL != box_len)
+                        *box_len = mlen + (int)COMPACTBOX_OVERHEAD;
+                return box;
+        }
+        box_release(&ctx->mem, box, mlen + COMPACTBOX_OVERHEAD);
+        return NULL;
+}
+
+
+/*
+ * Seal a message into a box. Each call sets up a context of its own,
+ * drawing a fresh random nonce prefix and counter; keys that seal many
+ * boxes should use compactbox_ctx_seal instead.
+ */
+unsigned char *
+compactbox_seal(unsigned char *m, int mlen, int *box_len, unsigned char *key)
+{
+        struct compactbox_ctx    stack;
+        struct compactbox_ctx   *ctx;
+        unsigned char           *box = NULL;
+
+        if (NULL != box_len)
+                *box_len = 0;
+        if (NULL != (ctx = compactbox_ctx_temp(&stack, key))) {
+                box = compactbox_ctx_seal(ctx, m, mlen, box_len);
+                compactbox_ctx_temp_free(ctx, &stack);
+        }
+        return box;
+}
+
+
+/*
+ * Check the truncated tag on a box. Returns 1 if it matches.
+ */
+int
+compactbox_check_tag(struct compactbox_ctx *ctx, unsigned char *box,
+                     int box_len)
+{
+        unsigned char    tag[COMPACTBOX_MAC_SIZE];
+        int              msglen = box_len - (int)COMPACTBOX_TAG_SIZE;
+        int              match = 0;
+
+        if (hmac_sha256(&ctx->tagkey, box, msglen, tag))
+        if (1 == constant_time_equals(tag, COMPACTBOX_TAG_SIZE, box + msglen,
+                                      COMPACTBOX_TAG_SIZE))
+                match = 1;
+        memset(tag, 0x0, sizeof tag);
+        return match;
+}
+
+
+/*
+ * Recover the message from a box using a context. The tag is checked
+ * before anything is decrypted.
+ */
+unsigned char *
+compactbox_ctx_open(struct compactbox_ctx *ctx, unsigned char *box,
+                    int box_len)
+{
+        unsigned char   *message;
+        int              mlen;
+
+        if (NULL == box || box_len < (int)COMPACTBOX_OVERHEAD)
+                return NULL;
+        mlen = box_len - (int)COMPACTBOX_OVERHEAD;
+        if (!compactbox_check_tag(ctx, box, box_len))
+                return NULL;
+        if (NULL == (message = box_alloc(&ctx->mem, 0 == mlen ? 1 : mlen)))
+                return NULL;
+        if (compactbox_crypt(ctx, box, box + COMPACTBOX_NONCE_SIZE, message,
+                             mlen))
+                return message;
+        box_release(&ctx->mem, message, 0 == mlen ? 1 : mlen);
+        return NULL;
+}
+
+
+/*
+ * Recover the message from a box.
+ */
+unsigned char *
+compactbox_open(unsigned char *box, int box_len, unsigned char *key)
+{
+        struct compactbox_ctx    stack;
+        struct compactbox_ctx   *ctx;
+        unsigned char           *message = NULL;
+
+        if (NULL != (ctx = compactbox_ctx_temp(&stack, key))) {
+                message = compactbox_ctx_open(ctx, box, box_len);
+                compactbox_ctx_temp_free(ctx, &stack);
+        }
+        return message;
+}
+
+
+/*
+ * Check that a box is authentic using a context, without decrypting
+ * it or allocating memory. Returns 1 if the tag matches and 0 if not.
+ */
+int
+compactbox_ctx_verify(struct compactbox_ctx *ctx, unsigned char *box,
+                      int box_len)
+{
+        if (NULL == box || box_len < (int)COMPACTBOX_OVERHEAD)
+                return 0;
+        return compactbox_check_tag(ctx, box, box_len);
+}
+
+
+/*
+ * Check that a box is authentic.
+ */
+int
+compactbox_verify(unsigned char *box, int box_len, unsigned char *key)
+{
+        struct compactbox_ctx    stack;
+        struct compactbox_ctx   *ctx;
+        int                      match = 0;
+
+        if (NULL != (ctx = compactbox_ctx_temp(&stack, key))) {
+                match = compactbox_ctx_verify(ctx, box, box_len);
+                compactbox_ctx_temp_free(ctx, &stack);
+        }
+        return match;
+}
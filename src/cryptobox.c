@@ -0,0 +1,827 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * cryptobox(1): generate keys, and seal and open files, standard input
+ * or whole directories from the command line. Everything is sealed in
+ * the chunked streaming format, so that nothing is ever read into
+ * memory whole. Without -j a file is sealed a chunk at a time on the
+ * calling thread; with -j, regular files go through the pipelined
+ * engine on that many workers, and directories are worked through that
+ * many files at a time.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include <cryptobox/batch.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/pipeline.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/stream.h>
+#include <cryptobox/strongbox.h>
+
+
+#define CLI_SUFFIX      ".cbx"
+#define CLI_KEY_MAX     80
+#define CLI_BENCH_NS    500000000ULL
+#define CLI_BENCH_BATCH 256
+
+
+/*
+ * The per-type functions the tool needs, with the contexts passed as
+ * void pointers so that both types fit one table.
+ */
+struct cli_box {
+        const char       *name;
+        int               type;
+        size_t            key_size;
+        int             (*generate_key)(unsigned char *);
+        void           *(*ctx_new)(unsigned char *);
+        void            (*ctx_free)(void *);
+        unsigned char  *(*ctx_seal)(void *, unsigned char *, int, int *);
+        unsigned char  *(*ctx_open)(void *, unsigned char *, int);
+};
+
+struct cli {
+        const struct cli_box    *box;
+        unsigned char            key[CLI_KEY_MAX];
+        size_t                   chunk_size;
+        int                      jobs;
+        size_t                   bench_mb;
+        const char              *keyfile;
+        const char              *outfile;
+};
+
+/*
+ * A directory being sealed or opened, shared by the threads working
+ * through it.
+ */
+struct cli_dir {
+        struct cli              *cli;
+        int                      sealing;
+        char                   **in;
+        char                   **out;
+        int                      n;
+        int                      next;
+        int                      failed;
+};
+
+
+static void     *cli_secretbox_new(unsigned char *);
+static void      cli_secretbox_free(void *);
+static unsigned char
+                *cli_secretbox_seal(void *, unsigned char *, int, int *);
+static unsigned char
+                *cli_secretbox_open(void *, unsigned char *, int);
+static void     *cli_strongbox_new(unsigned char *);
+static void      cli_strongbox_free(void *);
+static unsigned char
+                *cli_strongbox_seal(void *, unsigned char *, int, int *);
+static unsigned char
+                *cli_strongbox_open(void *, unsigned char *, int);
+static void      usage(void);
+static const struct cli_box
+                *cli_lookup(const char *);
+static void      cli_load_key(struct cli *);
+static ssize_t   cli_read(int, unsigned char *, size_t);
+static int       cli_write(int, unsigned char *, size_t);
+static int       cli_stream_seal(struct cli *, int, int);
+static int       cli_stream_open(struct cli *, int, int);
+static int       cli_file(struct cli *, int, const char *, const char *);
+static void     *cli_dir_run(void *);
+static int       cli_dir(struct cli *, int, const char *, const char *);
+static int       cmd_keygen(struct cli *);
+static int       cmd_crypt(struct cli *, int, int, char **);
+static uint64_t  cli_now(void);
+static void      bench_box(struct cli *, size_t);
+static void      bench_batch(struct cli *, size_t);
+static void      bench_file(struct cli *, int);
+static int       cmd_bench(struct cli *);
+
+
+static const struct cli_box     cli_boxes[] = {
+        { "secretbox", CRYPTOBOX_SECRETBOX, 48, secretbox_generate_key,
+          cli_secretbox_new, cli_secretbox_free, cli_secretbox_seal,
+          cli_secretbox_open },
+        { "strongbox", CRYPTOBOX_STRONGBOX, 80, strongbox_generate_key,
+          cli_strongbox_new, cli_strongbox_free, cli_strongbox_seal,
+          cli_strongbox_open },
+        { NULL, 0, 0, NULL, NULL, NULL, NULL, NULL }
+};
+
+
+void *
+cli_secretbox_new(unsigned char *key)
+{
+        return secretbox_ctx_new(key);
+}
+
+
+void
+cli_secretbox_free(void *ctx)
+{
+        secretbox_ctx_free(ctx);
+}
+
+
+unsigned char *
+cli_secretbox_seal(void *ctx, unsigned char *m, int mlen, int *box_len)
+{
+        return secretbox_ctx_seal(ctx, m, mlen, box_len);
+}
+
+
+unsigned char *
+cli_secretbox_open(void *ctx, unsigned char *box, int box_len)
+{
+        return secretbox_ctx_open(ctx, box, box_len);
+}
+
+
+void *
+cli_strongbox_new(unsigned char *key)
+{
+        return strongbox_ctx_new(key);
+}
+
+
+void
+cli_strongbox_free(void *ctx)
+{
+        strongbox_ctx_free(ctx);
+}
+
+
+unsigned char *
+cli_strongbox_seal(void *ctx, unsigned char *m, int mlen, int *box_len)
+{
+        return strongbox_ctx_seal(ctx, m, mlen, box_len);
+}
+
+
+unsigned char *
+cli_strongbox_open(void *ctx, unsigned char *box, int box_len)
+{
+        return strongbox_ctx_open(ctx, box, box_len);
+}
+
+
+void
+usage(void)
+{
+        fprintf(stderr, "usage: cryptobox keygen [-t type] [-o keyfile]\n");
+        fprintf(stderr, "       cryptobox seal -k keyfile [-t type] "
+                        "[-c chunk] [-j jobs] [in [out]]\n");
+        fprintf(stderr, "       cryptobox open -k keyfile [-t type] "
+                        "[-j jobs] [in [out]]\n");
+        fprintf(stderr, "       cryptobox bench [-t type] [-j jobs] "
+                        "[-s megabytes]\n");
+        exit(EX_USAGE);
+}
+
+
+const struct cli_box *
+cli_lookup(const char *name)
+{
+        const struct cli_box    *box;
+
+        for (box = cli_boxes; NULL != box->name; box++)
+                if (0 == strcmp(box->name, name))
+                        return box;
+        errx(EX_USAGE, "unknown box type %s", name);
+}
+
+
+/*
+ * Read the key file. Without -t, the type is the one whose key is as
+ * long as the file.
+ */
+void
+cli_load_key(struct cli *cli)
+{
+        const struct cli_box    *box;
+        ssize_t                  n;
+        int                      fd;
+
+        if (NULL == cli->keyfile)
+                usage();
+        if (-1 == (fd = open(cli->keyfile, O_RDONLY)))
+                err(EX_NOINPUT, "%s", cli->keyfile);
+        n = cli_read(fd, cli->key, sizeof cli->key);
+        if (n < 0)
+                err(EX_IOERR, "%s", cli->keyfile);
+        if (n == (ssize_t)sizeof cli->key &&
+            1 == cli_read(fd, cli->key, 1))
+                n++;
+        close(fd);
+
+        if (NULL == cli->box)
+                for (box = cli_boxes; NULL != box->name; box++)
+                        if ((size_t)n == box->key_size)
+                                cli->box = box;
+        if (NULL == cli->box || (size_t)n != cli->box->key_size)
+                errx(EX_DATAERR, "%s: not a key", cli->keyfile);
+}
+
+
+/*
+ * Read until len bytes have been read or the input ends, returning the
+ * number read, or -1 on error.
+ */
+ssize_t
+cli_read(int fd, unsigned char *buf, size_t len)
+{
+        size_t  off = 0;
+        ssize_t n;
+
+        while (off < len) {
+                n = read(fd, buf + off, len - off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n < 0)
+                        return -1;
+                if (0 == n)
+                        break;
+                off += (size_t)n;
+        }
+        return (ssize_t)off;
+}
+
+
+int
+cli_write(int fd, unsigned char *buf, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = write(fd, buf, len);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 1;
+}
+
+
+/*
+ * Seal from in to out a chunk at a time. A chunk shorter than a full
+ * one ends the stream, so input that ends on a chunk boundary is
+ * followed by an empty final chunk.
+ */
+int
+cli_stream_seal(struct cli *cli, int in, int out)
+{
+        struct cryptobox_stream *s;
+        unsigned char            head[64];
+        unsigned char           *buf;
+        size_t                   tag_size;
+        uint64_t                 index = 0;
+        ssize_t                  n;
+        int                      res = 0;
+
+        tag_size = cryptobox_stream_tag_size(cli->box->type);
+        if (NULL == (s = cryptobox_stream_new(cli->box->type, cli->key)))
+                return 0;
+        if (NULL == (buf = malloc(cli->chunk_size + tag_size))) {
+                cryptobox_stream_free(s);
+                return 0;
+        }
+        if (!cryptobox_stream_seal_head(s, cli->chunk_size, head) ||
+            !cli_write(out, head, cryptobox_stream_head_size(cli->box->type)))
+                goto out;
+        do {
+                if ((n = cli_read(in, buf, cli->chunk_size)) < 0)
+                        goto out;
+                if (!cryptobox_stream_seal_chunk(s, index++, buf, (size_t)n,
+                                                 buf) ||
+                    !cli_write(out, buf, (size_t)n + tag_size))
+                        goto out;
+        } while ((size_t)n == cli->chunk_size);
+        res = 1;
+
+out:
+        memset(buf, 0, cli->chunk_size + tag_size);
+        free(buf);
+        cryptobox_stream_free(s);
+        return res;
+}
+
+
+/*
+ * Open from in to out a chunk at a time. Each chunk is written once it
+ * has been checked; a stream that stops before its final chunk is an
+ * error.
+ */
+int
+cli_stream_open(struct cli *cli, int in, int out)
+{
+        struct cryptobox_stream *s;
+        unsigned char            head[64];
+        unsigned char           *buf = NULL;
+        size_t                   head_size, tag_size, sealed = 0;
+        uint64_t                 index = 0;
+        ssize_t                  n;
+        int                      res = 0;
+
+        head_size = cryptobox_stream_head_size(cli->box->type);
+        tag_size = cryptobox_stream_tag_size(cli->box->type);
+        if (NULL == (s = cryptobox_stream_new(cli->box->type, cli->key)))
+                return 0;
+        if (cli_read(in, head, head_size) != (ssize_t)head_size ||
+            !cryptobox_stream_open_head(s, head))
+                goto out;
+        sealed = cryptobox_stream_chunk_size(s) + tag_size;
+        if (NULL == (buf = malloc(sealed)))
+                goto out;
+        do {
+                if ((n = cli_read(in, buf, sealed)) < 0)
+                        goto out;
+                if (!cryptobox_stream_open_chunk(s, index++, buf, (size_t)n,
+                                                 buf) ||
+                    !cli_write(out, buf, (size_t)n - tag_size))
+                        goto out;
+        } while ((size_t)n == sealed);
+        res = 1;
+
+out:
+        if (NULL != buf) {
+                memset(buf, 0, sealed);
+                free(buf);
+        }
+        cryptobox_stream_free(s);
+        return res;
+}
+
+
+/*
+ * Seal or open one file; a path of NULL or "-" is standard input or
+ * output. A regular file going to a named output is handed to the
+ * pipelined engine when -j was given. A named output is removed if
+ * the file cannot be sealed or opened.
+ */
+int
+cli_file(struct cli *cli, int sealing, const char *inpath,
+         const char *outpath)
+{
+        struct stat      st;
+        int              in = STDIN_FILENO, out = STDOUT_FILENO;
+        int              res;
+
+        if (NULL != inpath && 0 != strcmp(inpath, "-") &&
+            -1 == (in = open(inpath, O_RDONLY))) {
+                warn("%s", inpath);
+                return 0;
+        }
+        if (NULL != outpath && 0 != strcmp(outpath, "-")) {
+                out = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+                if (-1 == out) {
+                        warn("%s", outpath);
+                        if (STDIN_FILENO != in)
+                                close(in);
+                        return 0;
+                }
+        } else if (isatty(out)) {
+                warnx("refusing to write to a terminal");
+                if (STDIN_FILENO != in)
+                        close(in);
+                return 0;
+        }
+
+        if (cli->jobs > 0 && STDOUT_FILENO != out &&
+            0 == fstat(in, &st) && S_ISREG(st.st_mode)) {
+                if (sealing)
+                        res = cryptobox_stream_seal_fd(cli->box->type, in,
+                                                       out, cli->chunk_size,
+                                                       cli->jobs, 0,
+                                                       cli->key);
+                else
+                        res = cryptobox_stream_open_fd(cli->box->type, in,
+                                                       out, cli->jobs, 0,
+                                                       cli->key);
+        } else if (sealing) {
+                res = cli_stream_seal(cli, in, out);
+        } else {
+                res = cli_stream_open(cli, in, out);
+        }
+
+        if (STDOUT_FILENO != out && -1 == close(out))
+                res = 0;
+        if (STDIN_FILENO != in)
+                close(in);
+        if (!res) {
+                warnx("%s: could not %s", NULL == inpath ? "-" : inpath,
+                      sealing ? "seal" : "open");
+                if (STDOUT_FILENO != out)
+                        unlink(outpath);
+        }
+        return res;
+}
+
+
+void *
+cli_dir_run(void *arg)
+{
+        struct cli_dir  *d = arg;
+        int              i;
+
+        while ((i = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED)) <
+               d->n)
+                if (!cli_file(d->cli, d->sealing, d->in[i], d->out[i]))
+                        __atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+}
+
+
+/*
+ * Seal every regular file in a directory into outdir, adding
+ * CLI_SUFFIX to its name, or open every file with the suffix, removing
+ * it. Subdirectories are not entered. With -j, that many files are
+ * worked on at once.
+ */
+int
+cli_dir(struct cli *cli, int sealing, const char *inpath, const char *outpath)
+{
+        struct cli_dir   d;
+        struct dirent   *ent;
+        struct stat      st;
+        pthread_t       *threads;
+        DIR             *dir;
+        size_t           len, slen = strlen(CLI_SUFFIX);
+        int              cap = 0, nthreads, i;
+
+        if (NULL == outpath)
+                errx(EX_USAGE, "%s is a directory; give an output directory",
+                     inpath);
+        if (-1 == mkdir(outpath, 0700) && EEXIST != errno)
+                err(EX_CANTCREAT, "%s", outpath);
+        if (NULL == (dir = opendir(inpath)))
+                err(EX_NOINPUT, "%s", inpath);
+
+        memset(&d, 0, sizeof d);
+        d.cli = cli;
+        d.sealing = sealing;
+        while (NULL != (ent = readdir(dir))) {
+                len = strlen(ent->d_name);
+                if (!sealing && (len <= slen ||
+                    0 != strcmp(ent->d_name + len - slen, CLI_SUFFIX)))
+                        continue;
+                if (d.n == cap) {
+                        cap = cap ? cap * 2 : 64;
+                        d.in = realloc(d.in, cap * sizeof(char *));
+                        d.out = realloc(d.out, cap * sizeof(char *));
+                        if (NULL == d.in || NULL == d.out)
+                                err(EX_OSERR, "realloc");
+                }
+                d.in[d.n] = malloc(strlen(inpath) + len + 2);
+                d.out[d.n] = malloc(strlen(outpath) + len + slen + 2);
+                if (NULL == d.in[d.n] || NULL == d.out[d.n])
+                        err(EX_OSERR, "malloc");
+                sprintf(d.in[d.n], "%s/%s", inpath, ent->d_name);
+                if (-1 == stat(d.in[d.n], &st) || !S_ISREG(st.st_mode)) {
+                        free(d.in[d.n]);
+                        free(d.out[d.n]);
+                        continue;
+                }
+                if (sealing)
+                        sprintf(d.out[d.n], "%s/%s%s", outpath, ent->d_name,
+                                CLI_SUFFIX);
+                else
+                        sprintf(d.out[d.n], "%s/%.*s", outpath,
+                                (int)(len - slen), ent->d_name);
+                d.n++;
+        }
+        closedir(dir);
+
+        nthreads = cli->jobs > 0 ? cli->jobs : 1;
+        if (nthreads > d.n)
+                nthreads = d.n > 0 ? d.n : 1;
+        if (NULL == (threads = malloc(nthreads * sizeof(pthread_t))))
+                err(EX_OSERR, "malloc");
+        for (i = 1; i < nthreads; i++)
+                if (0 != pthread_create(&threads[i], NULL, cli_dir_run, &d))
+                        errx(EX_OSERR, "failed to start a thread");
+        cli_dir_run(&d);
+        for (i = 1; i < nthreads; i++)
+                pthread_join(threads[i], NULL);
+        free(threads);
+
+        for (i = 0; i < d.n; i++) {
+                free(d.in[i]);
+                free(d.out[i]);
+        }
+        free(d.in);
+        free(d.out);
+        return !d.failed;
+}
+
+
+int
+cmd_keygen(struct cli *cli)
+{
+        int     fd = STDOUT_FILENO;
+        int     res;
+
+        if (NULL == cli->box)
+                cli->box = &cli_boxes[0];
+        if (NULL != cli->outfile) {
+                fd = open(cli->outfile, O_WRONLY | O_CREAT | O_EXCL, 0600);
+                if (-1 == fd)
+                        err(EX_CANTCREAT, "%s", cli->outfile);
+        } else if (isatty(fd)) {
+                errx(EX_USAGE, "refusing to write a key to a terminal");
+        }
+        if (!cli->box->generate_key(cli->key))
+                errx(EX_SOFTWARE, "failed to generate a key");
+        res = cli_write(fd, cli->key, cli->box->key_size);
+        if (STDOUT_FILENO != fd && -1 == close(fd))
+                res = 0;
+        if (!res)
+                err(EX_IOERR, "%s", NULL == cli->outfile ? "stdout" :
+                                    cli->outfile);
+        return EX_OK;
+}
+
+
+int
+cmd_crypt(struct cli *cli, int sealing, int argc, char **argv)
+{
+        struct stat      st;
+        const char      *in = NULL, *out = NULL;
+        int              res;
+
+        if (argc > 2)
+                usage();
+        if (argc > 0)
+                in = argv[0];
+        if (argc > 1)
+                out = argv[1];
+        cli_load_key(cli);
+        if (cli->jobs > 0)
+                sched_start(cli->jobs);
+
+        if (NULL != in && 0 == stat(in, &st) && S_ISDIR(st.st_mode))
+                res = cli_dir(cli, sealing, in, out);
+        else
+                res = cli_file(cli, sealing, in, out);
+        memset(cli->key, 0, sizeof cli->key);
+        return res ? EX_OK : EX_DATAERR;
+}
+
+
+uint64_t
+cli_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/*
+ * Seal and open messages of one size with a context on this thread.
+ */
+void
+bench_box(struct cli *cli, size_t size)
+{
+        unsigned char   *m, *box, *out;
+        void            *ctx;
+        uint64_t         start, elapsed, n;
+        int              box_len = 0;
+
+        if (NULL == (m = calloc(1, size)) ||
+            NULL == (ctx = cli->box->ctx_new(cli->key)))
+                errx(EX_SOFTWARE, "bench setup failed");
+        box = NULL;
+        start = cli_now();
+        for (n = 0; (elapsed = cli_now() - start) < CLI_BENCH_NS; n++) {
+                free(box);
+                if (NULL == (box = cli->box->ctx_seal(ctx, m, (int)size,
+                                                      &box_len)))
+                        errx(EX_SOFTWARE, "seal failed");
+        }
+        printf("%-9s seal %8zu bytes: %10.0f ops/s %9.1f MB/s\n",
+               cli->box->name, size, n * 1e9 / elapsed,
+               n * size * 1e3 / elapsed);
+        start = cli_now();
+        for (n = 0; (elapsed = cli_now() - start) < CLI_BENCH_NS; n++) {
+                if (NULL == (out = cli->box->ctx_open(ctx, box, box_len)))
+                        errx(EX_SOFTWARE, "open failed");
+                free(out);
+        }
+        printf("%-9s open %8zu bytes: %10.0f ops/s %9.1f MB/s\n",
+               cli->box->name, size, n * 1e9 / elapsed,
+               n * size * 1e3 / elapsed);
+        free(box);
+        cli->box->ctx_free(ctx);
+        free(m);
+}
+
+
+/*
+ * Seal batches of messages of one size on the worker pool.
+ */
+void
+bench_batch(struct cli *cli, size_t size)
+{
+        struct cryptobox_msg     msgs[CLI_BENCH_BATCH];
+        unsigned char           *m;
+        uint64_t                 start, elapsed, n;
+        int                      i;
+
+        if (NULL == (m = calloc(1, size)))
+                errx(EX_SOFTWARE, "bench setup failed");
+        for (i = 0; i < CLI_BENCH_BATCH; i++) {
+                msgs[i].in = m;
+                msgs[i].in_len = (int)size;
+        }
+        start = cli_now();
+        for (n = 0; (elapsed = cli_now() - start) < CLI_BENCH_NS; n++) {
+                if (CLI_BENCH_BATCH != cryptobox_seal_batch(cli->box->type,
+                    msgs, CLI_BENCH_BATCH, cli->key))
+                        errx(EX_SOFTWARE, "batch seal failed");
+                for (i = 0; i < CLI_BENCH_BATCH; i++)
+                        free(msgs[i].out);
+        }
+        n *= CLI_BENCH_BATCH;
+        printf("%-9s batch %7zu bytes: %10.0f ops/s %9.1f MB/s "
+               "(%d workers)\n", cli->box->name, size, n * 1e9 / elapsed,
+               n * size * 1e3 / elapsed, sched_workers());
+        free(m);
+}
+
+
+/*
+ * Seal a scratch file with the pipelined engine, with and without
+ * io_uring, and with the one-chunk-at-a-time loop.
+ */
+void
+bench_file(struct cli *cli, int depth)
+{
+        char             inpath[] = "/tmp/cryptobox_bench.XXXXXX";
+        char             outpath[] = "/tmp/cryptobox_bench.XXXXXX";
+        unsigned char   *buf;
+        size_t           size = cli->bench_mb * 1024 * 1024, i;
+        uint64_t         start, elapsed;
+        int              in, out, pass, res;
+        const char      *names[] = { "pipeline", "pread", "serial" };
+
+        if (-1 == (in = mkstemp(inpath)))
+                err(EX_CANTCREAT, "%s", inpath);
+        if (-1 == (out = mkstemp(outpath)))
+                err(EX_CANTCREAT, "%s", outpath);
+        if (NULL == (buf = calloc(1, 1024 * 1024)))
+                errx(EX_SOFTWARE, "bench setup failed");
+        for (i = 0; i < cli->bench_mb; i++)
+                if (!cli_write(in, buf, 1024 * 1024))
+                        err(EX_IOERR, "%s", inpath);
+        free(buf);
+
+        for (pass = 0; pass < 3; pass++) {
+                if (-1 == lseek(in, 0, SEEK_SET) || -1 == ftruncate(out, 0) ||
+                    -1 == lseek(out, 0, SEEK_SET))
+                        err(EX_IOERR, "%s", outpath);
+                start = cli_now();
+                if (pass < 2)
+                        res = cryptobox_stream_seal_fd(cli->box->type, in,
+                                  out, cli->chunk_size, depth,
+                                  pass ? CRYPTOBOX_PIPE_NO_URING : 0,
+                                  cli->key);
+                else
+                        res = cli_stream_seal(cli, in, out);
+                elapsed = cli_now() - start;
+                if (!res)
+                        errx(EX_SOFTWARE, "file seal failed");
+                printf("%-9s file %-8s %4zu MB: %9.1f MB/s\n",
+                       cli->box->name, names[pass], cli->bench_mb,
+                       size * 1e3 / elapsed);
+        }
+        close(in);
+        close(out);
+        unlink(inpath);
+        unlink(outpath);
+}
+
+
+int
+cmd_bench(struct cli *cli)
+{
+        static const size_t      sizes[] = { 64, 1024, 16384, 1048576 };
+        const struct cli_box    *box;
+        size_t                   i;
+
+        sched_start(cli->jobs);
+        for (box = cli_boxes; NULL != box->name; box++) {
+                if (NULL != cli->box && box != cli->box)
+                        continue;
+                cli->box = box;
+                if (!box->generate_key(cli->key))
+                        errx(EX_SOFTWARE, "failed to generate a key");
+                for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+                        bench_box(cli, sizes[i]);
+                for (i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+                        bench_batch(cli, sizes[i]);
+                bench_file(cli, cli->jobs);
+                cli->box = NULL;
+        }
+        memset(cli->key, 0, sizeof cli->key);
+        return EX_OK;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct cli       cli;
+        const char      *cmd;
+        char            *end;
+        unsigned long    n;
+        int              ch;
+
+        if (argc < 2)
+                usage();
+        memset(&cli, 0, sizeof cli);
+        cli.chunk_size = CRYPTOBOX_STREAM_CHUNK;
+        cli.bench_mb = 64;
+        cmd = argv[1];
+        argc--;
+        argv++;
+
+        while (-1 != (ch = getopt(argc, argv, "c:j:k:o:s:t:"))) {
+                switch (ch) {
+                case 'c':
+                case 'j':
+                case 's':
+                        n = strtoul(optarg, &end, 10);
+                        if ('\0' == *optarg || '\0' != *end || 0 == n)
+                                errx(EX_USAGE, "-%c: bad number %s", ch,
+                                     optarg);
+                        if ('c' == ch)
+                                cli.chunk_size = n;
+                        else if ('j' == ch)
+                                cli.jobs = n > 1024 ? 1024 : (int)n;
+                        else
+                                cli.bench_mb = n;
+                        break;
+                case 'k':
+                        cli.keyfile = optarg;
+                        break;
+                case 'o':
+                        cli.outfile = optarg;
+                        break;
+                case 't':
+                        cli.box = cli_lookup(optarg);
+                        break;
+                default:
+                        usage();
+                }
+        }
+        argc -= optind;
+        argv += optind;
+        if (cli.chunk_size > CRYPTOBOX_STREAM_MAX_CHUNK)
+                errx(EX_USAGE, "-c: chunks are at most %zu bytes",
+                     CRYPTOBOX_STREAM_MAX_CHUNK);
+
+        if (0 == strcmp(cmd, "keygen") && 0 == argc)
+                return cmd_keygen(&cli);
+        if (0 == strcmp(cmd, "seal"))
+                return cmd_crypt(&cli, 1, argc, argv);
+        if (0 == strcmp(cmd, "open"))
+                return cmd_crypt(&cli, 0, argc, argv);
+        if (0 == strcmp(cmd, "bench") && 0 == argc)
+                return cmd_bench(&cli);
+        usage();
+        return EX_USAGE;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __CRYPTOBOX_ARCHIVE_H__
+#define __CRYPTOBOX_ARCHIVE_H__
+
+#include <sys/types.h>
+#include <cryptobox/cryptobox.h>
+
+
+static const size_t     CRYPTOBOX_ARCHIVE_NAME_MAX = 65535;
+
+/*
+ * One member to add to an archive. ok is set to 1 for each member
+ * that was added.
+ */
+struct cryptobox_archive_member {
+        const char      *name;
+        unsigned char   *data;
+        size_t           len;
+        int              ok;
+};
+
+struct cryptobox_archive;
+
+struct cryptobox_archive *cryptobox_archive_create(const char *, int,
+                                                   unsigned char *);
+struct cryptobox_archive *cryptobox_archive_open(const char *, int,
+                                                 unsigned char *, int);
+int              cryptobox_archive_close(struct cryptobox_archive *);
+int              cryptobox_archive_add(struct cryptobox_archive *,
+                                       const char *, unsigned char *,
+                                       size_t);
+int              cryptobox_archive_add_batch(struct cryptobox_archive *,
+                                             struct cryptobox_archive_member *,
+                                             size_t);
+unsigned char   *cryptobox_archive_get(struct cryptobox_archive *,
+                                       const char *, size_t *);
+size_t           cryptobox_archive_count(struct cryptobox_archive *);
+const char      *cryptobox_archive_name(struct cryptobox_archive *, size_t);
+
+
+#endif
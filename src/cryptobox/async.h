@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+#ifndef __CRYPTOBOX_ASYNC_H__
+#define __CRYPTOBOX_ASYNC_H__
+
+#include <sys/types.h>
+#include <cryptobox/cryptobox.h>
+
+
+#define CRYPTOBOX_JOB_PENDING   0
+#define CRYPTOBOX_JOB_DONE      1
+#define CRYPTOBOX_JOB_FAILED    (-1)
+
+struct cryptobox_job;
+
+typedef void    (*cryptobox_callback)(struct cryptobox_job *, void *);
+
+/*
+ * A job is owned by the caller and must stay valid, along with its
+ * input and key, until it completes. The fields are filled in by
+ * cryptobox_job_init and the submit functions; once the job's status
+ * is no longer CRYPTOBOX_JOB_PENDING, out and out_len hold the result,
+ * which the caller must free.
+ */
+struct cryptobox_job {
+        int                      type;
+        int                      op;
+        unsigned char           *in;
+        int                      in_len;
+        unsigned char           *key;
+        unsigned char           *out;
+        int                      out_len;
+        int                      status;
+        cryptobox_callback       callback;
+        void                    *arg;
+        int                      notify_fd;
+};
+
+int      cryptobox_async_start(int, int);
+void     cryptobox_async_stop(void);
+void     cryptobox_job_init(struct cryptobox_job *, cryptobox_callback, void *,
+                            int);
+int      cryptobox_submit_seal(struct cryptobox_job *, int, unsigned char *,
+                               int, unsigned char *);
+int      cryptobox_submit_open(struct cryptobox_job *, int, unsigned char *,
+                               int, unsigned char *);
+int      cryptobox_job_status(struct cryptobox_job *);
+
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+#ifndef __CRYPTOBOX_BATCH_H__
+#define __CRYPTOBOX_BATCH_H__
+
+#include <sys/types.h>
+#include <cryptobox/cryptobox.h>
+
+
+/*
+ * One message in a batch. The caller sets in and in_len; the batch
+ * functions set out and out_len, leaving out NULL for messages that
+ * could not be sealed or opened. The caller frees each out. When a
+ * batch is verified, out_len is 1 for each authentic box.
+ */
+struct cryptobox_msg {
+        unsigned char   *in;
+        int              in_len;
+        unsigned char   *out;
+        int              out_len;
+};
+
+int      cryptobox_seal_batch(int, struct cryptobox_msg *, int,
+                              unsigned char *);
+int      cryptobox_open_batch(int, struct cryptobox_msg *, int,
+                              unsigned char *);
+int      cryptobox_verify_batch(int, struct cryptobox_msg *, int,
+                                unsigned char *);
+
+
+#endif
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __CRYPTOBOX_CLIENT_H__
+#define __CRYPTOBOX_CLIENT_H__
+
+#include <sys/types.h>
+#include <cryptobox/batch.h>
+#include <cryptobox/cryptobox.h>
+
+
+/*
+ * The largest message cryptoboxd will seal in one request.
+ */
+static const int        CRYPTOBOX_CLIENT_MAX = 65536;
+
+struct cryptobox_client;
+
+struct cryptobox_client *cryptobox_client_connect(const char *);
+void     cryptobox_client_close(struct cryptobox_client *);
+int      cryptobox_client_keys(struct cryptobox_client *);
+int      cryptobox_client_key_type(struct cryptobox_client *, int);
+unsigned char   *cryptobox_client_seal(struct cryptobox_client *, int,
+                                       unsigned char *, int, int *);
+unsigned char   *cryptobox_client_open(struct cryptobox_client *, int,
+                                       unsigned char *, int, int *);
+int      cryptobox_client_verify(struct cryptobox_client *, int,
+                                 unsigned char *, int);
+int      cryptobox_client_seal_batch(struct cryptobox_client *, int,
+                                     struct cryptobox_msg *, int);
+int      cryptobox_client_open_batch(struct cryptobox_client *, int,
+                                     struct cryptobox_msg *, int);
+int      cryptobox_client_verify_batch(struct cryptobox_client *, int,
+                                       struct cryptobox_msg *, int);
+
+
+#endif
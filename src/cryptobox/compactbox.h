@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __CRYPTOBOX_COMPACTBOX_H__
+#define __CRYPTOBOX_COMPACTBOX_H__
+
+#include <sys/types.h>
+#include <cryptobox/cryptobox.h>
+
+
+/*
+ * A compactbox is a 12-byte nonce, the ciphertext, and a tag truncated
+ * to COMPACTBOX_TAG_SIZE bytes. compactbox_seal gives every box a
+ * random nonce; a key that seals more than 2^32 boxes must seal them
+ * through a compactbox_ctx.
+ */
+static const size_t     COMPACTBOX_KEY_SIZE = 48;
+static const size_t     COMPACTBOX_OVERHEAD = 24;
+static const size_t     COMPACTBOX_NONCE_SIZE = 12;
+static const size_t     COMPACTBOX_TAG_SIZE = 12;
+
+struct compactbox_ctx;
+
+int              compactbox_generate_key(unsigned char *);
+unsigned char   *compactbox_seal(unsigned char *, int, int *, unsigned char *);
+unsigned char   *compactbox_open(unsigned char *, int, unsigned char *);
+int              compactbox_verify(unsigned char *, int, unsigned char *);
+
+struct compactbox_ctx   *compactbox_ctx_new(unsigned char *);
+void                     compactbox_ctx_free(struct compactbox_ctx *);
+unsigned char           *compactbox_ctx_seal(struct compactbox_ctx *,
+                                             unsigned char *, int, int *);
+unsigned char           *compactbox_ctx_open(struct compactbox_ctx *,
+                                             unsigned char *, int);
+int                      compactbox_ctx_verify(struct compactbox_ctx *,
+                                               unsigned char *, int);
+void                     compactbox_ctx_set_allocator(struct compactbox_ctx *,
+                                                      cryptobox_alloc_fn,
+                                                      cryptobox_free_fn,
+                                                      void *);
+
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+#ifndef __CRYPTOBOX_CRYPTOBOX_H__
+#define __CRYPTOBOX_CRYPTOBOX_H__
+
+#include <sys/types.h>
+
+
+/*
+ * Box types, for the interfaces that handle both kinds of box.
+ */
+#define CRYPTOBOX_SECRETBOX     1
+#define CRYPTOBOX_STRONGBOX     2
+
+
+/*
+ * Allocator hooks. alloc is called with a size and the opaque pointer
+ * the hooks were set with, and returns NULL on failure; free is called
+ * with a block from alloc and the opaque pointer. Either may be called
+ * from several threads at once.
+ */
+typedef void    *(*cryptobox_alloc_fn)(size_t, void *);
+typedef void     (*cryptobox_free_fn)(void *, void *);
+
+void     cryptobox_set_allocator(cryptobox_alloc_fn, cryptobox_free_fn,
+                                 void *);
+
+
+#endif
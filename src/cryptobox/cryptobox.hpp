@@ -0,0 +1,485 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * A header-only C++17 wrapper around secretbox and strongbox. Contexts
+ * own the expanded key and free it when they go out of scope. Boxes
+ * are sealed and opened straight into buffers the caller provides,
+ * using the detached-tag functions underneath, so no call allocates;
+ * the sizes involved are constant expressions, so those buffers may be
+ * std::arrays sized at compile time. Where the caller would rather
+ * have the library allocate, boxes and messages come back as move-only
+ * owning buffers drawn from a std::pmr::memory_resource and wiped
+ * before they are returned to it. With C++20, std::span overloads are
+ * provided as well.
+ */
+
+
+#ifndef __CRYPTOBOX_CRYPTOBOX_HPP__
+#define __CRYPTOBOX_CRYPTOBOX_HPP__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+
+#include <array>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <utility>
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#endif
+#endif
+
+extern "C" {
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+}
+
+
+namespace cryptobox {
+
+
+/*
+ * Box types. A box is the IV, the ciphertext and the tag, and the
+ * IV is 16 bytes for both, as described in secretbox(3) and
+ * strongbox(3).
+ */
+struct secretbox {
+        using ctx_type = secretbox_ctx;
+
+        static constexpr int            type = CRYPTOBOX_SECRETBOX;
+        static constexpr std::size_t    key_size = SECRETBOX_KEY_SIZE;
+        static constexpr std::size_t    overhead = SECRETBOX_OVERHEAD;
+        static constexpr std::size_t    iv_size = 16;
+        static constexpr std::size_t    tag_size = overhead - iv_size;
+
+        static int generate_key(unsigned char *key) noexcept
+        { return secretbox_generate_key(key); }
+        static ctx_type *ctx_new(unsigned char *key, bool secure) noexcept
+        { return secure ? secretbox_ctx_new_secure(key) :
+                          secretbox_ctx_new(key); }
+        static void ctx_free(ctx_type *ctx) noexcept
+        { secretbox_ctx_free(ctx); }
+        static int seal(ctx_type *ctx, unsigned char *m, std::size_t len,
+                        unsigned char *out, unsigned char *meta) noexcept
+        { return secretbox_ctx_seal_detached(ctx, m, len, out, meta); }
+        static int open(ctx_type *ctx, unsigned char *ct, std::size_t len,
+                        unsigned char *meta, unsigned char *out) noexcept
+        { return secretbox_ctx_open_detached(ctx, ct, len, meta, out); }
+        static int verify(ctx_type *ctx, unsigned char *box, int len) noexcept
+        { return secretbox_ctx_verify(ctx, box, len); }
+};
+
+struct strongbox {
+        using ctx_type = strongbox_ctx;
+
+        static constexpr int            type = CRYPTOBOX_STRONGBOX;
+        static constexpr std::size_t    key_size = STRONGBOX_KEY_SIZE;
+        static constexpr std::size_t    overhead = STRONGBOX_OVERHEAD;
+        static constexpr std::size_t    iv_size = 16;
+        static constexpr std::size_t    tag_size = overhead - iv_size;
+
+        static int generate_key(unsigned char *key) noexcept
+        { return strongbox_generate_key(key); }
+        static ctx_type *ctx_new(unsigned char *key, bool secure) noexcept
+        { return secure ? strongbox_ctx_new_secure(key) :
+                          strongbox_ctx_new(key); }
+        static void ctx_free(ctx_type *ctx) noexcept
+        { strongbox_ctx_free(ctx); }
+        static int seal(ctx_type *ctx, unsigned char *m, std::size_t len,
+                        unsigned char *out, unsigned char *meta) noexcept
+        { return strongbox_ctx_seal_detached(ctx, m, len, out, meta); }
+        static int open(ctx_type *ctx, unsigned char *ct, std::size_t len,
+                        unsigned char *meta, unsigned char *out) noexcept
+        { return strongbox_ctx_open_detached(ctx, ct, len, meta, out); }
+        static int verify(ctx_type *ctx, unsigned char *box, int len) noexcept
+        { return strongbox_ctx_verify(ctx, box, len); }
+};
+
+
+/*
+ * Sizes: the box around a message of len bytes, and the message in a
+ * box of len bytes, which is 0 if the box is too short to be one. The
+ * largest message is the one whose box still fits in an int.
+ */
+template <class Box>
+constexpr std::size_t
+sealed_size(std::size_t len) noexcept
+{
+        return len + Box::overhead;
+}
+
+template <class Box>
+constexpr std::size_t
+opened_size(std::size_t len) noexcept
+{
+        return len < Box::overhead ? 0 : len - Box::overhead;
+}
+
+template <class Box>
+constexpr std::size_t   max_message = INT_MAX - Box::overhead;
+
+template <class Box>
+using key = std::array<unsigned char, Box::key_size>;
+
+template <class Box, std::size_t N>
+using sealed_array = std::array<unsigned char, N + Box::overhead>;
+
+template <class Box, std::size_t N>
+using opened_array = std::array<unsigned char, N - Box::overhead>;
+
+
+/*
+ * Fill a key with random bytes. Returns false on failure.
+ */
+template <class Box>
+bool
+generate_key(key<Box> &k) noexcept
+{
+        return 1 == Box::generate_key(k.data());
+}
+
+
+namespace detail {
+
+/*
+ * Clear len bytes at p in a way the compiler may not drop because the
+ * memory is about to be freed.
+ */
+inline void
+wipe(void *p, std::size_t len) noexcept
+{
+        volatile unsigned char  *v = static_cast<unsigned char *>(p);
+
+        while (len-- > 0)
+                *v++ = 0;
+}
+
+}
+
+
+/*
+ * A move-only block of bytes from a memory resource, wiped before it
+ * is given back. A buffer that could not be allocated, or has been
+ * moved from, is empty and tests false; a buffer of 0 bytes that was
+ * allocated tests true.
+ */
+class buffer {
+public:
+        buffer() noexcept = default;
+
+        buffer(std::size_t len, std::pmr::memory_resource *mr) noexcept
+        {
+                if (nullptr == mr)
+                        return;
+                try {
+                        p = static_cast<unsigned char *>(
+                            mr->allocate(len > 0 ? len : 1));
+                } catch (...) {
+                        return;
+                }
+                n = len;
+                res = mr;
+        }
+
+        buffer(buffer &&o) noexcept
+            : p(std::exchange(o.p, nullptr)), n(std::exchange(o.n, 0)),
+              res(std::exchange(o.res, nullptr))
+        {
+        }
+
+        buffer &operator=(buffer &&o) noexcept
+        {
+                if (this != &o) {
+                        reset();
+                        p = std::exchange(o.p, nullptr);
+                        n = std::exchange(o.n, 0);
+                        res = std::exchange(o.res, nullptr);
+                }
+                return *this;
+        }
+
+        buffer(const buffer &) = delete;
+        buffer &operator=(const buffer &) = delete;
+
+        ~buffer() { reset(); }
+
+        /* Wipe the bytes and give them back, leaving the buffer empty. */
+        void reset() noexcept
+        {
+                if (nullptr == p)
+                        return;
+                detail::wipe(p, n);
+                res->deallocate(p, n > 0 ? n : 1);
+                p = nullptr;
+                n = 0;
+                res = nullptr;
+        }
+
+        unsigned char *data() noexcept { return p; }
+        const unsigned char *data() const noexcept { return p; }
+        std::size_t size() const noexcept { return n; }
+        unsigned char *begin() noexcept { return p; }
+        unsigned char *end() noexcept { return p + n; }
+        const unsigned char *begin() const noexcept { return p; }
+        const unsigned char *end() const noexcept { return p + n; }
+        std::pmr::memory_resource *resource() const noexcept { return res; }
+        explicit operator bool() const noexcept { return nullptr != p; }
+
+private:
+        unsigned char                   *p = nullptr;
+        std::size_t                      n = 0;
+        std::pmr::memory_resource       *res = nullptr;
+};
+
+
+/*
+ * A sealed box of a given type, so that it can only be opened with a
+ * context of that type.
+ */
+template <class Box>
+class box : public buffer {
+public:
+        using buffer::buffer;
+};
+
+
+/*
+ * A context for a box type: the expanded form of a key, freed when the
+ * context is destroyed. A context is not modified after it is set up,
+ * so it may be used from several threads at once. If it could not be
+ * set up, it tests false and every call on it fails.
+ */
+template <class Box>
+class context {
+public:
+        using box_type = box<Box>;
+
+        context() noexcept = default;
+
+        /*
+         * Set up a context from a key of Box::key_size bytes. If secure
+         * is true, the context and the messages the C functions return
+         * come from the secure heap, as for secretbox_ctx_new_secure.
+         */
+        explicit context(const unsigned char *k, bool secure = false) noexcept
+            : ctx(Box::ctx_new(const_cast<unsigned char *>(k), secure))
+        {
+        }
+
+        explicit context(const key<Box> &k, bool secure = false) noexcept
+            : context(k.data(), secure)
+        {
+        }
+
+        context(context &&o) noexcept : ctx(std::exchange(o.ctx, nullptr))
+        {
+        }
+
+        context &operator=(context &&o) noexcept
+        {
+                if (this != &o) {
+                        if (nullptr != ctx)
+                                Box::ctx_free(ctx);
+                        ctx = std::exchange(o.ctx, nullptr);
+                }
+                return *this;
+        }
+
+        context(const context &) = delete;
+        context &operator=(const context &) = delete;
+
+        ~context()
+        {
+                if (nullptr != ctx)
+                        Box::ctx_free(ctx);
+        }
+
+        typename Box::ctx_type *get() const noexcept { return ctx; }
+        explicit operator bool() const noexcept { return nullptr != ctx; }
+
+        /*
+         * Seal len bytes at m into out, which holds sealed_size(len)
+         * bytes and does not overlap m.
+         */
+        bool seal(const unsigned char *m, std::size_t len,
+                  unsigned char *out) const noexcept
+        {
+                unsigned char   meta[Box::overhead];
+
+                if (nullptr == ctx || nullptr == out ||
+                    len > max_message<Box>)
+                        return false;
+                if (!Box::seal(ctx, const_cast<unsigned char *>(m), len,
+                               out + Box::iv_size, meta))
+                        return false;
+                std::memcpy(out, meta, Box::iv_size);
+                std::memcpy(out + Box::iv_size + len, meta + Box::iv_size,
+                            Box::tag_size);
+                return true;
+        }
+
+        /*
+         * Open a box of len bytes into out, which holds opened_size(len)
+         * bytes. Nothing is written unless the box is authentic.
+         */
+        bool open(const unsigned char *b, std::size_t len,
+                  unsigned char *out) const noexcept
+        {
+                unsigned char   meta[Box::overhead];
+                std::size_t     mlen;
+
+                if (nullptr == ctx || nullptr == b || len < Box::overhead ||
+                    len > INT_MAX)
+                        return false;
+                mlen = len - Box::overhead;
+                std::memcpy(meta, b, Box::iv_size);
+                std::memcpy(meta + Box::iv_size, b + Box::iv_size + mlen,
+                            Box::tag_size);
+                return 1 == Box::open(ctx,
+                                      const_cast<unsigned char *>(b) +
+                                      Box::iv_size, mlen, meta, out);
+        }
+
+        /* Check a box without decrypting it. */
+        bool verify(const unsigned char *b, std::size_t len) const noexcept
+        {
+                if (nullptr == ctx || nullptr == b || len > INT_MAX)
+                        return false;
+                return 1 == Box::verify(ctx, const_cast<unsigned char *>(b),
+                                        static_cast<int>(len));
+        }
+
+        /* Seal and open between arrays sized at compile time. */
+        template <std::size_t N>
+        bool seal(const std::array<unsigned char, N> &m,
+                  sealed_array<Box, N> &out) const noexcept
+        {
+                return seal(m.data(), N, out.data());
+        }
+
+        template <std::size_t N>
+        bool open(const std::array<unsigned char, N> &b,
+                  opened_array<Box, N> &out) const noexcept
+        {
+                static_assert(N >= Box::overhead, "array too short for a box");
+                return open(b.data(), N, out.data());
+        }
+
+        /*
+         * Seal into, or open from, a box allocated from mr. The result
+         * tests false on failure.
+         */
+        box_type seal_box(const unsigned char *m, std::size_t len,
+                          std::pmr::memory_resource *mr =
+                          std::pmr::get_default_resource()) const noexcept
+        {
+                box_type        out;
+
+                if (len > max_message<Box>)
+                        return out;
+                out = box_type(sealed_size<Box>(len), mr);
+                if (out && !seal(m, len, out.data()))
+                        out.reset();
+                return out;
+        }
+
+        buffer open_box(const unsigned char *b, std::size_t len,
+                        std::pmr::memory_resource *mr =
+                        std::pmr::get_default_resource()) const noexcept
+        {
+                buffer          out;
+
+                if (len < Box::overhead)
+                        return out;
+                out = buffer(opened_size<Box>(len), mr);
+                if (out && !open(b, len, out.data()))
+                        out.reset();
+                return out;
+        }
+
+        buffer open_box(const box_type &b,
+                        std::pmr::memory_resource *mr =
+                        std::pmr::get_default_resource()) const noexcept
+        {
+                return open_box(b.data(), b.size(), mr);
+        }
+
+#ifdef __cpp_lib_span
+        /*
+         * The span forms check that out is large enough; a box is
+         * written to the first sealed_size(m.size()) bytes of out, and
+         * a message to the first opened_size(b.size()).
+         */
+        bool seal(std::span<const unsigned char> m,
+                  std::span<unsigned char> out) const noexcept
+        {
+                if (out.size() < sealed_size<Box>(m.size()))
+                        return false;
+                return seal(m.data(), m.size(), out.data());
+        }
+
+        bool open(std::span<const unsigned char> b,
+                  std::span<unsigned char> out) const noexcept
+        {
+                if (out.size() < opened_size<Box>(b.size()))
+                        return false;
+                return open(b.data(), b.size(), out.data());
+        }
+
+        bool verify(std::span<const unsigned char> b) const noexcept
+        {
+                return verify(b.data(), b.size());
+        }
+
+        box_type seal_box(std::span<const unsigned char> m,
+                          std::pmr::memory_resource *mr =
+                          std::pmr::get_default_resource()) const noexcept
+        {
+                return seal_box(m.data(), m.size(), mr);
+        }
+
+        buffer open_box(std::span<const unsigned char> b,
+                        std::pmr::memory_resource *mr =
+                        std::pmr::get_default_resource()) const noexcept
+        {
+                return open_box(b.data(), b.size(), mr);
+        }
+#endif
+
+private:
+        typename Box::ctx_type  *ctx = nullptr;
+};
+
+
+using secretbox_context = context<secretbox>;
+using strongbox_context = context<strongbox>;
+using secretbox_key = key<secretbox>;
+using strongbox_key = key<strongbox>;
+
+
+}
+
+
+#endif
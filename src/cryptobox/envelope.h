@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __CRYPTOBOX_ENVELOPE_H__
+#define __CRYPTOBOX_ENVELOPE_H__
+
+#include <sys/types.h>
+#include <cryptobox/cryptobox.h>
+
+
+static const size_t     CRYPTOBOX_ENVELOPE_WRAP = 48;
+static const int        CRYPTOBOX_ENVELOPE_MAX_KEYS = 65535;
+
+size_t           cryptobox_envelope_size(int, int, size_t);
+int              cryptobox_envelope_recipients(int, unsigned char *, size_t);
+unsigned char   *cryptobox_envelope_seal(int, unsigned char *, size_t,
+                                         size_t *, unsigned char **, int);
+unsigned char   *cryptobox_envelope_open(int, unsigned char *, size_t,
+                                         size_t *, unsigned char *);
+
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __CRYPTOBOX_KEYCACHE_H__
+#define __CRYPTOBOX_KEYCACHE_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <cryptobox/cryptobox.h>
+
+
+#define CRYPTOBOX_HKDF_SHA256   1
+#define CRYPTOBOX_HKDF_SHA384   2
+
+static const size_t     CRYPTOBOX_KEYCACHE_MAX_ID = 256;
+static const int        CRYPTOBOX_KEYCACHE_SHARDS = 64;
+
+struct cryptobox_keycache;
+struct cryptobox_tenant;
+
+int      cryptobox_hkdf(int, unsigned char *, size_t, unsigned char *, size_t,
+                        unsigned char *, size_t, unsigned char *, size_t);
+
+struct cryptobox_keycache *cryptobox_keycache_new(int, unsigned char *, size_t,
+                                                  size_t, int);
+void     cryptobox_keycache_free(struct cryptobox_keycache *);
+int      cryptobox_keycache_derive(struct cryptobox_keycache *,
+                                   unsigned char *, size_t, unsigned char *);
+struct cryptobox_tenant *cryptobox_keycache_get(struct cryptobox_keycache *,
+                                                unsigned char *, size_t);
+void     cryptobox_keycache_put(struct cryptobox_keycache *,
+                                struct cryptobox_tenant *);
+void    *cryptobox_keycache_ctx(struct cryptobox_tenant *);
+unsigned char *cryptobox_keycache_seal(struct cryptobox_keycache *,
+                                       unsigned char *, size_t,
+                                       unsigned char *, int, int *);
+unsigned char *cryptobox_keycache_open(struct cryptobox_keycache *,
+                                       unsigned char *, size_t,
+                                       unsigned char *, int);
+void     cryptobox_keycache_stats(struct cryptobox_keycache *, uint64_t *,
+                                  uint64_t *, uint64_t *);
+
+
+#endif
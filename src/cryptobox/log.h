@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __CRYPTOBOX_LOG_H__
+#define __CRYPTOBOX_LOG_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <cryptobox/cryptobox.h>
+
+
+static const size_t     CRYPTOBOX_LOG_RECORD_MAX = 16777216;
+static const int        CRYPTOBOX_LOG_INTERVAL = 4096;
+
+/*
+ * Called by cryptobox_log_read with each record, in order, and its
+ * sequence number. The record belongs to the library and is wiped
+ * once the call returns. Returning 0 stops the read.
+ */
+typedef int     (*cryptobox_log_fn)(void *, uint64_t, unsigned char *,
+                                    size_t);
+
+struct cryptobox_log;
+
+struct cryptobox_log    *cryptobox_log_create(const char *, int,
+                                              unsigned char *, int);
+struct cryptobox_log    *cryptobox_log_open(const char *, int,
+                                            unsigned char *, int);
+int      cryptobox_log_append(struct cryptobox_log *, unsigned char *,
+                              size_t);
+int      cryptobox_log_checkpoint(struct cryptobox_log *);
+uint64_t cryptobox_log_records(struct cryptobox_log *);
+int      cryptobox_log_close(struct cryptobox_log *);
+int      cryptobox_log_verify(const char *, int, unsigned char *, uint64_t,
+                              uint64_t *);
+int      cryptobox_log_read(const char *, int, unsigned char *, uint64_t,
+                            cryptobox_log_fn, void *);
+
+
+#endif
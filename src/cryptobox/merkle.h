@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __CRYPTOBOX_MERKLE_H__
+#define __CRYPTOBOX_MERKLE_H__
+
+#include <sys/types.h>
+#include <cryptobox/cryptobox.h>
+
+
+static const size_t     CRYPTOBOX_MERKLE_CHUNK = 65536;
+
+size_t           cryptobox_merkle_head_size(int);
+int              cryptobox_merkle_info(int, unsigned char *, size_t *,
+                                       size_t *);
+unsigned char   *cryptobox_merkle_seal(int, unsigned char *, size_t, size_t,
+                                       size_t *, unsigned char *);
+unsigned char   *cryptobox_merkle_open(int, unsigned char *, size_t,
+                                       size_t *, unsigned char *);
+unsigned char   *cryptobox_merkle_proof(int, unsigned char *, size_t, size_t,
+                                        size_t *, unsigned char *);
+int              cryptobox_merkle_open_chunk(int, unsigned char *, size_t,
+                                             unsigned char *, size_t,
+                                             unsigned char *, size_t,
+                                             unsigned char *,
+                                             unsigned char *);
+
+
+#endif
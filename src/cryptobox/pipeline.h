@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __CRYPTOBOX_PIPELINE_H__
+#define __CRYPTOBOX_PIPELINE_H__
+
+#include <sys/types.h>
+#include <cryptobox/cryptobox.h>
+
+
+/*
+ * Flags for the pipelined file functions.
+ */
+#define CRYPTOBOX_PIPE_NO_URING 0x01
+
+static const int        CRYPTOBOX_PIPE_DEPTH = 8;
+static const int        CRYPTOBOX_PIPE_MAX_DEPTH = 64;
+
+int      cryptobox_stream_seal_fd(int, int, int, size_t, int, int,
+                                  unsigned char *);
+int      cryptobox_stream_open_fd(int, int, int, int, int, unsigned char *);
+
+
+#endif
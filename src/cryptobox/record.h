@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __CRYPTOBOX_RECORD_H__
+#define __CRYPTOBOX_RECORD_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <cryptobox/cryptobox.h>
+
+
+/*
+ * The two ends of a connection. Each end tags its records with its
+ * role, so that records cannot be reflected back to their sender.
+ */
+#define CRYPTOBOX_RECORD_CLIENT 1
+#define CRYPTOBOX_RECORD_SERVER 2
+
+static const size_t     CRYPTOBOX_RECORD_MAX = 16384;
+static const size_t     CRYPTOBOX_RECORD_LIMIT = 16777216;
+static const int        CRYPTOBOX_RECORD_DEPTH = 32;
+
+struct cryptobox_record;
+
+struct cryptobox_record *cryptobox_record_new(int, int, int, unsigned char *,
+                                              size_t, int);
+void     cryptobox_record_free(struct cryptobox_record *);
+int      cryptobox_record_send(struct cryptobox_record *, unsigned char *,
+                               size_t);
+int      cryptobox_record_flush(struct cryptobox_record *);
+int      cryptobox_record_recv(struct cryptobox_record *, unsigned char **,
+                               size_t *);
+void     cryptobox_record_stats(struct cryptobox_record *, uint64_t *,
+                                uint64_t *);
+
+
+#endif
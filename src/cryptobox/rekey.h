@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __CRYPTOBOX_REKEY_H__
+#define __CRYPTOBOX_REKEY_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <cryptobox/cryptobox.h>
+
+
+static const size_t     CRYPTOBOX_REKEY_BUFFER = 65536;
+
+struct cryptobox_rekey;
+
+struct cryptobox_rekey *cryptobox_rekey_new(int, unsigned char *, int,
+                                            unsigned char *);
+void             cryptobox_rekey_free(struct cryptobox_rekey *);
+unsigned char   *cryptobox_rekey_box(struct cryptobox_rekey *, unsigned char *,
+                                     size_t, size_t *);
+int              cryptobox_rekey_boxes(struct cryptobox_rekey *,
+                                       unsigned char **, size_t *, size_t,
+                                       unsigned char **, size_t *);
+int              cryptobox_rekey_stream_fd(struct cryptobox_rekey *, int, int,
+                                           const char *);
+void             cryptobox_rekey_progress(struct cryptobox_rekey *,
+                                          uint64_t *, uint64_t *);
+
+
+#endif
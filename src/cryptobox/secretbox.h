@@ -19,14 +19,83 @@
 #define __CRYPTOBOX_SECRETBOX_H__
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <cryptobox/cryptobox.h>
 
 
-const size_t    SECRETBOX_KEY_SIZE = 48;
-const size_t    SECRETBOX_OVERHEAD = 48;
+static const size_t     SECRETBOX_KEY_SIZE = 48;
+static const size_t     SECRETBOX_OVERHEAD = 48;
+
+struct secretbox_ctx;
 
 int              secretbox_generate_key(unsigned char *);
 unsigned char   *secretbox_seal(unsigned char *, int, int *, unsigned char *);
 unsigned char   *secretbox_open(unsigned char *, int, unsigned char *);
+int              secretbox_verify(unsigned char *, int, unsigned char *);
+int              secretbox_seal_file(const char *, const char *,
+                                    unsigned char *);
+int              secretbox_open_file(const char *, const char *,
+                                    unsigned char *);
+int              secretbox_seal_detached(unsigned char *, size_t,
+                                        unsigned char *, unsigned char *,
+                                        unsigned char *);
+int              secretbox_open_detached(unsigned char *, size_t,
+                                        unsigned char *, unsigned char *,
+                                        unsigned char *);
+unsigned char   *secretbox_seal_aad(unsigned char *, int, unsigned char *,
+                                   size_t, int *, unsigned char *);
+unsigned char   *secretbox_open_aad(unsigned char *, int, unsigned char *,
+                                   size_t, unsigned char *);
+
+struct secretbox_ctx    *secretbox_ctx_new(unsigned char *);
+struct secretbox_ctx    *secretbox_ctx_new_secure(unsigned char *);
+void                     secretbox_ctx_free(struct secretbox_ctx *);
+unsigned char           *secretbox_ctx_seal(struct secretbox_ctx *,
+                                            unsigned char *, int, int *);
+unsigned char           *secretbox_ctx_open(struct secretbox_ctx *,
+                                            unsigned char *, int);
+int                      secretbox_ctx_verify(struct secretbox_ctx *,
+                                              unsigned char *, int);
+int                      secretbox_ctx_seal_detached(struct secretbox_ctx *,
+                                                     unsigned char *, size_t,
+                                                     unsigned char *,
+                                                     unsigned char *);
+int                      secretbox_ctx_open_detached(struct secretbox_ctx *,
+                                                     unsigned char *, size_t,
+                                                     unsigned char *,
+                                                     unsigned char *);
+unsigned char           *secretbox_ctx_seal_aad(struct secretbox_ctx *,
+                                                unsigned char *, int,
+                                                unsigned char *, size_t,
+                                                int *);
+unsigned char           *secretbox_ctx_seal_aadv(struct secretbox_ctx *,
+                                                 unsigned char *, int,
+                                                 const struct iovec *, int,
+                                                 int *);
+unsigned char           *secretbox_ctx_open_aad(struct secretbox_ctx *,
+                                                unsigned char *, int,
+                                                unsigned char *, size_t);
+unsigned char           *secretbox_ctx_open_aadv(struct secretbox_ctx *,
+                                                 unsigned char *, int,
+                                                 const struct iovec *, int);
+int                      secretbox_ctx_verify_aad(struct secretbox_ctx *,
+                                                  unsigned char *, int,
+                                                  unsigned char *, size_t);
+int                      secretbox_ctx_verify_aadv(struct secretbox_ctx *,
+                                                   unsigned char *, int,
+                                                   const struct iovec *,
+                                                   int);
+void                     secretbox_ctx_set_allocator(struct secretbox_ctx *,
+                                                     cryptobox_alloc_fn,
+                                                     cryptobox_free_fn,
+                                                     void *);
+int                      secretbox_ctx_keystream(struct secretbox_ctx *, int,
+                                                  size_t);
+int                      secretbox_ctx_refill(struct secretbox_ctx *);
+void                     secretbox_ctx_keystream_stats(struct secretbox_ctx *,
+                                                        uint64_t *,
+                                                        uint64_t *);
 
 
 #endif
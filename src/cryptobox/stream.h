@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __CRYPTOBOX_STREAM_H__
+#define __CRYPTOBOX_STREAM_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <cryptobox/cryptobox.h>
+
+
+static const size_t     CRYPTOBOX_STREAM_CHUNK = 65536;
+static const size_t     CRYPTOBOX_STREAM_MAX_CHUNK = 16777216;
+
+struct cryptobox_stream;
+
+struct cryptobox_stream *cryptobox_stream_new(int, unsigned char *);
+void             cryptobox_stream_free(struct cryptobox_stream *);
+size_t           cryptobox_stream_head_size(int);
+size_t           cryptobox_stream_tag_size(int);
+size_t           cryptobox_stream_chunk_size(struct cryptobox_stream *);
+int              cryptobox_stream_seal_head(struct cryptobox_stream *, size_t,
+                                            unsigned char *);
+int              cryptobox_stream_open_head(struct cryptobox_stream *,
+                                            unsigned char *);
+int              cryptobox_stream_seal_chunk(struct cryptobox_stream *,
+                                             uint64_t, unsigned char *,
+                                             size_t, unsigned char *);
+int              cryptobox_stream_open_chunk(struct cryptobox_stream *,
+                                             uint64_t, unsigned char *,
+                                             size_t, unsigned char *);
+
+
+#endif
@@ -19,14 +19,83 @@
 #define __CRYPTOBOX_STRONGBOX_H__
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <cryptobox/cryptobox.h>
 
 
-const size_t    STRONGBOX_KEY_SIZE = 80;
-const size_t    STRONGBOX_OVERHEAD = 64;
+static const size_t     STRONGBOX_KEY_SIZE = 80;
+static const size_t     STRONGBOX_OVERHEAD = 64;
+
+struct strongbox_ctx;
 
 int              strongbox_generate_key(unsigned char *);
 unsigned char   *strongbox_seal(unsigned char *, int, int *, unsigned char *);
 unsigned char   *strongbox_open(unsigned char *, int, unsigned char *);
+int              strongbox_verify(unsigned char *, int, unsigned char *);
+int              strongbox_seal_file(const char *, const char *,
+                                    unsigned char *);
+int              strongbox_open_file(const char *, const char *,
+                                    unsigned char *);
+int              strongbox_seal_detached(unsigned char *, size_t,
+                                        unsigned char *, unsigned char *,
+                                        unsigned char *);
+int              strongbox_open_detached(unsigned char *, size_t,
+                                        unsigned char *, unsigned char *,
+                                        unsigned char *);
+unsigned char   *strongbox_seal_aad(unsigned char *, int, unsigned char *,
+                                   size_t, int *, unsigned char *);
+unsigned char   *strongbox_open_aad(unsigned char *, int, unsigned char *,
+                                   size_t, unsigned char *);
+
+struct strongbox_ctx    *strongbox_ctx_new(unsigned char *);
+struct strongbox_ctx    *strongbox_ctx_new_secure(unsigned char *);
+void                     strongbox_ctx_free(struct strongbox_ctx *);
+unsigned char           *strongbox_ctx_seal(struct strongbox_ctx *,
+                                            unsigned char *, int, int *);
+unsigned char           *strongbox_ctx_open(struct strongbox_ctx *,
+                                            unsigned char *, int);
+int                      strongbox_ctx_verify(struct strongbox_ctx *,
+                                              unsigned char *, int);
+int                      strongbox_ctx_seal_detached(struct strongbox_ctx *,
+                                                     unsigned char *, size_t,
+                                                     unsigned char *,
+                                                     unsigned char *);
+int                      strongbox_ctx_open_detached(struct strongbox_ctx *,
+                                                     unsigned char *, size_t,
+                                                     unsigned char *,
+                                                     unsigned char *);
+unsigned char           *strongbox_ctx_seal_aad(struct strongbox_ctx *,
+                                                unsigned char *, int,
+                                                unsigned char *, size_t,
+                                                int *);
+unsigned char           *strongbox_ctx_seal_aadv(struct strongbox_ctx *,
+                                                 unsigned char *, int,
+                                                 const struct iovec *, int,
+                                                 int *);
+unsigned char           *strongbox_ctx_open_aad(struct strongbox_ctx *,
+                                                unsigned char *, int,
+                                                unsigned char *, size_t);
+unsigned char           *strongbox_ctx_open_aadv(struct strongbox_ctx *,
+                                                 unsigned char *, int,
+                                                 const struct iovec *, int);
+int                      strongbox_ctx_verify_aad(struct strongbox_ctx *,
+                                                  unsigned char *, int,
+                                                  unsigned char *, size_t);
+int                      strongbox_ctx_verify_aadv(struct strongbox_ctx *,
+                                                   unsigned char *, int,
+                                                   const struct iovec *,
+                                                   int);
+void                     strongbox_ctx_set_allocator(struct strongbox_ctx *,
+                                                     cryptobox_alloc_fn,
+                                                     cryptobox_free_fn,
+                                                     void *);
+int                      strongbox_ctx_keystream(struct strongbox_ctx *, int,
+                                                  size_t);
+int                      strongbox_ctx_refill(struct strongbox_ctx *);
+void                     strongbox_ctx_keystream_stats(struct strongbox_ctx *,
+                                                        uint64_t *,
+                                                        uint64_t *);
 
 
 #endif
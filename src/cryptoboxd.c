@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * cryptoboxd(8): hold keys on behalf of other processes, and seal,
+ * open and verify boxes for them over shared memory. The keys are
+ * read once at startup into the library's locked arena; clients only
+ * ever refer to them by number, in the order they were given on the
+ * command line.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include "server.h"
+#include "shmring.h"
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secmem.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define CBD_KEY_MAX     80
+
+
+static volatile sig_atomic_t    cbd_stop;
+
+
+static void      usage(void);
+static void      cbd_signal(int);
+static void      cbd_load_key(const char *, struct server_key *);
+
+
+void
+usage(void)
+{
+        fprintf(stderr, "usage: cryptoboxd -s socket [-j jobs] "
+                        "-k keyfile [-k keyfile ...]\n");
+        exit(EX_USAGE);
+}
+
+
+void
+cbd_signal(int sig)
+{
+        (void)sig;
+        cbd_stop = 1;
+}
+
+
+/*
+ * Read a key file into the locked arena. The type is the one whose key
+ * is as long as the file.
+ */
+void
+cbd_load_key(const char *path, struct server_key *key)
+{
+        unsigned char    buf[CBD_KEY_MAX + 1];
+        size_t           len = 0;
+        ssize_t          n;
+        int              fd;
+
+        if (-1 == (fd = open(path, O_RDONLY)))
+                err(EX_NOINPUT, "%s", path);
+        while (len < sizeof buf) {
+                n = read(fd, buf + len, sizeof buf - len);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n < 0)
+                        err(EX_IOERR, "%s", path);
+                if (0 == n)
+                        break;
+                len += (size_t)n;
+        }
+        close(fd);
+
+        if (SECRETBOX_KEY_SIZE == len)
+                key->type = CRYPTOBOX_SECRETBOX;
+        else if (STRONGBOX_KEY_SIZE == len)
+                key->type = CRYPTOBOX_STRONGBOX;
+        else
+                errx(EX_DATAERR, "%s: not a key", path);
+        if (NULL == (key->key = cryptobox_secmem_alloc(len)))
+                errx(EX_OSERR, "%s: cannot lock key in memory", path);
+        memcpy(key->key, buf, len);
+        memset(buf, 0, sizeof buf);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+        struct server_key        keys[SHMRING_MAX_KEYS];
+        struct sigaction         sa;
+        const char              *sock = NULL;
+        char                    *end;
+        unsigned long            n;
+        int                      nkeys = 0, jobs = 0;
+        int                      ch, fd, res;
+        mode_t                   mask;
+
+        while (-1 != (ch = getopt(argc, argv, "j:k:s:"))) {
+                switch (ch) {
+                case 'j':
+                        n = strtoul(optarg, &end, 10);
+                        if ('\0' == *optarg || '\0' != *end || 0 == n)
+                                errx(EX_USAGE, "-j: bad number %s", optarg);
+                        jobs = n > 1024 ? 1024 : (int)n;
+                        break;
+                case 'k':
+                        if (SHMRING_MAX_KEYS == nkeys)
+                                errx(EX_USAGE, "at most %d keys",
+                                     SHMRING_MAX_KEYS);
+                        cbd_load_key(optarg, &keys[nkeys++]);
+                        break;
+                case 's':
+                        sock = optarg;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (NULL == sock || 0 == nkeys || optind != argc)
+                usage();
+
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = cbd_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sa.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &sa, NULL);
+
+        mask = umask(077);
+        fd = server_listen(sock);
+        umask(mask);
+        if (-1 == fd)
+                err(EX_OSERR, "%s", sock);
+        sched_start(jobs);
+
+        res = server_run(fd, keys, nkeys, &cbd_stop);
+        close(fd);
+        unlink(sock);
+        while (nkeys > 0)
+                cryptobox_secmem_free(keys[--nkeys].key);
+        if (!res)
+                errx(EX_SOFTWARE, "serving failed");
+        return EX_OK;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Boxes with a detached tag: the ciphertext is exactly as long as the
+ * message and may be written over it, and the IV and tag go to a
+ * separate metadata slot of the box type's overhead. The tag is the
+ * same one a box would carry, over the IV and ciphertext, so a box is
+ * the IV, the ciphertext and the tag put back together.
+ */
+
+#include <sys/types.h>
+#include <limits.h>
+#include <string.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "box.h"
+#include "constant_time.h"
+#include "detached.h"
+
+
+static int       detached_tag(const struct box_ops *, void *, unsigned char *,
+                              unsigned char *, size_t, unsigned char *);
+
+
+/*
+ * Compute the tag over iv and len bytes of ciphertext.
+ */
+int
+detached_tag(const struct box_ops *ops, void *ctx, unsigned char *iv,
+             unsigned char *ct, size_t len, unsigned char *tag)
+{
+        union box_mac_state     mac;
+        int                     res = 0;
+
+        ops->tag_start(ctx, &mac);
+        if (ops->tag_update(&mac, iv, ops->iv_size))
+        if (0 == len || ops->tag_update(&mac, ct, len))
+        if (ops->tag_finish(ctx, &mac, tag))
+                res = 1;
+        memset(&mac, 0x0, sizeof mac);
+        return res;
+}
+
+
+/*
+ * Encrypt len bytes from m into out, which may be m, writing a fresh
+ * IV and the tag to meta. Returns 1 on success and 0 on failure, when
+ * meta is cleared and out holds nothing of use.
+ */
+int
+detached_seal(const struct box_ops *ops, void *ctx, unsigned char *m,
+              size_t len, unsigned char *out, unsigned char *meta)
+{
+        if (NULL == ctx || NULL == meta || len > INT_MAX ||
+            (len > 0 && (NULL == m || NULL == out)))
+                return 0;
+        if (RAND_bytes(meta, ops->iv_size))
+        if (0 == len || ops->crypt(ctx, meta, 0, m, out, len))
+        if (detached_tag(ops, ctx, meta, out, len, meta + ops->iv_size))
+                return 1;
+        memset(meta, 0x0, ops->overhead);
+        return 0;
+}
+
+
+/*
+ * Check the tag in meta against len bytes of ciphertext, and only if
+ * it matches decrypt them into out, which may be ct. Returns 1 on
+ * success and 0 if the ciphertext is not authentic, leaving out
+ * untouched.
+ */
+int
+detached_open(const struct box_ops *ops, void *ctx, unsigned char *ct,
+              size_t len, unsigned char *meta, unsigned char *out)
+{
+        unsigned char   tag[SHA512_DIGEST_LENGTH];
+        int             match = 0;
+
+        if (NULL == ctx || NULL == meta || len > INT_MAX ||
+            (len > 0 && (NULL == ct || NULL == out)))
+                return 0;
+        if (detached_tag(ops, ctx, meta, ct, len, tag))
+        if (1 == constant_time_equals(tag, ops->tag_size,
+                                      meta + ops->iv_size, ops->tag_size))
+                match = 1;
+        memset(tag, 0x0, sizeof tag);
+        if (!match)
+                return 0;
+        return 0 == len || ops->crypt(ctx, meta, 0, ct, out, len);
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Envelopes: a message sealed once under a random data key, with the
+ * data key wrapped for each of a set of recipient keys. An envelope is
+ *
+ *      magic (4) | type (1) | 0 (1) | recipients (2)
+ *      wrapped key (48) for each recipient
+ *      IV | ciphertext | tag
+ *
+ * The data key is a 32-byte seed, from which the payload's box key is
+ * expanded with HKDF. Each wrapped key is the seed in a deterministic
+ * (SIV-style) key-wrap box under the recipient's key: the first 16
+ * bytes of a MAC over the seed, under a key derived from the
+ * recipient's key for key wrapping alone, serve as both the CTR IV
+ * for the seed and its check value, so a wrapped key costs 48 bytes
+ * rather than a full box. The payload tag is taken
+ * under the payload key over everything before it, so the recipient
+ * list cannot be altered without the envelope failing to open.
+ *
+ * Sealing costs one pass over the message and a key setup for each
+ * recipient, instead of a pass over the message per recipient.
+ */
+
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "box.h"
+#include "constant_time.h"
+#include "hkdf.h"
+#include <cryptobox/envelope.h>
+#include <cryptobox/keycache.h>
+
+
+#define ENVELOPE_MAGIC          "CBEV"
+#define ENVELOPE_FIXED          8
+#define ENVELOPE_SEED           32
+#define ENVELOPE_SIV            BOX_BLOCK_SIZE
+#define ENVELOPE_MAX_KEY        80
+
+
+static const char       envelope_wrap_label[] = "cryptobox-envelope-wrap";
+static const char       envelope_key_label[] = "cryptobox-envelope-key";
+
+
+static int       envelope_siv(const struct box_ops *, void *,
+                              unsigned char *, unsigned char *);
+static int       envelope_wrap(const struct box_ops *, unsigned char *,
+                               unsigned char *, unsigned char *);
+static void     *envelope_payload_ctx(const struct box_ops *,
+                                      unsigned char *);
+static int       envelope_payload_tag(const struct box_ops *, void *,
+                                      unsigned char *, size_t,
+                                      unsigned char *);
+
+
+/*
+ * Compute the synthetic IV of a seed under the wrapping key derived
+ * from a recipient's context.
+ */
+int
+envelope_siv(const struct box_ops *ops, void *ctx, unsigned char *seed,
+             unsigned char *siv)
+{
+        struct box_mac_key       mk;
+        union box_mac_state      mac;
+        unsigned char            tag[SHA512_DIGEST_LENGTH];
+        int                      res = 0;
+
+        if (!ops->mac_key(ctx, envelope_wrap_label, &mk))
+                return 0;
+        box_mac_start(&mk, &mac);
+        if (ops->tag_update(&mac, seed, ENVELOPE_SEED))
+        if (box_mac_finish(&mk, &mac, tag)) {
+                memcpy(siv, tag, ENVELOPE_SIV);
+                res = 1;
+        }
+        box_mac_zero(&mk);
+        memset(&mac, 0x0, sizeof mac);
+        memset(tag, 0x0, sizeof tag);
+        return res;
+}
+
+
+/*
+ * Wrap a seed for a recipient key into out, which has room for
+ * CRYPTOBOX_ENVELOPE_WRAP bytes.
+ */
+int
+envelope_wrap(const struct box_ops *ops, unsigned char *key,
+              unsigned char *seed, unsigned char *out)
+{
+        void    *ctx;
+        int      res = 0;
+
+        if (NULL == key || NULL == (ctx = ops->ctx_new(key)))
+                return 0;
+        if (envelope_siv(ops, ctx, seed, out))
+        if (ops->crypt(ctx, out, 0, seed, out + ENVELOPE_SIV, ENVELOPE_SEED))
+                res = 1;
+        ops->ctx_free(ctx);
+        return res;
+}
+
+
+/*
+ * Set up a context for the payload key expanded from a seed.
+ */
+void *
+envelope_payload_ctx(const struct box_ops *ops, unsigned char *seed)
+{
+        unsigned char    key[ENVELOPE_MAX_KEY];
+        void            *ctx = NULL;
+        int              hash;
+
+        hash = CRYPTOBOX_STRONGBOX == ops->type ? CRYPTOBOX_HKDF_SHA384 :
+                                                  CRYPTOBOX_HKDF_SHA256;
+        if (cryptobox_hkdf(hash, NULL, 0, seed, ENVELOPE_SEED,
+                           (unsigned char *)envelope_key_label,
+                           sizeof envelope_key_label - 1, key,
+                           ops->key_size))
+                ctx = ops->ctx_new(key);
+        memset(key, 0x0, sizeof key);
+        return ctx;
+}
+
+
+/*
+ * Compute the payload tag over the first len bytes of an envelope.
+ */
+int
+envelope_payload_tag(const struct box_ops *ops, void *ctx,
+                     unsigned char *env, size_t len, unsigned char *tag)
+{
+        union box_mac_state      mac;
+
+        ops->tag_start(ctx, &mac);
+        if (ops->tag_update(&mac, env, len))
+                return ops->tag_finish(ctx, &mac, tag);
+        memset(&mac, 0x0, sizeof mac);
+        return 0;
+}
+
+
+/*
+ * Return the size of an envelope of the given box type holding a
+ * message of mlen bytes for nkeys recipients, or 0 if there cannot be
+ * one.
+ */
+size_t
+cryptobox_envelope_size(int type, int nkeys, size_t mlen)
+{
+        const struct box_ops    *ops;
+        size_t                   fixed;
+
+        if (NULL == (ops = box_ops_lookup(type)) || nkeys < 1 ||
+            nkeys > CRYPTOBOX_ENVELOPE_MAX_KEYS)
+                return 0;
+        fixed = ENVELOPE_FIXED + (size_t)nkeys * CRYPTOBOX_ENVELOPE_WRAP +
+                ops->overhead;
+        if (mlen > SIZE_MAX - fixed)
+                return 0;
+        return fixed + mlen;
+}
+
+
+/*
+ * Return the number of recipients of an envelope, or 0 if it is not an
+ * envelope of the given box type. The envelope is not checked.
+ */
+int
+cryptobox_envelope_recipients(int type, unsigned char *env, size_t env_len)
+{
+        size_t  n;
+
+        if (NULL == env || env_len < ENVELOPE_FIXED ||
+            0 != memcmp(env, ENVELOPE_MAGIC, 4) ||
+            (unsigned char)type != env[4] || 0 != env[5])
+                return 0;
+        n = ((size_t)env[6] << 8) | env[7];
+        if (0 == cryptobox_envelope_size(type, (int)n, 0) ||
+            env_len < cryptobox_envelope_size(type, (int)n, 0))
+                return 0;
+        return (int)n;
+}
+
+
+/*
+ * Seal a message once for the nkeys recipient keys in keys, each of
+ * the box type's key size. The length of the envelope is stored in
+ * env_len if it is not NULL. Returns NULL on failure.
+ */
+unsigned char *
+cryptobox_envelope_seal(int type, unsigned char *m, size_t mlen,
+                        size_t *env_len, unsigned char **keys, int nkeys)
+{
+        const struct box_ops    *ops;
+        unsigned char            seed[ENVELOPE_SEED];
+        unsigned char           *env, *iv;
+        size_t                   size, head;
+        void                    *ctx;
+        int                      i, ok = 0;
+
+        if (NULL != env_len)
+                *env_len = 0;
+        if (NULL == (ops = box_ops_lookup(type)) || NULL == keys ||
+            (NULL == m && mlen > 0))
+                return NULL;
+        if (0 == (size = cryptobox_envelope_size(type, nkeys, mlen)))
+                return NULL;
+        if (!RAND_bytes(seed, ENVELOPE_SEED))
+                return NULL;
+        if (NULL == (ctx = envelope_payload_ctx(ops, seed))) {
+                memset(seed, 0x0, ENVELOPE_SEED);
+                return NULL;
+        }
+        if (NULL == (env = ops->ctx_alloc(ctx, size))) {
+                memset(seed, 0x0, ENVELOPE_SEED);
+                ops->ctx_free(ctx);
+                return NULL;
+        }
+
+        memcpy(env, ENVELOPE_MAGIC, 4);
+        env[4] = (unsigned char)type;
+        env[5] = 0;
+        env[6] = (unsigned char)(nkeys >> 8);
+        env[7] = (unsigned char)nkeys;
+        head = ENVELOPE_FIXED + (size_t)nkeys * CRYPTOBOX_ENVELOPE_WRAP;
+        for (i = 0; i < nkeys; i++)
+                if (!envelope_wrap(ops, keys[i], seed, env + ENVELOPE_FIXED +
+                                   (size_t)i * CRYPTOBOX_ENVELOPE_WRAP))
+                        break;
+        memset(seed, 0x0, ENVELOPE_SEED);
+
+        iv = env + head;
+        if (i == nkeys && RAND_bytes(iv, ops->iv_size))
+        if (0 == mlen || ops->crypt(ctx, iv, 0, m, iv + ops->iv_size, mlen))
+        if (envelope_payload_tag(ops, ctx, env, size - ops->tag_size,
+                                 env + size - ops->tag_size))
+                ok = 1;
+        if (!ok) {
+                ops->ctx_release(ctx, env, size);
+                env = NULL;
+        } else if (NULL != env_len) {
+                *env_len = size;
+        }
+        ops->ctx_free(ctx);
+        return env;
+}
+
+
+/*
+ * Open an envelope with one recipient key, trying it against each
+ * wrapped key in turn. The message length is stored in mlen if it is
+ * not NULL. Returns NULL if the key is not a recipient's or the
+ * envelope is not authentic.
+ */
+unsigned char *
+cryptobox_envelope_open(int type, unsigned char *env, size_t env_len,
+                        size_t *mlen, unsigned char *key)
+{
+        const struct box_ops    *ops;
+        unsigned char            seed[ENVELOPE_SEED];
+        unsigned char            siv[ENVELOPE_SIV];
+        unsigned char            tag[SHA512_DIGEST_LENGTH];
+        unsigned char           *wrap, *iv, *out = NULL;
+        size_t                   head, len;
+        void                    *rctx, *ctx = NULL;
+        int                      n, i, found = 0;
+
+        if (NULL != mlen)
+                *mlen = 0;
+        if (NULL == (ops = box_ops_lookup(type)) || NULL == key)
+                return NULL;
+        if (0 == (n = cryptobox_envelope_recipients(type, env, env_len)))
+                return NULL;
+        head = ENVELOPE_FIXED + (size_t)n * CRYPTOBOX_ENVELOPE_WRAP;
+        len = env_len - cryptobox_envelope_size(type, n, 0);
+
+        if (NULL == (rctx = ops->ctx_new(key)))
+                return NULL;
+        for (i = 0; !found && i < n; i++) {
+                wrap = env + ENVELOPE_FIXED + (size_t)i *
+                       CRYPTOBOX_ENVELOPE_WRAP;
+                if (!ops->crypt(rctx, wrap, 0, wrap + ENVELOPE_SIV, seed,
+                                ENVELOPE_SEED) ||
+                    !envelope_siv(ops, rctx, seed, siv))
+                        break;
+                found = 1 == constant_time_equals(siv, ENVELOPE_SIV, wrap,
+                                                  ENVELOPE_SIV);
+        }
+        ops->ctx_free(rctx);
+        if (found)
+                ctx = envelope_payload_ctx(ops, seed);
+        memset(seed, 0x0, ENVELOPE_SEED);
+        if (NULL == ctx)
+                return NULL;
+
+        iv = env + head;
+        if (envelope_payload_tag(ops, ctx, env, env_len - ops->tag_size, tag))
+        if (1 == constant_time_equals(tag, (int)ops->tag_size,
+                                      env + env_len - ops->tag_size,
+                                      (int)ops->tag_size))
+        if (NULL != (out = ops->ctx_alloc(ctx, len + 1))) {
+                if (len > 0 && !ops->crypt(ctx, iv, 0, iv + ops->iv_size, out,
+                                           len)) {
+                        ops->ctx_release(ctx, out, len + 1);
+                        out = NULL;
+                } else if (NULL != mlen) {
+                        *mlen = len;
+                }
+        }
+        memset(tag, 0x0, sizeof tag);
+        ops->ctx_free(ctx);
+        return out;
+}
@@ -0,0 +1,551 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Encrypted stdio streams over the chunked streaming format. A stream
+ * opened for writing seals what is written to it a chunk at a time and
+ * writes the final chunk when it is closed. A stream opened for reading
+ * checks the final chunk as it is opened, which fixes the length of
+ * the message, and then opens whichever chunk the read position falls
+ * in, so that it may be seeked freely. Writers cannot seek: rewriting
+ * a chunk would encrypt new data under a key stream already used. The
+ * streams are built on fopencookie(3) where it exists and funopen(3)
+ * on the BSDs; stdio is given a buffer of one chunk, so that it hands
+ * over whole chunks.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "box.h"
+#include <cryptobox/file.h>
+#include <cryptobox/stream.h>
+
+
+#if defined(__GLIBC__)
+#define FILE_COOKIE             1
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+      defined(__NetBSD__) || defined(__DragonFly__)
+#define FILE_FUNOPEN            1
+#endif
+
+
+/*
+ * The state behind a stream. buf holds one sealed chunk: the chunk
+ * being gathered when writing, and the last chunk opened, index
+ * loaded, when reading. size is the length of the message, which is
+ * only known when reading.
+ */
+struct cbfile {
+        struct cryptobox_stream *s;
+        struct box_allocator     mem;
+        int                      fd;
+        int                      writing;
+        int                      type;
+        size_t                   head_size;
+        size_t                   tag_size;
+        size_t                   chunk_size;
+        size_t                   rec_size;
+        unsigned char           *buf;
+        size_t                   fill;
+        uint64_t                 index;
+        uint64_t                 loaded;
+        size_t                   len;
+        off_t                    pos;
+        off_t                    size;
+        int                      failed;
+};
+
+
+static struct cbfile    *file_new(int, int, unsigned char *);
+static void              file_free(struct cbfile *);
+static int               file_write_all(int, unsigned char *, size_t);
+static ssize_t           file_pread_all(int, unsigned char *, size_t, off_t);
+static int               file_load(struct cbfile *, uint64_t);
+static int               file_start_read(struct cbfile *);
+static int               file_start_write(struct cbfile *);
+static int               file_seal(struct cbfile *);
+static ssize_t           file_read(void *, char *, size_t);
+static ssize_t           file_write(void *, const char *, size_t);
+static int               file_seek(void *, off_t *, int);
+static int               file_close(void *);
+static FILE             *file_stream(struct cbfile *, int);
+
+
+struct cbfile *
+file_new(int fd, int type, unsigned char *key)
+{
+        struct cbfile   *f;
+
+        if (NULL == (f = box_malloc(sizeof(struct cbfile))))
+                return NULL;
+        memset(f, 0, sizeof(struct cbfile));
+        box_allocator_get(&f->mem);
+        f->fd = fd;
+        f->type = type;
+        f->head_size = cryptobox_stream_head_size(type);
+        f->tag_size = cryptobox_stream_tag_size(type);
+        f->loaded = UINT64_MAX;
+        if (NULL == (f->s = cryptobox_stream_new(type, key))) {
+                box_free(f);
+                return NULL;
+        }
+        return f;
+}
+
+
+/*
+ * Release a stream's state, wiping the chunk buffer. The descriptor
+ * is left open.
+ */
+void
+file_free(struct cbfile *f)
+{
+        if (NULL != f->buf)
+                box_release(&f->mem, f->buf, f->rec_size);
+        cryptobox_stream_free(f->s);
+        box_free(f);
+}
+
+
+int
+file_write_all(int fd, unsigned char *buf, size_t len)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = write(fd, buf, len);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 1;
+}
+
+
+/*
+ * Read up to len bytes at off, stopping only at the end of the file.
+ */
+ssize_t
+file_pread_all(int fd, unsigned char *buf, size_t len, off_t off)
+{
+        size_t  done = 0;
+        ssize_t n;
+
+        while (done < len) {
+                n = pread(fd, buf + done, len - done, off + (off_t)done);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n < 0)
+                        return -1;
+                if (0 == n)
+                        break;
+                done += (size_t)n;
+        }
+        return (ssize_t)done;
+}
+
+
+/*
+ * Read and open a chunk into the buffer. Every chunk before the last
+ * must be complete. Returns 0, with errno set, if the chunk cannot be
+ * read or is not authentic.
+ */
+int
+file_load(struct cbfile *f, uint64_t index)
+{
+        ssize_t n;
+        off_t   off;
+
+        if (index == f->loaded)
+                return 1;
+        f->loaded = UINT64_MAX;
+        off = (off_t)f->head_size + (off_t)index * (off_t)f->rec_size;
+        if (-1 == (n = file_pread_all(f->fd, f->buf, f->rec_size, off)))
+                return 0;
+        if (!cryptobox_stream_open_chunk(f->s, index, f->buf, (size_t)n,
+                                         f->buf)) {
+                errno = EIO;
+                return 0;
+        }
+        f->len = (size_t)n - f->tag_size;
+        f->loaded = index;
+        return 1;
+}
+
+
+/*
+ * Read the header, and work out the length of the message from the
+ * size of the file, checking it by opening the final chunk.
+ */
+int
+file_start_read(struct cbfile *f)
+{
+        unsigned char    head[64];
+        struct stat      st;
+        off_t            body, rem;
+        uint64_t         last;
+
+        if (-1 == fstat(f->fd, &st))
+                return 0;
+        if (!S_ISREG(st.st_mode)) {
+                errno = ESPIPE;
+                return 0;
+        }
+        if ((ssize_t)f->head_size != file_pread_all(f->fd, head,
+                                                    f->head_size, 0) ||
+            !cryptobox_stream_open_head(f->s, head)) {
+                errno = EIO;
+                return 0;
+        }
+        f->chunk_size = cryptobox_stream_chunk_size(f->s);
+        f->rec_size = f->chunk_size + f->tag_size;
+        if (NULL == (f->buf = box_alloc(&f->mem, f->rec_size)))
+                return 0;
+
+        body = st.st_size - (off_t)f->head_size;
+        rem = body % (off_t)f->rec_size;
+        if (rem < (off_t)f->tag_size) {
+                errno = EIO;
+                return 0;
+        }
+        last = (uint64_t)(body / (off_t)f->rec_size);
+        if (!file_load(f, last))
+                return 0;
+        f->size = (off_t)last * (off_t)f->chunk_size + (off_t)f->len;
+        return 1;
+}
+
+
+int
+file_start_write(struct cbfile *f)
+{
+        f->chunk_size = CRYPTOBOX_STREAM_CHUNK;
+        f->rec_size = f->chunk_size + f->tag_size;
+        f->writing = 1;
+        if (NULL == (f->buf = box_alloc(&f->mem, f->rec_size)))
+                return 0;
+        if (!cryptobox_stream_seal_head(f->s, f->chunk_size, f->buf))
+                return 0;
+        return file_write_all(f->fd, f->buf, f->head_size);
+}
+
+
+/*
+ * Seal the gathered chunk in place and write it out.
+ */
+int
+file_seal(struct cbfile *f)
+{
+        if (!cryptobox_stream_seal_chunk(f->s, f->index, f->buf, f->fill,
+                                         f->buf) ||
+            !file_write_all(f->fd, f->buf, f->fill + f->tag_size)) {
+                f->failed = 1;
+                return 0;
+        }
+        f->index++;
+        f->fill = 0;
+        return 1;
+}
+
+
+ssize_t
+file_read(void *cookie, char *out, size_t size)
+{
+        struct cbfile   *f = cookie;
+        size_t           done = 0;
+        size_t           off, n;
+        uint64_t         index;
+
+        if (f->writing) {
+                errno = EBADF;
+                return -1;
+        }
+        while (done < size && f->pos < f->size) {
+                index = (uint64_t)(f->pos / (off_t)f->chunk_size);
+                off = (size_t)(f->pos % (off_t)f->chunk_size);
+                if (!file_load(f, index))
+                        return done > 0 ? (ssize_t)done : -1;
+                if (off >= f->len) {
+                        errno = EIO;
+                        return done > 0 ? (ssize_t)done : -1;
+                }
+                n = f->len - off;
+                if (n > size - done)
+                        n = size - done;
+                memcpy(out + done, f->buf + off, n);
+                done += n;
+                f->pos += (off_t)n;
+        }
+        return (ssize_t)done;
+}
+
+
+ssize_t
+file_write(void *cookie, const char *in, size_t size)
+{
+        struct cbfile   *f = cookie;
+        size_t           done = 0;
+        size_t           n;
+
+        if (!f->writing || f->failed) {
+                errno = !f->writing ? EBADF : EIO;
+                return -1;
+        }
+        while (done < size) {
+                n = f->chunk_size - f->fill;
+                if (n > size - done)
+                        n = size - done;
+                memcpy(f->buf + f->fill, in + done, n);
+                f->fill += n;
+                done += n;
+                if (f->fill == f->chunk_size && !file_seal(f))
+                        return -1;
+        }
+        f->pos += (off_t)size;
+        return (ssize_t)size;
+}
+
+
+/*
+ * Move the read position; a writer may only ask where it is.
+ */
+int
+file_seek(void *cookie, off_t *offset, int whence)
+{
+        struct cbfile   *f = cookie;
+        off_t            pos;
+
+        switch (whence) {
+        case SEEK_SET:
+                pos = *offset;
+                break;
+        case SEEK_CUR:
+                pos = f->pos + *offset;
+                break;
+        case SEEK_END:
+                if (f->writing) {
+                        errno = ESPIPE;
+                        return -1;
+                }
+                pos = f->size + *offset;
+                break;
+        default:
+                errno = EINVAL;
+                return -1;
+        }
+        if (pos < 0 || (f->writing && pos != f->pos)) {
+                errno = f->writing ? ESPIPE : EINVAL;
+                return -1;
+        }
+        f->pos = pos;
+        *offset = pos;
+        return 0;
+}
+
+
+/*
+ * Write the final chunk, if writing, and release everything.
+ */
+int
+file_close(void *cookie)
+{
+        struct cbfile   *f = cookie;
+        int              res = 0;
+
+        if (f->writing && (f->failed || !file_seal(f)))
+                res = -1;
+        if (-1 == close(f->fd))
+                res = -1;
+        file_free(f);
+        if (-1 == res)
+                errno = EIO;
+        return res;
+}
+
+
+#if defined(FILE_COOKIE)
+static ssize_t   file_cookie_write(void *, const char *, size_t);
+static int       file_cookie_seek(void *, off64_t *, int);
+
+
+/*
+ * fopencookie wants 0 rather than -1 for a failed write.
+ */
+ssize_t
+file_cookie_write(void *cookie, const char *in, size_t size)
+{
+        ssize_t n;
+
+        n = file_write(cookie, in, size);
+        return n < 0 ? 0 : n;
+}
+
+
+int
+file_cookie_seek(void *cookie, off64_t *offset, int whence)
+{
+        off_t   pos = (off_t)*offset;
+
+        if (-1 == file_seek(cookie, &pos, whence))
+                return -1;
+        *offset = (off64_t)pos;
+        return 0;
+}
+
+
+FILE *
+file_stream(struct cbfile *f, int writing)
+{
+        cookie_io_functions_t    io;
+
+        io.read = file_read;
+        io.write = file_cookie_write;
+        io.seek = file_cookie_seek;
+        io.close = file_close;
+        return fopencookie(f, writing ? "w" : "r", io);
+}
+#elif defined(FILE_FUNOPEN)
+static int       file_funopen_read(void *, char *, int);
+static int       file_funopen_write(void *, const char *, int);
+static fpos_t    file_funopen_seek(void *, fpos_t, int);
+
+
+int
+file_funopen_read(void *cookie, char *out, int size)
+{
+        return (int)file_read(cookie, out, (size_t)size);
+}
+
+
+int
+file_funopen_write(void *cookie, const char *in, int size)
+{
+        return (int)file_write(cookie, in, (size_t)size);
+}
+
+
+fpos_t
+file_funopen_seek(void *cookie, fpos_t offset, int whence)
+{
+        off_t   pos = (off_t)offset;
+
+        if (-1 == file_seek(cookie, &pos, whence))
+                return -1;
+        return (fpos_t)pos;
+}
+
+
+FILE *
+file_stream(struct cbfile *f, int writing)
+{
+        if (writing)
+                return funopen(f, NULL, file_funopen_write,
+                               file_funopen_seek, file_close);
+        return funopen(f, file_funopen_read, NULL, file_funopen_seek,
+                       file_close);
+}
+#else
+FILE *
+file_stream(struct cbfile *f, int writing)
+{
+        (void)f;
+        (void)writing;
+        errno = ENOTSUP;
+        return NULL;
+}
+#endif
+
+
+/*
+ * Open an encrypted stream on a descriptor, which the stream takes
+ * over and closes along with itself. mode is "r" or "w", optionally
+ * with "b"; reading needs a regular file. Returns NULL, with errno
+ * set, on failure, in which case the descriptor is left open.
+ */
+FILE *
+cryptobox_fdopen(int fd, const char *mode, int type, unsigned char *key)
+{
+        struct cbfile   *f;
+        FILE            *fp;
+        int              writing;
+
+        if (NULL == mode || ('r' != mode[0] && 'w' != mode[0]) ||
+            (0 != mode[1] && 0 != strcmp(mode + 1, "b"))) {
+                errno = EINVAL;
+                return NULL;
+        }
+        writing = 'w' == mode[0];
+        if (NULL == (f = file_new(fd, type, key))) {
+                errno = EINVAL;
+                return NULL;
+        }
+        if (!(writing ? file_start_write(f) : file_start_read(f)))
+                goto fail;
+        if (NULL == (fp = file_stream(f, writing)))
+                goto fail;
+        setvbuf(fp, NULL, _IOFBF, f->chunk_size);
+        return fp;
+
+fail:
+        file_free(f);
+        return NULL;
+}
+
+
+/*
+ * Open the file at path as an encrypted stream of the given box type.
+ * Opening for writing creates or truncates the file, as fopen does.
+ */
+FILE *
+cryptobox_fopen(const char *path, const char *mode, int type,
+                unsigned char *key)
+{
+        FILE    *fp;
+        int      fd, saved;
+
+        if (NULL == mode || NULL == path) {
+                errno = EINVAL;
+                return NULL;
+        }
+        if ('w' == mode[0])
+                fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        else
+                fd = open(path, O_RDONLY);
+        if (-1 == fd)
+                return NULL;
+        if (NULL == (fp = cryptobox_fdopen(fd, mode, type, key))) {
+                saved = errno;
+                close(fd);
+                errno = saved;
+        }
+        return fp;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * HKDF (RFC 5869) over HMAC-SHA-256 and HMAC-SHA-384. The extract step
+ * leaves the pseudorandom key set up as an HMAC key, so that a caller
+ * deriving many keys from one secret, such as the tenant key cache,
+ * pays for the key pads once.
+ */
+
+
+#include <sys/types.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "hkdf.h"
+#include "hmac_sha2.h"
+#include <cryptobox/keycache.h>
+
+
+static int       hkdf_block(struct hkdf_prk *, unsigned char *, size_t,
+                            unsigned char *, size_t, unsigned char *, size_t,
+                            unsigned char, unsigned char *);
+
+
+/*
+ * Extract a pseudorandom key from ikm with the given hash, which is
+ * CRYPTOBOX_HKDF_SHA256 or CRYPTOBOX_HKDF_SHA384. A NULL or empty salt
+ * stands for a string of zeros as long as the hash. Returns 1 on
+ * success and 0 on failure.
+ */
+int
+hkdf_extract(struct hkdf_prk *prk, int hash, unsigned char *salt,
+             size_t saltlen, unsigned char *ikm, size_t ikmlen)
+{
+        unsigned char    zeros[SHA384_DIGEST_LENGTH];
+        unsigned char    out[SHA384_DIGEST_LENGTH];
+        int              res = 0;
+
+        memset(prk, 0x0, sizeof(struct hkdf_prk));
+        switch (hash) {
+        case CRYPTOBOX_HKDF_SHA256:
+                prk->hash_len = SHA256_DIGEST_LENGTH;
+                break;
+        case CRYPTOBOX_HKDF_SHA384:
+                prk->hash_len = SHA384_DIGEST_LENGTH;
+                break;
+        default:
+                return 0;
+        }
+        prk->hash = hash;
+        if (NULL == salt || 0 == saltlen) {
+                memset(zeros, 0x0, sizeof zeros);
+                salt = zeros;
+                saltlen = prk->hash_len;
+        }
+
+        if (CRYPTOBOX_HKDF_SHA256 == hash) {
+                if (hmac_sha256_init(&prk->key.sha256, salt, saltlen))
+                if (hmac_sha256(&prk->key.sha256, ikm, ikmlen, out))
+                if (hmac_sha256_init(&prk->key.sha256, out, prk->hash_len))
+                        res = 1;
+        } else {
+                if (hmac_sha384_init(&prk->key.sha384, salt, saltlen))
+                if (hmac_sha384(&prk->key.sha384, ikm, ikmlen, out))
+                if (hmac_sha384_init(&prk->key.sha384, out, prk->hash_len))
+                        res = 1;
+        }
+
+        memset(out, 0x0, sizeof out);
+        if (!res)
+                hkdf_zero(prk);
+        return res;
+}
+
+
+/*
+ * Compute one block of output, HMAC(PRK, prev | info | suffix | ctr).
+ * The info is given in two parts so that callers can put a fixed label
+ * in front of a variable one without copying them together.
+ */
+int
+hkdf_block(struct hkdf_prk *prk, unsigned char *prev, size_t prevlen,
+           unsigned char *info, size_t infolen, unsigned char *suffix,
+           size_t suffixlen, unsigned char ctr, unsigned char *out)
+{
+        SHA256_CTX      s256;
+        SHA512_CTX      s384;
+
+        if (CRYPTOBOX_HKDF_SHA256 == prk->hash) {
+                hmac_sha256_start(&prk->key.sha256, &s256);
+                if (SHA256_Update(&s256, prev, prevlen))
+                if (SHA256_Update(&s256, info, infolen))
+                if (SHA256_Update(&s256, suffix, suffixlen))
+                if (SHA256_Update(&s256, &ctr, 1))
+                        return hmac_sha256_finish(&prk->key.sha256, &s256,
+                                                  out);
+                memset(&s256, 0x0, sizeof s256);
+                return 0;
+        }
+
+        hmac_sha384_start(&prk->key.sha384, &s384);
+        if (SHA384_Update(&s384, prev, prevlen))
+        if (SHA384_Update(&s384, info, infolen))
+        if (SHA384_Update(&s384, suffix, suffixlen))
+        if (SHA384_Update(&s384, &ctr, 1))
+                return hmac_sha384_finish(&prk->key.sha384, &s384, out);
+        memset(&s384, 0x0, sizeof s384);
+        return 0;
+}
+
+
+/*
+ * Expand outlen bytes of key material from a pseudorandom key, with
+ * info followed by suffix as the context string; either may be NULL if
+ * its length is 0. At most 255 blocks of the hash may be produced.
+ * Returns 1 on success and 0 on failure.
+ */
+int
+hkdf_expand(struct hkdf_prk *prk, unsigned char *info, size_t infolen,
+            unsigned char *suffix, size_t suffixlen, unsigned char *out,
+            size_t outlen)
+{
+        unsigned char    block[SHA384_DIGEST_LENGTH];
+        size_t           n, prevlen = 0;
+        unsigned char    ctr = 0;
+        int              res = 1;
+
+        if (outlen > 255 * prk->hash_len)
+                return 0;
+        while (res && outlen > 0) {
+                ctr++;
+                res = hkdf_block(prk, block, prevlen, info, infolen, suffix,
+                                 suffixlen, ctr, block);
+                prevlen = prk->hash_len;
+                n = outlen < prevlen ? outlen : prevlen;
+                memcpy(out, block, n);
+                out += n;
+                outlen -= n;
+        }
+        memset(block, 0x0, sizeof block);
+        return res;
+}
+
+
+/*
+ * Wipe a pseudorandom key.
+ */
+void
+hkdf_zero(struct hkdf_prk *prk)
+{
+        memset(prk, 0x0, sizeof(struct hkdf_prk));
+}
+
+
+/*
+ * Derive outlen bytes from ikm with HKDF, in one call.
+ */
+int
+cryptobox_hkdf(int hash, unsigned char *salt, size_t saltlen,
+               unsigned char *ikm, size_t ikmlen, unsigned char *info,
+               size_t infolen, unsigned char *out, size_t outlen)
+{
+        struct hkdf_prk  prk;
+        int              res = 0;
+
+        if (NULL == out || (NULL == ikm && ikmlen > 0) ||
+            (NULL == info && infolen > 0))
+                return 0;
+        if (hkdf_extract(&prk, hash, salt, saltlen, ikm, ikmlen)) {
+                res = hkdf_expand(&prk, info, infolen, NULL, 0, out, outlen);
+                hkdf_zero(&prk);
+        }
+        if (!res)
+                memset(out, 0x0, outlen);
+        return res;
+}
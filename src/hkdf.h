@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __HKDF_H__
+#define __HKDF_H__
+
+#include <sys/types.h>
+
+#include "hmac_sha2.h"
+
+
+/*
+ * An HKDF pseudorandom key, held as the HMAC key it is used as, so that
+ * expanding many keys from it costs no key setup.
+ */
+struct hkdf_prk {
+        int                      hash;
+        size_t                   hash_len;
+        union {
+                struct hmac_sha256       sha256;
+                struct hmac_sha384       sha384;
+        }                        key;
+};
+
+
+int     hkdf_extract(struct hkdf_prk *, int, unsigned char *, size_t,
+                     unsigned char *, size_t);
+int     hkdf_expand(struct hkdf_prk *, unsigned char *, size_t,
+                    unsigned char *, size_t, unsigned char *, size_t);
+void    hkdf_zero(struct hkdf_prk *);
+
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * HMAC-SHA-256 and HMAC-SHA-384 (RFC 2104) built directly on the
+ * libcrypto SHA-2 block functions. The generic HMAC() interface
+ * rebuilds the key pads and looks up the digest on every call; here
+ * the pads are absorbed once, when the key is set up, and each tag
+ * costs only the message blocks plus one block for the outer hash.
+ * The compression functions are libcrypto's, which select the SHA
+ * extensions, AVX2 or SSSE3 code paths at runtime as the CPU allows.
+ */
+
+
+#include <sys/types.h>
+#include <string.h>
+#include <openssl/sha.h>
+
+#include "hmac_sha2.h"
+
+
+#define HMAC_IPAD       0x36
+#define HMAC_OPAD       0x5c
+
+
+/*
+ * Set up an HMAC-SHA-256 key. Keys longer than the block size are
+ * hashed first, as RFC 2104 requires. Returns 1 on success and 0 on
+ * failure.
+ */
+int
+hmac_sha256_init(struct hmac_sha256 *hkey, unsigned char *key, size_t keylen)
+{
+        unsigned char    pad[SHA256_CBLOCK];
+        unsigned char    kh[SHA256_DIGEST_LENGTH];
+        size_t           i;
+        int              res = 0;
+
+        if (keylen > SHA256_CBLOCK) {
+                if (NULL == SHA256(key, keylen, kh))
+                        return 0;
+                key = kh;
+                keylen = SHA256_DIGEST_LENGTH;
+        }
+
+        memset(pad, HMAC_IPAD, SHA256_CBLOCK);
+        for (i = 0; i < keylen; i++)
+                pad[i] ^= key[i];
+        if (SHA256_Init(&hkey->inner))
+        if (SHA256_Update(&hkey->inner, pad, SHA256_CBLOCK)) {
+                memset(pad, HMAC_OPAD, SHA256_CBLOCK);
+                for (i = 0; i < keylen; i++)
+                        pad[i] ^= key[i];
+                if (SHA256_Init(&hkey->outer))
+                if (SHA256_Update(&hkey->outer, pad, SHA256_CBLOCK))
+                        res = 1;
+        }
+
+        memset(pad, 0x0, SHA256_CBLOCK);
+        memset(kh, 0x0, SHA256_DIGEST_LENGTH);
+        return res;
+}
+
+
+/*
+ * Begin a tag computation by copying the inner midstate into state;
+ * the caller feeds the message with SHA256_Update.
+ */
+void
+hmac_sha256_start(struct hmac_sha256 *hkey, SHA256_CTX *state)
+{
+        memcpy(state, &hkey->inner, sizeof(SHA256_CTX));
+}
+
+
+/*
+ * Finish a tag computation started with hmac_sha256_start, writing
+ * SHA256_DIGEST_LENGTH bytes to tag. The state is wiped.
+ */
+int
+hmac_sha256_finish(struct hmac_sha256 *hkey, SHA256_CTX *state,
+                   unsigned char *tag)
+{
+        unsigned char    ihash[SHA256_DIGEST_LENGTH];
+        int              res = 0;
+
+        if (SHA256_Final(ihash, state)) {
+                memcpy(state, &hkey->outer, sizeof(SHA256_CTX));
+                if (SHA256_Update(state, ihash, SHA256_DIGEST_LENGTH))
+                if (SHA256_Final(tag, state))
+                        res = 1;
+        }
+        memset(ihash, 0x0, SHA256_DIGEST_LENGTH);
+        memset(state, 0x0, sizeof(SHA256_CTX));
+        return res;
+}
+
+
+/*
+ * Compute the tag for a single buffer.
+ */
+int
+hmac_sha256(struct hmac_sha256 *hkey, unsigned char *in, size_t inlen,
+            unsigned char *tag)
+{
+        SHA256_CTX      state;
+
+        hmac_sha256_start(hkey, &state);
+        if (!SHA256_Update(&state, in, inlen)) {
+                memset(&state, 0x0, sizeof(SHA256_CTX));
+                return 0;
+        }
+        return hmac_sha256_finish(hkey, &state, tag);
+}
+
+
+/*
+ * Wipe a key.
+ */
+void
+hmac_sha256_zero(struct hmac_sha256 *hkey)
+{
+        memset(hkey, 0x0, sizeof(struct hmac_sha256));
+}
+
+
+/*
+ * Set up an HMAC-SHA-384 key. Keys longer than the block size are
+ * hashed first, as RFC 2104 requires. Returns 1 on success and 0 on
+ * failure.
+ */
+int
+hmac_sha384_init(struct hmac_sha384 *hkey, unsigned char *key, size_t keylen)
+{
+        unsigned char    pad[SHA512_CBLOCK];
+        unsigned char    kh[SHA384_DIGEST_LENGTH];
+        size_t           i;
+        int              res = 0;
+
+        if (keylen > SHA512_CBLOCK) {
+                if (NULL == SHA384(key, keylen, kh))
+                        return 0;
+                key = kh;
+                keylen = SHA384_DIGEST_LENGTH;
+        }
+
+        memset(pad, HMAC_IPAD, SHA512_CBLOCK);
+        for (i = 0; i < keylen; i++)
+                pad[i] ^= key[i];
+        if (SHA384_Init(&hkey->inner))
+        if (SHA384_Update(&hkey->inner, pad, SHA512_CBLOCK)) {
+                memset(pad, HMAC_OPAD, SHA512_CBLOCK);
+                for (i = 0; i < keylen; i++)
+                        pad[i] ^= key[i];
+                if (SHA384_Init(&hkey->outer))
+                if (SHA384_Update(&hkey->outer, pad, SHA512_CBLOCK))
+                        res = 1;
+        }
+
+        memset(pad, 0x0, SHA512_CBLOCK);
+        memset(kh, 0x0, SHA384_DIGEST_LENGTH);
+        return res;
+}
+
+
+/*
+ * Begin a tag computation by copying the inner midstate into state;
+ * the caller feeds the message with SHA384_Update.
+ */
+void
+hmac_sha384_start(struct hmac_sha384 *hkey, SHA512_CTX *state)
+{
+        memcpy(state, &hkey->inner, sizeof(SHA512_CTX));
+}
+
+
+/*
+ * Finish a tag computation started with hmac_sha384_start, writing
+ * SHA384_DIGEST_LENGTH bytes to tag. The state is wiped.
+ */
+int
+hmac_sha384_finish(struct hmac_sha384 *hkey, SHA512_CTX *state,
+                   unsigned char *tag)
+{
+        unsigned char    ihash[SHA384_DIGEST_LENGTH];
+        int              res = 0;
+
+        if (SHA384_Final(ihash, state)) {
+                memcpy(state, &hkey->outer, sizeof(SHA512_CTX));
+                if (SHA384_Update(state, ihash, SHA384_DIGEST_LENGTH))
+                if (SHA384_Final(tag, state))
+                        res = 1;
+        }
+        memset(ihash, 0x0, SHA384_DIGEST_LENGTH);
+        memset(state, 0x0, sizeof(SHA512_CTX));
+        return res;
+}
+
+
+/*
+ * Compute the tag for a single buffer.
+ */
+int
+hmac_sha384(struct hmac_sha384 *hkey, unsigned char *in, size_t inlen,
+            unsigned char *tag)
+{
+        SHA512_CTX      state;
+
+        hmac_sha384_start(hkey, &state);
+        if (!SHA384_Update(&state, in, inlen)) {
+                memset(&state, 0x0, sizeof(SHA512_CTX));
+                return 0;
+        }
+        return hmac_sha384_finish(hkey, &state, tag);
+}
+
+
+/*
+ * Wipe a key.
+ */
+void
+hmac_sha384_zero(struct hmac_sha384 *hkey)
+{
+        memset(hkey, 0x0, sizeof(struct hmac_sha384));
+}
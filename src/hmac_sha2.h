@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __HMAC_SHA2_H__
+#define __HMAC_SHA2_H__
+
+#include <sys/types.h>
+#include <openssl/sha.h>
+
+
+/*
+ * An HMAC key, stored as the SHA-2 states left after absorbing the
+ * inner and outer key pads. Computing a tag starts from a copy of
+ * these midstates, so the pads are only hashed once per key. A key
+ * is never modified after initialisation and may be shared between
+ * threads.
+ */
+struct hmac_sha256 {
+        SHA256_CTX      inner;
+        SHA256_CTX      outer;
+};
+
+struct hmac_sha384 {
+        SHA512_CTX      inner;
+        SHA512_CTX      outer;
+};
+
+
+int     hmac_sha256_init(struct hmac_sha256 *, unsigned char *, size_t);
+void    hmac_sha256_start(struct hmac_sha256 *, SHA256_CTX *);
+int     hmac_sha256_finish(struct hmac_sha256 *, SHA256_CTX *,
+                           unsigned char *);
+int     hmac_sha256(struct hmac_sha256 *, unsigned char *, size_t,
+                    unsigned char *);
+void    hmac_sha256_zero(struct hmac_sha256 *);
+
+int     hmac_sha384_init(struct hmac_sha384 *, unsigned char *, size_t);
+void    hmac_sha384_start(struct hmac_sha384 *, SHA512_CTX *);
+int     hmac_sha384_finish(struct hmac_sha384 *, SHA512_CTX *,
+                           unsigned char *);
+int     hmac_sha384(struct hmac_sha384 *, unsigned char *, size_t,
+                    unsigned char *);
+void    hmac_sha384_zero(struct hmac_sha384 *);
+
+
+#endif
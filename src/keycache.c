@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * A cache of ready-to-use box contexts for many tenants, each with a
+ * key derived from one master key. Deriving a key and setting up a
+ * context (the AES key schedule and the HMAC pads) costs far more than
+ * sealing a small message, so the contexts of recently used tenants
+ * are kept, up to a fixed number, and the least recently used one is
+ * dropped to make room for another.
+ *
+ * The cache is split into shards, each a hash table with its own LRU
+ * list and lock, chosen by the tenant ID's hash, so that lookups for
+ * different tenants rarely contend. The hash is keyed with a random
+ * seed, so that tenant IDs cannot be chosen to pile into one shard.
+ * An entry handed out by cryptobox_keycache_get is counted as in use;
+ * if it is evicted while in use it is unlinked at once but freed only
+ * when the last user puts it back. Freeing an entry frees its context,
+ * which wipes the key material.
+ */
+
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/rand.h>
+
+#include "box.h"
+#include "hkdf.h"
+#include <cryptobox/keycache.h>
+
+
+#define KEYCACHE_CACHE_LINE     64
+#define KEYCACHE_MAX_KEY        80
+
+
+/*
+ * The HKDF context string for a tenant is the box type's label
+ * followed by the tenant ID.
+ */
+static const char       keycache_secretbox_label[] =
+                        "cryptobox-tenant-secretbox:";
+static const char       keycache_strongbox_label[] =
+                        "cryptobox-tenant-strongbox:";
+
+
+struct cryptobox_tenant {
+        struct cryptobox_tenant *chain;
+        struct cryptobox_tenant *newer;
+        struct cryptobox_tenant *older;
+        struct keycache_shard   *shard;
+        void                    *ctx;
+        uint64_t                 hash;
+        int                      refs;
+        int                      cached;
+        size_t                   idlen;
+        unsigned char            id[];
+};
+
+
+/*
+ * A shard is padded out to a cache line of its own, so that threads
+ * working in neighbouring shards do not share lines.
+ */
+struct keycache_shard {
+        pthread_mutex_t          lock;
+        struct cryptobox_tenant **buckets;
+        size_t                   mask;
+        struct cryptobox_tenant *newest;
+        struct cryptobox_tenant *oldest;
+        size_t                   count;
+        size_t                   capacity;
+        uint64_t                 hits;
+        uint64_t                 misses;
+        uint64_t                 evictions;
+        char                     pad[KEYCACHE_CACHE_LINE];
+};
+
+
+struct cryptobox_keycache {
+        const struct box_ops    *ops;
+        struct hkdf_prk          prk;
+        unsigned char           *label;
+        size_t                   label_len;
+        uint64_t                 seed;
+        struct keycache_shard   *shards;
+        int                      nshards;
+};
+
+
+static uint64_t                  keycache_hash(struct cryptobox_keycache *,
+                                               unsigned char *, size_t);
+static struct cryptobox_tenant  *keycache_find(struct keycache_shard *,
+                                               uint64_t, unsigned char *,
+                                               size_t);
+static void                      keycache_unlink(struct keycache_shard *,
+                                                 struct cryptobox_tenant *);
+static void                      keycache_touch(struct keycache_shard *,
+                                                struct cryptobox_tenant *);
+static struct cryptobox_tenant  *keycache_entry_new(struct cryptobox_keycache *,
+                                                    unsigned char *, size_t,
+                                                    uint64_t);
+static void                      keycache_entry_free(
+                                    struct cryptobox_keycache *,
+                                    struct cryptobox_tenant *);
+
+
+/*
+ * Hash a tenant ID with FNV-1a from a seeded basis, followed by a
+ * 64-bit finaliser to spread the bits used to pick the shard and the
+ * bucket.
+ */
+uint64_t
+keycache_hash(struct cryptobox_keycache *c, unsigned char *id, size_t idlen)
+{
+        uint64_t        h = 0xcbf29ce484222325ULL ^ c->seed;
+        size_t          i;
+
+        for (i = 0; i < idlen; i++) {
+                h ^= id[i];
+                h *= 0x100000001b3ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+}
+
+
+/*
+ * Look a tenant up in a shard, whose lock must be held.
+ */
+struct cryptobox_tenant *
+keycache_find(struct keycache_shard *shard, uint64_t hash, unsigned char *id,
+              size_t idlen)
+{
+        struct cryptobox_tenant *t;
+
+        t = shard->buckets[hash & shard->mask];
+        for (; NULL != t; t = t->chain)
+                if (hash == t->hash && idlen == t->idlen &&
+                    0 == memcmp(id, t->id, idlen))
+                        return t;
+        return NULL;
+}
+
+
+/*
+ * Take an entry out of its shard's table and LRU list.
+ */
+void
+keycache_unlink(struct keycache_shard *shard, struct cryptobox_tenant *t)
+{
+        struct cryptobox_tenant **pp;
+
+        pp = &shard->buckets[t->hash & shard->mask];
+        while (*pp != t)
+                pp = &(*pp)->chain;
+        *pp = t->chain;
+
+        if (NULL != t->newer)
+                t->newer->older = t->older;
+        else
+                shard->newest = t->older;
+        if (NULL != t->older)
+                t->older->newer = t->newer;
+        else
+                shard->oldest = t->newer;
+        t->chain = t->newer = t->older = NULL;
+        t->cached = 0;
+        shard->count--;
+}
+
+
+/*
+ * Move an entry to the front of its shard's LRU list.
+ */
+void
+keycache_touch(struct keycache_shard *shard, struct cryptobox_tenant *t)
+{
+        if (shard->newest == t)
+                return;
+        t->newer->older = t->older;
+        if (NULL != t->older)
+                t->older->newer = t->newer;
+        else
+                shard->oldest = t->newer;
+        t->newer = NULL;
+        t->older = shard->newest;
+        shard->newest->newer = t;
+        shard->newest = t;
+}
+
+
+/*
+ * Derive a tenant's key and set up a context for it. No lock is held
+ * while this runs.
+ */
+struct cryptobox_tenant *
+keycache_entry_new(struct cryptobox_keycache *c, unsigned char *id,
+                   size_t idlen, uint64_t hash)
+{
+        struct cryptobox_tenant *t;
+        unsigned char            key[KEYCACHE_MAX_KEY];
+
+        if (NULL == (t = box_malloc(sizeof(struct cryptobox_tenant) + idlen)))
+                return NULL;
+        memset(t, 0x0, sizeof(struct cryptobox_tenant));
+        if (cryptobox_keycache_derive(c, id, idlen, key))
+                t->ctx = c->ops->ctx_new(key);
+        memset(key, 0x0, sizeof key);
+        if (NULL == t->ctx) {
+                box_free(t);
+                return NULL;
+        }
+        memcpy(t->id, id, idlen);
+        t->idlen = idlen;
+        t->hash = hash;
+        t->refs = 1;
+        return t;
+}
+
+
+void
+keycache_entry_free(struct cryptobox_keycache *c, struct cryptobox_tenant *t)
+{
+        c->ops->ctx_free(t->ctx);
+        memset(t->id, 0x0, t->idlen);
+        box_free(t);
+}
+
+
+/*
+ * Set up a cache of contexts of the given box type for tenant keys
+ * derived from master, holding at most capacity contexts spread over
+ * shards shards, or CRYPTOBOX_KEYCACHE_SHARDS if it is 0; the number of
+ * shards is rounded up to a power of two. Returns NULL on failure.
+ */
+struct cryptobox_keycache *
+cryptobox_keycache_new(int type, unsigned char *master, size_t master_len,
+                       size_t capacity, int shards)
+{
+        struct cryptobox_keycache       *c;
+        struct keycache_shard           *shard;
+        const struct box_ops            *ops;
+        size_t                           per, nbuckets;
+        int                              hash, n, i;
+
+        if (NULL == (ops = box_ops_lookup(type)) || NULL == master ||
+            0 == master_len || 0 == capacity || shards < 0)
+                return NULL;
+        if (0 == shards)
+                shards = CRYPTOBOX_KEYCACHE_SHARDS;
+        for (n = 1; n < shards && n < 65536; n <<= 1)
+                ;
+        if ((size_t)n > capacity)
+                for (n = 1; (size_t)n * 2 <= capacity; n <<= 1)
+                        ;
+        per = (capacity + (size_t)n - 1) / (size_t)n;
+        for (nbuckets = 1; nbuckets < per; nbuckets <<= 1)
+                ;
+
+        if (NULL == (c = box_malloc(sizeof(struct cryptobox_keycache))))
+                return NULL;
+        memset(c, 0x0, sizeof(struct cryptobox_keycache));
+        c->ops = ops;
+        if (CRYPTOBOX_SECRETBOX == type) {
+                hash = CRYPTOBOX_HKDF_SHA256;
+                c->label = (unsigned char *)keycache_secretbox_label;
+                c->label_len = sizeof keycache_secretbox_label - 1;
+        } else {
+                hash = CRYPTOBOX_HKDF_SHA384;
+                c->label = (unsigned char *)keycache_strongbox_label;
+                c->label_len = sizeof keycache_strongbox_label - 1;
+        }
+        if (!hkdf_extract(&c->prk, hash, NULL, 0, master, master_len) ||
+            !RAND_bytes((unsigned char *)&c->seed, sizeof c->seed)) {
+                cryptobox_keycache_free(c);
+                return NULL;
+        }
+
+        c->shards = box_malloc((size_t)n * sizeof(struct keycache_shard));
+        if (NULL == c->shards) {
+                cryptobox_keycache_free(c);
+                return NULL;
+        }
+        memset(c->shards, 0x0, (size_t)n * sizeof(struct keycache_shard));
+        for (i = 0; i < n; i++) {
+                shard = &c->shards[i];
+                shard->capacity = per;
+                shard->mask = nbuckets - 1;
+                shard->buckets = box_malloc(nbuckets *
+                                            sizeof(struct cryptobox_tenant *));
+                if (NULL == shard->buckets) {
+                        cryptobox_keycache_free(c);
+                        return NULL;
+                }
+                memset(shard->buckets, 0x0,
+                       nbuckets * sizeof(struct cryptobox_tenant *));
+                pthread_mutex_init(&shard->lock, NULL);
+                c->nshards = i + 1;
+        }
+        return c;
+}
+
+
+/*
+ * Release a cache and every context in it, wiping the key material. No
+ * entry may still be in use.
+ */
+void
+cryptobox_keycache_free(struct cryptobox_keycache *c)
+{
+        struct keycache_shard   *shard;
+        struct cryptobox_tenant *t;
+        int                      i;
+
+        if (NULL == c)
+                return;
+        for (i = 0; i < c->nshards; i++) {
+                shard = &c->shards[i];
+                while (NULL != (t = shard->oldest)) {
+                        keycache_unlink(shard, t);
+                        keycache_entry_free(c, t);
+                }
+                pthread_mutex_destroy(&shard->lock);
+                box_free(shard->buckets);
+        }
+        box_free(c->shards);
+        hkdf_zero(&c->prk);
+        box_free(c);
+}
+
+
+/*
+ * Derive a tenant's key into key, which must hold the box type's key
+ * size, without touching the cache. This is the key the tenant's
+ * cached context uses: HKDF over the master key, with no salt, the
+ * type's label followed by the tenant ID as the context string, and
+ * SHA-256 for secretbox or SHA-384 for strongbox.
+ */
+int
+cryptobox_keycache_derive(struct cryptobox_keycache *c, unsigned char *id,
+                          size_t idlen, unsigned char *key)
+{
+        if (NULL == c || NULL == id || 0 == idlen ||
+            idlen > CRYPTOBOX_KEYCACHE_MAX_ID || NULL == key)
+                return 0;
+        return hkdf_expand(&c->prk, c->label, c->label_len, id, idlen, key,
+                           c->ops->key_size);
+}
+
+
+/*
+ * Find or set up the context for a tenant, marking it in use until it
+ * is returned with cryptobox_keycache_put. On a miss the key is
+ * derived with the shard unlocked, so other lookups in the shard carry
+ * on meanwhile; if another thread set the same tenant up first, its
+ * entry is used and this one dropped. Returns NULL on failure.
+ */
+struct cryptobox_tenant *
+cryptobox_keycache_get(struct cryptobox_keycache *c, unsigned char *id,
+                       size_t idlen)
+{
+        struct keycache_shard   *shard;
+        struct cryptobox_tenant *t, *fresh, *victim, *dead = NULL;
+        uint64_t                 hash;
+
+        if (NULL == c || NULL == id || 0 == idlen ||
+            idlen > CRYPTOBOX_KEYCACHE_MAX_ID)
+                return NULL;
+        hash = keycache_hash(c, id, idlen);
+        shard = &c->shards[(hash >> 32) & (uint64_t)(c->nshards - 1)];
+
+        pthread_mutex_lock(&shard->lock);
+        if (NULL != (t = keycache_find(shard, hash, id, idlen))) {
+                t->refs++;
+                shard->hits++;
+                keycache_touch(shard, t);
+                pthread_mutex_unlock(&shard->lock);
+                return t;
+        }
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+
+        if (NULL == (fresh = keycache_entry_new(c, id, idlen, hash)))
+                return NULL;
+        fresh->shard = shard;
+
+        pthread_mutex_lock(&shard->lock);
+        if (NULL != (t = keycache_find(shard, hash, id, idlen))) {
+                t->refs++;
+                keycache_touch(shard, t);
+                pthread_mutex_unlock(&shard->lock);
+                keycache_entry_free(c, fresh);
+                return t;
+        }
+        fresh->chain = shard->buckets[hash & shard->mask];
+        shard->buckets[hash & shard->mask] = fresh;
+        fresh->older = shard->newest;
+        if (NULL != shard->newest)
+                shard->newest->newer = fresh;
+        else
+                shard->oldest = fresh;
+        shard->newest = fresh;
+        fresh->cached = 1;
+        shard->count++;
+
+        while (shard->count > shard->capacity) {
+                victim = shard->oldest;
+                keycache_unlink(shard, victim);
+                shard->evictions++;
+                if (0 == victim->refs) {
+                        victim->chain = dead;
+                        dead = victim;
+                }
+        }
+        pthread_mutex_unlock(&shard->lock);
+
+        while (NULL != (victim = dead)) {
+                dead = victim->chain;
+                keycache_entry_free(c, victim);
+        }
+        return fresh;
+}
+
+
+/*
+ * Return an entry taken with cryptobox_keycache_get. The entry, and the
+ * context it holds, must not be used afterwards.
+ */
+void
+cryptobox_keycache_put(struct cryptobox_keycache *c, struct cryptobox_tenant *t)
+{
+        struct keycache_shard   *shard;
+        int                      dead;
+
+        if (NULL == c || NULL == t)
+                return;
+        shard = t->shard;
+        pthread_mutex_lock(&shard->lock);
+        t->refs--;
+        dead = !t->cached && 0 == t->refs;
+        pthread_mutex_unlock(&shard->lock);
+        if (dead)
+                keycache_entry_free(c, t);
+}
+
+
+/*
+ * Return the context held by an entry: a struct secretbox_ctx or a
+ * struct strongbox_ctx, as the cache's box type.
+ */
+void *
+cryptobox_keycache_ctx(struct cryptobox_tenant *t)
+{
+        if (NULL == t)
+                return NULL;
+        return t->ctx;
+}
+
+
+/*
+ * Seal a message for a tenant, as the box type's ctx_seal does.
+ */
+unsigned char *
+cryptobox_keycache_seal(struct cryptobox_keycache *c, unsigned char *id,
+                        size_t idlen, unsigned char *m, int mlen, int *blen)
+{
+        struct cryptobox_tenant *t;
+        unsigned char           *box;
+
+        if (NULL == (t = cryptobox_keycache_get(c, id, idlen)))
+                return NULL;
+        box = c->ops->ctx_seal(t->ctx, m, mlen, blen);
+        cryptobox_keycache_put(c, t);
+        return box;
+}
+
+
+/*
+ * Open a box for a tenant, as the box type's ctx_open does.
+ */
+unsigned char *
+cryptobox_keycache_open(struct cryptobox_keycache *c, unsigned char *id,
+                        size_t idlen, unsigned char *box, int blen)
+{
+        struct cryptobox_tenant *t;
+        unsigned char           *m;
+
+        if (NULL == (t = cryptobox_keycache_get(c, id, idlen)))
+                return NULL;
+        m = c->ops->ctx_open(t->ctx, box, blen);
+        cryptobox_keycache_put(c, t);
+        return m;
+}
+
+
+/*
+ * Report the number of lookups that found a cached context, the number
+ * that had to set one up, and the number of contexts evicted.
+ */
+void
+cryptobox_keycache_stats(struct cryptobox_keycache *c, uint64_t *hits,
+                         uint64_t *misses, uint64_t *evictions)
+{
+        struct keycache_shard   *shard;
+        uint64_t                 h = 0, m = 0, e = 0;
+        int                      i;
+
+        for (i = 0; NULL != c && i < c->nshards; i++) {
+                shard = &c->shards[i];
+                pthread_mutex_lock(&shard->lock);
+                h += shard->hits;
+                m += shard->misses;
+                e += shard->evictions;
+                pthread_mutex_unlock(&shard->lock);
+        }
+        if (NULL != hits)
+                *hits = h;
+        if (NULL != misses)
+                *misses = m;
+        if (NULL != evictions)
+                *evictions = e;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Precomputed CTR key stream for low-latency sealing. A keystream
+ * holds a ring of slots, each with a fresh random IV and the first
+ * max_len bytes of the key stream for it. Slots are filled by
+ * keystream_refill, which the application calls when it is idle or
+ * from a thread of its own; a seal that finds a ready slot only has to
+ * XOR the message into the box. Each slot moves from empty to filling
+ * to ready to taken and back to empty, and only one thread can win
+ * each transition, so every IV is used for exactly one box.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "keystream.h"
+
+
+#define KS_EMPTY        0
+#define KS_FILLING      1
+#define KS_READY        2
+#define KS_TAKEN        3
+
+
+struct keystream_slot {
+        int                      state;
+        unsigned char           *iv;
+        unsigned char           *stream;
+};
+
+struct keystream {
+        struct box_allocator     mem;
+        struct keystream_slot   *slots;
+        unsigned char           *buf;
+        int                      depth;
+        size_t                   max_len;
+        size_t                   iv_size;
+        unsigned int             next;
+        uint64_t                 hits;
+        uint64_t                 misses;
+};
+
+
+static int       keystream_fill(struct keystream_slot *, size_t, size_t,
+                                const EVP_CIPHER *, unsigned char *);
+
+
+/*
+ * Set up depth slots of max_len bytes of key stream each, allocated
+ * with mem. The slots start out empty. Returns NULL on failure.
+ */
+struct keystream *
+keystream_new(const struct box_allocator *mem, int depth, size_t max_len,
+              size_t iv_size)
+{
+        struct keystream        *ks;
+        size_t                   slot_size;
+        int                      i;
+
+        if (depth <= 0 || 0 == max_len || max_len > SIZE_MAX - iv_size)
+                return NULL;
+        slot_size = iv_size + max_len;
+        if ((size_t)depth > SIZE_MAX / slot_size ||
+            (size_t)depth > SIZE_MAX / sizeof(struct keystream_slot))
+                return NULL;
+        if (NULL == (ks = box_alloc(mem, sizeof(struct keystream))))
+                return NULL;
+        memset(ks, 0, sizeof(struct keystream));
+        memcpy(&ks->mem, mem, sizeof(struct box_allocator));
+        ks->depth = depth;
+        ks->max_len = max_len;
+        ks->iv_size = iv_size;
+        ks->slots = box_alloc(mem, depth * sizeof(struct keystream_slot));
+        ks->buf = box_alloc(mem, depth * slot_size);
+        if (NULL == ks->slots || NULL == ks->buf) {
+                keystream_free(ks);
+                return NULL;
+        }
+        for (i = 0; i < depth; i++) {
+                ks->slots[i].state = KS_EMPTY;
+                ks->slots[i].iv = ks->buf + i * slot_size;
+                ks->slots[i].stream = ks->slots[i].iv + iv_size;
+        }
+        return ks;
+}
+
+
+/*
+ * Wipe and release a keystream. No other thread may be using it.
+ */
+void
+keystream_free(struct keystream *ks)
+{
+        struct box_allocator    mem;
+
+        if (NULL == ks)
+                return;
+        memcpy(&mem, &ks->mem, sizeof(struct box_allocator));
+        if (NULL != ks->buf)
+                box_release(&mem, ks->buf,
+                            ks->depth * (ks->iv_size + ks->max_len));
+        if (NULL != ks->slots)
+                box_release(&mem, ks->slots,
+                            ks->depth * sizeof(struct keystream_slot));
+        box_release(&mem, ks, sizeof(struct keystream));
+}
+
+
+/*
+ * Pick a new IV for a slot and compute its key stream by encrypting
+ * zeros in CTR mode.
+ */
+int
+keystream_fill(struct keystream_slot *slot, size_t iv_size, size_t max_len,
+               const EVP_CIPHER *cipher, unsigned char *key)
+{
+        EVP_CIPHER_CTX   crypt;
+        int              outlen = 0;
+        int              res = 0;
+
+        if (!RAND_bytes(slot->iv, iv_size))
+                return 0;
+        memset(slot->stream, 0, max_len);
+        EVP_CIPHER_CTX_init(&crypt);
+        if (EVP_EncryptInit_ex(&crypt, cipher, NULL, key, slot->iv))
+        if (EVP_EncryptUpdate(&crypt, slot->stream, &outlen, slot->stream,
+                              (int)max_len))
+        if (outlen == (int)max_len)
+                res = 1;
+        EVP_CIPHER_CTX_cleanup(&crypt);
+        return res;
+}
+
+
+/*
+ * Fill every empty slot. Returns the number of slots filled.
+ */
+int
+keystream_refill(struct keystream *ks, const EVP_CIPHER *cipher,
+                 unsigned char *key)
+{
+        struct keystream_slot   *slot;
+        int                      expected;
+        int                      filled = 0;
+        int                      i;
+
+        for (i = 0; i < ks->depth; i++) {
+                slot = &ks->slots[i];
+                expected = KS_EMPTY;
+                if (!__atomic_compare_exchange_n(&slot->state, &expected,
+                    KS_FILLING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                        continue;
+                if (!keystream_fill(slot, ks->iv_size, ks->max_len, cipher,
+                                    key)) {
+                        memset(slot->iv, 0, ks->iv_size + ks->max_len);
+                        __atomic_store_n(&slot->state, KS_EMPTY,
+                                         __ATOMIC_RELEASE);
+                        break;
+                }
+                __atomic_store_n(&slot->state, KS_READY, __ATOMIC_RELEASE);
+                filled++;
+        }
+        return filled;
+}
+
+
+/*
+ * Encrypt a message of up to max_len bytes with a ready slot, writing
+ * the IV and ciphertext to out. The part of the key stream that was
+ * used is wiped. Returns 1 on a hit, and 0 if the message is too long
+ * or no slot is ready, in which case the caller encrypts as usual.
+ */
+int
+keystream_seal(struct keystream *ks, unsigned char *m, size_t mlen,
+               unsigned char *out)
+{
+        struct keystream_slot   *slot;
+        unsigned char           *ct = out + ks->iv_size;
+        unsigned int             start;
+        size_t                   j;
+        int                      expected;
+        int                      i;
+
+        if (mlen > ks->max_len) {
+                __atomic_add_fetch(&ks->misses, 1, __ATOMIC_RELAXED);
+                return 0;
+        }
+
+        start = __atomic_fetch_add(&ks->next, 1, __ATOMIC_RELAXED);
+        for (i = 0; i < ks->depth; i++) {
+                slot = &ks->slots[(start + (unsigned int)i) %
+                                  (unsigned int)ks->depth];
+                expected = KS_READY;
+                if (!__atomic_compare_exchange_n(&slot->state, &expected,
+                    KS_TAKEN, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                        continue;
+                memcpy(out, slot->iv, ks->iv_size);
+                for (j = 0; j < mlen; j++)
+                        ct[j] = m[j] ^ slot->stream[j];
+                memset(slot->stream, 0, mlen);
+                __atomic_store_n(&slot->state, KS_EMPTY, __ATOMIC_RELEASE);
+                __atomic_add_fetch(&ks->hits, 1, __ATOMIC_RELAXED);
+                return 1;
+        }
+        __atomic_add_fetch(&ks->misses, 1, __ATOMIC_RELAXED);
+        return 0;
+}
+
+
+void
+keystream_stats(struct keystream *ks, uint64_t *hits, uint64_t *misses)
+{
+        if (NULL != hits)
+                *hits = __atomic_load_n(&ks->hits, __ATOMIC_RELAXED);
+        if (NULL != misses)
+                *misses = __atomic_load_n(&ks->misses, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __KEYSTREAM_H__
+#define __KEYSTREAM_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+#include "box.h"
+
+
+struct keystream;
+
+
+struct keystream *keystream_new(const struct box_allocator *, int, size_t,
+                                size_t);
+void             keystream_free(struct keystream *);
+int              keystream_refill(struct keystream *, const EVP_CIPHER *,
+                                  unsigned char *);
+int              keystream_seal(struct keystream *, unsigned char *, size_t,
+                                unsigned char *);
+void             keystream_stats(struct keystream *, uint64_t *, uint64_t *);
+
+
+#endif
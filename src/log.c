@@ -0,0 +1,898 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+/*
+ * Sealed logs: an append-only file of records, each sealed as a box
+ * whose associated data includes the tag of the frame before it, so
+ * that the records can be neither reordered, dropped from the middle
+ * nor spliced in from elsewhere. Appending costs one box the size of
+ * the record. The file is laid out as
+ *
+ *      header | checkpoint | records ... | checkpoint | records ...
+ *
+ * with each checkpoint and record framed as
+ *
+ *      kind (1) | box length (4) | box
+ *
+ * A record's associated data is its kind, the log id, its sequence
+ * number and the previous frame's tag. A checkpoint, written every
+ * so many records, is tagged without reference to what comes before
+ * it: its associated data is its kind, the log id, the number of
+ * records before it and its offset, and its message is the previous
+ * frame's tag. A reader can therefore start at any checkpoint, and
+ * the stretches between checkpoints can be checked in parallel; each
+ * stretch's last tag is compared with the one the next checkpoint
+ * holds once they are done. Readers find the checkpoints by walking
+ * the framing through a read-only mapping, which costs no crypto, and
+ * ignore a frame that runs past the end of the file, which a writer
+ * may be in the middle of.
+ */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+
+#include "box.h"
+#include "constant_time.h"
+#include "scheduler.h"
+#include <cryptobox/log.h>
+
+
+#define LOG_MAGIC               "CBLG"
+#define LOG_VERSION             1
+#define LOG_ID_SIZE             16
+#define LOG_HEAD_SIZE           24
+#define LOG_FRAME_HEAD          5
+#define LOG_AAD_SIZE            (1 + LOG_ID_SIZE + 16)
+#define LOG_MAX_TAG             48
+
+#define LOG_RECORD              1
+#define LOG_CHECKPOINT          2
+
+#define LOG_VERIFY              1
+#define LOG_READ                2
+
+
+/*
+ * A log open for appending. prev is the tag of the last frame
+ * written, and since the number of records since the last
+ * checkpoint. If a write fails and the file cannot be put back as it
+ * was, the log is marked broken and refuses further appends.
+ */
+struct cryptobox_log {
+        const struct box_ops    *ops;
+        void                    *ctx;
+        unsigned char            id[LOG_ID_SIZE];
+        unsigned char            prev[LOG_MAX_TAG];
+        int                      fd;
+        int                      interval;
+        int                      since;
+        int                      broken;
+        uint64_t                 seq;
+        uint64_t                 end;
+        pthread_mutex_t          lock;
+};
+
+
+/*
+ * A checkpoint and the records up to the next one. start is the tag
+ * the checkpoint holds, and last the tag of the segment's last frame.
+ * When reading, the opened records are kept in recs until they have
+ * been passed on.
+ */
+struct log_segment {
+        uint64_t                 offset;
+        uint64_t                 seq;
+        uint64_t                 nrecords;
+        unsigned char            start[LOG_MAX_TAG];
+        unsigned char            last[LOG_MAX_TAG];
+        unsigned char          **recs;
+        size_t                  *lens;
+        int                      ok;
+};
+
+struct log_map;
+
+/*
+ * A log mapped for reading. size covers the complete frames only.
+ * Each pass checks the segments from next up to end on the worker
+ * pool.
+ */
+struct log_map {
+        const struct box_ops    *ops;
+        void                    *ctx;
+        unsigned char           *base;
+        size_t                   map_len;
+        size_t                   size;
+        struct log_segment      *segs;
+        size_t                   nsegs;
+        uint64_t                 records;
+        int                      op;
+
+        size_t                   next;
+        size_t                   end;
+        int                      remaining;
+        sem_t                    sem;
+};
+
+struct log_task {
+        struct sched_task        task;
+        struct log_map          *map;
+};
+
+
+static struct cryptobox_log
+                        *log_new(int, unsigned char *, int);
+static void              log_free(struct cryptobox_log *);
+static void              log_aad(unsigned char *, int, unsigned char *,
+                                 uint64_t, uint64_t);
+static int               log_frame_write(struct cryptobox_log *, int,
+                                         struct iovec *, unsigned char *,
+                                         size_t);
+static int               log_checkpoint_write(struct cryptobox_log *);
+static int               log_writev(int, struct iovec *, int);
+static int               log_map_open(struct log_map *, const char *, int,
+                                      unsigned char *);
+static void              log_map_close(struct log_map *);
+static int               log_map_walk(struct log_map *);
+static int               log_segment_check(struct log_map *,
+                                           struct log_segment *);
+static void              log_segment_clear(struct log_map *,
+                                           struct log_segment *);
+static void              log_worker(struct sched_task *);
+static int               log_pass(struct log_map *, size_t, size_t);
+static int               log_run(const char *, int, unsigned char *,
+                                 uint64_t, uint64_t *, cryptobox_log_fn,
+                                 void *);
+static void              log_put32(unsigned char *, uint32_t);
+static uint32_t          log_get32(unsigned char *);
+static void              log_put64(unsigned char *, uint64_t);
+
+
+/*
+ * Set up an empty writer for a box type and key.
+ */
+struct cryptobox_log *
+log_new(int type, unsigned char *key, int interval)
+{
+        struct cryptobox_log    *log;
+        const struct box_ops    *ops;
+
+        if (NULL == (ops = box_ops_lookup(type)) || NULL == key ||
+            interval < 0)
+                return NULL;
+        if (NULL == (log = box_malloc(sizeof(struct cryptobox_log))))
+                return NULL;
+        memset(log, 0, sizeof(struct cryptobox_log));
+        log->ops = ops;
+        log->fd = -1;
+        log->interval = 0 == interval ? CRYPTOBOX_LOG_INTERVAL : interval;
+        if (0 != pthread_mutex_init(&log->lock, NULL)) {
+                box_free(log);
+                return NULL;
+        }
+        if (NULL == (log->ctx = ops->ctx_new(key))) {
+                pthread_mutex_destroy(&log->lock);
+                box_free(log);
+                return NULL;
+        }
+        return log;
+}
+
+
+void
+log_free(struct cryptobox_log *log)
+{
+        if (-1 != log->fd)
+                close(log->fd);
+        log->ops->ctx_free(log->ctx);
+        pthread_mutex_destroy(&log->lock);
+        memset(log, 0, sizeof(struct cryptobox_log));
+        box_free(log);
+}
+
+
+/*
+ * Create an empty log at path, replacing any existing file, for
+ * records sealed as boxes of the given type under key. A checkpoint
+ * is written every interval records, or every CRYPTOBOX_LOG_INTERVAL
+ * if interval is 0. Returns NULL on failure.
+ */
+struct cryptobox_log *
+cryptobox_log_create(const char *path, int type, unsigned char *key,
+                     int interval)
+{
+        struct cryptobox_log    *log;
+        unsigned char            head[LOG_HEAD_SIZE];
+        struct iovec             iov;
+
+        if (NULL == path || NULL == (log = log_new(type, key, interval)))
+                return NULL;
+        memcpy(head, LOG_MAGIC, 4);
+        head[4] = LOG_VERSION;
+        head[5] = (unsigned char)type;
+        head[6] = head[7] = 0;
+        iov.iov_base = head;
+        iov.iov_len = LOG_HEAD_SIZE;
+        if (!RAND_bytes(log->id, LOG_ID_SIZE) ||
+            -1 == (log->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600))) {
+                log_free(log);
+                return NULL;
+        }
+        memcpy(head + 8, log->id, LOG_ID_SIZE);
+        if (!log_writev(log->fd, &iov, 1)) {
+                log_free(log);
+                return NULL;
+        }
+        log->end = LOG_HEAD_SIZE;
+        if (!log_checkpoint_write(log)) {
+                log_free(log);
+                return NULL;
+        }
+        return log;
+}
+
+
+/*
+ * Open an existing log for appending. The records since the last
+ * checkpoint are checked to recover the chain, and a frame left
+ * incomplete by a writer that stopped part way through is cut off.
+ * Returns NULL if the log cannot be read, was not made with this type
+ * and key, or does not check out.
+ */
+struct cryptobox_log *
+cryptobox_log_open(const char *path, int type, unsigned char *key,
+                   int interval)
+{
+        struct cryptobox_log    *log;
+        struct log_map           map;
+        struct log_segment      *seg;
+        int                      ok = 0;
+
+        if (NULL == path || NULL == (log = log_new(type, key, interval)))
+                return NULL;
+        if (log_map_open(&map, path, type, key)) {
+                seg = &map.segs[map.nsegs - 1];
+                map.op = LOG_VERIFY;
+                if (log_segment_check(&map, seg) &&
+                    seg->nrecords < (uint64_t)INT_MAX) {
+                        memcpy(log->id, map.base + 8, LOG_ID_SIZE);
+                        memcpy(log->prev, seg->last, log->ops->tag_size);
+                        log->seq = map.records;
+                        log->since = (int)seg->nrecords;
+                        log->end = map.size;
+                        ok = 1;
+                }
+                log_map_close(&map);
+        }
+        if (ok) {
+                log->fd = open(path, O_RDWR);
+                ok = -1 != log->fd &&
+                     0 == ftruncate(log->fd, (off_t)log->end) &&
+                     -1 != lseek(log->fd, (off_t)log->end, SEEK_SET);
+        }
+        if (!ok) {
+                log_free(log);
+                return NULL;
+        }
+        return log;
+}
+
+
+/*
+ * Lay out the fixed part of a frame's associated data: the kind, the
+ * log id and two 64-bit fields, which for a record are its sequence
+ * number and zero, and for a checkpoint the number of records
+ * before it and its offset.
+ */
+void
+log_aad(unsigned char *aad, int kind, unsigned char *id, uint64_t a,
+        uint64_t b)
+{
+        aad[0] = (unsigned char)kind;
+        memcpy(aad + 1, id, LOG_ID_SIZE);
+        log_put64(aad + 1 + LOG_ID_SIZE, a);
+        log_put64(aad + 1 + LOG_ID_SIZE + 8, b);
+}
+
+
+/*
+ * Seal m as a frame of the given kind with the associated data in
+ * iov, and write it at the end of the log with the lock held. The
+ * new frame's tag becomes the previous tag.
+ */
+int
+log_frame_write(struct cryptobox_log *log, int kind, struct iovec *aad,
+                unsigned char *m, size_t mlen)
+{
+        unsigned char    head[LOG_FRAME_HEAD];
+        struct iovec     iov[2];
+        unsigned char   *box;
+        int              box_len = 0;
+        int              res;
+
+        box = log->ops->ctx_seal_aadv(log->ctx, m, (int)mlen, aad,
+                                      LOG_RECORD == kind ? 2 : 1, &box_len);
+        if (NULL == box)
+                return 0;
+        head[0] = (unsigned char)kind;
+        log_put32(head + 1, (uint32_t)box_len);
+        iov[0].iov_base = head;
+        iov[0].iov_len = LOG_FRAME_HEAD;
+        iov[1].iov_base = box;
+        iov[1].iov_len = (size_t)box_len;
+        if ((res = log_writev(log->fd, iov, 2))) {
+                memcpy(log->prev, box + box_len - log->ops->tag_size,
+                       log->ops->tag_size);
+                log->end += LOG_FRAME_HEAD + (uint64_t)box_len;
+        } else if (0 != ftruncate(log->fd, (off_t)log->end) ||
+                   -1 == lseek(log->fd, (off_t)log->end, SEEK_SET)) {
+                log->broken = 1;
+        }
+        log->ops->ctx_release(log->ctx, box, (size_t)box_len);
+        return res;
+}
+
+
+/*
+ * Write a checkpoint holding the previous tag, with the lock held.
+ */
+int
+log_checkpoint_write(struct cryptobox_log *log)
+{
+        unsigned char    aad[LOG_AAD_SIZE];
+        unsigned char    prev[LOG_MAX_TAG];
+        struct iovec     iov;
+
+        log_aad(aad, LOG_CHECKPOINT, log->id, log->seq, log->end);
+        iov.iov_base = aad;
+        iov.iov_len = LOG_AAD_SIZE;
+        memcpy(prev, log->prev, log->ops->tag_size);
+        if (!log_frame_write(log, LOG_CHECKPOINT, &iov, prev,
+                             log->ops->tag_size))
+                return 0;
+        log->since = 0;
+        return 1;
+}
+
+
+/*
+ * Append a record of len bytes, writing a checkpoint first if one is
+ * due. Appends from several threads are serialised. Returns 1 on
+ * success and 0 on failure.
+ */
+int
+cryptobox_log_append(struct cryptobox_log *log, unsigned char *rec,
+                     size_t len)
+{
+        unsigned char    aad[LOG_AAD_SIZE];
+        unsigned char    empty = 0;
+        struct iovec     iov[2];
+        int              res = 0;
+
+        if (NULL == log || (NULL == rec && len > 0) ||
+            len > CRYPTOBOX_LOG_RECORD_MAX)
+                return 0;
+        if (NULL == rec)
+                rec = &empty;
+        pthread_mutex_lock(&log->lock);
+        if (!log->broken &&
+            (log->since < log->interval || log_checkpoint_write(log))) {
+                log_aad(aad, LOG_RECORD, log->id, log->seq, 0);
+                iov[0].iov_base = aad;
+                iov[0].iov_len = LOG_AAD_SIZE;
+                iov[1].iov_base = log->prev;
+                iov[1].iov_len = log->ops->tag_size;
+                if ((res = log_frame_write(log, LOG_RECORD, iov, rec, len))) {
+                        log->seq++;
+                        log->since++;
+                }
+        }
+        pthread_mutex_unlock(&log->lock);
+        return res;
+}
+
+
+/*
+ * Write a checkpoint now and sync the log, so that everything up to
+ * here is on disk and readers may start from here.
+ */
+int
+cryptobox_log_checkpoint(struct cryptobox_log *log)
+{
+        int     res = 0;
+
+        if (NULL == log)
+                return 0;
+        pthread_mutex_lock(&log->lock);
+        if (!log->broken && log_checkpoint_write(log) && 0 == fsync(log->fd))
+                res = 1;
+        pthread_mutex_unlock(&log->lock);
+        return res;
+}
+
+
+/*
+ * Return the number of records in the log.
+ */
+uint64_t
+cryptobox_log_records(struct cryptobox_log *log)
+{
+        uint64_t        n;
+
+        if (NULL == log)
+                return 0;
+        pthread_mutex_lock(&log->lock);
+        n = log->seq;
+        pthread_mutex_unlock(&log->lock);
+        return n;
+}
+
+
+/*
+ * Sync and close a log. Returns 0 if the log could not be synced or
+ * an earlier write left it broken.
+ */
+int
+cryptobox_log_close(struct cryptobox_log *log)
+{
+        int     res;
+
+        if (NULL == log)
+                return 0;
+        res = !log->broken && 0 == fsync(log->fd);
+        log_free(log);
+        return res;
+}
+
+
+int
+log_writev(int fd, struct iovec *iov, int n)
+{
+        ssize_t w;
+        size_t  left;
+
+        while (n > 0) {
+                w = writev(fd, iov, n);
+                if (w < 0 && EINTR == errno)
+                        continue;
+                if (w <= 0)
+                        return 0;
+                left = (size_t)w;
+                while (n > 0 && left >= iov->iov_len) {
+                        left -= iov->iov_len;
+                        iov++;
+                        n--;
+                }
+                if (n > 0) {
+                        iov->iov_base = (unsigned char *)iov->iov_base + left;
+                        iov->iov_len -= left;
+                }
+        }
+        return 1;
+}
+
+
+/*
+ * Map the log at path for reading and walk its framing. Returns 0 if
+ * it is not a log of this type, holds a frame that cannot be right,
+ * or does not begin with a checkpoint.
+ */
+int
+log_map_open(struct log_map *map, const char *path, int type,
+             unsigned char *key)
+{
+        struct stat      st;
+        int              fd;
+
+        memset(map, 0, sizeof(struct log_map));
+        map->base = MAP_FAILED;
+        if (NULL == (map->ops = box_ops_lookup(type)) || NULL == key)
+                return 0;
+        if (-1 == (fd = open(path, O_RDONLY)))
+                return 0;
+        if (-1 == fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+            st.st_size < LOG_HEAD_SIZE || (uint64_t)st.st_size > SIZE_MAX) {
+                close(fd);
+                return 0;
+        }
+        map->map_len = (size_t)st.st_size;
+        map->base = mmap(NULL, map->map_len, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (MAP_FAILED == map->base ||
+            0 != memcmp(map->base, LOG_MAGIC, 4) ||
+            LOG_VERSION != map->base[4] ||
+            (unsigned char)type != map->base[5] || !log_map_walk(map) ||
+            NULL == (map->ctx = map->ops->ctx_new(key))) {
+                log_map_close(map);
+                return 0;
+        }
+        return 1;
+}
+
+
+void
+log_map_close(struct log_map *map)
+{
+        size_t  i;
+
+        for (i = 0; i < map->nsegs; i++)
+                log_segment_clear(map, &map->segs[i]);
+        if (NULL != map->ctx)
+                map->ops->ctx_free(map->ctx);
+        if (MAP_FAILED != map->base)
+                munmap(map->base, map->map_len);
+        box_free(map->segs);
+        memset(map, 0, sizeof(struct log_map));
+}
+
+
+/*
+ * Walk the frames, starting a segment at each checkpoint and counting
+ * the records in it. A frame that runs past the end of the file ends
+ * the walk; anything else out of place fails it.
+ */
+int
+log_map_walk(struct log_map *map)
+{
+        struct log_segment      *seg, *segs;
+        size_t                   pos = LOG_HEAD_SIZE, cap = 0, len;
+        int                      kind;
+
+        while (map->map_len - pos >= LOG_FRAME_HEAD) {
+                kind = map->base[pos];
+                len = log_get32(map->base + pos + 1);
+                if (len > map->map_len - pos - LOG_FRAME_HEAD)
+                        break;
+                if (len < map->ops->overhead ||
+                    (LOG_CHECKPOINT == kind &&
+                     len != map->ops->overhead + map->ops->tag_size) ||
+                    (LOG_RECORD == kind &&
+                     len - map->ops->overhead > CRYPTOBOX_LOG_RECORD_MAX) ||
+                    (LOG_RECORD == kind && 0 == map->nsegs) ||
+                    (LOG_RECORD != kind && LOG_CHECKPOINT != kind))
+                        return 0;
+                if (LOG_CHECKPOINT == kind) {
+                        if (map->nsegs == cap) {
+                                cap = 0 == cap ? 64 : cap * 2;
+                                segs = box_malloc(cap *
+                                                  sizeof(struct log_segment));
+                                if (NULL == segs)
+                                        return 0;
+                                if (map->nsegs > 0)
+                                        memcpy(segs, map->segs, map->nsegs *
+                                               sizeof(struct log_segment));
+                                box_free(map->segs);
+                                map->segs = segs;
+                        }
+                        seg = &map->segs[map->nsegs++];
+                        memset(seg, 0, sizeof(struct log_segment));
+                        seg->offset = pos;
+                        seg->seq = map->records;
+                } else {
+                        map->segs[map->nsegs - 1].nrecords++;
+                        map->records++;
+                }
+                pos += LOG_FRAME_HEAD + len;
+        }
+        map->size = pos;
+        return map->nsegs > 0;
+}
+
+
+/*
+ * Check a segment: open its checkpoint, then check each record in
+ * turn against the tag before it, opening it too when reading.
+ * Empty records are only checked, as there is nothing to open.
+ */
+int
+log_segment_check(struct log_map *map, struct log_segment *seg)
+{
+        const struct box_ops    *ops = map->ops;
+        unsigned char            aad[LOG_AAD_SIZE];
+        unsigned char           *id = map->base + 8;
+        unsigned char           *frame, *m, *prev;
+        struct iovec             iov[2];
+        uint64_t                 i;
+        size_t                   pos;
+        int                      len;
+
+        frame = map->base + seg->offset;
+        len = (int)log_get32(frame + 1);
+        log_aad(aad, LOG_CHECKPOINT, id, seg->seq, seg->offset);
+        iov[0].iov_base = aad;
+        iov[0].iov_len = LOG_AAD_SIZE;
+        m = ops->ctx_open_aadv(map->ctx, frame + LOG_FRAME_HEAD, len, iov, 1);
+        if (NULL == m)
+                return 0;
+        memcpy(seg->start, m, ops->tag_size);
+        ops->ctx_release(map->ctx, m, ops->tag_size);
+
+        if (LOG_READ == map->op && seg->nrecords > 0) {
+                seg->recs = box_malloc((size_t)seg->nrecords *
+                                       sizeof(unsigned char *));
+                seg->lens = box_malloc((size_t)seg->nrecords *
+                                       sizeof(size_t));
+                if (NULL == seg->recs || NULL == seg->lens)
+                        return 0;
+                memset(seg->recs, 0,
+                       (size_t)seg->nrecords * sizeof(unsigned char *));
+                memset(seg->lens, 0, (size_t)seg->nrecords * sizeof(size_t));
+        }
+
+        prev = frame + LOG_FRAME_HEAD + len - ops->tag_size;
+        pos = (size_t)seg->offset + LOG_FRAME_HEAD + (size_t)len;
+        for (i = 0; i < seg->nrecords; i++) {
+                frame = map->base + pos;
+                len = (int)log_get32(frame + 1);
+                log_aad(aad, LOG_RECORD, id, seg->seq + i, 0);
+                iov[1].iov_base = prev;
+                iov[1].iov_len = ops->tag_size;
+                if (LOG_READ == map->op && (size_t)len > ops->overhead) {
+                        m = ops->ctx_open_aadv(map->ctx,
+                                               frame + LOG_FRAME_HEAD, len,
+                                               iov, 2);
+                        if (NULL == m)
+                                return 0;
+                        seg->recs[i] = m;
+                        seg->lens[i] = (size_t)len - ops->overhead;
+                } else if (!ops->ctx_verify_aadv(map->ctx,
+                                                 frame + LOG_FRAME_HEAD, len,
+                                                 iov, 2)) {
+                        return 0;
+                }
+                prev = frame + LOG_FRAME_HEAD + len - ops->tag_size;
+                pos += LOG_FRAME_HEAD + (size_t)len;
+        }
+        memcpy(seg->last, prev, ops->tag_size);
+        seg->ok = 1;
+        return 1;
+}
+
+
+/*
+ * Wipe and release the records opened for a segment.
+ */
+void
+log_segment_clear(struct log_map *map, struct log_segment *seg)
+{
+        uint64_t        i;
+
+        if (NULL != seg->recs) {
+                for (i = 0; i < seg->nrecords; i++)
+                        map->ops->ctx_release(map->ctx, seg->recs[i],
+                                              seg->lens[i]);
+        }
+        box_free(seg->recs);
+        box_free(seg->lens);
+        seg->recs = NULL;
+        seg->lens = NULL;
+}
+
+
+void
+log_worker(struct sched_task *task)
+{
+        struct log_map  *map;
+        size_t           i;
+
+        map = ((struct log_task *)task)->map;
+        for (;;) {
+                i = __atomic_fetch_add(&map->next, 1, __ATOMIC_RELAXED);
+                if (i >= map->end)
+                        break;
+                log_segment_check(map, &map->segs[i]);
+        }
+        if (0 == __atomic_sub_fetch(&map->remaining, 1, __ATOMIC_ACQ_REL))
+                sem_post(&map->sem);
+}
+
+
+/*
+ * Check the segments from first up to end on the worker pool, and
+ * return 1 if every one of them checked out.
+ */
+int
+log_pass(struct log_map *map, size_t first, size_t end)
+{
+        struct log_task *tasks;
+        size_t           i;
+        int              ntasks;
+
+        ntasks = sched_workers();
+        if (ntasks < 1)
+                ntasks = 1;
+        if ((size_t)ntasks > end - first)
+                ntasks = (int)(end - first);
+        if (NULL == (tasks = box_malloc((size_t)ntasks *
+                                        sizeof(struct log_task))))
+                return 0;
+        map->next = first;
+        map->end = end;
+        map->remaining = ntasks;
+        if (-1 == sem_init(&map->sem, 0, 0)) {
+                box_free(tasks);
+                return 0;
+        }
+        for (i = 0; i < (size_t)ntasks; i++) {
+                tasks[i].map = map;
+                tasks[i].task.run = log_worker;
+                if (!sched_spawn(&tasks[i].task))
+                        log_worker(&tasks[i].task);
+        }
+        if (sched_self() >= 0) {
+                while (__atomic_load_n(&map->remaining, __ATOMIC_ACQUIRE) > 0)
+                        if (!sched_help())
+                                sched_yield();
+        } else {
+                while (-1 == sem_wait(&map->sem) && EINTR == errno)
+                        ;
+        }
+        sem_destroy(&map->sem);
+        box_free(tasks);
+
+        for (i = first; i < end; i++)
+                if (!map->segs[i].ok)
+                        return 0;
+        return 1;
+}
+
+
+/*
+ * Check the log from the last checkpoint at or before record from to
+ * its end, passing the records from there on to fn if it is not
+ * NULL. Reading goes a pool's worth of segments at a time, so that
+ * only that many segments' records are held at once; each window is
+ * linked to the one before it and handed over in order before the
+ * next is opened.
+ */
+int
+log_run(const char *path, int type, unsigned char *key, uint64_t from,
+        uint64_t *count, cryptobox_log_fn fn, void *arg)
+{
+        struct log_map           map;
+        struct log_segment      *seg;
+        unsigned char            empty = 0;
+        unsigned char           *rec;
+        size_t                   first, i, j, k, window;
+        uint64_t                 r;
+        int                      ok = 1, stop = 0;
+
+        if (NULL == path || !log_map_open(&map, path, type, key))
+                return 0;
+        if (from > map.records) {
+                log_map_close(&map);
+                return 0;
+        }
+        map.op = NULL == fn ? LOG_VERIFY : LOG_READ;
+        for (first = map.nsegs - 1; first > 0; first--)
+                if (map.segs[first].seq <= from)
+                        break;
+
+        if (sched_self() < 0)
+                sched_start(0);
+        window = map.nsegs;
+        if (LOG_READ == map.op && sched_workers() > 0)
+                window = (size_t)sched_workers();
+
+        for (i = first; ok && !stop && i < map.nsegs; i = j) {
+                j = map.nsegs - i > window ? i + window : map.nsegs;
+                ok = log_pass(&map, i, j);
+                for (k = i; ok && k < j; k++) {
+                        if (k > first && 1 != constant_time_equals(
+                            map.segs[k - 1].last, (int)map.ops->tag_size,
+                            map.segs[k].start, (int)map.ops->tag_size))
+                                ok = 0;
+                }
+                for (k = i; ok && !stop && NULL != fn && k < j; k++) {
+                        seg = &map.segs[k];
+                        for (r = 0; !stop && r < seg->nrecords; r++) {
+                                if (seg->seq + r < from)
+                                        continue;
+                                rec = NULL == seg->recs[r] ? &empty :
+                                      seg->recs[r];
+                                if (!fn(arg, seg->seq + r, rec,
+                                        seg->lens[r]))
+                                        stop = 1;
+                        }
+                }
+                for (k = i; k < j; k++)
+                        log_segment_clear(&map, &map.segs[k]);
+        }
+        if (ok && NULL != count)
+                *count = map.records;
+        log_map_close(&map);
+        return ok;
+}
+
+
+/*
+ * Check a log from the last checkpoint at or before record from to
+ * its end, with the stretches between checkpoints checked in
+ * parallel. The number of records in the log is stored in count if
+ * it is not NULL. Returns 1 if the log checks out and 0 otherwise.
+ */
+int
+cryptobox_log_verify(const char *path, int type, unsigned char *key,
+                     uint64_t from, uint64_t *count)
+{
+        return log_run(path, type, key, from, count, NULL, NULL);
+}
+
+
+/*
+ * Open the records of a log from record from onwards and pass each
+ * to fn in order. No record is passed on before the records between
+ * it and the starting checkpoint have checked out. Returns 1 if the
+ * records were all read or fn stopped the read, and 0 if the log
+ * could not be read or did not check out; in that case some records
+ * may already have been passed on.
+ */
+int
+cryptobox_log_read(const char *path, int type, unsigned char *key,
+                   uint64_t from, cryptobox_log_fn fn, void *arg)
+{
+        if (NULL == fn)
+                return 0;
+        return log_run(path, type, key, from, NULL, fn, arg);
+}
+
+
+void
+log_put32(unsigned char *p, uint32_t v)
+{
+        int     i;
+
+        for (i = 0; i < 4; i++)
+                p[i] = (unsigned char)(v >> (24 - 8 * i));
+}
+
+
+uint32_t
+log_get32(unsigned char *p)
+{
+        uint32_t        v = 0;
+        int             i;
+
+        for (i = 0; i < 4; i++)
+                v = (v << 8) | p[i];
+        return v;
+}
+
+
+void
+log_put64(unsigned char *p, uint64_t v)
+{
+        int     i;
+
+        for (i = 0; i < 8; i++)
+                p[i] = (unsigned char)(v >> (56 - 8 * i));
+}
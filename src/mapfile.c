@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Sealing and opening files through memory mappings. The output file
+ * is sized up front and both files are mapped a window at a time, so
+ * the data is never copied into a heap buffer and the memory in use
+ * stays bounded however large the file is. The box written is the
+ * same as secretbox_seal or strongbox_seal would produce. When a file
+ * is opened, the tag is checked in a first pass over the box, and the
+ * output is only created once it has matched. The second pass, which
+ * decrypts, maps the input afresh; a MAP_PRIVATE mapping would not
+ * stop it changing, as pages not yet copied still follow the file. An
+ * input rewritten between the passes is therefore decrypted unchecked,
+ * and callers must keep the file still while it is opened.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "constant_time.h"
+#include "mapfile.h"
+
+
+struct mapfile_window {
+        unsigned char   *base;
+        size_t           len;
+        unsigned char   *data;
+};
+
+
+static int       mapfile_map(struct mapfile_window *, int, off_t, size_t,
+                             int);
+static void      mapfile_unmap(struct mapfile_window *);
+static int       mapfile_pread(int, unsigned char *, size_t, off_t);
+static int       mapfile_pwrite(int, unsigned char *, size_t, off_t);
+static int       mapfile_create(const char *, off_t);
+static int       mapfile_tag(const struct box_ops *, void *, int,
+                             unsigned char *, off_t, unsigned char *);
+
+
+/*
+ * Map len bytes of a file starting at off, which need not be page
+ * aligned, and tell the kernel they will be read through in order.
+ */
+int
+mapfile_map(struct mapfile_window *w, int fd, off_t off, size_t len,
+            int prot)
+{
+        off_t   delta;
+        long    page = sysconf(_SC_PAGESIZE);
+
+        if (page <= 0)
+                page = 4096;
+        delta = off % (off_t)page;
+        w->len = len + (size_t)delta;
+        w->base = mmap(NULL, w->len, prot, MAP_SHARED, fd, off - delta);
+        if (MAP_FAILED == w->base) {
+                w->base = NULL;
+                return 0;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(w->base, w->len, MADV_SEQUENTIAL);
+#endif
+#ifdef MADV_HUGEPAGE
+        madvise(w->base, w->len, MADV_HUGEPAGE);
+#endif
+        w->data = w->base + delta;
+        return 1;
+}
+
+
+void
+mapfile_unmap(struct mapfile_window *w)
+{
+        if (NULL != w->base)
+                munmap(w->base, w->len);
+        w->base = NULL;
+}
+
+
+int
+mapfile_pread(int fd, unsigned char *buf, size_t len, off_t off)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = pread(fd, buf, len, off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 1;
+}
+
+
+int
+mapfile_pwrite(int fd, unsigned char *buf, size_t len, off_t off)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = pwrite(fd, buf, len, off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 1;
+}
+
+
+/*
+ * Create the output file with its final size, readable and writable
+ * only by its owner. Returns the descriptor, or -1 on failure.
+ */
+int
+mapfile_create(const char *path, off_t size)
+{
+        int     fd;
+
+        if (-1 == (fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)))
+                return -1;
+        if (-1 == ftruncate(fd, size)) {
+                close(fd);
+                unlink(path);
+                return -1;
+        }
+        return fd;
+}
+
+
+/*
+ * Compute the tag over the first len bytes of a file, which hold the
+ * IV and ciphertext.
+ */
+int
+mapfile_tag(const struct box_ops *ops, void *ctx, int fd, unsigned char *iv,
+            off_t len, unsigned char *tag)
+{
+        struct mapfile_window    w;
+        union box_mac_state      mac;
+        off_t                    off;
+        size_t                   n;
+
+        ops->tag_start(ctx, &mac);
+        if (!ops->tag_update(&mac, iv, ops->iv_size))
+                goto fail;
+        for (off = (off_t)ops->iv_size; off < len; off += (off_t)n) {
+                n = (size_t)(len - off);
+                if (n > MAPFILE_WINDOW)
+                        n = MAPFILE_WINDOW;
+                if (!mapfile_map(&w, fd, off, n, PROT_READ))
+                        goto fail;
+                if (!ops->tag_update(&mac, w.data, n)) {
+                        mapfile_unmap(&w);
+                        goto fail;
+                }
+                mapfile_unmap(&w);
+        }
+        return ops->tag_finish(ctx, &mac, tag);
+
+fail:
+        memset(&mac, 0, sizeof mac);
+        return 0;
+}
+
+
+/*
+ * Seal the file at in into a box at out, which is created or
+ * truncated. Returns 1 on success and 0 on failure, in which case out
+ * is removed.
+ */
+int
+mapfile_seal(const struct box_ops *ops, const char *in, const char *out,
+             unsigned char *key)
+{
+        struct mapfile_window    src, dst;
+        unsigned char            iv[BOX_BLOCK_SIZE];
+        unsigned char            tag[SHA512_DIGEST_LENGTH];
+        union box_mac_state      mac;
+        struct stat              st;
+        void                    *ctx = NULL;
+        off_t                    len, off;
+        size_t                   n;
+        int                      ifd, ofd = -1;
+        int                      res = 0;
+
+        if (-1 == (ifd = open(in, O_RDONLY)))
+                return 0;
+        if (-1 == fstat(ifd, &st) || !S_ISREG(st.st_mode))
+                goto out;
+        len = st.st_size;
+        if (NULL == (ctx = ops->ctx_new(key)))
+                goto out;
+        if (!RAND_bytes(iv, ops->iv_size))
+                goto out;
+        ofd = mapfile_create(out, len + (off_t)ops->overhead);
+        if (-1 == ofd)
+                goto out;
+
+        ops->tag_start(ctx, &mac);
+        if (!mapfile_pwrite(ofd, iv, ops->iv_size, 0) ||
+            !ops->tag_update(&mac, iv, ops->iv_size))
+                goto fail;
+        for (off = 0; off < len; off += (off_t)n) {
+                n = (size_t)(len - off);
+                if (n > MAPFILE_WINDOW)
+                        n = MAPFILE_WINDOW;
+                if (!mapfile_map(&src, ifd, off, n, PROT_READ))
+                        goto fail;
+                if (!mapfile_map(&dst, ofd, off + (off_t)ops->iv_size, n,
+                                 PROT_READ | PROT_WRITE)) {
+                        mapfile_unmap(&src);
+                        goto fail;
+                }
+                res = ops->crypt(ctx, iv, (size_t)off / BOX_BLOCK_SIZE,
+                                 src.data, dst.data, n) &&
+                      ops->tag_update(&mac, dst.data, n);
+                mapfile_unmap(&src);
+                mapfile_unmap(&dst);
+                if (!res)
+                        goto fail;
+        }
+        res = 0;
+        if (ops->tag_finish(ctx, &mac, tag))
+        if (mapfile_pwrite(ofd, tag, ops->tag_size,
+                           len + (off_t)ops->iv_size))
+                res = 1;
+
+fail:
+        memset(&mac, 0, sizeof mac);
+        if (-1 == close(ofd))
+                res = 0;
+        if (!res)
+                unlink(out);
+out:
+        if (NULL != ctx)
+                ops->ctx_free(ctx);
+        close(ifd);
+        return res;
+}
+
+
+/*
+ * Check the box in the file at in and write the message to out, which
+ * is only created once the tag has matched. The box is read twice, so
+ * if in is rewritten in between, out holds the decryption of whatever
+ * it was changed to. Returns 1 on success and 0 on failure.
+ */
+int
+mapfile_open(const struct box_ops *ops, const char *in, const char *out,
+             unsigned char *key)
+{
+        struct mapfile_window    src, dst;
+        unsigned char            iv[BOX_BLOCK_SIZE];
+        unsigned char            tag[SHA512_DIGEST_LENGTH];
+        unsigned char            atag[SHA512_DIGEST_LENGTH];
+        struct stat              st;
+        void                    *ctx = NULL;
+        off_t                    len, off;
+        size_t                   n;
+        int                      ifd, ofd;
+        int                      res = 0;
+
+        if (-1 == (ifd = open(in, O_RDONLY)))
+                return 0;
+        if (-1 == fstat(ifd, &st) || !S_ISREG(st.st_mode) ||
+            st.st_size < (off_t)ops->overhead)
+                goto out;
+        len = st.st_size - (off_t)ops->overhead;
+        if (NULL == (ctx = ops->ctx_new(key)))
+                goto out;
+        if (!mapfile_pread(ifd, iv, ops->iv_size, 0) ||
+            !mapfile_pread(ifd, tag, ops->tag_size,
+                           len + (off_t)ops->iv_size))
+                goto out;
+        if (!mapfile_tag(ops, ctx, ifd, iv, len + (off_t)ops->iv_size,
+                         atag) ||
+            1 != constant_time_equals(atag, (int)ops->tag_size, tag,
+                                      (int)ops->tag_size))
+                goto out;
+
+        if (-1 == (ofd = mapfile_create(out, len)))
+                goto out;
+        res = 1;
+        for (off = 0; res && off < len; off += (off_t)n) {
+                n = (size_t)(len - off);
+                if (n > MAPFILE_WINDOW)
+                        n = MAPFILE_WINDOW;
+                res = 0;
+                if (!mapfile_map(&src, ifd, off + (off_t)ops->iv_size, n,
+                                 PROT_READ))
+                        break;
+                if (mapfile_map(&dst, ofd, off, n, PROT_READ | PROT_WRITE)) {
+                        res = ops->crypt(ctx, iv,
+                                         (size_t)off / BOX_BLOCK_SIZE,
+                                         src.data, dst.data, n);
+                        mapfile_unmap(&dst);
+                }
+                mapfile_unmap(&src);
+        }
+        if (-1 == close(ofd))
+                res = 0;
+        if (!res)
+                unlink(out);
+
+out:
+        memset(atag, 0, sizeof atag);
+        if (NULL != ctx)
+                ops->ctx_free(ctx);
+        close(ifd);
+        return res;
+}
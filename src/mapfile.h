@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+
+#ifndef __MAPFILE_H__
+#define __MAPFILE_H__
+
+#include <sys/types.h>
+
+#include "box.h"
+
+
+/*
+ * Files are processed through mappings of at most MAPFILE_WINDOW
+ * bytes at a time, which bounds the memory they take up however large
+ * the file is.
+ */
+#define MAPFILE_WINDOW          (8 * 1024 * 1024)
+
+
+int     mapfile_seal(const struct box_ops *, const char *, const char *,
+                     unsigned char *);
+int     mapfile_open(const struct box_ops *, const char *, const char *,
+                     unsigned char *);
+
+
+#endif
@@ -0,0 +1,739 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Sealed objects authenticated by a Merkle tree. The message is
+ * encrypted in CTR mode as in a box, and cut into chunks of a fixed
+ * size; each chunk of ciphertext has a leaf hash, pairs of hashes are
+ * hashed together up to a single root, and the tag covers the header
+ * and the root. The chunks can therefore be hashed on separate
+ * workers, and a single chunk can be checked against the tag given
+ * the hashes of its siblings along the path to the root (an inclusion
+ * proof), without the rest of the object.
+ *
+ * An object is laid out as
+ *
+ *      magic (4) | type (1) | zero (3) | chunk size (4) | length (8) |
+ *      IV | tag | ciphertext
+ *
+ * with the integers big-endian. All hashes are HMACs under a key of
+ * their own, expanded from the box type's tag key, with a leading byte
+ * to tell leaves, inner nodes and the root tag apart; a leaf also
+ * covers the chunk's index. Proofs publish inner hashes, so were they
+ * made under the tag key itself, a leaf hash over a public chunk would
+ * be a valid box tag. When a level has an odd number of nodes, the
+ * last is carried up unchanged.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/rand.h>
+
+#include "box.h"
+#include "constant_time.h"
+#include "parallel.h"
+#include "scheduler.h"
+#include <cryptobox/merkle.h>
+
+
+#define MERKLE_MAGIC            "CBMT"
+#define MERKLE_FIXED            20
+#define MERKLE_MAX_DEPTH        64
+#define MERKLE_LABEL            "cryptobox-merkle"
+
+#define MERKLE_LEAF             0x00
+#define MERKLE_NODE             0x01
+#define MERKLE_ROOT             0x02
+
+#define MERKLE_SEAL             1
+#define MERKLE_OPEN             2
+#define MERKLE_HASH             3
+
+
+struct merkle;
+
+struct merkle_range {
+        struct sched_task        task;
+        struct merkle           *mk;
+        size_t                   lo;
+        size_t                   hi;
+};
+
+/*
+ * The state of a pass over the chunks of an object. in holds the
+ * message when sealing and the ciphertext otherwise; out receives the
+ * other, and is NULL when only hashing. The leaf hashes are written
+ * to nodes.
+ */
+struct merkle {
+        const struct box_ops    *ops;
+        void                    *ctx;
+        struct box_mac_key       mac;
+        int                      op;
+        unsigned char           *iv;
+        unsigned char           *in;
+        unsigned char           *out;
+        size_t                   len;
+        size_t                   chunk_size;
+        size_t                   nleaves;
+        size_t                   grain;
+        unsigned char           *nodes;
+        struct merkle_range     *ranges;
+        size_t                   next_range;
+        size_t                   remaining;
+        int                      failed;
+        sem_t                    done;
+};
+
+
+static void      merkle_put32(unsigned char *, uint32_t);
+static void      merkle_put64(unsigned char *, uint64_t);
+static uint64_t  merkle_get64(unsigned char *);
+static size_t    merkle_head_size(const struct box_ops *);
+static int       merkle_parse(const struct box_ops *, unsigned char *,
+                              size_t *, size_t *);
+static size_t    merkle_leaves(size_t, size_t);
+static int       merkle_leaf(const struct box_ops *, struct box_mac_key *,
+                             size_t, unsigned char *, size_t,
+                             unsigned char *);
+static int       merkle_node(const struct box_ops *, struct box_mac_key *,
+                             unsigned char *, unsigned char *,
+                             unsigned char *);
+static int       merkle_tag(const struct box_ops *, struct box_mac_key *,
+                            unsigned char *, unsigned char *,
+                            unsigned char *);
+static int       merkle_ctx_new(struct merkle *, unsigned char *);
+static void      merkle_ctx_free(struct merkle *);
+static int       merkle_chunk_run(struct merkle *, size_t);
+static void      merkle_range_run(struct sched_task *);
+static int       merkle_run(struct merkle *);
+static int       merkle_reduce(struct merkle *, size_t, unsigned char *,
+                               size_t *);
+static int       merkle_check(struct merkle *, unsigned char *, size_t,
+                              unsigned char *, size_t, unsigned char *,
+                              size_t *);
+
+
+void
+merkle_put32(unsigned char *p, uint32_t v)
+{
+        p[0] = (unsigned char)(v >> 24);
+        p[1] = (unsigned char)(v >> 16);
+        p[2] = (unsigned char)(v >> 8);
+        p[3] = (unsigned char)v;
+}
+
+
+void
+merkle_put64(unsigned char *p, uint64_t v)
+{
+        merkle_put32(p, (uint32_t)(v >> 32));
+        merkle_put32(p + 4, (uint32_t)v);
+}
+
+
+uint64_t
+merkle_get64(unsigned char *p)
+{
+        uint64_t        v = 0;
+        int             i;
+
+        for (i = 0; i < 8; i++)
+                v = (v << 8) | p[i];
+        return v;
+}
+
+
+size_t
+merkle_head_size(const struct box_ops *ops)
+{
+        return MERKLE_FIXED + ops->iv_size + ops->tag_size;
+}
+
+
+/*
+ * Check the fixed part of a header and read the chunk size and the
+ * message length from it. Nothing is authenticated at this point.
+ */
+int
+merkle_parse(const struct box_ops *ops, unsigned char *head,
+             size_t *chunk_size, size_t *len)
+{
+        uint64_t        v;
+
+        if (0 != memcmp(head, MERKLE_MAGIC, 4) || head[4] != ops->type)
+                return 0;
+        if (0 != head[5] || 0 != head[6] || 0 != head[7])
+                return 0;
+        *chunk_size = ((size_t)head[8] << 24) | ((size_t)head[9] << 16) |
+                      ((size_t)head[10] << 8) | (size_t)head[11];
+        if (0 == *chunk_size || 0 != *chunk_size % BOX_BLOCK_SIZE ||
+            *chunk_size > INT32_MAX)
+                return 0;
+        v = merkle_get64(head + 12);
+        if (v > SIZE_MAX - merkle_head_size(ops))
+                return 0;
+        *len = (size_t)v;
+        return 1;
+}
+
+
+/*
+ * The number of chunks in a message; an empty message has a single
+ * empty chunk.
+ */
+size_t
+merkle_leaves(size_t len, size_t chunk_size)
+{
+        if (0 == len)
+                return 1;
+        return len / chunk_size + (0 != len % chunk_size);
+}
+
+
+/*
+ * Set up the box context for a pass and the Merkle MAC key from it.
+ */
+int
+merkle_ctx_new(struct merkle *mk, unsigned char *key)
+{
+        if (NULL == (mk->ctx = mk->ops->ctx_new(key)))
+                return 0;
+        if (!mk->ops->mac_key(mk->ctx, MERKLE_LABEL, &mk->mac)) {
+                mk->ops->ctx_free(mk->ctx);
+                mk->ctx = NULL;
+                return 0;
+        }
+        return 1;
+}
+
+
+void
+merkle_ctx_free(struct merkle *mk)
+{
+        box_mac_zero(&mk->mac);
+        mk->ops->ctx_free(mk->ctx);
+}
+
+
+int
+merkle_leaf(const struct box_ops *ops, struct box_mac_key *key, size_t index,
+            unsigned char *chunk, size_t len, unsigned char *hash)
+{
+        union box_mac_state     mac;
+        unsigned char           prefix[9];
+
+        prefix[0] = MERKLE_LEAF;
+        merkle_put64(prefix + 1, (uint64_t)index);
+        box_mac_start(key, &mac);
+        if (ops->tag_update(&mac, prefix, sizeof prefix))
+        if (ops->tag_update(&mac, chunk, len))
+                return box_mac_finish(key, &mac, hash);
+        memset(&mac, 0, sizeof mac);
+        return 0;
+}
+
+
+/*
+ * Hash two nodes into their parent, which may be stored over either.
+ */
+int
+merkle_node(const struct box_ops *ops, struct box_mac_key *key,
+            unsigned char *left, unsigned char *right, unsigned char *parent)
+{
+        union box_mac_state     mac;
+        unsigned char           prefix = MERKLE_NODE;
+
+        box_mac_start(key, &mac);
+        if (ops->tag_update(&mac, &prefix, 1))
+        if (ops->tag_update(&mac, left, ops->tag_size))
+        if (ops->tag_update(&mac, right, ops->tag_size))
+                return box_mac_finish(key, &mac, parent);
+        memset(&mac, 0, sizeof mac);
+        return 0;
+}
+
+
+/*
+ * Compute the tag over the header, up to the tag itself, and the root.
+ */
+int
+merkle_tag(const struct box_ops *ops, struct box_mac_key *key,
+           unsigned char *head, unsigned char *root, unsigned char *tag)
+{
+        union box_mac_state     mac;
+        unsigned char           prefix = MERKLE_ROOT;
+
+        box_mac_start(key, &mac);
+        if (ops->tag_update(&mac, &prefix, 1))
+        if (ops->tag_update(&mac, head, MERKLE_FIXED + ops->iv_size))
+        if (ops->tag_update(&mac, root, ops->tag_size))
+                return box_mac_finish(key, &mac, tag);
+        memset(&mac, 0, sizeof mac);
+        return 0;
+}
+
+
+/*
+ * Encrypt or decrypt one chunk, as the pass calls for, and compute its
+ * leaf hash over the ciphertext.
+ */
+int
+merkle_chunk_run(struct merkle *mk, size_t i)
+{
+        const struct box_ops    *ops = mk->ops;
+        unsigned char           *hash = mk->nodes + i * ops->tag_size;
+        size_t                   off = i * mk->chunk_size;
+        size_t                   len = mk->len - off;
+        size_t                   block = off / BOX_BLOCK_SIZE;
+
+        if (len > mk->chunk_size)
+                len = mk->chunk_size;
+        sched_account(len);
+        switch (mk->op) {
+        case MERKLE_SEAL:
+                if (len > 0 && !ops->crypt(mk->ctx, mk->iv, block,
+                                           mk->in + off, mk->out + off, len))
+                        return 0;
+                return merkle_leaf(ops, &mk->mac, i, mk->out + off, len, hash);
+        case MERKLE_OPEN:
+                if (!merkle_leaf(ops, &mk->mac, i, mk->in + off, len, hash))
+                        return 0;
+                if (len > 0 && !ops->crypt(mk->ctx, mk->iv, block,
+                                           mk->in + off, mk->out + off, len))
+                        return 0;
+                return 1;
+        default:
+                return merkle_leaf(ops, &mk->mac, i, mk->in + off, len, hash);
+        }
+}
+
+
+/*
+ * Run a range of chunks, giving away the upper half of the range until
+ * it is down to the grain size.
+ */
+void
+merkle_range_run(struct sched_task *task)
+{
+        struct merkle_range     *r = (struct merkle_range *)task;
+        struct merkle_range     *half;
+        struct merkle           *mk = r->mk;
+        size_t                   lo = r->lo;
+        size_t                   hi = r->hi;
+        size_t                   mid, i;
+        int                      ok = 1;
+
+        while (hi - lo > mk->grain) {
+                mid = lo + (hi - lo) / 2;
+                half = &mk->ranges[__atomic_fetch_add(&mk->next_range, 1,
+                                                      __ATOMIC_RELAXED)];
+                half->task.run = merkle_range_run;
+                half->mk = mk;
+                half->lo = mid;
+                half->hi = hi;
+                if (!sched_spawn(&half->task))
+                        merkle_range_run(&half->task);
+                hi = mid;
+        }
+        for (i = lo; ok && i < hi; i++)
+                ok = merkle_chunk_run(mk, i);
+        if (!ok)
+                __atomic_store_n(&mk->failed, 1, __ATOMIC_RELAXED);
+        if (0 == __atomic_sub_fetch(&mk->remaining, hi - lo,
+                                    __ATOMIC_ACQ_REL))
+                sem_post(&mk->done);
+}
+
+
+/*
+ * Process every chunk. Objects smaller than PAR_SPLIT are done by the
+ * caller; larger ones are spread over the worker pool, which is
+ * started if need be, in ranges of at least PAR_CHUNK bytes. Returns
+ * 1 if every chunk succeeded.
+ */
+int
+merkle_run(struct merkle *mk)
+{
+        struct merkle_range     *root;
+        size_t                   i;
+
+        mk->grain = PAR_CHUNK / mk->chunk_size;
+        if (0 == mk->grain)
+                mk->grain = 1;
+        if (mk->len >= PAR_SPLIT && mk->nleaves > mk->grain)
+                mk->ranges = box_malloc(mk->nleaves *
+                                        sizeof(struct merkle_range));
+        if (NULL == mk->ranges || -1 == sem_init(&mk->done, 0, 0)) {
+                box_free(mk->ranges);
+                mk->ranges = NULL;
+                for (i = 0; i < mk->nleaves; i++)
+                        if (!merkle_chunk_run(mk, i))
+                                return 0;
+                return 1;
+        }
+
+        mk->remaining = mk->nleaves;
+        if (sched_self() < 0)
+                sched_start(0);
+        root = &mk->ranges[mk->next_range++];
+        root->task.run = merkle_range_run;
+        root->mk = mk;
+        root->lo = 0;
+        root->hi = mk->nleaves;
+        if (!sched_spawn(&root->task)) {
+                merkle_range_run(&root->task);
+        } else if (sched_self() >= 0) {
+                while (__atomic_load_n(&mk->remaining, __ATOMIC_ACQUIRE) > 0)
+                        if (!sched_help())
+                                sched_yield();
+        } else {
+                while (-1 == sem_wait(&mk->done) && EINTR == errno)
+                        ;
+        }
+        sem_destroy(&mk->done);
+        box_free(mk->ranges);
+        mk->ranges = NULL;
+        return !__atomic_load_n(&mk->failed, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Hash the leaves up to the root, which is left at the start of
+ * nodes. If proof is not NULL, the siblings on the path from leaf
+ * index are appended to it.
+ */
+int
+merkle_reduce(struct merkle *mk, size_t index, unsigned char *proof,
+              size_t *proof_len)
+{
+        size_t  ts = mk->ops->tag_size;
+        size_t  n = mk->nleaves;
+        size_t  j;
+
+        while (n > 1) {
+                if (NULL != proof && (index ^ 1) < n) {
+                        memcpy(proof + *proof_len, mk->nodes + (index ^ 1) * ts,
+                               ts);
+                        *proof_len += ts;
+                }
+                for (j = 0; j + 1 < n; j += 2)
+                        if (!merkle_node(mk->ops, &mk->mac,
+                                         mk->nodes + j * ts,
+                                         mk->nodes + (j + 1) * ts,
+                                         mk->nodes + (j / 2) * ts))
+                                return 0;
+                if (n & 1)
+                        memmove(mk->nodes + (n / 2) * ts,
+                                mk->nodes + (n - 1) * ts, ts);
+                index >>= 1;
+                n = (n + 1) / 2;
+        }
+        return 1;
+}
+
+
+/*
+ * Return the size of the header, including the tag, of an object of
+ * the given box type, or 0 if the type is not known. Chunk i of the
+ * ciphertext starts i times the chunk size bytes after the header.
+ */
+size_t
+cryptobox_merkle_head_size(int type)
+{
+        const struct box_ops    *ops;
+
+        if (NULL == (ops = box_ops_lookup(type)))
+                return 0;
+        return merkle_head_size(ops);
+}
+
+
+/*
+ * Read the chunk size and message length from the header of an object,
+ * so that a reader can locate a chunk. These values are only
+ * authenticated once a chunk or the whole object has been opened.
+ * Returns 1 if the header is well formed and 0 otherwise.
+ */
+int
+cryptobox_merkle_info(int type, unsigned char *head, size_t *chunk_size,
+                      size_t *len)
+{
+        const struct box_ops    *ops;
+
+        if (NULL == head || NULL == (ops = box_ops_lookup(type)))
+                return 0;
+        return merkle_parse(ops, head, chunk_size, len);
+}
+
+
+/*
+ * Seal a message into an object with chunks of chunk_size bytes, which
+ * must be a multiple of 16; 0 selects CRYPTOBOX_MERKLE_CHUNK. The
+ * length of the object is stored in obj_len if it is not NULL. Returns
+ * NULL on failure.
+ */
+unsigned char *
+cryptobox_merkle_seal(int type, unsigned char *m, size_t mlen,
+                      size_t chunk_size, size_t *obj_len, unsigned char *key)
+{
+        struct merkle    mk;
+        unsigned char   *obj = NULL;
+        size_t           head_size;
+
+        if (NULL != obj_len)
+                *obj_len = 0;
+        memset(&mk, 0, sizeof mk);
+        if (NULL == (mk.ops = box_ops_lookup(type)))
+                return NULL;
+        if (0 == chunk_size)
+                chunk_size = CRYPTOBOX_MERKLE_CHUNK;
+        head_size = merkle_head_size(mk.ops);
+        if (0 != chunk_size % BOX_BLOCK_SIZE || chunk_size > INT32_MAX ||
+            mlen > SIZE_MAX - head_size)
+                return NULL;
+        if (!merkle_ctx_new(&mk, key))
+                return NULL;
+
+        mk.op = MERKLE_SEAL;
+        mk.len = mlen;
+        mk.chunk_size = chunk_size;
+        mk.nleaves = merkle_leaves(mlen, chunk_size);
+        mk.nodes = box_malloc(mk.nleaves * mk.ops->tag_size);
+        obj = mk.ops->ctx_alloc(mk.ctx, head_size + mlen);
+        if (NULL == mk.nodes || NULL == obj)
+                goto fail;
+
+        memcpy(obj, MERKLE_MAGIC, 4);
+        obj[4] = (unsigned char)type;
+        obj[5] = obj[6] = obj[7] = 0;
+        merkle_put32(obj + 8, (uint32_t)chunk_size);
+        merkle_put64(obj + 12, (uint64_t)mlen);
+        mk.iv = obj + MERKLE_FIXED;
+        mk.in = m;
+        mk.out = obj + head_size;
+        if (!RAND_bytes(mk.iv, mk.ops->iv_size))
+                goto fail;
+        if (merkle_run(&mk))
+        if (merkle_reduce(&mk, 0, NULL, NULL))
+        if (merkle_tag(mk.ops, &mk.mac, obj, mk.nodes, mk.iv +
+                       mk.ops->iv_size)) {
+                if (NULL != obj_len)
+                        *obj_len = head_size + mlen;
+                box_free(mk.nodes);
+                merkle_ctx_free(&mk);
+                return obj;
+        }
+
+fail:
+        if (NULL != obj)
+                mk.ops->ctx_release(mk.ctx, obj, head_size + mlen);
+        box_free(mk.nodes);
+        merkle_ctx_free(&mk);
+        return NULL;
+}
+
+
+/*
+ * Set up a pass over a sealed object and compute its root. The chunks
+ * are decrypted into out on the way if it is not NULL. Returns 1 if
+ * the root matches the tag.
+ */
+int
+merkle_check(struct merkle *mk, unsigned char *obj, size_t obj_len,
+             unsigned char *out, size_t index, unsigned char *proof,
+             size_t *proof_len)
+{
+        unsigned char    tag[SHA512_DIGEST_LENGTH];
+        size_t           head_size = merkle_head_size(mk->ops);
+        int              match = 0;
+
+        if (obj_len < head_size ||
+            !merkle_parse(mk->ops, obj, &mk->chunk_size, &mk->len) ||
+            obj_len - head_size != mk->len)
+                return 0;
+        mk->op = NULL == out ? MERKLE_HASH : MERKLE_OPEN;
+        mk->iv = obj + MERKLE_FIXED;
+        mk->in = obj + head_size;
+        mk->out = out;
+        mk->nleaves = merkle_leaves(mk->len, mk->chunk_size);
+        if (index >= mk->nleaves)
+                return 0;
+        if (NULL == (mk->nodes = box_malloc(mk->nleaves * mk->ops->tag_size)))
+                return 0;
+        if (merkle_run(mk))
+        if (merkle_reduce(mk, index, proof, proof_len))
+        if (merkle_tag(mk->ops, &mk->mac, obj, mk->nodes, tag))
+        if (1 == constant_time_equals(tag, (int)mk->ops->tag_size,
+                                      mk->iv + mk->ops->iv_size,
+                                      (int)mk->ops->tag_size))
+                match = 1;
+        memset(tag, 0, sizeof tag);
+        box_free(mk->nodes);
+        mk->nodes = NULL;
+        return match;
+}
+
+
+/*
+ * Check and decrypt a whole object, hashing and decrypting its chunks
+ * in parallel. The message length is stored in mlen if it is not NULL.
+ * Returns NULL if the object is not authentic.
+ */
+unsigned char *
+cryptobox_merkle_open(int type, unsigned char *obj, size_t obj_len,
+                      size_t *mlen, unsigned char *key)
+{
+        struct merkle    mk;
+        unsigned char   *out = NULL;
+        size_t           len;
+
+        if (NULL != mlen)
+                *mlen = 0;
+        memset(&mk, 0, sizeof mk);
+        if (NULL == obj || NULL == (mk.ops = box_ops_lookup(type)))
+                return NULL;
+        if (obj_len < merkle_head_size(mk.ops))
+                return NULL;
+        len = obj_len - merkle_head_size(mk.ops);
+        if (!merkle_ctx_new(&mk, key))
+                return NULL;
+        if (NULL != (out = mk.ops->ctx_alloc(mk.ctx, len + 1))) {
+                if (merkle_check(&mk, obj, obj_len, out, 0, NULL, NULL)) {
+                        if (NULL != mlen)
+                                *mlen = len;
+                } else {
+                        mk.ops->ctx_release(mk.ctx, out, len + 1);
+                        out = NULL;
+                }
+        }
+        merkle_ctx_free(&mk);
+        return out;
+}
+
+
+/*
+ * Build the inclusion proof for chunk index of an object, after
+ * checking the whole object. The length of the proof is stored in
+ * proof_len. Returns NULL if the object is not authentic or the chunk
+ * does not exist; the caller frees the proof.
+ */
+unsigned char *
+cryptobox_merkle_proof(int type, unsigned char *obj, size_t obj_len,
+                       size_t index, size_t *proof_len, unsigned char *key)
+{
+        struct merkle    mk;
+        unsigned char   *proof;
+        size_t           plen = 0;
+        size_t           size;
+
+        if (NULL != proof_len)
+                *proof_len = 0;
+        memset(&mk, 0, sizeof mk);
+        if (NULL == obj || NULL == (mk.ops = box_ops_lookup(type)))
+                return NULL;
+        if (!merkle_ctx_new(&mk, key))
+                return NULL;
+        size = MERKLE_MAX_DEPTH * mk.ops->tag_size;
+        if (NULL != (proof = mk.ops->ctx_alloc(mk.ctx, size))) {
+                if (merkle_check(&mk, obj, obj_len, NULL, index, proof,
+                                 &plen)) {
+                        if (NULL != proof_len)
+                                *proof_len = plen;
+                } else {
+                        mk.ops->ctx_release(mk.ctx, proof, size);
+                        proof = NULL;
+                }
+        }
+        merkle_ctx_free(&mk);
+        return proof;
+}
+
+
+/*
+ * Check a single chunk against the header of its object, using an
+ * inclusion proof from cryptobox_merkle_proof, and decrypt it into out
+ * if out is not NULL. head is the first cryptobox_merkle_head_size
+ * bytes of the object; out must have room for chunk_len bytes. Returns
+ * 1 if the chunk is authentic and 0 otherwise.
+ */
+int
+cryptobox_merkle_open_chunk(int type, unsigned char *head, size_t index,
+                            unsigned char *chunk, size_t chunk_len,
+                            unsigned char *proof, size_t proof_len,
+                            unsigned char *out, unsigned char *key)
+{
+        const struct box_ops    *ops;
+        void                    *ctx;
+        struct box_mac_key       mac;
+        unsigned char            hash[SHA512_DIGEST_LENGTH];
+        unsigned char            tag[SHA512_DIGEST_LENGTH];
+        size_t                   chunk_size, len, n, idx;
+        size_t                   used = 0;
+        int                      match = 0;
+        int                      ok;
+
+        if (NULL == head || NULL == chunk ||
+            NULL == (ops = box_ops_lookup(type)))
+                return 0;
+        if (!merkle_parse(ops, head, &chunk_size, &len))
+                return 0;
+        n = merkle_leaves(len, chunk_size);
+        if (index >= n || (index < n - 1 && chunk_len != chunk_size) ||
+            (index == n - 1 && chunk_len != len - index * chunk_size))
+                return 0;
+        if (NULL == (ctx = ops->ctx_new(key)))
+                return 0;
+        if (!ops->mac_key(ctx, MERKLE_LABEL, &mac)) {
+                ops->ctx_free(ctx);
+                return 0;
+        }
+
+        ok = merkle_leaf(ops, &mac, index, chunk, chunk_len, hash);
+        for (idx = index; ok && n > 1; idx >>= 1, n = (n + 1) / 2) {
+                if ((idx ^ 1) >= n)
+                        continue;
+                if (NULL == proof || proof_len - used < ops->tag_size) {
+                        ok = 0;
+                        break;
+                }
+                if (idx & 1)
+                        ok = merkle_node(ops, &mac, proof + used, hash, hash);
+                else
+                        ok = merkle_node(ops, &mac, hash, proof + used, hash);
+                used += ops->tag_size;
+        }
+        if (ok && used == proof_len)
+        if (merkle_tag(ops, &mac, head, hash, tag))
+        if (1 == constant_time_equals(tag, (int)ops->tag_size,
+                                      head + MERKLE_FIXED + ops->iv_size,
+                                      (int)ops->tag_size))
+                match = 1;
+        if (match && NULL != out && chunk_len > 0)
+                match = ops->crypt(ctx, head + MERKLE_FIXED,
+                                   index * chunk_size / BOX_BLOCK_SIZE,
+                                   chunk, out, chunk_len);
+        memset(tag, 0, sizeof tag);
+        box_mac_zero(&mac);
+        ops->ctx_free(ctx);
+        return match;
+}
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Sealing and opening single large messages on several workers. The
+ * CTR key stream for any block can be computed independently, so the
+ * message is cut into segments that are encrypted or decrypted as
+ * separate, stealable tasks. The tag is a single HMAC over the IV and
+ * ciphertext, which has to be computed in order. When sealing it is
+ * pipelined behind the segments, with whichever worker completes the
+ * next segment in order taking over the hashing of every contiguous
+ * completed segment. When opening it is checked over the whole box
+ * before any segment is decrypted, as a single-threaded open does, so
+ * that no plaintext of a forged box is ever written out.
+ *
+ * On NUMA machines each segment is queued for the workers of the node
+ * holding its input, so that the bulk of the memory traffic stays on
+ * one node; the output is written by the same worker and so is first
+ * touched, and allocated, on that node as well.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/rand.h>
+
+#include "constant_time.h"
+#include "parallel.h"
+#include "topology.h"
+
+
+static void      par_segment_run(struct sched_task *);
+static void      par_segment_done(struct par_box *, size_t, int);
+static void      par_box_finish(struct par_box *);
+static int       par_box_verify(struct par_box *);
+static size_t    par_box_length(struct par_box *);
+static unsigned char
+                *par_box_ciphertext(struct par_box *);
+
+
+/*
+ * Return the length of the message, in either direction.
+ */
+size_t
+par_box_length(struct par_box *pb)
+{
+        if (PAR_SEAL == pb->op)
+                return (size_t)pb->in_len;
+        return (size_t)pb->out_len;
+}
+
+
+/*
+ * Return the start of the IV and ciphertext that the tag covers.
+ */
+unsigned char *
+par_box_ciphertext(struct par_box *pb)
+{
+        if (PAR_SEAL == pb->op)
+                return pb->out;
+        return pb->in;
+}
+
+
+/*
+ * Check the tag of a box being opened. Returns 1 if it matches.
+ */
+int
+par_box_verify(struct par_box *pb)
+{
+        const struct box_ops    *ops = pb->ops;
+        union box_mac_state      mac;
+        unsigned char            tag[64];
+        size_t                   len;
+        int                      match = 0;
+
+        len = ops->iv_size + par_box_length(pb);
+        ops->tag_start(pb->ctx, &mac);
+        if (ops->tag_update(&mac, pb->in, len))
+        if (ops->tag_finish(pb->ctx, &mac, tag))
+                match = 1 == constant_time_equals(tag, (int)ops->tag_size,
+                                                  pb->in + len,
+                                                  (int)ops->tag_size);
+        memset(&mac, 0, sizeof mac);
+        memset(tag, 0, sizeof tag);
+        return match;
+}
+
+
+/*
+ * Set up the output and the tag state and spawn a task for each
+ * segment. A box being opened has its tag checked first. If the
+ * scheduler is not running, the segments are run by the caller before
+ * this returns.
+ */
+void
+par_box_start(struct par_box *pb)
+{
+        const struct box_ops    *ops = pb->ops;
+        struct par_segment      *segs;
+        unsigned char           *src;
+        size_t                   len, nsegs, seg_size, i;
+        int                      numa;
+
+        pb->out = NULL;
+        pb->out_len = 0;
+        pb->ok = 0;
+        pb->segs = NULL;
+        pb->seg_done = NULL;
+        pb->nsegs = 0;
+        pb->next_hash = 0;
+        pb->hashing = 0;
+        pb->failed = 0;
+
+        if (PAR_SEAL == pb->op) {
+                if (pb->in_len < 0)
+                        goto fail;
+                pb->out_len = pb->in_len + (int)ops->overhead;
+                if (NULL == (pb->out = ops->ctx_alloc(pb->ctx, pb->out_len)))
+                        goto fail;
+                if (!RAND_bytes(pb->out, ops->iv_size))
+                        goto fail;
+        } else {
+                if (pb->in_len < (int)ops->overhead)
+                        goto fail;
+                pb->out_len = pb->in_len - (int)ops->overhead;
+                if (!par_box_verify(pb))
+                        goto fail;
+                pb->out = ops->ctx_alloc(pb->ctx, pb->out_len + 1);
+                if (NULL == pb->out)
+                        goto fail;
+        }
+        if (PAR_SEAL == pb->op) {
+                ops->tag_start(pb->ctx, &pb->mac);
+                if (!ops->tag_update(&pb->mac, pb->out, ops->iv_size))
+                        goto fail;
+        }
+
+        len = par_box_length(pb);
+        pb->seg_size = PAR_SEGMENT;
+        while (len / pb->seg_size >= PAR_MAX_SEGMENTS)
+                pb->seg_size <<= 1;
+        nsegs = (len + pb->seg_size - 1) / pb->seg_size;
+        if (0 == nsegs) {
+                par_box_finish(pb);
+                return;
+        }
+
+        segs = box_malloc(nsegs * sizeof(struct par_segment));
+        pb->seg_done = box_malloc(nsegs);
+        if (NULL == segs || NULL == pb->seg_done) {
+                box_free(segs);
+                goto fail;
+        }
+        memset(pb->seg_done, 0, nsegs);
+        pthread_mutex_init(&pb->lock, NULL);
+        pb->segs = segs;
+        pb->nsegs = nsegs;
+        for (i = 0; i < nsegs; i++) {
+                segs[i].task.run = par_segment_run;
+                segs[i].box = pb;
+                segs[i].index = i;
+        }
+
+        /*
+         * The box may be finished, and released by its owner, as soon
+         * as the last segment has been spawned, so only the locals are
+         * used from here on.
+         */
+        src = PAR_SEAL == pb->op ? pb->in : pb->in + ops->iv_size;
+        seg_size = pb->seg_size;
+        numa = sched_nodes() > 1;
+        for (i = 0; i < nsegs; i++) {
+                if (!sched_spawn_node(&segs[i].task, numa ?
+                    topo_node_of(src + i * seg_size) : -1))
+                        par_segment_run(&segs[i].task);
+        }
+        return;
+
+fail:
+        if (NULL != pb->out)
+                ops->ctx_release(pb->ctx, pb->out, pb->out_len);
+        box_free(pb->seg_done);
+        pb->seg_done = NULL;
+        pb->out = NULL;
+        pb->out_len = 0;
+        pb->done(pb);
+}
+
+
+/*
+ * Encrypt or decrypt one segment.
+ */
+void
+par_segment_run(struct sched_task *task)
+{
+        struct par_segment      *seg = (struct par_segment *)task;
+        struct par_box          *pb = seg->box;
+        const struct box_ops    *ops = pb->ops;
+        unsigned char           *src, *dst;
+        size_t                   off, n;
+        int                      ok;
+
+        off = seg->index * pb->seg_size;
+        n = par_box_length(pb) - off;
+        if (n > pb->seg_size)
+                n = pb->seg_size;
+        if (PAR_SEAL == pb->op) {
+                src = pb->in + off;
+                dst = pb->out + ops->iv_size + off;
+        } else {
+                src = pb->in + ops->iv_size + off;
+                dst = pb->out + off;
+        }
+        ok = ops->crypt(pb->ctx, par_box_ciphertext(pb), off / BOX_BLOCK_SIZE,
+                        src, dst, n);
+        sched_account(n);
+        par_segment_done(pb, seg->index, ok);
+}
+
+
+/*
+ * Record a finished segment and, when sealing, unless another worker
+ * is already doing so, hash every segment that is ready in order. The
+ * worker that hashes the last segment finishes the box. A box being
+ * opened was checked before it was decrypted, so its segments need
+ * only be counted.
+ */
+void
+par_segment_done(struct par_box *pb, size_t index, int ok)
+{
+        unsigned char   *ct;
+        size_t           i, off, n, len;
+        int              finished;
+
+        pthread_mutex_lock(&pb->lock);
+        pb->seg_done[index] = 1;
+        if (!ok)
+                pb->failed = 1;
+        if (PAR_OPEN == pb->op) {
+                finished = ++pb->next_hash == pb->nsegs;
+                pthread_mutex_unlock(&pb->lock);
+                if (finished)
+                        par_box_finish(pb);
+                return;
+        }
+        if (pb->hashing) {
+                pthread_mutex_unlock(&pb->lock);
+                return;
+        }
+        pb->hashing = 1;
+
+        len = par_box_length(pb);
+        ct = par_box_ciphertext(pb) + pb->ops->iv_size;
+        while (pb->next_hash < pb->nsegs && pb->seg_done[pb->next_hash]) {
+                i = pb->next_hash;
+                pthread_mutex_unlock(&pb->lock);
+
+                off = i * pb->seg_size;
+                n = len - off;
+                if (n > pb->seg_size)
+                        n = pb->seg_size;
+                ok = pb->ops->tag_update(&pb->mac, ct + off, n);
+
+                pthread_mutex_lock(&pb->lock);
+                if (!ok)
+                        pb->failed = 1;
+                pb->next_hash++;
+        }
+        pb->hashing = 0;
+        finished = pb->next_hash == pb->nsegs;
+        pthread_mutex_unlock(&pb->lock);
+
+        if (finished)
+                par_box_finish(pb);
+}
+
+
+/*
+ * Write the tag of a sealed box, release the segment state and hand
+ * the box back to its owner. A box that fails is wiped.
+ */
+void
+par_box_finish(struct par_box *pb)
+{
+        const struct box_ops    *ops = pb->ops;
+        unsigned char           *ctag;
+
+        ctag = pb->out + ops->iv_size + par_box_length(pb);
+        if (pb->failed)
+                memset(&pb->mac, 0, sizeof(union box_mac_state));
+        else if (PAR_SEAL == pb->op)
+                pb->ok = ops->tag_finish(pb->ctx, &pb->mac, ctag);
+        else
+                pb->ok = 1;
+
+        if (!pb->ok) {
+                ops->ctx_release(pb->ctx, pb->out, pb->out_len);
+                pb->out = NULL;
+                pb->out_len = 0;
+        }
+        if (pb->nsegs > 0) {
+                pthread_mutex_destroy(&pb->lock);
+                box_free(pb->segs);
+                box_free(pb->seg_done);
+                pb->segs = NULL;
+                pb->seg_done = NULL;
+        }
+        pb->done(pb);
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "box.h"
+#include "scheduler.h"
+
+
+/*
+ * Messages at least PAR_SPLIT bytes long are sealed or opened in
+ * segments of PAR_SEGMENT bytes, which the workers can steal from
+ * each other. Smaller messages in a batch are grouped into chunks of
+ * about PAR_CHUNK bytes, so that tiny messages do not each cost a
+ * task.
+ */
+#define PAR_SEGMENT             (256 * 1024)
+#define PAR_MAX_SEGMENTS        1024
+#define PAR_SPLIT               (4 * PAR_SEGMENT)
+#define PAR_CHUNK               (64 * 1024)
+
+#define PAR_SEAL                1
+#define PAR_OPEN                2
+
+
+struct par_box;
+
+struct par_segment {
+        struct sched_task        task;
+        struct par_box          *box;
+        size_t                   index;
+};
+
+/*
+ * A message being sealed or opened in segments. The caller fills in
+ * the first group of fields and calls par_box_start; done is called
+ * exactly once, from whichever thread finishes the box, after out,
+ * out_len and ok have been set. On failure out is NULL.
+ */
+struct par_box {
+        const struct box_ops    *ops;
+        void                    *ctx;
+        int                      op;
+        unsigned char           *in;
+        int                      in_len;
+        void                   (*done)(struct par_box *);
+        void                    *arg;
+
+        unsigned char           *out;
+        int                      out_len;
+        int                      ok;
+
+        struct par_segment      *segs;
+        unsigned char           *seg_done;
+        size_t                   nsegs;
+        size_t                   seg_size;
+        size_t                   next_hash;
+        int                      hashing;
+        int                      failed;
+        pthread_mutex_t          lock;
+        union box_mac_state      mac;
+};
+
+
+void     par_box_start(struct par_box *);
+
+
+#endif
@@ -0,0 +1,860 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Pipelined sealing and opening of files in the chunked streaming
+ * format. Every chunk of a stream sits at a fixed offset in both the
+ * input and the output, so chunks can be read, sealed and written out
+ * of order: the calling thread keeps up to depth reads in flight
+ * through io_uring, hands each chunk that arrives to the worker pool
+ * to be sealed or opened in place, and writes it out as soon as it is
+ * done. The chunk buffers are registered with the ring, so the kernel
+ * does not pin and unpin their pages for every I/O. The ring is driven
+ * with the raw system calls. Where io_uring is not available, or
+ * CRYPTOBOX_PIPE_NO_URING is given, the chunks are spread over worker
+ * tasks that each read, seal and write with pread and pwrite.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#define PIPE_URING
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#endif
+
+#include "box.h"
+#include "scheduler.h"
+#include <cryptobox/pipeline.h>
+#include <cryptobox/stream.h>
+
+
+#define PIPE_SEAL       1
+#define PIPE_OPEN       2
+
+#define PIPE_WAKE       (~(uint64_t)0)
+
+
+struct pipe;
+
+/*
+ * A chunk buffer. While a slot is being sealed or opened, task is on
+ * the worker pool; when it is done the slot is pushed onto the pipe's
+ * list of finished slots through next.
+ */
+struct pipe_slot {
+        struct sched_task        task;
+        struct pipe             *p;
+        struct pipe_slot        *next;
+        unsigned char           *buf;
+        uint64_t                 index;
+        size_t                   len;
+        size_t                   done;
+        int                      ok;
+#ifdef PIPE_URING
+        struct iovec             iov;
+#endif
+};
+
+/*
+ * A pipeline run. remaining counts the worker tasks that have not yet
+ * finished with the pipe: the fallback's tasks, or the chunks handed
+ * to the workers by the ring, which push themselves onto finished and
+ * signal efd when they are done.
+ */
+struct pipe {
+        struct cryptobox_stream *s;
+        int                      op;
+        int                      in_fd;
+        int                      out_fd;
+        off_t                    in_base;
+        off_t                    out_base;
+        size_t                   in_stride;
+        size_t                   out_stride;
+        size_t                   tag_size;
+        uint64_t                 nchunks;
+        size_t                   last_len;
+        int                      depth;
+        int                      flags;
+
+        struct pipe_slot        *slots;
+        int                      nslots;
+        unsigned char           *mem;
+        size_t                   mem_len;
+        size_t                   buf_size;
+        int                      mem_busy;
+
+        uint64_t                 next;
+        int                      failed;
+        int                      remaining;
+        sem_t                    done;
+
+        struct pipe_slot        *finished;
+        int                      efd;
+};
+
+
+static size_t    pipe_in_len(struct pipe *, uint64_t);
+static off_t     pipe_in_off(struct pipe *, uint64_t);
+static off_t     pipe_out_off(struct pipe *, uint64_t);
+static size_t    pipe_out_len(struct pipe *, size_t);
+static int       pipe_pread(int, unsigned char *, size_t, off_t);
+static int       pipe_pwrite(int, unsigned char *, size_t, off_t);
+static int       pipe_crypt(struct pipe *, struct pipe_slot *);
+static void      pipe_worker_run(struct sched_task *);
+static int       pipe_threads(struct pipe *);
+static int       pipe_run(struct pipe *);
+#ifdef PIPE_URING
+static void      pipe_crypt_run(struct sched_task *);
+static int       pipe_uring(struct pipe *);
+#endif
+
+
+size_t
+pipe_in_len(struct pipe *p, uint64_t index)
+{
+        return index + 1 < p->nchunks ? p->in_stride : p->last_len;
+}
+
+
+off_t
+pipe_in_off(struct pipe *p, uint64_t index)
+{
+        return p->in_base + (off_t)(index * p->in_stride);
+}
+
+
+off_t
+pipe_out_off(struct pipe *p, uint64_t index)
+{
+        return p->out_base + (off_t)(index * p->out_stride);
+}
+
+
+/*
+ * Return the length of a chunk once it has been sealed or opened.
+ */
+size_t
+pipe_out_len(struct pipe *p, size_t in_len)
+{
+        if (PIPE_SEAL == p->op)
+                return in_len + p->tag_size;
+        return in_len - p->tag_size;
+}
+
+
+int
+pipe_pread(int fd, unsigned char *buf, size_t len, off_t off)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = pread(fd, buf, len, off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 1;
+}
+
+
+int
+pipe_pwrite(int fd, unsigned char *buf, size_t len, off_t off)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = pwrite(fd, buf, len, off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 1;
+}
+
+
+/*
+ * Seal or open the chunk in a slot in place. The stream is not
+ * modified by either, so any number of slots may be done at once.
+ */
+int
+pipe_crypt(struct pipe *p, struct pipe_slot *slot)
+{
+        size_t  len = pipe_in_len(p, slot->index);
+
+        if (PIPE_SEAL == p->op)
+                return cryptobox_stream_seal_chunk(p->s, slot->index,
+                                                   slot->buf, len, slot->buf);
+        return cryptobox_stream_open_chunk(p->s, slot->index, slot->buf, len,
+                                           slot->buf);
+}
+
+
+/*
+ * A worker task for the fallback: take chunks in order until they run
+ * out or one fails, reading, sealing and writing each in turn.
+ */
+void
+pipe_worker_run(struct sched_task *task)
+{
+        struct pipe_slot        *slot = (struct pipe_slot *)task;
+        struct pipe             *p = slot->p;
+        size_t                   len;
+        int                      ok;
+
+        while (!__atomic_load_n(&p->failed, __ATOMIC_RELAXED)) {
+                slot->index = __atomic_fetch_add(&p->next, 1,
+                                                 __ATOMIC_RELAXED);
+                if (slot->index >= p->nchunks)
+                        break;
+                len = pipe_in_len(p, slot->index);
+                ok = pipe_pread(p->in_fd, slot->buf, len,
+                                pipe_in_off(p, slot->index)) &&
+                     pipe_crypt(p, slot) &&
+                     pipe_pwrite(p->out_fd, slot->buf, pipe_out_len(p, len),
+                                 pipe_out_off(p, slot->index));
+                if (!ok)
+                        __atomic_store_n(&p->failed, 1, __ATOMIC_RELAXED);
+        }
+        if (0 == __atomic_sub_fetch(&p->remaining, 1, __ATOMIC_ACQ_REL))
+                sem_post(&p->done);
+}
+
+
+/*
+ * Run the fallback: one task per slot on the worker pool, each doing
+ * its own blocking I/O. The wait is as for a batch.
+ */
+int
+pipe_threads(struct pipe *p)
+{
+        int     i;
+
+        if (-1 == sem_init(&p->done, 0, 0))
+                return 0;
+        p->remaining = p->nslots;
+        if (sched_self() < 0)
+                sched_start(0);
+        for (i = 0; i < p->nslots; i++) {
+                p->slots[i].task.run = pipe_worker_run;
+                if (!sched_spawn(&p->slots[i].task))
+                        pipe_worker_run(&p->slots[i].task);
+        }
+        if (sched_self() >= 0) {
+                while (__atomic_load_n(&p->remaining, __ATOMIC_ACQUIRE) > 0)
+                        if (!sched_help())
+                                sched_yield();
+        } else {
+                while (-1 == sem_wait(&p->done) && EINTR == errno)
+                        ;
+        }
+        sem_destroy(&p->done);
+        return !p->failed;
+}
+
+
+#ifdef PIPE_URING
+/*
+ * The parts of an io_uring instance the pipe uses. The rings are
+ * shared with the kernel: the pipe is the only producer of submission
+ * entries and the only consumer of completions.
+ */
+struct pipe_ring {
+        int                      fd;
+        int                      fixed;
+        unsigned                 entries;
+        unsigned                 pending;
+        unsigned                *sq_head;
+        unsigned                *sq_tail;
+        unsigned                *sq_mask;
+        unsigned                *sq_array;
+        unsigned                *cq_head;
+        unsigned                *cq_tail;
+        unsigned                *cq_mask;
+        struct io_uring_sqe     *sqes;
+        struct io_uring_cqe     *cqes;
+        void                    *sq_map;
+        size_t                   sq_map_len;
+        void                    *cq_map;
+        size_t                   cq_map_len;
+        size_t                   sqes_len;
+};
+
+
+static int       ring_setup(struct pipe_ring *, unsigned);
+static void      ring_teardown(struct pipe_ring *);
+static struct io_uring_sqe
+                *ring_sqe(struct pipe_ring *);
+static int       ring_enter(struct pipe_ring *, unsigned);
+static int       ring_drain(struct pipe_ring *, int);
+static void      ring_io(struct pipe *, struct pipe_ring *,
+                         struct pipe_slot *, int);
+static void      ring_wake(struct pipe *, struct pipe_ring *);
+
+
+#define RING_PTR(map, off)      ((unsigned *)(void *)((char *)(map) + (off)))
+
+
+int
+ring_setup(struct pipe_ring *r, unsigned entries)
+{
+        struct io_uring_params  par;
+
+        memset(r, 0, sizeof(struct pipe_ring));
+        memset(&par, 0, sizeof par);
+        r->fd = (int)syscall(__NR_io_uring_setup, entries, &par);
+        if (r->fd < 0)
+                return 0;
+        r->entries = par.sq_entries;
+        r->sq_map_len = par.sq_off.array + par.sq_entries * sizeof(unsigned);
+        r->cq_map_len = par.cq_off.cqes +
+                        par.cq_entries * sizeof(struct io_uring_cqe);
+        r->sqes_len = par.sq_entries * sizeof(struct io_uring_sqe);
+        r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+        r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+        if (MAP_FAILED == r->sq_map || MAP_FAILED == r->cq_map ||
+            MAP_FAILED == (void *)r->sqes) {
+                ring_teardown(r);
+                return 0;
+        }
+        r->sq_head = RING_PTR(r->sq_map, par.sq_off.head);
+        r->sq_tail = RING_PTR(r->sq_map, par.sq_off.tail);
+        r->sq_mask = RING_PTR(r->sq_map, par.sq_off.ring_mask);
+        r->sq_array = RING_PTR(r->sq_map, par.sq_off.array);
+        r->cq_head = RING_PTR(r->cq_map, par.cq_off.head);
+        r->cq_tail = RING_PTR(r->cq_map, par.cq_off.tail);
+        r->cq_mask = RING_PTR(r->cq_map, par.cq_off.ring_mask);
+        r->cqes = (struct io_uring_cqe *)(void *)((char *)r->cq_map +
+                                                  par.cq_off.cqes);
+        return 1;
+}
+
+
+/*
+ * Close a ring. The kernel cancels whatever is still in flight, but may
+ * not be done with the buffers by the time this returns; see
+ * ring_drain.
+ */
+void
+ring_teardown(struct pipe_ring *r)
+{
+        if (NULL != r->sq_map && MAP_FAILED != r->sq_map)
+                munmap(r->sq_map, r->sq_map_len);
+        if (NULL != r->cq_map && MAP_FAILED != r->cq_map)
+                munmap(r->cq_map, r->cq_map_len);
+        if (NULL != r->sqes && MAP_FAILED != (void *)r->sqes)
+                munmap(r->sqes, r->sqes_len);
+        if (r->fd >= 0)
+                close(r->fd);
+}
+
+
+/*
+ * Return the next submission entry, cleared, and queue it. The ring
+ * has room for every slot and the wakeup, and the queue is flushed on
+ * each pass of the loop, so it cannot fill up.
+ */
+struct io_uring_sqe *
+ring_sqe(struct pipe_ring *r)
+{
+        struct io_uring_sqe     *sqe;
+        unsigned                 idx = (*r->sq_tail + r->pending) &
+                                       *r->sq_mask;
+
+        sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        r->sq_array[idx] = idx;
+        r->pending++;
+        return sqe;
+}
+
+
+/*
+ * Publish the queued entries and submit them, waiting for at least
+ * min completions. Returns 0 if the ring has failed.
+ */
+int
+ring_enter(struct pipe_ring *r, unsigned min)
+{
+        long    n;
+
+        __atomic_store_n(r->sq_tail, *r->sq_tail + r->pending,
+                         __ATOMIC_RELEASE);
+        r->pending = 0;
+        for (;;) {
+                n = syscall(__NR_io_uring_enter, r->fd,
+                            *r->sq_tail - __atomic_load_n(r->sq_head,
+                                                          __ATOMIC_ACQUIRE),
+                            min, IORING_ENTER_GETEVENTS, NULL, 0);
+                if (n >= 0)
+                        return 1;
+                if (EINTR == errno)
+                        continue;
+                return EAGAIN == errno || EBUSY == errno;
+        }
+}
+
+
+/*
+ * Reap the completions of the io reads and writes still in flight when
+ * the pipeline stops early, so that the kernel is done with the slot
+ * buffers before they are unmapped. Returns 0 if the ring can no longer
+ * be waited on, in which case the buffers must be left alone.
+ */
+int
+ring_drain(struct pipe_ring *r, int io)
+{
+        unsigned        head;
+
+        while (io > 0) {
+                if (!ring_enter(r, 1))
+                        return 0;
+                head = *r->cq_head;
+                while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+                        if (PIPE_WAKE != r->cqes[head & *r->cq_mask].user_data)
+                                io--;
+                        head++;
+                        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+                }
+        }
+        return 1;
+}
+
+
+/*
+ * Queue the rest of a slot's read or write.
+ */
+void
+ring_io(struct pipe *p, struct pipe_ring *r, struct pipe_slot *slot,
+        int writing)
+{
+        struct io_uring_sqe     *sqe = ring_sqe(r);
+        unsigned char           *addr = slot->buf + slot->done;
+        size_t                   len = slot->len - slot->done;
+
+        if (writing) {
+                sqe->fd = p->out_fd;
+                sqe->off = (uint64_t)pipe_out_off(p, slot->index) +
+                           slot->done;
+        } else {
+                sqe->fd = p->in_fd;
+                sqe->off = (uint64_t)pipe_in_off(p, slot->index) + slot->done;
+        }
+        if (r->fixed) {
+                sqe->opcode = writing ? IORING_OP_WRITE_FIXED :
+                                        IORING_OP_READ_FIXED;
+                sqe->addr = (uint64_t)(uintptr_t)addr;
+                sqe->len = (uint32_t)len;
+                sqe->buf_index = (uint16_t)(slot - p->slots);
+        } else {
+                sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+                slot->iov.iov_base = addr;
+                slot->iov.iov_len = len;
+                sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+                sqe->len = 1;
+        }
+        sqe->user_data = ((uint64_t)(slot - p->slots) << 1) | (writing != 0);
+}
+
+
+/*
+ * Queue a poll on the eventfd the workers signal when they finish a
+ * chunk, so that a wait on the ring also ends then.
+ */
+void
+ring_wake(struct pipe *p, struct pipe_ring *r)
+{
+        struct io_uring_sqe     *sqe = ring_sqe(r);
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = p->efd;
+        sqe->poll_events = POLLIN;
+        sqe->user_data = PIPE_WAKE;
+}
+
+
+/*
+ * A worker task for the ring: seal or open a chunk that has been read,
+ * and hand it back to the thread driving the ring.
+ */
+void
+pipe_crypt_run(struct sched_task *task)
+{
+        struct pipe_slot        *slot = (struct pipe_slot *)task;
+        struct pipe             *p = slot->p;
+        uint64_t                 one = 1;
+
+        slot->ok = pipe_crypt(p, slot);
+        slot->next = __atomic_load_n(&p->finished, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&p->finished, &slot->next, slot,
+                                            1, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+                ;
+        while (-1 == write(p->efd, &one, sizeof one) && EINTR == errno)
+                ;
+        __atomic_sub_fetch(&p->remaining, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Drive the pipeline through io_uring. Returns 1 on success, 0 on
+ * failure, and -1 if a ring could not be set up, before anything has
+ * been read or written.
+ */
+int
+pipe_uring(struct pipe *p)
+{
+        struct pipe_ring         r;
+        struct io_uring_cqe     *cqe;
+        struct pipe_slot        *slot, *list, *free_slots = NULL;
+        struct iovec            *iov;
+        uint64_t                 next = 0, finished = 0, data, efd_count;
+        unsigned                 head;
+        int                      reads = 0, io = 0, jobs = 0, failed = 0;
+        int                      res, ran, i;
+
+        if (!ring_setup(&r, (unsigned)p->nslots + 1))
+                return -1;
+        p->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (p->efd < 0) {
+                ring_teardown(&r);
+                return -1;
+        }
+        if (NULL != (iov = box_malloc(p->nslots * sizeof(struct iovec)))) {
+                for (i = 0; i < p->nslots; i++) {
+                        iov[i].iov_base = p->slots[i].buf;
+                        iov[i].iov_len = p->buf_size;
+                }
+                r.fixed = 0 == syscall(__NR_io_uring_register, r.fd,
+                                       IORING_REGISTER_BUFFERS, iov,
+                                       p->nslots);
+                box_free(iov);
+        }
+        for (i = p->nslots - 1; i >= 0; i--) {
+                p->slots[i].next = free_slots;
+                free_slots = &p->slots[i];
+        }
+        if (sched_self() < 0)
+                sched_start(0);
+        ring_wake(p, &r);
+
+        while (finished < p->nchunks) {
+                while (!failed && reads < p->depth && NULL != free_slots &&
+                       next < p->nchunks) {
+                        slot = free_slots;
+                        free_slots = slot->next;
+                        slot->index = next++;
+                        slot->len = pipe_in_len(p, slot->index);
+                        slot->done = 0;
+                        ring_io(p, &r, slot, 0);
+                        reads++;
+                        io++;
+                }
+
+                list = __atomic_exchange_n(&p->finished, NULL,
+                                           __ATOMIC_ACQUIRE);
+                while (NULL != (slot = list)) {
+                        list = slot->next;
+                        jobs--;
+                        if (!slot->ok)
+                                failed = 1;
+                        if (failed) {
+                                slot->next = free_slots;
+                                free_slots = slot;
+                                continue;
+                        }
+                        slot->len = pipe_out_len(p, pipe_in_len(p,
+                                                                slot->index));
+                        slot->done = 0;
+                        ring_io(p, &r, slot, 1);
+                        io++;
+                }
+                if (failed && 0 == io && 0 == jobs)
+                        break;
+
+                /*
+                 * A caller that is itself a worker runs tasks rather than
+                 * sleep on chunks queued behind it.
+                 */
+                ran = sched_help();
+                if (!ring_enter(&r, ran || NULL != __atomic_load_n(
+                                    &p->finished, __ATOMIC_RELAXED) ? 0 : 1)) {
+                        failed = 1;
+                        break;
+                }
+
+                head = *r.cq_head;
+                while (head != __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE)) {
+                        cqe = &r.cqes[head & *r.cq_mask];
+                        data = cqe->user_data;
+                        res = cqe->res;
+                        head++;
+                        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+
+                        if (PIPE_WAKE == data) {
+                                while (-1 == read(p->efd, &efd_count,
+                                                  sizeof efd_count) &&
+                                       EINTR == errno)
+                                        ;
+                                ring_wake(p, &r);
+                                continue;
+                        }
+                        slot = &p->slots[data >> 1];
+                        if (-EINTR == res || -EAGAIN == res) {
+                                ring_io(p, &r, slot, data & 1);
+                                continue;
+                        }
+                        if (res > 0)
+                                slot->done += (size_t)res;
+                        if (res > 0 && slot->done < slot->len) {
+                                ring_io(p, &r, slot, data & 1);
+                                continue;
+                        }
+                        io--;
+                        if (!(data & 1))
+                                reads--;
+                        if (res < 0 || (0 == res && slot->len > 0))
+                                failed = 1;
+                        if (failed || (data & 1)) {
+                                if (!failed)
+                                        finished++;
+                                slot->next = free_slots;
+                                free_slots = slot;
+                                continue;
+                        }
+                        jobs++;
+                        __atomic_add_fetch(&p->remaining, 1, __ATOMIC_RELAXED);
+                        slot->task.run = pipe_crypt_run;
+                        if (!sched_spawn(&slot->task))
+                                pipe_crypt_run(&slot->task);
+                }
+        }
+
+        /*
+         * Tasks still running hold their slots and the eventfd; wait for
+         * every one to be done with both.
+         */
+        while (__atomic_load_n(&p->remaining, __ATOMIC_ACQUIRE) > 0)
+                if (!sched_help())
+                        sched_yield();
+        if (!ring_drain(&r, io))
+                p->mem_busy = 1;
+        ring_teardown(&r);
+        close(p->efd);
+        return !failed && finished == p->nchunks;
+}
+#endif
+
+
+/*
+ * Set up the slots and run the pipeline. The buffers are wiped before
+ * they are released, as they have held the message.
+ */
+int
+pipe_run(struct pipe *p)
+{
+        long    page = sysconf(_SC_PAGESIZE);
+        int     i, res = -1;
+
+        if (page <= 0)
+                page = 4096;
+        if (p->depth <= 0)
+                p->depth = CRYPTOBOX_PIPE_DEPTH;
+        if (p->depth > CRYPTOBOX_PIPE_MAX_DEPTH)
+                p->depth = CRYPTOBOX_PIPE_MAX_DEPTH;
+        p->nslots = 2 * p->depth;
+        if ((uint64_t)p->nslots > p->nchunks)
+                p->nslots = (int)p->nchunks;
+
+        p->buf_size = p->in_stride > p->out_stride ? p->in_stride :
+                                                     p->out_stride;
+        p->buf_size = (p->buf_size + (size_t)page - 1) & ~((size_t)page - 1);
+        p->mem_len = p->buf_size * (size_t)p->nslots;
+        p->mem = mmap(NULL, p->mem_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == p->mem)
+                return 0;
+        if (NULL == (p->slots = box_malloc(p->nslots *
+                                           sizeof(struct pipe_slot)))) {
+                munmap(p->mem, p->mem_len);
+                return 0;
+        }
+        memset(p->slots, 0, p->nslots * sizeof(struct pipe_slot));
+        for (i = 0; i < p->nslots; i++) {
+                p->slots[i].p = p;
+                p->slots[i].buf = p->mem + (size_t)i * p->buf_size;
+        }
+
+#ifdef PIPE_URING
+        if (!(p->flags & CRYPTOBOX_PIPE_NO_URING))
+                res = pipe_uring(p);
+#endif
+        if (res < 0)
+                res = pipe_threads(p);
+
+        /*
+         * Buffers the kernel may still be reading or writing, after a
+         * ring that could not be drained, are left mapped.
+         */
+        if (p->mem_busy)
+                return res;
+        memset(p->mem, 0, p->mem_len);
+        munmap(p->mem, p->mem_len);
+        box_free(p->slots);
+        return res;
+}
+
+
+/*
+ * Seal the regular file open on in_fd into a stream written to out_fd
+ * from its start, in chunks of chunk_size bytes, or the default if it
+ * is 0. depth is the number of reads to keep in flight; 0 picks a
+ * default. A regular output file is truncated to the stream's length.
+ * Returns 1 on success and 0 on failure.
+ */
+int
+cryptobox_stream_seal_fd(int type, int in_fd, int out_fd, size_t chunk_size,
+                         int depth, int flags, unsigned char *key)
+{
+        struct pipe      p;
+        struct stat      st;
+        unsigned char    head[64];
+        size_t           head_size;
+        int              res = 0;
+
+        if (-1 == fstat(in_fd, &st) || !S_ISREG(st.st_mode))
+                return 0;
+        memset(&p, 0, sizeof p);
+        if (NULL == (p.s = cryptobox_stream_new(type, key)))
+                return 0;
+        if (0 == chunk_size)
+                chunk_size = CRYPTOBOX_STREAM_CHUNK;
+        head_size = cryptobox_stream_head_size(type);
+        if (head_size > sizeof head ||
+            !cryptobox_stream_seal_head(p.s, chunk_size, head))
+                goto out;
+
+        p.op = PIPE_SEAL;
+        p.in_fd = in_fd;
+        p.out_fd = out_fd;
+        p.depth = depth;
+        p.flags = flags;
+        p.tag_size = cryptobox_stream_tag_size(type);
+        p.in_base = 0;
+        p.in_stride = chunk_size;
+        p.out_base = (off_t)head_size;
+        p.out_stride = chunk_size + p.tag_size;
+        p.nchunks = (uint64_t)st.st_size / chunk_size + 1;
+        p.last_len = (size_t)((uint64_t)st.st_size % chunk_size);
+
+        if (!pipe_pwrite(out_fd, head, head_size, 0))
+                goto out;
+        if (0 == fstat(out_fd, &st) && S_ISREG(st.st_mode) &&
+            -1 == ftruncate(out_fd, pipe_out_off(&p, p.nchunks - 1) +
+                            (off_t)(p.last_len + p.tag_size)))
+                goto out;
+        res = pipe_run(&p);
+
+out:
+        cryptobox_stream_free(p.s);
+        return res;
+}
+
+
+/*
+ * Open the stream in the regular file open on in_fd, writing the
+ * message to out_fd from its start. Each chunk is checked before it
+ * is written, but chunks are written as they are checked: if the call
+ * fails, what has been written should be discarded. Returns 1 on
+ * success and 0 on failure.
+ */
+int
+cryptobox_stream_open_fd(int type, int in_fd, int out_fd, int depth,
+                         int flags, unsigned char *key)
+{
+        struct pipe      p;
+        struct stat      st;
+        unsigned char    head[64];
+        uint64_t         body;
+        size_t           head_size, chunk_size;
+        int              res = 0;
+
+        if (-1 == fstat(in_fd, &st) || !S_ISREG(st.st_mode))
+                return 0;
+        memset(&p, 0, sizeof p);
+        if (NULL == (p.s = cryptobox_stream_new(type, key)))
+                return 0;
+        head_size = cryptobox_stream_head_size(type);
+        if (head_size > sizeof head || st.st_size < (off_t)head_size ||
+            !pipe_pread(in_fd, head, head_size, 0) ||
+            !cryptobox_stream_open_head(p.s, head))
+                goto out;
+        chunk_size = cryptobox_stream_chunk_size(p.s);
+
+        p.op = PIPE_OPEN;
+        p.in_fd = in_fd;
+        p.out_fd = out_fd;
+        p.depth = depth;
+        p.flags = flags;
+        p.tag_size = cryptobox_stream_tag_size(type);
+        p.in_base = (off_t)head_size;
+        p.in_stride = chunk_size + p.tag_size;
+        p.out_base = 0;
+        p.out_stride = chunk_size;
+        body = (uint64_t)st.st_size - head_size;
+        p.nchunks = body / p.in_stride + 1;
+        p.last_len = (size_t)(body % p.in_stride);
+        if (p.last_len < p.tag_size)
+                goto out;
+
+        if (0 == fstat(out_fd, &st) && S_ISREG(st.st_mode) &&
+            -1 == ftruncate(out_fd, (off_t)(body - p.nchunks * p.tag_size)))
+                goto out;
+        res = pipe_run(&p);
+
+out:
+        cryptobox_stream_free(p.s);
+        return res;
+}
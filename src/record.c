@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * A framed record layer over a connected stream socket. Each record is
+ *
+ *      length (4) | IV | ciphertext | tag
+ *
+ * where the length counts what follows it, and the tag covers the
+ * sender's role, the record's sequence number in its direction, the
+ * length, the IV and the ciphertext, so that records cannot be
+ * dropped, replayed, reordered or reflected without the receiver
+ * noticing. Records are tagged under a key of their own, expanded from
+ * the box type's tag key, so that a record seen on the wire cannot be
+ * rearranged into a box that opens under the connection key.
+ *
+ * Records are sealed straight into a ring of page-aligned buffers,
+ * mapped and faulted in when the layer is set up, and on Linux are
+ * sent from there with MSG_ZEROCOPY: the message is read once, by the
+ * cipher, and the record is never copied on its way to the NIC. A
+ * buffer is not reused until the kernel has reported, on the socket's
+ * error queue, that it is done with it. Where zero-copy sends are not
+ * available the records are sent normally and the buffers are free at
+ * once. Received records are opened in place in a receive buffer, and
+ * handed to the caller from there.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define RECORD_ZEROCOPY
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
+
+#include "box.h"
+#include "constant_time.h"
+#include <cryptobox/record.h>
+
+
+#define RECORD_LEN_SIZE 4
+#define RECORD_LABEL    "cryptobox-record"
+
+
+/*
+ * A send buffer. While the kernel may still be reading it, pending
+ * counts the zero-copy sends it took that have not completed; their
+ * notification IDs run from first to last.
+ */
+struct record_slot {
+        unsigned char   *buf;
+        uint32_t         first;
+        uint32_t         last;
+        uint32_t         pending;
+};
+
+struct cryptobox_record {
+        const struct box_ops    *ops;
+        void                    *ctx;
+        struct box_mac_key       mac;
+        int                      fd;
+        int                      role;
+        size_t                   max_len;
+        size_t                   wire_max;
+
+        struct record_slot      *slots;
+        int                      nslots;
+        int                      next_slot;
+        unsigned char           *send_mem;
+        size_t                   send_len;
+        size_t                   slot_size;
+        uint64_t                 send_seq;
+        uint32_t                 zc_next;
+        int                      zerocopy;
+        uint64_t                 sent;
+        uint64_t                 copied;
+
+        unsigned char           *recv_buf;
+        size_t                   recv_size;
+        size_t                   recv_start;
+        size_t                   recv_end;
+        uint64_t                 recv_seq;
+};
+
+
+static void      record_put32(unsigned char *, uint32_t);
+static uint32_t  record_get32(unsigned char *);
+static int       record_tag(struct cryptobox_record *, int, uint64_t,
+                            unsigned char *, size_t, unsigned char *);
+static int       record_reap(struct cryptobox_record *);
+static int       record_wait(struct cryptobox_record *,
+                             struct record_slot *);
+static int       record_transmit(struct cryptobox_record *,
+                                 struct record_slot *, size_t);
+
+
+void
+record_put32(unsigned char *p, uint32_t v)
+{
+        p[0] = (unsigned char)(v >> 24);
+        p[1] = (unsigned char)(v >> 16);
+        p[2] = (unsigned char)(v >> 8);
+        p[3] = (unsigned char)v;
+}
+
+
+uint32_t
+record_get32(unsigned char *p)
+{
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+               ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+
+/*
+ * Compute the tag of a record from role with sequence number seq. rec
+ * points at the record's length field, and len is the length of the
+ * IV and ciphertext that follow it.
+ */
+int
+record_tag(struct cryptobox_record *r, int role, uint64_t seq,
+           unsigned char *rec, size_t len, unsigned char *tag)
+{
+        union box_mac_state      mac;
+        unsigned char            prefix[9];
+        int                      i;
+
+        prefix[0] = (unsigned char)role;
+        for (i = 0; i < 8; i++)
+                prefix[1 + i] = (unsigned char)(seq >> (56 - 8 * i));
+        box_mac_start(&r->mac, &mac);
+        if (r->ops->tag_update(&mac, prefix, sizeof prefix))
+        if (r->ops->tag_update(&mac, rec, RECORD_LEN_SIZE + len))
+                return box_mac_finish(&r->mac, &mac, tag);
+        memset(&mac, 0, sizeof mac);
+        return 0;
+}
+
+
+/*
+ * Set up a record layer on a connected stream socket, which should be
+ * in blocking mode, for a box type and role. Records hold at most
+ * max_len bytes of message, or CRYPTOBOX_RECORD_MAX if it is 0, and
+ * up to depth records, or CRYPTOBOX_RECORD_DEPTH if it is 0, may be
+ * in flight at once. Returns NULL on failure.
+ */
+struct cryptobox_record *
+cryptobox_record_new(int fd, int type, int role, unsigned char *key,
+                     size_t max_len, int depth)
+{
+        struct cryptobox_record *r;
+        const struct box_ops    *ops;
+        long                     page = sysconf(_SC_PAGESIZE);
+        int                      i;
+#ifdef RECORD_ZEROCOPY
+        int                      one = 1;
+#endif
+
+        if (NULL == (ops = box_ops_lookup(type)))
+                return NULL;
+        if (CRYPTOBOX_RECORD_CLIENT != role && CRYPTOBOX_RECORD_SERVER != role)
+                return NULL;
+        if (0 == max_len)
+                max_len = CRYPTOBOX_RECORD_MAX;
+        if (max_len > CRYPTOBOX_RECORD_LIMIT)
+                return NULL;
+        if (depth <= 0)
+                depth = CRYPTOBOX_RECORD_DEPTH;
+        if (page <= 0)
+                page = 4096;
+
+        if (NULL == (r = box_malloc(sizeof(struct cryptobox_record))))
+                return NULL;
+        memset(r, 0, sizeof(struct cryptobox_record));
+        r->ops = ops;
+        r->fd = fd;
+        r->role = role;
+        r->max_len = max_len;
+        r->wire_max = RECORD_LEN_SIZE + ops->overhead + max_len;
+        r->send_mem = MAP_FAILED;
+        r->recv_buf = MAP_FAILED;
+        if (NULL == (r->ctx = ops->ctx_new(key)) ||
+            !ops->mac_key(r->ctx, RECORD_LABEL, &r->mac))
+                goto fail;
+
+        r->slot_size = (r->wire_max + (size_t)page - 1) &
+                       ~((size_t)page - 1);
+        r->nslots = depth;
+        r->send_len = r->slot_size * (size_t)depth;
+        r->recv_size = 2 * r->slot_size;
+        r->slots = box_malloc((size_t)depth * sizeof(struct record_slot));
+        if (NULL == r->slots)
+                goto fail;
+        memset(r->slots, 0, (size_t)depth * sizeof(struct record_slot));
+#ifdef MAP_POPULATE
+        r->send_mem = mmap(NULL, r->send_len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANON | MAP_POPULATE, -1, 0);
+#else
+        r->send_mem = mmap(NULL, r->send_len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANON, -1, 0);
+#endif
+        r->recv_buf = mmap(NULL, r->recv_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == r->send_mem || MAP_FAILED == r->recv_buf)
+                goto fail;
+        for (i = 0; i < depth; i++)
+                r->slots[i].buf = r->send_mem + (size_t)i * r->slot_size;
+
+#ifdef RECORD_ZEROCOPY
+        r->zerocopy = 0 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one,
+                                      sizeof one);
+#endif
+        return r;
+
+fail:
+        cryptobox_record_free(r);
+        return NULL;
+}
+
+
+/*
+ * Release a record layer. The socket is left open. Buffers that the
+ * kernel is still sending from stay pinned by the kernel until it is
+ * done with them, so they may be unmapped here.
+ */
+void
+cryptobox_record_free(struct cryptobox_record *r)
+{
+        if (NULL == r)
+                return;
+        if (MAP_FAILED != r->send_mem)
+                munmap(r->send_mem, r->send_len);
+        if (MAP_FAILED != r->recv_buf) {
+                memset(r->recv_buf, 0, r->recv_size);
+                munmap(r->recv_buf, r->recv_size);
+        }
+        box_free(r->slots);
+        box_mac_zero(&r->mac);
+        if (NULL != r->ctx)
+                r->ops->ctx_free(r->ctx);
+        box_free(r);
+}
+
+
+/*
+ * Read what zero-copy completions are waiting on the error queue and
+ * credit them to the buffers they belong to. The IDs wrap, so they are
+ * compared by their distance from each buffer's first ID. Returns 0 on
+ * error.
+ */
+int
+record_reap(struct cryptobox_record *r)
+{
+#ifdef RECORD_ZEROCOPY
+        struct sock_extended_err        *serr;
+        struct record_slot              *slot;
+        struct cmsghdr                  *cm;
+        struct msghdr                    msg;
+        unsigned char                    control[128];
+        int32_t                          lo, hi, n, start, end;
+        int                              i;
+
+        for (;;) {
+                memset(&msg, 0, sizeof msg);
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof control;
+                if (-1 == recvmsg(r->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) {
+                        if (EINTR == errno)
+                                continue;
+                        return EAGAIN == errno || EWOULDBLOCK == errno;
+                }
+                for (cm = CMSG_FIRSTHDR(&msg); NULL != cm;
+                     cm = CMSG_NXTHDR(&msg, cm)) {
+                        if (!((SOL_IP == cm->cmsg_level &&
+                               IP_RECVERR == cm->cmsg_type) ||
+                              (SOL_IPV6 == cm->cmsg_level &&
+                               IPV6_RECVERR == cm->cmsg_type)))
+                                continue;
+                        serr = (struct sock_extended_err *)
+                               (void *)CMSG_DATA(cm);
+                        if (SO_EE_ORIGIN_ZEROCOPY != serr->ee_origin)
+                                continue;
+                        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                                r->copied += serr->ee_data - serr->ee_info + 1;
+                        for (i = 0; i < r->nslots; i++) {
+                                slot = &r->slots[i];
+                                if (0 == slot->pending)
+                                        continue;
+                                lo = (int32_t)(serr->ee_info - slot->first);
+                                hi = (int32_t)(serr->ee_data - slot->first);
+                                n = (int32_t)(slot->last - slot->first);
+                                start = lo > 0 ? lo : 0;
+                                end = hi < n ? hi : n;
+                                if (end >= start)
+                                        slot->pending -= end - start + 1;
+                        }
+                }
+        }
+#else
+        (void)r;
+        return 1;
+#endif
+}
+
+
+/*
+ * Wait until the kernel is done with a buffer, or with every buffer if
+ * slot is NULL. Returns 0 on error.
+ */
+int
+record_wait(struct cryptobox_record *r, struct record_slot *slot)
+{
+        struct pollfd    pfd;
+        int              i, busy;
+
+        for (;;) {
+                if (!record_reap(r))
+                        return 0;
+                busy = 0;
+                if (NULL != slot)
+                        busy = slot->pending > 0;
+                else
+                        for (i = 0; i < r->nslots; i++)
+                                busy |= r->slots[i].pending > 0;
+                if (!busy)
+                        return 1;
+
+                /* The error queue filling shows up as POLLERR. */
+                pfd.fd = r->fd;
+                pfd.events = 0;
+                pfd.revents = 0;
+                if (-1 == poll(&pfd, 1, -1) && EINTR != errno)
+                        return 0;
+                if (pfd.revents & (POLLHUP | POLLNVAL))
+                        if (!record_reap(r) || (pfd.revents & POLLNVAL))
+                                return 0;
+        }
+}
+
+
+/*
+ * Send the len bytes of a sealed record from its buffer. A zero-copy
+ * send that the kernel cannot take for want of memory for its
+ * notifications waits for earlier sends to complete and is tried
+ * again, or goes out as a normal send if there are none.
+ */
+int
+record_transmit(struct cryptobox_record *r, struct record_slot *slot,
+                size_t len)
+{
+        unsigned char   *p = slot->buf;
+        ssize_t          n;
+        int              flags, i, busy;
+
+        while (len > 0) {
+                flags = MSG_NOSIGNAL;
+#ifdef RECORD_ZEROCOPY
+                if (r->zerocopy)
+                        flags |= MSG_ZEROCOPY;
+#endif
+                n = send(r->fd, p, len, flags);
+                if (n < 0 && EINTR == errno)
+                        continue;
+#ifdef RECORD_ZEROCOPY
+                if (n < 0 && ENOBUFS == errno && (flags & MSG_ZEROCOPY)) {
+                        busy = 0;
+                        for (i = 0; i < r->nslots; i++)
+                                busy |= r->slots[i].pending > 0;
+                        if (busy) {
+                                if (!record_wait(r, NULL))
+                                        return 0;
+                                continue;
+                        }
+                        n = send(r->fd, p, len, MSG_NOSIGNAL);
+                        if (n > 0)
+                                r->copied++;
+                        if (n < 0 && (ENOBUFS == errno || EINTR == errno))
+                                continue;
+                }
+                if (n > 0 && (flags & MSG_ZEROCOPY)) {
+                        if (0 == slot->pending)
+                                slot->first = r->zc_next;
+                        slot->last = r->zc_next++;
+                        slot->pending++;
+                }
+#else
+                (void)i;
+                (void)busy;
+#endif
+                if (n <= 0)
+                        return 0;
+                p += n;
+                len -= (size_t)n;
+        }
+        return 1;
+}
+
+
+/*
+ * Seal a message of up to the layer's maximum record length into the
+ * next send buffer and send it. The call blocks until the record has
+ * been handed to the kernel, and, if every buffer is in flight, until
+ * the oldest is free again. Returns 1 on success and 0 on failure;
+ * after a failure the connection should be abandoned.
+ */
+int
+cryptobox_record_send(struct cryptobox_record *r, unsigned char *m,
+                      size_t mlen)
+{
+        struct record_slot      *slot;
+        unsigned char           *iv, *ct;
+        size_t                   body;
+
+        if (NULL == r || mlen > r->max_len || (NULL == m && mlen > 0))
+                return 0;
+        slot = &r->slots[r->next_slot];
+        if (slot->pending > 0 && !record_wait(r, slot))
+                return 0;
+        r->next_slot = (r->next_slot + 1) % r->nslots;
+
+        body = r->ops->iv_size + mlen;
+        iv = slot->buf + RECORD_LEN_SIZE;
+        ct = iv + r->ops->iv_size;
+        record_put32(slot->buf, (uint32_t)(body + r->ops->tag_size));
+        if (!RAND_bytes(iv, r->ops->iv_size))
+                return 0;
+        if (mlen > 0 && !r->ops->crypt(r->ctx, iv, 0, m, ct, mlen))
+                return 0;
+        if (!record_tag(r, r->role, r->send_seq, slot->buf, body, ct + mlen))
+                return 0;
+        r->send_seq++;
+        r->sent++;
+        return record_transmit(r, slot, RECORD_LEN_SIZE + body +
+                                        r->ops->tag_size);
+}
+
+
+/*
+ * Wait until the kernel is done with every record sent so far.
+ * Returns 1 on success and 0 on failure.
+ */
+int
+cryptobox_record_flush(struct cryptobox_record *r)
+{
+        if (NULL == r)
+                return 0;
+        return record_wait(r, NULL);
+}
+
+
+/*
+ * Receive the next record and open it in place. On success *m points
+ * at the message inside the layer's receive buffer, where it stays
+ * until the next call, and *mlen is its length. Returns 1 if a record
+ * was received, 0 if the peer closed the connection between records,
+ * and -1 on failure, including a record that is not authentic; after
+ * a failure the connection should be abandoned.
+ */
+int
+cryptobox_record_recv(struct cryptobox_record *r, unsigned char **m,
+                      size_t *mlen)
+{
+        unsigned char    tag[SHA512_DIGEST_LENGTH];
+        unsigned char   *rec, *iv;
+        size_t           avail, body, len;
+        ssize_t          n;
+        int              peer, match;
+
+        if (NULL == r || NULL == m || NULL == mlen)
+                return -1;
+        peer = CRYPTOBOX_RECORD_CLIENT == r->role ? CRYPTOBOX_RECORD_SERVER :
+                                                    CRYPTOBOX_RECORD_CLIENT;
+        for (;;) {
+                avail = r->recv_end - r->recv_start;
+                rec = r->recv_buf + r->recv_start;
+                if (avail >= RECORD_LEN_SIZE) {
+                        body = record_get32(rec);
+                        if (body < r->ops->overhead ||
+                            body > r->wire_max - RECORD_LEN_SIZE)
+                                return -1;
+                        if (avail >= RECORD_LEN_SIZE + body)
+                                break;
+                }
+
+                /*
+                 * Move a partial record to the front when the rest of
+                 * it would not fit; this is the only copy made.
+                 */
+                if (0 == avail || r->recv_size - r->recv_start <
+                    (avail >= RECORD_LEN_SIZE ? RECORD_LEN_SIZE + body :
+                                                r->wire_max)) {
+                        memmove(r->recv_buf, rec, avail);
+                        r->recv_start = 0;
+                        r->recv_end = avail;
+                }
+                n = recv(r->fd, r->recv_buf + r->recv_end,
+                         r->recv_size - r->recv_end, 0);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n < 0)
+                        return -1;
+                if (0 == n)
+                        return 0 == avail ? 0 : -1;
+                r->recv_end += (size_t)n;
+        }
+
+        len = body - r->ops->tag_size;
+        match = 0;
+        if (record_tag(r, peer, r->recv_seq, rec, len, tag))
+        if (1 == constant_time_equals(tag, (int)r->ops->tag_size,
+                                      rec + RECORD_LEN_SIZE + len,
+                                      (int)r->ops->tag_size))
+                match = 1;
+        memset(tag, 0, sizeof tag);
+        if (!match)
+                return -1;
+
+        iv = rec + RECORD_LEN_SIZE;
+        len -= r->ops->iv_size;
+        if (len > 0 && !r->ops->crypt(r->ctx, iv, 0, iv + r->ops->iv_size,
+                                      iv + r->ops->iv_size, len))
+                return -1;
+        r->recv_seq++;
+        r->recv_start += RECORD_LEN_SIZE + body;
+        *m = iv + r->ops->iv_size;
+        *mlen = len;
+        return 1;
+}
+
+
+/*
+ * Report how many records have been sent, and how many of them the
+ * kernel had to copy after all, which it does for loopback and for
+ * devices that cannot send from user pages.
+ */
+void
+cryptobox_record_stats(struct cryptobox_record *r, uint64_t *sent,
+                       uint64_t *copied)
+{
+        if (NULL != sent)
+                *sent = r->sent;
+        if (NULL != copied)
+                *copied = r->zerocopy ? r->copied : r->sent;
+}
@@ -0,0 +1,784 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * Re-keying: moving boxes and streams from one key, and possibly one
+ * box type, to another without ever holding a whole plaintext. A box
+ * is checked under the old key first, then decrypted and re-encrypted
+ * through a buffer of CRYPTOBOX_REKEY_BUFFER bytes at a time, the new
+ * tag being accumulated as the new ciphertext is written. A stream is
+ * re-keyed chunk by chunk, each chunk opened and resealed in place in
+ * its worker's buffer, so at most one chunk of plaintext per worker
+ * exists at any time. Boxes in a batch and the chunks of a stream are
+ * spread over the worker pool.
+ *
+ * A stream can be re-keyed with a checkpoint file. The chunks are done
+ * in windows; after each window the output is synced and the file is
+ * replaced with a record of how far the rotation has got, along with
+ * the new stream's header, so that an interrupted rotation picks up
+ * where it left off, writing the rest of the stream under the same
+ * header. The record is tagged under a key derived from the new key
+ * for checkpoints alone, since a forged one could otherwise make the
+ * rest of the stream reuse another stream's key stream, and a tag
+ * under the new box key itself would make the record a valid box.
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "box.h"
+#include "constant_time.h"
+#include "scheduler.h"
+#include <cryptobox/rekey.h>
+#include <cryptobox/stream.h>
+
+
+#define REKEY_MAX_KEY           80
+#define REKEY_MAX_HEAD          64
+#define REKEY_WINDOW            8
+#define REKEY_CKPT_MAGIC        "CBRK"
+#define REKEY_CKPT_LABEL        "cryptobox-rekey-checkpoint"
+#define REKEY_CKPT_FIXED        60
+#define REKEY_CKPT_MAX          (REKEY_CKPT_FIXED + REKEY_MAX_HEAD + \
+                                 SHA512_DIGEST_LENGTH)
+
+#define REKEY_BOXES             1
+#define REKEY_STREAM            2
+
+
+struct cryptobox_rekey {
+        const struct box_ops    *old_ops;
+        const struct box_ops    *new_ops;
+        void                    *old_ctx;
+        void                    *new_ctx;
+        struct box_mac_key       ckpt_mac;
+        unsigned char            old_key[REKEY_MAX_KEY];
+        unsigned char            new_key[REKEY_MAX_KEY];
+        uint64_t                 done;
+        uint64_t                 total;
+};
+
+
+struct rekey_run;
+
+struct rekey_task {
+        struct sched_task        task;
+        struct rekey_run        *run;
+        unsigned char           *buf;
+};
+
+/*
+ * One parallel pass: the tasks take units from next up to end until
+ * they run out. For a batch the units are boxes; for a stream they
+ * are chunks.
+ */
+struct rekey_run {
+        struct cryptobox_rekey  *rk;
+        int                      op;
+
+        unsigned char          **in;
+        size_t                  *in_lens;
+        unsigned char          **out;
+        size_t                  *out_lens;
+
+        struct cryptobox_stream *os;
+        struct cryptobox_stream *ns;
+        int                      in_fd;
+        int                      out_fd;
+        uint64_t                 nchunks;
+        size_t                   last_len;
+        off_t                    in_base;
+        off_t                    out_base;
+        size_t                   in_stride;
+        size_t                   out_stride;
+        size_t                   old_tag;
+        size_t                   new_tag;
+        unsigned char            old_head[REKEY_MAX_HEAD];
+        unsigned char            new_head[REKEY_MAX_HEAD];
+        size_t                   old_head_size;
+        size_t                   new_head_size;
+        size_t                   chunk_size;
+        uint64_t                 in_len;
+
+        struct rekey_task       *tasks;
+        int                      ntasks;
+        size_t                   buf_size;
+        uint64_t                 next;
+        uint64_t                 end;
+        int                      failed;
+        int                      remaining;
+        sem_t                    sem;
+};
+
+
+static unsigned char    *rekey_one_box(struct cryptobox_rekey *,
+                                       unsigned char *, size_t,
+                                       unsigned char *, size_t *);
+static int               rekey_one_chunk(struct rekey_run *, uint64_t,
+                                         unsigned char *);
+static void              rekey_worker(struct sched_task *);
+static int               rekey_tasks_new(struct rekey_run *, uint64_t,
+                                         size_t);
+static void              rekey_tasks_free(struct rekey_run *);
+static int               rekey_pass(struct rekey_run *, uint64_t, uint64_t);
+static int               rekey_pread(int, unsigned char *, size_t, off_t);
+static int               rekey_pwrite(int, unsigned char *, size_t, off_t);
+static void              rekey_put64(unsigned char *, uint64_t);
+static uint64_t          rekey_get64(unsigned char *);
+static size_t            rekey_ckpt_build(struct rekey_run *, uint64_t,
+                                          unsigned char *);
+static int               rekey_ckpt_save(struct rekey_run *, const char *,
+                                         uint64_t);
+static int               rekey_ckpt_load(struct rekey_run *, const char *,
+                                         uint64_t *);
+
+
+/*
+ * Set up a re-keying engine from old_key, of box type old_type, to
+ * new_key, of box type new_type. The types may differ, to move boxes
+ * from secretbox to strongbox. Returns NULL on failure.
+ */
+struct cryptobox_rekey *
+cryptobox_rekey_new(int old_type, unsigned char *old_key, int new_type,
+                    unsigned char *new_key)
+{
+        struct cryptobox_rekey  *rk;
+        const struct box_ops    *old_ops, *new_ops;
+
+        if (NULL == (old_ops = box_ops_lookup(old_type)) ||
+            NULL == (new_ops = box_ops_lookup(new_type)) ||
+            NULL == old_key || NULL == new_key)
+                return NULL;
+        if (NULL == (rk = box_malloc(sizeof(struct cryptobox_rekey))))
+                return NULL;
+        memset(rk, 0, sizeof(struct cryptobox_rekey));
+        rk->old_ops = old_ops;
+        rk->new_ops = new_ops;
+        memcpy(rk->old_key, old_key, old_ops->key_size);
+        memcpy(rk->new_key, new_key, new_ops->key_size);
+        if (NULL == (rk->old_ctx = old_ops->ctx_new(old_key)) ||
+            NULL == (rk->new_ctx = new_ops->ctx_new(new_key)) ||
+            !new_ops->mac_key(rk->new_ctx, REKEY_CKPT_LABEL,
+                              &rk->ckpt_mac)) {
+                cryptobox_rekey_free(rk);
+                return NULL;
+        }
+        return rk;
+}
+
+
+/*
+ * Wipe and release a re-keying engine.
+ */
+void
+cryptobox_rekey_free(struct cryptobox_rekey *rk)
+{
+        if (NULL == rk)
+                return;
+        if (NULL != rk->old_ctx)
+                rk->old_ops->ctx_free(rk->old_ctx);
+        box_mac_zero(&rk->ckpt_mac);
+        if (NULL != rk->new_ctx)
+                rk->new_ops->ctx_free(rk->new_ctx);
+        memset(rk, 0, sizeof(struct cryptobox_rekey));
+        box_free(rk);
+}
+
+
+/*
+ * Re-key one box through buf, which holds CRYPTOBOX_REKEY_BUFFER
+ * bytes. The old tag is checked before anything is decrypted.
+ */
+unsigned char *
+rekey_one_box(struct cryptobox_rekey *rk, unsigned char *box, size_t blen,
+              unsigned char *buf, size_t *out_len)
+{
+        const struct box_ops    *oo = rk->old_ops, *no = rk->new_ops;
+        union box_mac_state      mac;
+        unsigned char           *out, *old_ct, *new_ct;
+        size_t                   len, off, n, size;
+        int                      ok = 1;
+
+        if (NULL == box || blen < oo->overhead || blen > INT32_MAX)
+                return NULL;
+        if (!oo->ctx_verify(rk->old_ctx, box, (int)blen))
+                return NULL;
+        len = blen - oo->overhead;
+        size = len + no->overhead;
+        if (NULL == (out = no->ctx_alloc(rk->new_ctx, size)))
+                return NULL;
+        if (!RAND_bytes(out, no->iv_size)) {
+                no->ctx_release(rk->new_ctx, out, size);
+                return NULL;
+        }
+
+        old_ct = box + oo->iv_size;
+        new_ct = out + no->iv_size;
+        no->tag_start(rk->new_ctx, &mac);
+        ok = no->tag_update(&mac, out, no->iv_size);
+        for (off = 0; ok && off < len; off += n) {
+                n = len - off < CRYPTOBOX_REKEY_BUFFER ? len - off :
+                                                         CRYPTOBOX_REKEY_BUFFER;
+                ok = oo->crypt(rk->old_ctx, box, off / BOX_BLOCK_SIZE,
+                               old_ct + off, buf, n) &&
+                     no->crypt(rk->new_ctx, out, off / BOX_BLOCK_SIZE, buf,
+                               new_ct + off, n) &&
+                     no->tag_update(&mac, new_ct + off, n);
+        }
+        memset(buf, 0, len < CRYPTOBOX_REKEY_BUFFER ? len :
+                                                      CRYPTOBOX_REKEY_BUFFER);
+        if (ok)
+                ok = no->tag_finish(rk->new_ctx, &mac, new_ct + len);
+        else
+                memset(&mac, 0, sizeof mac);
+        if (!ok) {
+                no->ctx_release(rk->new_ctx, out, size);
+                return NULL;
+        }
+        __atomic_add_fetch(&rk->done, blen, __ATOMIC_RELAXED);
+        *out_len = size;
+        return out;
+}
+
+
+/*
+ * Re-key a single box. The length of the new box is stored in out_len
+ * if it is not NULL. Returns NULL if the box is not authentic under
+ * the old key, or on failure.
+ */
+unsigned char *
+cryptobox_rekey_box(struct cryptobox_rekey *rk, unsigned char *box,
+                    size_t blen, size_t *out_len)
+{
+        unsigned char   *buf, *out = NULL;
+        size_t           len = 0;
+
+        if (NULL != out_len)
+                *out_len = 0;
+        if (NULL == rk)
+                return NULL;
+        if (NULL == (buf = box_malloc(CRYPTOBOX_REKEY_BUFFER)))
+                return NULL;
+        __atomic_store_n(&rk->done, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&rk->total, blen, __ATOMIC_RELAXED);
+        out = rekey_one_box(rk, box, blen, buf, &len);
+        if (NULL != out && NULL != out_len)
+                *out_len = len;
+        box_free(buf);
+        return out;
+}
+
+
+/*
+ * Re-key chunk index of a stream in place in buf: read it, open it
+ * under the old stream, seal it under the new one, and write it out.
+ */
+int
+rekey_one_chunk(struct rekey_run *run, uint64_t index, unsigned char *buf)
+{
+        size_t  len, plen;
+
+        len = index + 1 < run->nchunks ? run->in_stride : run->last_len;
+        plen = len - run->old_tag;
+        if (!rekey_pread(run->in_fd, buf, len, run->in_base +
+                         (off_t)(index * run->in_stride)))
+                return 0;
+        if (!cryptobox_stream_open_chunk(run->os, index, buf, len, buf) ||
+            !cryptobox_stream_seal_chunk(run->ns, index, buf, plen, buf)) {
+                memset(buf, 0, len);
+                return 0;
+        }
+        if (!rekey_pwrite(run->out_fd, buf, plen + run->new_tag,
+                          run->out_base + (off_t)(index * run->out_stride)))
+                return 0;
+        __atomic_add_fetch(&run->rk->done, len, __ATOMIC_RELAXED);
+        return 1;
+}
+
+
+/*
+ * A worker task: take units until they run out. A box that fails is
+ * left NULL in the output and the rest go on; a chunk that fails
+ * stops the pass.
+ */
+void
+rekey_worker(struct sched_task *task)
+{
+        struct rekey_task       *t = (struct rekey_task *)task;
+        struct rekey_run        *run = t->run;
+        uint64_t                 i;
+        int                      ok;
+
+        for (;;) {
+                if (REKEY_STREAM == run->op &&
+                    __atomic_load_n(&run->failed, __ATOMIC_RELAXED))
+                        break;
+                i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+                if (i >= run->end)
+                        break;
+                if (REKEY_BOXES == run->op) {
+                        run->out[i] = rekey_one_box(run->rk, run->in[i],
+                                                    run->in_lens[i], t->buf,
+                                                    &run->out_lens[i]);
+                        ok = NULL != run->out[i];
+                } else {
+                        ok = rekey_one_chunk(run, i, t->buf);
+                }
+                if (!ok)
+                        __atomic_store_n(&run->failed, 1, __ATOMIC_RELAXED);
+        }
+        if (0 == __atomic_sub_fetch(&run->remaining, 1, __ATOMIC_ACQ_REL))
+                sem_post(&run->sem);
+}
+
+
+/*
+ * Set up one task, with a buffer of buf_size bytes, per worker, but no
+ * more than there are units.
+ */
+int
+rekey_tasks_new(struct rekey_run *run, uint64_t units, size_t buf_size)
+{
+        int     i;
+
+        if (sched_self() < 0)
+                sched_start(0);
+        run->ntasks = sched_workers();
+        if (run->ntasks < 1)
+                run->ntasks = 1;
+        if (units > 0 && (uint64_t)run->ntasks > units)
+                run->ntasks = (int)units;
+        run->buf_size = buf_size;
+        run->tasks = box_malloc((size_t)run->ntasks *
+                                sizeof(struct rekey_task));
+        if (NULL == run->tasks)
+                return 0;
+        memset(run->tasks, 0, (size_t)run->ntasks * sizeof(struct rekey_task));
+        for (i = 0; i < run->ntasks; i++) {
+                run->tasks[i].run = run;
+                if (NULL == (run->tasks[i].buf = box_malloc(buf_size))) {
+                        rekey_tasks_free(run);
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+
+void
+rekey_tasks_free(struct rekey_run *run)
+{
+        int     i;
+
+        for (i = 0; NULL != run->tasks && i < run->ntasks; i++) {
+                if (NULL == run->tasks[i].buf)
+                        continue;
+                memset(run->tasks[i].buf, 0, run->buf_size);
+                box_free(run->tasks[i].buf);
+        }
+        box_free(run->tasks);
+        run->tasks = NULL;
+}
+
+
+/*
+ * Run units first to end over the tasks and wait for them, helping
+ * the pool if the caller is a worker itself.
+ */
+int
+rekey_pass(struct rekey_run *run, uint64_t first, uint64_t end)
+{
+        int     i;
+
+        if (-1 == sem_init(&run->sem, 0, 0))
+                return 0;
+        run->next = first;
+        run->end = end;
+        run->remaining = run->ntasks;
+        for (i = 0; i < run->ntasks; i++) {
+                run->tasks[i].task.run = rekey_worker;
+                if (!sched_spawn(&run->tasks[i].task))
+                        rekey_worker(&run->tasks[i].task);
+        }
+        if (sched_self() >= 0) {
+                while (__atomic_load_n(&run->remaining, __ATOMIC_ACQUIRE) > 0)
+                        if (!sched_help())
+                                sched_yield();
+        } else {
+                while (-1 == sem_wait(&run->sem) && EINTR == errno)
+                        ;
+        }
+        sem_destroy(&run->sem);
+        return !run->failed;
+}
+
+
+/*
+ * Re-key n boxes in parallel, storing each new box and its length in
+ * out and out_lens. A box that is not authentic under the old key is
+ * left NULL. Returns 1 if every box was re-keyed and 0 otherwise.
+ */
+int
+cryptobox_rekey_boxes(struct cryptobox_rekey *rk, unsigned char **boxes,
+                      size_t *lens, size_t n, unsigned char **out,
+                      size_t *out_lens)
+{
+        struct rekey_run         run;
+        uint64_t                 total = 0;
+        size_t                   i;
+        int                      res;
+
+        if (NULL == rk || NULL == boxes || NULL == lens || NULL == out ||
+            NULL == out_lens)
+                return 0;
+        for (i = 0; i < n; i++) {
+                out[i] = NULL;
+                out_lens[i] = 0;
+                total += lens[i];
+        }
+        __atomic_store_n(&rk->done, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&rk->total, total, __ATOMIC_RELAXED);
+        if (0 == n)
+                return 1;
+
+        memset(&run, 0, sizeof run);
+        run.rk = rk;
+        run.op = REKEY_BOXES;
+        run.in = boxes;
+        run.in_lens = lens;
+        run.out = out;
+        run.out_lens = out_lens;
+        if (!rekey_tasks_new(&run, n, CRYPTOBOX_REKEY_BUFFER))
+                return 0;
+        res = rekey_pass(&run, 0, n);
+        rekey_tasks_free(&run);
+        return res;
+}
+
+
+int
+rekey_pread(int fd, unsigned char *buf, size_t len, off_t off)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = pread(fd, buf, len, off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 1;
+}
+
+
+int
+rekey_pwrite(int fd, unsigned char *buf, size_t len, off_t off)
+{
+        ssize_t n;
+
+        while (len > 0) {
+                n = pwrite(fd, buf, len, off);
+                if (n < 0 && EINTR == errno)
+                        continue;
+                if (n <= 0)
+                        return 0;
+                buf += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 1;
+}
+
+
+void
+rekey_put64(unsigned char *p, uint64_t v)
+{
+        int     i;
+
+        for (i = 0; i < 8; i++)
+                p[i] = (unsigned char)(v >> (56 - 8 * i));
+}
+
+
+uint64_t
+rekey_get64(unsigned char *p)
+{
+        uint64_t        v = 0;
+        int             i;
+
+        for (i = 0; i < 8; i++)
+                v = (v << 8) | p[i];
+        return v;
+}
+
+
+/*
+ * Lay out a checkpoint recording that chunks before done have been
+ * re-keyed:
+ *
+ *      magic (4) | old type (1) | new type (1) | 0 (2) | chunk size (4)
+ *      input length (8) | chunks done (8) | SHA-256 of the old header
+ *      new header | tag
+ *
+ * with the tag taken under the checkpoint key. Returns the length, or 0 on
+ * failure.
+ */
+size_t
+rekey_ckpt_build(struct rekey_run *run, uint64_t done, unsigned char *ckpt)
+{
+        const struct box_ops    *no = run->rk->new_ops;
+        union box_mac_state      mac;
+        size_t                   len;
+
+        memcpy(ckpt, REKEY_CKPT_MAGIC, 4);
+        ckpt[4] = (unsigned char)run->rk->old_ops->type;
+        ckpt[5] = (unsigned char)no->type;
+        ckpt[6] = ckpt[7] = 0;
+        ckpt[8] = (unsigned char)(run->chunk_size >> 24);
+        ckpt[9] = (unsigned char)(run->chunk_size >> 16);
+        ckpt[10] = (unsigned char)(run->chunk_size >> 8);
+        ckpt[11] = (unsigned char)run->chunk_size;
+        rekey_put64(ckpt + 12, run->in_len);
+        rekey_put64(ckpt + 20, done);
+        if (NULL == SHA256(run->old_head, run->old_head_size, ckpt + 28))
+                return 0;
+        memcpy(ckpt + REKEY_CKPT_FIXED, run->new_head, run->new_head_size);
+        len = REKEY_CKPT_FIXED + run->new_head_size;
+
+        box_mac_start(&run->rk->ckpt_mac, &mac);
+        if (!no->tag_update(&mac, ckpt, len)) {
+                memset(&mac, 0, sizeof mac);
+                return 0;
+        }
+        if (!box_mac_finish(&run->rk->ckpt_mac, &mac, ckpt + len))
+                return 0;
+        return len + no->tag_size;
+}
+
+
+/*
+ * Replace the checkpoint file with one recording done chunks, writing
+ * a temporary file and renaming it over the old one so that a crash
+ * leaves one or the other intact.
+ */
+int
+rekey_ckpt_save(struct rekey_run *run, const char *path, uint64_t done)
+{
+        unsigned char    ckpt[REKEY_CKPT_MAX];
+        char            *tmp;
+        size_t           len, plen;
+        int              fd, res = 0;
+
+        if (0 == (len = rekey_ckpt_build(run, done, ckpt)))
+                return 0;
+        plen = strlen(path);
+        if (NULL == (tmp = box_malloc(plen + 5)))
+                return 0;
+        memcpy(tmp, path, plen);
+        memcpy(tmp + plen, ".tmp", 5);
+        if (-1 != (fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600))) {
+                if (rekey_pwrite(fd, ckpt, len, 0) && 0 == fsync(fd))
+                        res = 1;
+                close(fd);
+                if (res && -1 == rename(tmp, path))
+                        res = 0;
+                if (!res)
+                        unlink(tmp);
+        }
+        box_free(tmp);
+        return res;
+}
+
+
+/*
+ * Read the checkpoint file, if there is one. Returns 1 with the number
+ * of chunks done stored in done and the new header restored, 1 with
+ * done set to 0 if there is no checkpoint, and 0 if the checkpoint
+ * belongs to another rotation or has been altered.
+ */
+int
+rekey_ckpt_load(struct rekey_run *run, const char *path, uint64_t *done)
+{
+        unsigned char    ckpt[REKEY_CKPT_MAX];
+        unsigned char    want[REKEY_CKPT_MAX];
+        size_t           len;
+        ssize_t          n;
+        int              fd, match;
+
+        *done = 0;
+        if (-1 == (fd = open(path, O_RDONLY)))
+                return ENOENT == errno;
+        n = read(fd, ckpt, sizeof ckpt);
+        close(fd);
+        len = REKEY_CKPT_FIXED + run->new_head_size +
+              run->rk->new_ops->tag_size;
+        if (n < 0 || (size_t)n != len)
+                return 0;
+
+        /*
+         * Rebuild the checkpoint from what it claims, under this
+         * rotation's parameters, and compare the lot, tag included.
+         */
+        memcpy(run->new_head, ckpt + REKEY_CKPT_FIXED, run->new_head_size);
+        *done = rekey_get64(ckpt + 20);
+        if (len != rekey_ckpt_build(run, *done, want))
+                return 0;
+        match = 1 == constant_time_equals(ckpt, (int)len, want, (int)len);
+        if (!match || *done > run->nchunks ||
+            !cryptobox_stream_open_head(run->ns, run->new_head) ||
+            cryptobox_stream_chunk_size(run->ns) != run->chunk_size) {
+                *done = 0;
+                return 0;
+        }
+        return 1;
+}
+
+
+/*
+ * Re-key the stream in the regular file open on in_fd into out_fd,
+ * with the same chunk size. If checkpoint is not NULL, progress is
+ * recorded in that file as the work goes on, and a rotation that was
+ * interrupted is resumed from it; the file is removed once the stream
+ * is done. Returns 1 on success and 0 on failure.
+ */
+int
+cryptobox_rekey_stream_fd(struct cryptobox_rekey *rk, int in_fd, int out_fd,
+                          const char *checkpoint)
+{
+        struct rekey_run         run;
+        struct stat              st;
+        uint64_t                 body, done = 0, first, end, window;
+        int                      res = 0;
+
+        if (NULL == rk || -1 == fstat(in_fd, &st) || !S_ISREG(st.st_mode))
+                return 0;
+        memset(&run, 0, sizeof run);
+        run.rk = rk;
+        run.op = REKEY_STREAM;
+        run.in_fd = in_fd;
+        run.out_fd = out_fd;
+        run.old_head_size = cryptobox_stream_head_size(rk->old_ops->type);
+        run.new_head_size = cryptobox_stream_head_size(rk->new_ops->type);
+        run.old_tag = cryptobox_stream_tag_size(rk->old_ops->type);
+        run.new_tag = cryptobox_stream_tag_size(rk->new_ops->type);
+        if (run.old_head_size > REKEY_MAX_HEAD ||
+            run.new_head_size > REKEY_MAX_HEAD ||
+            st.st_size < (off_t)run.old_head_size)
+                return 0;
+        run.os = cryptobox_stream_new(rk->old_ops->type, rk->old_key);
+        run.ns = cryptobox_stream_new(rk->new_ops->type, rk->new_key);
+        if (NULL == run.os || NULL == run.ns)
+                goto out;
+        if (!rekey_pread(in_fd, run.old_head, run.old_head_size, 0) ||
+            !cryptobox_stream_open_head(run.os, run.old_head))
+                goto out;
+
+        run.chunk_size = cryptobox_stream_chunk_size(run.os);
+        run.in_len = (uint64_t)st.st_size;
+        run.in_base = (off_t)run.old_head_size;
+        run.in_stride = run.chunk_size + run.old_tag;
+        run.out_base = (off_t)run.new_head_size;
+        run.out_stride = run.chunk_size + run.new_tag;
+        body = (uint64_t)st.st_size - run.old_head_size;
+        run.nchunks = body / run.in_stride + 1;
+        run.last_len = (size_t)(body % run.in_stride);
+        if (run.last_len < run.old_tag)
+                goto out;
+
+        if (NULL != checkpoint && !rekey_ckpt_load(&run, checkpoint, &done))
+                goto out;
+        if (0 == done &&
+            !cryptobox_stream_seal_head(run.ns, run.chunk_size, run.new_head))
+                goto out;
+        __atomic_store_n(&rk->total, run.in_len, __ATOMIC_RELAXED);
+        __atomic_store_n(&rk->done, run.old_head_size + done * run.in_stride,
+                         __ATOMIC_RELAXED);
+
+        if (!rekey_pwrite(out_fd, run.new_head, run.new_head_size, 0))
+                goto out;
+        if (0 == fstat(out_fd, &st) && S_ISREG(st.st_mode) &&
+            -1 == ftruncate(out_fd, run.out_base +
+                            (off_t)((run.nchunks - 1) * run.out_stride +
+                                    run.last_len - run.old_tag + run.new_tag)))
+                goto out;
+        if (!rekey_tasks_new(&run, run.nchunks - done,
+                             run.chunk_size + (run.old_tag > run.new_tag ?
+                                               run.old_tag : run.new_tag)))
+                goto out;
+
+        /*
+         * Without a checkpoint the stream is done in one pass; with
+         * one, in windows of a few chunks per task.
+         */
+        window = run.nchunks;
+        if (NULL != checkpoint)
+                window = (uint64_t)run.ntasks * REKEY_WINDOW;
+        for (first = done; first < run.nchunks; first = end) {
+                end = run.nchunks - first < window ? run.nchunks :
+                                                     first + window;
+                if (!rekey_pass(&run, first, end))
+                        break;
+                if (NULL == checkpoint)
+                        continue;
+                if (-1 == fsync(out_fd) ||
+                    !rekey_ckpt_save(&run, checkpoint, end))
+                        break;
+        }
+        rekey_tasks_free(&run);
+        res = first >= run.nchunks && !run.failed;
+        if (res && NULL != checkpoint)
+                unlink(checkpoint);
+
+out:
+        cryptobox_stream_free(run.os);
+        cryptobox_stream_free(run.ns);
+        memset(run.new_head, 0, sizeof run.new_head);
+        return res;
+}
+
+
+/*
+ * Report how many bytes of input the current or last call has dealt
+ * with, and how many it has to deal with in all. This may be called
+ * from another thread while a re-key is running.
+ */
+void
+cryptobox_rekey_progress(struct cryptobox_rekey *rk, uint64_t *done,
+                         uint64_t *total)
+{
+        if (NULL != done)
+                *done = NULL == rk ? 0 :
+                        __atomic_load_n(&rk->done, __ATOMIC_RELAXED);
+        if (NULL != total)
+                *total = NULL == rk ? 0 :
+                         __atomic_load_n(&rk->total, __ATOMIC_RELAXED);
+}
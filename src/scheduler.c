@@ -0,0 +1,756 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * A work-stealing scheduler for the library's worker threads. Each
+ * worker owns a Chase-Lev deque: it pushes and pops tasks at the
+ * bottom, in LIFO order, while idle workers steal from the top, taking
+ * the oldest (and usually largest) pieces of work. Threads outside the
+ * pool hand tasks in through a shared injection list. Users split big
+ * jobs by spawning tasks from within a task, so a worker that has run
+ * out of work takes half of someone else's rather than sitting idle.
+ *
+ * On NUMA machines each worker is pinned to the CPUs of one node, and
+ * prefers to steal from workers on its own node. A task that works on
+ * memory belonging to a node can be spawned onto that node's queue,
+ * which only the node's workers take from, so the memory is never
+ * dragged across the interconnect.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+#include "topology.h"
+
+
+#define SCHED_DEQUE_SIZE        4096
+#define SCHED_CACHE_LINE        64
+
+
+struct sched_deque {
+        long                     top;
+        char                     pad0[SCHED_CACHE_LINE];
+        long                     bottom;
+        char                     pad1[SCHED_CACHE_LINE];
+        struct sched_task       *tasks[SCHED_DEQUE_SIZE];
+};
+
+struct sched_queue {
+        pthread_mutex_t          lock;
+        struct sched_task       *head;
+        struct sched_task       *tail;
+};
+
+/*
+ * Each node has its own queue of tasks and its own semaphore, so that
+ * work for a node wakes one of that node's workers.
+ */
+struct sched_node {
+        struct sched_queue       queue;
+        int                      nworkers;
+        int                      idle;
+        sem_t                    wake;
+        char                     pad[SCHED_CACHE_LINE];
+};
+
+struct sched_worker {
+        struct sched_deque       deque;
+        pthread_t                thread;
+        int                      id;
+        int                      node;
+        uint32_t                 seed;
+        struct sched_stats       stats;
+};
+
+
+static void              sched_make_key(void);
+static int               deque_push(struct sched_deque *, struct sched_task *);
+static struct sched_task
+                        *deque_pop(struct sched_deque *);
+static struct sched_task
+                        *deque_steal(struct sched_deque *);
+static void              queue_push(struct sched_queue *,
+                                    struct sched_task *);
+static struct sched_task
+                        *queue_pop(struct sched_queue *);
+static struct sched_task
+                        *sched_steal(struct sched_worker *, int);
+static struct sched_task
+                        *sched_find(struct sched_worker *);
+static int               sched_work(struct sched_worker *);
+static void             *sched_worker_main(void *);
+static uint64_t          sched_now(void);
+static int               sched_queue_task(struct sched_queue *,
+                                          struct sched_task *, int);
+static void              sched_notify_node(int);
+static int               sched_drain(void);
+
+
+static struct {
+        struct sched_worker     *workers;
+        int                      nworkers;
+        struct sched_node       *nodes;
+        int                      nnodes;
+        int                      running;
+        int                      inflight;
+        int                      idle;
+        struct sched_queue       inject;
+        int                    (*source)(void);
+} sched;
+
+static pthread_mutex_t  sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t   sched_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t    sched_key;
+
+
+void
+sched_make_key(void)
+{
+        pthread_key_create(&sched_key, NULL);
+}
+
+
+uint64_t
+sched_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/*
+ * Push a task onto the bottom of a deque; only the owning worker may
+ * do this. Returns 0 if the deque is full.
+ */
+int
+deque_push(struct sched_deque *dq, struct sched_task *task)
+{
+        long    b, t;
+
+        b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+        t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+        if (b - t >= SCHED_DEQUE_SIZE)
+                return 0;
+        __atomic_store_n(&dq->tasks[b & (SCHED_DEQUE_SIZE - 1)], task,
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+        return 1;
+}
+
+
+/*
+ * Pop a task from the bottom of a deque; only the owning worker may
+ * do this. When a single task is left, the owner races thieves for it
+ * on top.
+ */
+struct sched_task *
+deque_pop(struct sched_deque *dq)
+{
+        struct sched_task       *task = NULL;
+        long                     b, t;
+
+        b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+        __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+        if (t <= b) {
+                task = __atomic_load_n(&dq->tasks[b & (SCHED_DEQUE_SIZE - 1)],
+                                       __ATOMIC_RELAXED);
+                if (t == b) {
+                        if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1,
+                            0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                                task = NULL;
+                        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+                }
+        } else {
+                __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+        return task;
+}
+
+
+/*
+ * Steal a task from the top of another worker's deque. Returns NULL
+ * if the deque is empty or another thief won the race.
+ */
+struct sched_task *
+deque_steal(struct sched_deque *dq)
+{
+        struct sched_task       *task;
+        long                     b, t;
+
+        t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+        if (t >= b)
+                return NULL;
+        task = __atomic_load_n(&dq->tasks[t & (SCHED_DEQUE_SIZE - 1)],
+                               __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                return NULL;
+        return task;
+}
+
+
+/*
+ * Append a task to a shared queue.
+ */
+void
+queue_push(struct sched_queue *q, struct sched_task *task)
+{
+        task->next = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (NULL == q->tail)
+                __atomic_store_n(&q->head, task, __ATOMIC_RELEASE);
+        else
+                q->tail->next = task;
+        q->tail = task;
+        pthread_mutex_unlock(&q->lock);
+}
+
+
+/*
+ * Take the oldest task from a shared queue.
+ */
+struct sched_task *
+queue_pop(struct sched_queue *q)
+{
+        struct sched_task       *task;
+
+        if (NULL == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+                return NULL;
+        pthread_mutex_lock(&q->lock);
+        if (NULL != (task = q->head)) {
+                __atomic_store_n(&q->head, task->next, __ATOMIC_RELEASE);
+                if (NULL == task->next)
+                        q->tail = NULL;
+        }
+        pthread_mutex_unlock(&q->lock);
+        return task;
+}
+
+
+/*
+ * Try to steal from the other workers, starting from a random victim;
+ * local selects the workers on the thief's own node, or the rest.
+ */
+struct sched_task *
+sched_steal(struct sched_worker *w, int local)
+{
+        struct sched_task       *task;
+        struct sched_worker     *v;
+        int                      i, victim;
+
+        w->seed ^= w->seed << 13;
+        w->seed ^= w->seed >> 17;
+        w->seed ^= w->seed << 5;
+        victim = (int)(w->seed % (uint32_t)sched.nworkers);
+        for (i = 0; i < sched.nworkers; i++, victim++) {
+                if (victim == sched.nworkers)
+                        victim = 0;
+                v = &sched.workers[victim];
+                if (v == w || (v->node == w->node) != local)
+                        continue;
+                if (NULL != (task = deque_steal(&v->deque))) {
+                        w->stats.steals++;
+                        return task;
+                }
+        }
+        return NULL;
+}
+
+
+/*
+ * Find work for a worker: its own deque first, then its node's queue,
+ * then the deques of the workers on its node, then those on other
+ * nodes, then tasks injected from outside.
+ */
+struct sched_task *
+sched_find(struct sched_worker *w)
+{
+        struct sched_task       *task;
+
+        if (NULL != (task = deque_pop(&w->deque)))
+                return task;
+        if (NULL != (task = queue_pop(&sched.nodes[w->node].queue)))
+                return task;
+        if (NULL != (task = sched_steal(w, 1)))
+                return task;
+        if (sched.nnodes > 1 && NULL != (task = sched_steal(w, 0)))
+                return task;
+        return queue_pop(&sched.inject);
+}
+
+
+/*
+ * Run one task, or poll the external work source. Returns 1 if any
+ * work was done.
+ */
+int
+sched_work(struct sched_worker *w)
+{
+        struct sched_task       *task;
+        int                    (*source)(void);
+        uint64_t                 start;
+        int                      worked = 0;
+
+        start = sched_now();
+        if (NULL != (task = sched_find(w))) {
+                task->run(task);
+                w->stats.tasks++;
+                worked = 1;
+        } else {
+                source = __atomic_load_n(&sched.source, __ATOMIC_ACQUIRE);
+                if (NULL != source)
+                        worked = source();
+        }
+        if (worked)
+                w->stats.busy_ns += sched_now() - start;
+        return worked;
+}
+
+
+/*
+ * Workers run until the scheduler is stopped and no work is left.
+ * Before sleeping, a worker announces itself as idle and looks for
+ * work once more, so work made available at the same moment is never
+ * left behind.
+ */
+void *
+sched_worker_main(void *arg)
+{
+        struct sched_worker     *w = arg;
+        struct sched_node       *node = &sched.nodes[w->node];
+        int                      worked;
+
+        pthread_setspecific(sched_key, w);
+        if (sched.nnodes > 1)
+                topo_bind(w->node);
+        for (;;) {
+                if (sched_work(w))
+                        continue;
+                if (!__atomic_load_n(&sched.running, __ATOMIC_SEQ_CST))
+                        break;
+
+                __atomic_add_fetch(&node->idle, 1, __ATOMIC_SEQ_CST);
+                __atomic_add_fetch(&sched.idle, 1, __ATOMIC_SEQ_CST);
+                worked = sched_work(w);
+                if (!worked && __atomic_load_n(&sched.running,
+                                               __ATOMIC_SEQ_CST)) {
+                        while (-1 == sem_wait(&node->wake) && EINTR == errno)
+                                ;
+                }
+                __atomic_sub_fetch(&sched.idle, 1, __ATOMIC_SEQ_CST);
+                __atomic_sub_fetch(&node->idle, 1, __ATOMIC_SEQ_CST);
+        }
+        return NULL;
+}
+
+
+/*
+ * Start nworkers worker threads; zero or a negative value starts one
+ * per online CPU. The workers are spread evenly over the NUMA nodes.
+ * Returns 1 if the scheduler is running and 0 on failure. Starting a
+ * running scheduler does nothing.
+ */
+int
+sched_start(int nworkers)
+{
+        int     i, n;
+        int     nnodes = 0;
+        int     res = 0;
+
+        pthread_once(&sched_key_once, sched_make_key);
+        pthread_mutex_lock(&sched_lock);
+        if (sched.running) {
+                pthread_mutex_unlock(&sched_lock);
+                return 1;
+        }
+
+        if (nworkers <= 0)
+                nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (nworkers <= 0)
+                nworkers = 1;
+        sched.nnodes = topo_nodes();
+        if (sched.nnodes > nworkers)
+                sched.nnodes = 1;
+        sched.workers = calloc(nworkers, sizeof(struct sched_worker));
+        sched.nodes = calloc(sched.nnodes, sizeof(struct sched_node));
+        if (NULL == sched.workers || NULL == sched.nodes)
+                goto out;
+        for (nnodes = 0; nnodes < sched.nnodes; nnodes++) {
+                if (-1 == sem_init(&sched.nodes[nnodes].wake, 0, 0))
+                        goto out;
+                pthread_mutex_init(&sched.nodes[nnodes].queue.lock, NULL);
+        }
+        pthread_mutex_init(&sched.inject.lock, NULL);
+        sched.inject.head = NULL;
+        sched.inject.tail = NULL;
+        sched.idle = 0;
+        sched.inflight = 0;
+        for (i = 0; i < nworkers; i++) {
+                sched.workers[i].id = i;
+                sched.workers[i].node = (int)((long)i * sched.nnodes /
+                                              nworkers);
+                sched.workers[i].stats.node = sched.workers[i].node;
+                sched.workers[i].seed = 2463534242U + (uint32_t)i * 7919U;
+                sched.nodes[sched.workers[i].node].nworkers++;
+        }
+
+        sched.nworkers = nworkers;
+        __atomic_store_n(&sched.running, 1, __ATOMIC_SEQ_CST);
+        for (i = 0; i < nworkers; i++) {
+                if (0 != pthread_create(&sched.workers[i].thread, NULL,
+                                        sched_worker_main, &sched.workers[i]))
+                        break;
+        }
+        if (i == nworkers) {
+                res = 1;
+        } else {
+                /*
+                 * The workers that did start may be stealing from the
+                 * others' deques, so the pool keeps its full size
+                 * until they have been stopped.
+                 */
+                __atomic_store_n(&sched.running, 0, __ATOMIC_SEQ_CST);
+                n = i;
+                for (i = 0; i < n; i++)
+                        sem_post(&sched.nodes[sched.workers[i].node].wake);
+                for (i = 0; i < n; i++)
+                        pthread_join(sched.workers[i].thread, NULL);
+                pthread_mutex_destroy(&sched.inject.lock);
+                sched.nworkers = 0;
+        }
+
+out:
+        if (!res) {
+                for (i = 0; i < nnodes; i++) {
+                        sem_destroy(&sched.nodes[i].wake);
+                        pthread_mutex_destroy(&sched.nodes[i].queue.lock);
+                }
+                free(sched.workers);
+                free(sched.nodes);
+                sched.workers = NULL;
+                sched.nodes = NULL;
+        }
+        pthread_mutex_unlock(&sched_lock);
+        return res;
+}
+
+
+/*
+ * Run whatever is left on the shared queues once the workers have
+ * gone. Returns 1 if any task was run.
+ */
+int
+sched_drain(void)
+{
+        struct sched_task       *task;
+        int                      i, ran = 0;
+
+        for (i = 0; i < sched.nnodes; i++) {
+                while (NULL != (task = queue_pop(&sched.nodes[i].queue))) {
+                        task->run(task);
+                        ran = 1;
+                }
+        }
+        while (NULL != (task = queue_pop(&sched.inject))) {
+                task->run(task);
+                ran = 1;
+        }
+        return ran;
+}
+
+
+/*
+ * Stop the scheduler. Every task that has been spawned is run before
+ * this returns: the workers run what they can before they are
+ * joined, and tasks a worker queued for a node whose workers had
+ * already left are run by the caller.
+ */
+void
+sched_stop(void)
+{
+        int     i;
+
+        pthread_mutex_lock(&sched_lock);
+        if (!sched.running) {
+                pthread_mutex_unlock(&sched_lock);
+                return;
+        }
+
+        __atomic_store_n(&sched.running, 0, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&sched.inflight, __ATOMIC_SEQ_CST))
+                sched_yield();
+        for (i = 0; i < sched.nworkers; i++)
+                sem_post(&sched.nodes[sched.workers[i].node].wake);
+        for (i = 0; i < sched.nworkers; i++)
+                pthread_join(sched.workers[i].thread, NULL);
+        while (sched_drain())
+                ;
+
+        for (i = 0; i < sched.nnodes; i++) {
+                sem_destroy(&sched.nodes[i].wake);
+                pthread_mutex_destroy(&sched.nodes[i].queue.lock);
+        }
+        pthread_mutex_destroy(&sched.inject.lock);
+        free(sched.workers);
+        free(sched.nodes);
+        sched.workers = NULL;
+        sched.nodes = NULL;
+        sched.nworkers = 0;
+        sched.nnodes = 0;
+        pthread_mutex_unlock(&sched_lock);
+}
+
+
+/*
+ * Return the number of workers, or 0 if the scheduler is not running.
+ */
+int
+sched_workers(void)
+{
+        if (!__atomic_load_n(&sched.running, __ATOMIC_ACQUIRE))
+                return 0;
+        return sched.nworkers;
+}
+
+
+/*
+ * Return the index of the calling worker, or -1 if the caller is not
+ * one of the scheduler's threads.
+ */
+int
+sched_self(void)
+{
+        struct sched_worker     *w;
+
+        pthread_once(&sched_key_once, sched_make_key);
+        if (NULL == (w = pthread_getspecific(sched_key)))
+                return -1;
+        return w->id;
+}
+
+
+/*
+ * Put a task on a shared queue and wake a worker for it, unless the
+ * scheduler has stopped. node is the node to wake, or -1 for any.
+ */
+int
+sched_queue_task(struct sched_queue *q, struct sched_task *task, int node)
+{
+        int     res = 0;
+
+        __atomic_add_fetch(&sched.inflight, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&sched.running, __ATOMIC_SEQ_CST)) {
+                queue_push(q, task);
+                if (node < 0)
+                        sched_notify();
+                else
+                        sched_notify_node(node);
+                res = 1;
+        }
+        __atomic_sub_fetch(&sched.inflight, 1, __ATOMIC_SEQ_CST);
+        return res;
+}
+
+
+/*
+ * Make a task available to the workers. From a worker, the task goes
+ * onto the worker's own deque, or is run at once if the deque is
+ * full; from any other thread it is injected. Returns 0 if the task
+ * could not be scheduled because the scheduler is not running, in
+ * which case the caller still owns it.
+ */
+int
+sched_spawn(struct sched_task *task)
+{
+        struct sched_worker     *w;
+
+        pthread_once(&sched_key_once, sched_make_key);
+        if (NULL != (w = pthread_getspecific(sched_key))) {
+                if (!deque_push(&w->deque, task)) {
+                        task->run(task);
+                        return 1;
+                }
+                sched_notify();
+                return 1;
+        }
+        return sched_queue_task(&sched.inject, task, -1);
+}
+
+
+/*
+ * Make a task available to the workers on a NUMA node, for work on
+ * memory that lives there. A node of -1, or one with no workers, puts
+ * the task where sched_spawn would. The return value is as for
+ * sched_spawn.
+ */
+int
+sched_spawn_node(struct sched_task *task, int node)
+{
+        if (node < 0 || node >= sched_nodes() ||
+            0 == sched.nodes[node].nworkers)
+                return sched_spawn(task);
+        return sched_queue_task(&sched.nodes[node].queue, task, node);
+}
+
+
+/*
+ * Return the number of NUMA nodes the workers are spread over, or 0
+ * if the scheduler is not running.
+ */
+int
+sched_nodes(void)
+{
+        if (!__atomic_load_n(&sched.running, __ATOMIC_ACQUIRE))
+                return 0;
+        return sched.nnodes;
+}
+
+
+/*
+ * Run one task on behalf of a worker that is waiting for other tasks
+ * to finish, so that waiting inside a task cannot starve the pool.
+ * Returns 1 if a task was run, and 0 if none was found or the caller
+ * is not a worker.
+ */
+int
+sched_help(void)
+{
+        struct sched_worker     *w;
+        struct sched_task       *task;
+        uint64_t                 start;
+
+        pthread_once(&sched_key_once, sched_make_key);
+        if (NULL == (w = pthread_getspecific(sched_key)))
+                return 0;
+        start = sched_now();
+        if (NULL == (task = sched_find(w)))
+                return 0;
+        task->run(task);
+        w->stats.tasks++;
+        w->stats.busy_ns += sched_now() - start;
+        return 1;
+}
+
+
+/*
+ * Set the function idle workers call to look for work that is queued
+ * outside the scheduler. It returns nonzero if it found and did some.
+ */
+void
+sched_set_source(int (*source)(void))
+{
+        __atomic_store_n(&sched.source, source, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Wake a sleeping worker, if there is one, after making work
+ * available.
+ */
+void
+sched_notify(void)
+{
+        int     i;
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (0 == __atomic_load_n(&sched.idle, __ATOMIC_SEQ_CST))
+                return;
+        for (i = 0; i < sched.nnodes; i++) {
+                if (__atomic_load_n(&sched.nodes[i].idle,
+                                    __ATOMIC_SEQ_CST) > 0) {
+                        sem_post(&sched.nodes[i].wake);
+                        return;
+                }
+        }
+}
+
+
+/*
+ * Wake a sleeping worker on a node after queueing work for it.
+ */
+void
+sched_notify_node(int node)
+{
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&sched.nodes[node].idle, __ATOMIC_SEQ_CST) > 0)
+                sem_post(&sched.nodes[node].wake);
+}
+
+
+/*
+ * Credit the calling worker with bytes of data processed, for the
+ * per-node throughput figures.
+ */
+void
+sched_account(size_t bytes)
+{
+        struct sched_worker     *w;
+
+        pthread_once(&sched_key_once, sched_make_key);
+        if (NULL != (w = pthread_getspecific(sched_key)))
+                w->stats.bytes += bytes;
+}
+
+
+/*
+ * Copy the counters for up to n workers into stats.
+ */
+void
+sched_stats(struct sched_stats *stats, int n)
+{
+        int     i;
+
+        pthread_mutex_lock(&sched_lock);
+        for (i = 0; i < n && i < sched.nworkers; i++)
+                memcpy(&stats[i], &sched.workers[i].stats,
+                       sizeof(struct sched_stats));
+        pthread_mutex_unlock(&sched_lock);
+}
+
+
+/*
+ * Clear the per-worker counters.
+ */
+void
+sched_reset_stats(void)
+{
+        int     i;
+
+        pthread_mutex_lock(&sched_lock);
+        for (i = 0; i < sched.nworkers; i++) {
+                memset(&sched.workers[i].stats, 0, sizeof(struct sched_stats));
+                sched.workers[i].stats.node = sched.workers[i].node;
+        }
+        pthread_mutex_unlock(&sched_lock);
+}
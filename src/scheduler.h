@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+
+/*
+ * A unit of work for the scheduler. Tasks are embedded at the start
+ * of larger structures by their users; run is called with the task
+ * once, on some worker thread.
+ */
+struct sched_task {
+        void                    (*run)(struct sched_task *);
+        struct sched_task        *next;
+};
+
+/*
+ * Per-worker counters, for benchmarks, and the NUMA node the worker
+ * runs on.
+ */
+struct sched_stats {
+        uint64_t        tasks;
+        uint64_t        steals;
+        uint64_t        busy_ns;
+        uint64_t        bytes;
+        int             node;
+};
+
+
+int      sched_start(int);
+void     sched_stop(void);
+int      sched_workers(void);
+int      sched_self(void);
+int      sched_spawn(struct sched_task *);
+int      sched_spawn_node(struct sched_task *, int);
+int      sched_nodes(void);
+int      sched_help(void);
+void     sched_set_source(int (*)(void));
+void     sched_notify(void);
+void     sched_account(size_t);
+void     sched_stats(struct sched_stats *, int);
+void     sched_reset_stats(void);
+
+
+#endif
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * A locked arena for keys, contexts and message buffers. The arena is
+ * a single mapping, locked into memory and excluded from core dumps
+ * when it is set up, so allocating from it costs no system calls. It
+ * is divided into one region per size class, from 32 bytes to 64 KB
+ * in powers of two, with an inaccessible guard page around each
+ * region so that a stray read or write past the end of a region
+ * faults rather than reaching other secrets. Blocks are wiped when
+ * they are freed and kept on a free list for their class.
+ *
+ * Requests that are too large for the biggest class, or that find
+ * their class exhausted, get a locked, guarded mapping of their own.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cryptobox/secmem.h>
+
+
+#define SECMEM_MIN_SHIFT        5
+#define SECMEM_CLASSES          12
+#define SECMEM_DEFAULT_SIZE     (1024 * 1024)
+#define SECMEM_MAGIC            0x5345434dUL
+
+
+struct secmem_class {
+        pthread_mutex_t          lock;
+        unsigned char           *base;
+        size_t                   size;
+        size_t                   used;
+        size_t                   chunk;
+        void                    *free;
+};
+
+/*
+ * Blocks in their own mapping are preceded by a header, which keeps
+ * the block 16-byte aligned.
+ */
+struct secmem_large {
+        size_t                   magic;
+        size_t                   map_len;
+};
+
+
+static int               secmem_setup(size_t);
+static int               secmem_lock(void *, size_t);
+static int               secmem_class_of(size_t);
+static struct secmem_class
+                        *secmem_owner(void *);
+static void             *secmem_large_alloc(size_t);
+static void              secmem_large_free(void *);
+
+
+static struct {
+        unsigned char           *map;
+        size_t                   map_len;
+        size_t                   page;
+        int                      ready;
+        struct secmem_class      classes[SECMEM_CLASSES];
+} secmem;
+
+static pthread_mutex_t  secmem_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Lock a range into memory and keep it out of core dumps.
+ */
+int
+secmem_lock(void *p, size_t len)
+{
+        if (-1 == mlock(p, len))
+                return 0;
+#ifdef MADV_DONTDUMP
+        (void)madvise(p, len, MADV_DONTDUMP);
+#endif
+        return 1;
+}
+
+
+/*
+ * Map and lock the arena, with size bytes shared between the classes.
+ * Called with secmem_init_lock held.
+ */
+int
+secmem_setup(size_t size)
+{
+        struct secmem_class     *c;
+        unsigned char           *p;
+        size_t                   region[SECMEM_CLASSES];
+        size_t                   page, len;
+        int                      i;
+
+        page = (size_t)sysconf(_SC_PAGESIZE);
+        len = page;
+        for (i = 0; i < SECMEM_CLASSES; i++) {
+                region[i] = size / SECMEM_CLASSES;
+                if (region[i] < ((size_t)1 << (SECMEM_MIN_SHIFT + i)))
+                        region[i] = (size_t)1 << (SECMEM_MIN_SHIFT + i);
+                region[i] = (region[i] + page - 1) & ~(page - 1);
+                len += region[i] + page;
+        }
+
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+                 -1, 0);
+        if (MAP_FAILED == p)
+                return 0;
+        secmem.map = p;
+        secmem.map_len = len;
+        secmem.page = page;
+        i = 0;
+        if (-1 == mprotect(p, page, PROT_NONE))
+                goto fail;
+
+        p += page;
+        for (; i < SECMEM_CLASSES; i++) {
+                c = &secmem.classes[i];
+                if (-1 == mprotect(p + region[i], page, PROT_NONE) ||
+                    !secmem_lock(p, region[i]))
+                        goto fail;
+                pthread_mutex_init(&c->lock, NULL);
+                c->base = p;
+                c->size = region[i];
+                c->used = 0;
+                c->chunk = (size_t)1 << (SECMEM_MIN_SHIFT + i);
+                c->free = NULL;
+                p += region[i] + page;
+        }
+        __atomic_store_n(&secmem.ready, 1, __ATOMIC_RELEASE);
+        return 1;
+
+fail:
+        while (--i >= 0)
+                pthread_mutex_destroy(&secmem.classes[i].lock);
+        munmap(secmem.map, len);
+        secmem.map = NULL;
+        return 0;
+}
+
+
+/*
+ * Set up the arena with size bytes of locked memory for small blocks;
+ * zero selects a default of 1 MB. This fails if the memory cannot be
+ * locked, for example because of RLIMIT_MEMLOCK. Setting up an arena
+ * that is already in place does nothing. Returns 1 on success and 0 on
+ * failure.
+ */
+int
+cryptobox_secmem_init(size_t size)
+{
+        int     res = 1;
+
+        pthread_mutex_lock(&secmem_init_lock);
+        if (!secmem.ready)
+                res = secmem_setup(0 == size ? SECMEM_DEFAULT_SIZE : size);
+        pthread_mutex_unlock(&secmem_init_lock);
+        return res;
+}
+
+
+/*
+ * Returns 1 if the arena has been set up.
+ */
+int
+cryptobox_secmem_enabled(void)
+{
+        return __atomic_load_n(&secmem.ready, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Return the class that serves len bytes, or -1 if it is too large.
+ */
+int
+secmem_class_of(size_t len)
+{
+        int     i;
+
+        for (i = 0; i < SECMEM_CLASSES; i++)
+                if (len <= ((size_t)1 << (SECMEM_MIN_SHIFT + i)))
+                        return i;
+        return -1;
+}
+
+
+/*
+ * Return the class whose region holds p, or NULL if p has a mapping of
+ * its own.
+ */
+struct secmem_class *
+secmem_owner(void *p)
+{
+        unsigned char   *cp = p;
+        int              i;
+
+        if (cp < secmem.map || cp >= secmem.map + secmem.map_len)
+                return NULL;
+        for (i = 0; i < SECMEM_CLASSES; i++)
+                if (cp >= secmem.classes[i].base &&
+                    cp < secmem.classes[i].base + secmem.classes[i].size)
+                        return &secmem.classes[i];
+        return NULL;
+}
+
+
+void *
+secmem_large_alloc(size_t len)
+{
+        struct secmem_large     *hdr;
+        unsigned char           *p;
+        size_t                   data_len, map_len;
+
+        /* The header, the rounding and both guard pages must fit. */
+        if (len > SIZE_MAX - sizeof(struct secmem_large) - 3 * secmem.page)
+                return NULL;
+        data_len = (sizeof(struct secmem_large) + len + secmem.page - 1) &
+                   ~(secmem.page - 1);
+        map_len = data_len + 2 * secmem.page;
+        p = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == p)
+                return NULL;
+        if (-1 == mprotect(p, secmem.page, PROT_NONE) ||
+            -1 == mprotect(p + secmem.page + data_len, secmem.page,
+                           PROT_NONE) ||
+            !secmem_lock(p + secmem.page, data_len)) {
+                munmap(p, map_len);
+                return NULL;
+        }
+        hdr = (struct secmem_large *)(p + secmem.page);
+        hdr->magic = SECMEM_MAGIC;
+        hdr->map_len = map_len;
+        return hdr + 1;
+}
+
+
+void
+secmem_large_free(void *p)
+{
+        struct secmem_large     *hdr = (struct secmem_large *)p - 1;
+        unsigned char           *map;
+        size_t                   map_len = hdr->map_len;
+
+        if (SECMEM_MAGIC != hdr->magic)
+                return;
+        map = (unsigned char *)hdr - secmem.page;
+        memset(hdr, 0, map_len - 2 * secmem.page);
+        munlock(hdr, map_len - 2 * secmem.page);
+        munmap(map, map_len);
+}
+
+
+/*
+ * Allocate len bytes of locked memory, setting up the arena with the
+ * default size if need be. Blocks are aligned to at least 16 bytes.
+ * Returns NULL on failure.
+ */
+void *
+cryptobox_secmem_alloc(size_t len)
+{
+        struct secmem_class     *c;
+        void                    *p = NULL;
+        int                      i;
+
+        if (!cryptobox_secmem_enabled() && !cryptobox_secmem_init(0))
+                return NULL;
+        if (-1 == (i = secmem_class_of(0 == len ? 1 : len)))
+                return secmem_large_alloc(len);
+
+        c = &secmem.classes[i];
+        pthread_mutex_lock(&c->lock);
+        if (NULL != (p = c->free)) {
+                memcpy(&c->free, p, sizeof(void *));
+                memset(p, 0, sizeof(void *));
+        } else if (c->used + c->chunk <= c->size) {
+                p = c->base + c->used;
+                c->used += c->chunk;
+        }
+        pthread_mutex_unlock(&c->lock);
+        if (NULL == p)
+                p = secmem_large_alloc(len);
+        return p;
+}
+
+
+/*
+ * Wipe and release a block allocated with cryptobox_secmem_alloc.
+ */
+void
+cryptobox_secmem_free(void *p)
+{
+        struct secmem_class     *c;
+
+        if (NULL == p)
+                return;
+        if (NULL == (c = secmem_owner(p))) {
+                secmem_large_free(p);
+                return;
+        }
+        memset(p, 0, c->chunk);
+        pthread_mutex_lock(&c->lock);
+        memcpy(p, &c->free, sizeof(void *));
+        c->free = p;
+        pthread_mutex_unlock(&c->lock);
+}
+
+
+/*
+ * Wipe and unmap the arena. Every block must have been freed first.
+ */
+void
+cryptobox_secmem_destroy(void)
+{
+        int     i;
+
+        pthread_mutex_lock(&secmem_init_lock);
+        if (secmem.ready) {
+                __atomic_store_n(&secmem.ready, 0, __ATOMIC_RELEASE);
+                for (i = 0; i < SECMEM_CLASSES; i++) {
+                        memset(secmem.classes[i].base, 0,
+                               secmem.classes[i].size);
+                        pthread_mutex_destroy(&secmem.classes[i].lock);
+                }
+                munlock(secmem.map, secmem.map_len);
+                munmap(secmem.map, secmem.map_len);
+                secmem.map = NULL;
+        }
+        pthread_mutex_unlock(&secmem_init_lock);
+}
@@ -19,27 +19,124 @@
 #include <sys/types.h>
 #include <string.h>
 #include <openssl/evp.h>
-#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <stdio.h>
 
+#include "box.h"
 #include "constant_time.h"
+#include "detached.h"
+#include "hmac_sha2.h"
+#include "keystream.h"
+#include "mapfile.h"
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secmem.h>
 #include <cryptobox/secretbox.h>
 
 
-static int       secretbox_decrypt(unsigned char *, unsigned char *,
+#define SECRETBOX_IV_SIZE       16
+#define SECRETBOX_CRYPT_SIZE    16
+#define SECRETBOX_AAD_LABEL     "cryptobox-secretbox-aad"
+#define SECRETBOX_TAG_SIZE      32
+
+
+/*
+ * A secretbox context holds the expanded form of a key: the AES key
+ * and the HMAC midstates, for boxes alone and for boxes tagged along
+ * with associated data. It is not modified after it is set up, so a
+ * single context may be used from several threads at once. Boxes and
+ * messages are allocated with mem; self is the allocator the context
+ * itself came from. If ks is set, seals draw on its precomputed key
+ * stream; the keystream does its own locking.
+ */
+struct secretbox_ctx {
+        unsigned char           cryptkey[SECRETBOX_CRYPT_SIZE];
+        struct hmac_sha256      tagkey;
+        struct hmac_sha256      aadkey;
+        struct box_allocator    mem;
+        struct box_allocator    self;
+        struct keystream        *ks;
+};
+
+
+static int       secretbox_ctx_init(struct secretbox_ctx *, unsigned char *);
+static int       secretbox_mac_key(struct secretbox_ctx *, const char *,
+                                   struct hmac_sha256 *);
+static void      secretbox_ctx_zero(struct secretbox_ctx *);
+static struct secretbox_ctx
+                *secretbox_ctx_temp(struct secretbox_ctx *, unsigned char *);
+static void      secretbox_ctx_temp_free(struct secretbox_ctx *,
+                                         struct secretbox_ctx *);
+static int       secretbox_decrypt(struct secretbox_ctx *, unsigned char *,
                                    unsigned char *, int);
-static int       secretbox_encrypt(unsigned char *, unsigned char *,
+static int       secretbox_encrypt(struct secretbox_ctx *, unsigned char *,
                                    unsigned char *, int);
 static int       secretbox_generate_nonce(unsigned char *);
-static int       secretbox_tag(unsigned char *, unsigned char *, int,
-                               unsigned char *);
-static int       secretbox_check_tag(unsigned char *, unsigned char *, int);
+static int       secretbox_tag(struct secretbox_ctx *, struct box_aad *,
+                               unsigned char *, int, unsigned char *);
+static int       secretbox_check_tag(struct secretbox_ctx *, struct box_aad *,
+                                     unsigned char *, int);
+static unsigned char
+                *secretbox_seal_box(struct secretbox_ctx *, struct box_aad *,
+                                    unsigned char *, int, int *);
+static unsigned char
+                *secretbox_open_box(struct secretbox_ctx *, struct box_aad *,
+                                    unsigned char *, int);
+static int       secretbox_verify_box(struct secretbox_ctx *, struct box_aad *,
+                                      unsigned char *, int);
+static void     *secretbox_ops_ctx_new(unsigned char *);
+static void      secretbox_ops_ctx_free(void *);
+static unsigned char
+                *secretbox_ops_ctx_seal(void *, unsigned char *, int, int *);
+static unsigned char
+                *secretbox_ops_ctx_open(void *, unsigned char *, int);
+static int       secretbox_ops_ctx_verify(void *, unsigned char *, int);
+static unsigned char
+                *secretbox_ops_ctx_seal_aadv(void *, unsigned char *, int,
+                                             const struct iovec *, int,
+                                             int *);
+static unsigned char
+                *secretbox_ops_ctx_open_aadv(void *, unsigned char *, int,
+                                             const struct iovec *, int);
+static int       secretbox_ops_ctx_verify_aadv(void *, unsigned char *, int,
+                                               const struct iovec *, int);
+static unsigned char
+                *secretbox_ops_ctx_alloc(void *, size_t);
+static void      secretbox_ops_ctx_release(void *, unsigned char *, size_t);
+static int       secretbox_ops_crypt(void *, unsigned char *, size_t,
+                                     unsigned char *, unsigned char *, size_t);
+static int       secretbox_ops_mac_key(void *, const char *,
+                                     struct box_mac_key *);
+static void      secretbox_ops_tag_start(void *, union box_mac_state *);
+static int       secretbox_ops_tag_update(union box_mac_state *,
+                                          unsigned char *, size_t);
+static int       secretbox_ops_tag_finish(void *, union box_mac_state *,
+                                          unsigned char *);
 
 
-const size_t SECRETBOX_IV_SIZE  = 16;
-const size_t SECRETBOX_CRYPT_SIZE = 16;
-const size_t SECRETBOX_TAG_SIZE = 32;
+const struct box_ops secretbox_ops = {
+        CRYPTOBOX_SECRETBOX,
+        48,                     /* SECRETBOX_KEY_SIZE */
+        48,                     /* SECRETBOX_OVERHEAD */
+        SECRETBOX_IV_SIZE,
+        SECRETBOX_TAG_SIZE,
+        secretbox_seal,
+        secretbox_open,
+        secretbox_ops_ctx_new,
+        secretbox_ops_ctx_free,
+        secretbox_ops_ctx_seal,
+        secretbox_ops_ctx_open,
+        secretbox_ops_ctx_verify,
+        secretbox_ops_ctx_seal_aadv,
+        secretbox_ops_ctx_open_aadv,
+        secretbox_ops_ctx_verify_aadv,
+        secretbox_ops_ctx_alloc,
+        secretbox_ops_ctx_release,
+        secretbox_ops_crypt,
+        secretbox_ops_mac_key,
+        secretbox_ops_tag_start,
+        secretbox_ops_tag_update,
+        secretbox_ops_tag_finish
+};
 
 
 /*
@@ -65,16 +162,254 @@ secretbox_generate_nonce(unsigned char *nonce)
 }
 
 
+/*
+ * Expand a key into a context. Returns 1 on success and 0 on failure.
+ */
+int
+secretbox_ctx_init(struct secretbox_ctx *ctx, unsigned char *key)
+{
+        memcpy(ctx->cryptkey, key, SECRETBOX_CRYPT_SIZE);
+        box_allocator_get(&ctx->mem);
+        ctx->ks = NULL;
+        if (!hmac_sha256_init(&ctx->tagkey, key+SECRETBOX_CRYPT_SIZE,
+                              SECRETBOX_TAG_SIZE) ||
+            !secretbox_mac_key(ctx, SECRETBOX_AAD_LABEL, &ctx->aadkey)) {
+                secretbox_ctx_zero(ctx);
+                return 0;
+        }
+        return 1;
+}
+
+
+/*
+ * Wipe the key material in a context.
+ */
+void
+secretbox_ctx_zero(struct secretbox_ctx *ctx)
+{
+        memset(ctx->cryptkey, 0x0, SECRETBOX_CRYPT_SIZE);
+        hmac_sha256_zero(&ctx->tagkey);
+        hmac_sha256_zero(&ctx->aadkey);
+}
+
+
+/*
+ * Derive a MAC key of its own for label from the tag key. This is HKDF
+ * expansion with the tag key as the pseudorandom key; one block of
+ * output is enough, so it comes down to an HMAC over the label and a
+ * 0x01 byte. Boxes with associated data are tagged under such a key, so
+ * that one cannot be passed off as a box without any, or the reverse,
+ * however the data and ciphertext are split; the formats built on boxes
+ * use one each for the same reason.
+ */
+int
+secretbox_mac_key(struct secretbox_ctx *ctx, const char *label,
+                  struct hmac_sha256 *hkey)
+{
+        SHA256_CTX       state;
+        unsigned char    key[SECRETBOX_TAG_SIZE];
+        unsigned char    ctr = 0x01;
+        int              res = 0;
+
+        hmac_sha256_start(&ctx->tagkey, &state);
+        if (SHA256_Update(&state, label, strlen(label)))
+        if (SHA256_Update(&state, &ctr, 1))
+        if (hmac_sha256_finish(&ctx->tagkey, &state, key))
+                res = hmac_sha256_init(hkey, key, SECRETBOX_TAG_SIZE);
+        memset(&state, 0x0, sizeof(SHA256_CTX));
+        memset(key, 0x0, SECRETBOX_TAG_SIZE);
+        return res;
+}
+
+
+/*
+ * Allocate a context for the key, which must be SECRETBOX_KEY_SIZE
+ * bytes. Sealing and opening through a context skips the per-call key
+ * setup that secretbox_seal and secretbox_open carry out. Returns NULL
+ * on failure; the context should be released with secretbox_ctx_free.
+ */
+struct secretbox_ctx *
+secretbox_ctx_new(unsigned char *key)
+{
+        struct secretbox_ctx    *ctx;
+        struct box_allocator     self;
+
+        box_allocator_get(&self);
+        if (NULL == (ctx = box_alloc(&self, sizeof(struct secretbox_ctx))))
+                return NULL;
+        if (!secretbox_ctx_init(ctx, key)) {
+                box_release(&self, ctx, sizeof(struct secretbox_ctx));
+                return NULL;
+        }
+        memcpy(&ctx->self, &self, sizeof(struct box_allocator));
+        return ctx;
+}
+
+
+/*
+ * Allocate a context in the locked arena, setting the arena up with
+ * the default size if need be. Boxes sealed and messages opened with
+ * a secure context are allocated from the arena as well, and must be
+ * released with cryptobox_secmem_free. Returns NULL on failure.
+ */
+struct secretbox_ctx *
+secretbox_ctx_new_secure(unsigned char *key)
+{
+        struct secretbox_ctx    *ctx;
+        struct box_allocator     self;
+
+        box_allocator_secure(&self);
+        if (NULL == (ctx = box_alloc(&self, sizeof(struct secretbox_ctx))))
+                return NULL;
+        if (!secretbox_ctx_init(ctx, key)) {
+                box_release(&self, ctx, sizeof(struct secretbox_ctx));
+                return NULL;
+        }
+        memcpy(&ctx->mem, &self, sizeof(struct box_allocator));
+        memcpy(&ctx->self, &self, sizeof(struct box_allocator));
+        return ctx;
+}
+
+
+/*
+ * Allocate the boxes and messages from a context with alloc and free
+ * instead of the library-wide allocator; passing NULL for either
+ * restores the library-wide allocator. This must be done before the
+ * context is shared between threads.
+ */
+void
+secretbox_ctx_set_allocator(struct secretbox_ctx *ctx, cryptobox_alloc_fn alloc,
+                            cryptobox_free_fn release, void *opaque)
+{
+        if (NULL == alloc || NULL == release) {
+                box_allocator_get(&ctx->mem);
+                return;
+        }
+        ctx->mem.alloc = alloc;
+        ctx->mem.free = release;
+        ctx->mem.opaque = opaque;
+}
+
+
+/*
+ * Wipe and release a context.
+ */
+void
+secretbox_ctx_free(struct secretbox_ctx *ctx)
+{
+        struct box_allocator     self;
+
+        if (NULL == ctx)
+                return;
+        keystream_free(ctx->ks);
+        memcpy(&self, &ctx->self, sizeof(struct box_allocator));
+        box_release(&self, ctx, sizeof(struct secretbox_ctx));
+}
+
+
+/*
+ * Keep depth fresh nonces in reserve, each with the key stream for a
+ * message of up to max_len bytes precomputed, so that sealing a short
+ * message costs only an XOR and the tag. The reserve is filled by
+ * secretbox_ctx_refill. A depth of 0 turns precomputation off. This
+ * must be done before the context is shared between threads. Returns
+ * 1 on success and 0 on failure.
+ */
+int
+secretbox_ctx_keystream(struct secretbox_ctx *ctx, int depth, size_t max_len)
+{
+        struct keystream        *ks = NULL;
+
+        if (depth < 0)
+                return 0;
+        if (depth > 0 && NULL == (ks = keystream_new(&ctx->self, depth,
+                                                     max_len,
+                                                     SECRETBOX_IV_SIZE)))
+                return 0;
+        keystream_free(ctx->ks);
+        ctx->ks = ks;
+        return 1;
+}
+
+
+/*
+ * Refill the nonces used since the last refill. This is meant to be
+ * called when the application is idle, or from a thread of its own;
+ * it may run at the same time as seals on the context. Returns the
+ * number of nonces added to the reserve.
+ */
+int
+secretbox_ctx_refill(struct secretbox_ctx *ctx)
+{
+        if (NULL == ctx->ks)
+                return 0;
+        return keystream_refill(ctx->ks, EVP_aes_128_ctr(), ctx->cryptkey);
+}
+
+
+/*
+ * Report how many seals were served from the reserve and how many had
+ * to compute their key stream because the reserve was empty or the
+ * message was longer than max_len.
+ */
+void
+secretbox_ctx_keystream_stats(struct secretbox_ctx *ctx, uint64_t *hits,
+                              uint64_t *misses)
+{
+        if (NULL != ctx->ks) {
+                keystream_stats(ctx->ks, hits, misses);
+                return;
+        }
+        if (NULL != hits)
+                *hits = 0;
+        if (NULL != misses)
+                *misses = 0;
+}
+
+
+/*
+ * Set up a context for a single call to secretbox_seal or
+ * secretbox_open. Once the arena is in use the context is taken from
+ * it, so the expanded key is never left on the stack; otherwise the
+ * caller's stack context is used.
+ */
+struct secretbox_ctx *
+secretbox_ctx_temp(struct secretbox_ctx *stack, unsigned char *key)
+{
+        struct secretbox_ctx    *ctx = NULL;
+
+        if (cryptobox_secmem_enabled())
+                ctx = cryptobox_secmem_alloc(sizeof(struct secretbox_ctx));
+        if (NULL == ctx)
+                ctx = stack;
+        if (!secretbox_ctx_init(ctx, key)) {
+                if (ctx != stack)
+                        cryptobox_secmem_free(ctx);
+                return NULL;
+        }
+        return ctx;
+}
+
+
+void
+secretbox_ctx_temp_free(struct secretbox_ctx *ctx, struct secretbox_ctx *stack)
+{
+        if (ctx != stack)
+                cryptobox_secmem_free(ctx);
+        else
+                secretbox_ctx_zero(ctx);
+}
+
+
 /*
  * Encrypt the plaintext input using AES-128 in CTR mode.
  */
 int
-secretbox_encrypt(unsigned char *key, unsigned char *in, unsigned char *out,
-                  int data_len)
+secretbox_encrypt(struct secretbox_ctx *ctx, unsigned char *in,
+                  unsigned char *out, int data_len)
 {
         EVP_CIPHER_CTX   crypt;
         unsigned char    nonce[SECRETBOX_IV_SIZE];
-        unsigned char    cryptkey[SECRETBOX_CRYPT_SIZE];
         int              ctlen = 0;
 	int		 finale = 0;
         int              res = 0;
@@ -83,96 +418,139 @@ secretbox_encrypt(unsigned char *key, unsigned char *in, unsigned char *out,
                 return -1;
         }
 	memcpy(out, nonce, SECRETBOX_IV_SIZE);
-        memcpy(cryptkey, key, SECRETBOX_CRYPT_SIZE);
 
         EVP_CIPHER_CTX_init(&crypt);
-        if (EVP_EncryptInit_ex(&crypt, EVP_aes_128_ctr(), NULL, cryptkey, nonce))
+        if (EVP_EncryptInit_ex(&crypt, EVP_aes_128_ctr(), NULL, ctx->cryptkey,
+                               nonce))
         if (EVP_EncryptUpdate(&crypt, out+SECRETBOX_IV_SIZE, &ctlen, in, data_len))
         if (EVP_EncryptFinal_ex(&crypt, out+SECRETBOX_IV_SIZE+ctlen, &finale))
         if (ctlen+finale == data_len)
                 res = 1;
         EVP_CIPHER_CTX_cleanup(&crypt);
-        memset(cryptkey, 0x0, SECRETBOX_CRYPT_SIZE);
         return res;
 }
 
 
 /*
- * Compute the message tag for buffer passed in.
+ * Compute the message tag for the IV and ciphertext passed in,
+ * starting from the HMAC midstates in the context. If there is any
+ * associated data, the tag is taken under the associated data key
+ * over the data, the IV and ciphertext, and the lengths of both.
  */
 int
-secretbox_tag(unsigned char *key, unsigned char *in, int inlen,
-              unsigned char *tag)
+secretbox_tag(struct secretbox_ctx *ctx, struct box_aad *aad,
+              unsigned char *in, int inlen, unsigned char *tag)
 {
-        unsigned char    tagkey[SECRETBOX_TAG_SIZE+1];
-        unsigned int     md_len;
-        int              res = 0;
+        SHA256_CTX       state;
+        unsigned char    trailer[BOX_AAD_TRAILER];
+        int              ok = 1;
+        int              i;
 
-        memcpy(tagkey, key+SECRETBOX_CRYPT_SIZE, SECRETBOX_TAG_SIZE);
-        tag = HMAC(EVP_sha256(), tagkey, SECRETBOX_TAG_SIZE, in, inlen,
-                   tag, &md_len);
-        memset(tagkey, 0x0, SECRETBOX_TAG_SIZE);
-        if (NULL != tag)
-                res = 1;
-        return res;
+        if (NULL == aad || 0 == aad->len)
+                return hmac_sha256(&ctx->tagkey, in, inlen, tag);
+
+        box_aad_trailer(trailer, aad->len, (size_t)inlen);
+        hmac_sha256_start(&ctx->aadkey, &state);
+        for (i = 0; ok && i < aad->iovcnt; i++)
+                ok = SHA256_Update(&state, aad->iov[i].iov_base,
+                                   aad->iov[i].iov_len);
+        if (ok)
+        if (SHA256_Update(&state, in, inlen))
+        if (SHA256_Update(&state, trailer, BOX_AAD_TRAILER))
+                return hmac_sha256_finish(&ctx->aadkey, &state, tag);
+        memset(&state, 0x0, sizeof(SHA256_CTX));
+        return 0;
 }
 
 
 /*
- * Seal a message into a box.
+ * Seal a message into a box, tagged along with any associated data.
  */
 unsigned char *
-secretbox_seal(unsigned char *m, int mlen, int *box_len, unsigned char *key)
+secretbox_seal_box(struct secretbox_ctx *ctx, struct box_aad *aad,
+                   unsigned char *m, int mlen, int *box_len)
 {
         unsigned char           *box;
 	int			 ctlen;
+        int                      ok;
 
+	if (NULL != box_len)
+		*box_len = 0;
 	ctlen = mlen+SECRETBOX_IV_SIZE;
-        if (NULL == (box = malloc(mlen+SECRETBOX_OVERHEAD)))
+        if (NULL == (box = box_alloc(&ctx->mem, mlen+SECRETBOX_OVERHEAD)))
                 return NULL;
 
-        if (secretbox_encrypt(key, m, box, mlen))
-        if (secretbox_tag(key, box, ctlen, box+ctlen)) {
+        if (NULL != ctx->ks && keystream_seal(ctx->ks, m, (size_t)mlen, box))
+                ok = 1;
+        else
+                ok = secretbox_encrypt(ctx, m, box, mlen);
+        if (1 == ok)
+        if (secretbox_tag(ctx, aad, box, ctlen, box+ctlen)) {
 		if (NULL != box_len)
 			*box_len = mlen+SECRETBOX_OVERHEAD;
 		return box;
         }
 
-        if (NULL != box) {
-                memset(box, 0, mlen+SECRETBOX_OVERHEAD);
-                free(box);
-	}
-	*box_len = 0;
+        box_release(&ctx->mem, box, mlen+SECRETBOX_OVERHEAD);
         return NULL;
 }
 
 
+/*
+ * Seal a message into a box using a context.
+ */
+unsigned char *
+secretbox_ctx_seal(struct secretbox_ctx *ctx, unsigned char *m, int mlen,
+                   int *box_len)
+{
+        return secretbox_seal_box(ctx, NULL, m, mlen, box_len);
+}
+
+
+/*
+ * Seal a message into a box.
+ */
+unsigned char *
+secretbox_seal(unsigned char *m, int mlen, int *box_len, unsigned char *key)
+{
+        struct secretbox_ctx     stack;
+        struct secretbox_ctx    *ctx;
+        unsigned char           *box = NULL;
+
+	if (NULL != box_len)
+		*box_len = 0;
+        if (NULL != (ctx = secretbox_ctx_temp(&stack, key))) {
+                box = secretbox_ctx_seal(ctx, m, mlen, box_len);
+                secretbox_ctx_temp_free(ctx, &stack);
+        }
+        return box;
+}
+
+
 /*
  * Decrypt the ciphertext input using AES-128 in CTR mode.
  */
 int
-secretbox_decrypt(unsigned char *key, unsigned char *in, unsigned char *out,
-                  int data_len)
+secretbox_decrypt(struct secretbox_ctx *ctx, unsigned char *in,
+                  unsigned char *out, int data_len)
 {
         EVP_CIPHER_CTX   crypt;
         unsigned char    nonce[SECRETBOX_IV_SIZE];
-        unsigned char    cryptkey[SECRETBOX_CRYPT_SIZE];
         int              ptlen = 0;
         int              res = 0;
 	int		 finale = 0;
 
         memcpy(nonce, in, SECRETBOX_IV_SIZE);
-        memcpy(cryptkey, key, SECRETBOX_CRYPT_SIZE);
 
         EVP_CIPHER_CTX_init(&crypt);
-        if (EVP_DecryptInit_ex(&crypt, EVP_aes_128_ctr(), NULL, cryptkey, nonce))
+        if (EVP_DecryptInit_ex(&crypt, EVP_aes_128_ctr(), NULL, ctx->cryptkey,
+                               nonce))
         if (EVP_DecryptUpdate(&crypt, out, &ptlen, in+SECRETBOX_IV_SIZE,
                               data_len))
         if (EVP_DecryptFinal_ex(&crypt, out, &finale))
         if (ptlen+finale == data_len)
                 res = 1;
         EVP_CIPHER_CTX_cleanup(&crypt);
-        memset(cryptkey, 0x0, SECRETBOX_CRYPT_SIZE);
         return res;
 }
 
@@ -182,43 +560,482 @@ secretbox_decrypt(unsigned char *key, unsigned char *in, unsigned char *out,
  * there is a failure.
  */
 int
-secretbox_check_tag(unsigned char *key, unsigned char *in, int inlen)
+secretbox_check_tag(struct secretbox_ctx *ctx, struct box_aad *aad,
+                    unsigned char *in, int inlen)
 {
-        unsigned char    tagkey[SECRETBOX_TAG_SIZE];
-        unsigned char    tag[SECRETBOX_TAG_SIZE];
         unsigned char    atag[SECRETBOX_TAG_SIZE];
         int              msglen = 0;
         int              match = 0;
 
         msglen = inlen - SECRETBOX_TAG_SIZE;
-        memcpy(tagkey, key+SECRETBOX_CRYPT_SIZE, SECRETBOX_TAG_SIZE);
-        memcpy(tag, in+msglen, SECRETBOX_TAG_SIZE);
-        if (secretbox_tag(key, in, msglen, atag))
-	if (constant_time_equals(atag, SECRETBOX_TAG_SIZE, tag, SECRETBOX_TAG_SIZE) == 1)
+        if (secretbox_tag(ctx, aad, in, msglen, atag))
+	if (constant_time_equals(atag, SECRETBOX_TAG_SIZE, in+msglen,
+				 SECRETBOX_TAG_SIZE) == 1)
 		match = 1;
-        memset(tagkey, 0, SECRETBOX_TAG_SIZE);
+        memset(atag, 0, SECRETBOX_TAG_SIZE);
         return match;
 }
 
 
 /*
- * Recover the message from a box.
+ * Recover the message from a box tagged along with any associated
+ * data. The tag is checked before anything is decrypted.
  */
 unsigned char *
-secretbox_open(unsigned char *box, int box_len, unsigned char *key)
+secretbox_open_box(struct secretbox_ctx *ctx, struct box_aad *aad,
+                   unsigned char *box, int box_len)
 {
         unsigned char   *message = NULL;
 	int		 decryptlen = 0;
 
-	if (box == NULL)
+	if (box == NULL || box_len < (int)SECRETBOX_OVERHEAD)
 		return NULL;
 	decryptlen = box_len - SECRETBOX_OVERHEAD;
-        if (NULL != (message = malloc(decryptlen)))
-        if (secretbox_decrypt(key, box, message, decryptlen))
-	if (secretbox_check_tag(key, box, box_len))
+	if (!secretbox_check_tag(ctx, aad, box, box_len))
+		return NULL;
+        if (NULL == (message = box_alloc(&ctx->mem, decryptlen)))
+                return NULL;
+        if (secretbox_decrypt(ctx, box, message, decryptlen))
 		return message;
-        if (NULL != message)
-                memset(message, 0, decryptlen+1);
-        free(message);
+        box_release(&ctx->mem, message, decryptlen);
         return NULL;
 }
+
+
+/*
+ * Recover the message from a box using a context.
+ */
+unsigned char *
+secretbox_ctx_open(struct secretbox_ctx *ctx, unsigned char *box, int box_len)
+{
+        return secretbox_open_box(ctx, NULL, box, box_len);
+}
+
+
+/*
+ * Check a box tagged along with any associated data, without
+ * decrypting it.
+ */
+int
+secretbox_verify_box(struct secretbox_ctx *ctx, struct box_aad *aad,
+                     unsigned char *box, int box_len)
+{
+	if (box == NULL || box_len < (int)SECRETBOX_OVERHEAD)
+		return 0;
+        return secretbox_check_tag(ctx, aad, box, box_len);
+}
+
+
+/*
+ * Check that a box is authentic using a context, without decrypting
+ * it or allocating memory. Returns 1 if the tag matches and 0 if not.
+ */
+int
+secretbox_ctx_verify(struct secretbox_ctx *ctx, unsigned char *box,
+                     int box_len)
+{
+        return secretbox_verify_box(ctx, NULL, box, box_len);
+}
+
+
+/*
+ * Check that a box is authentic.
+ */
+int
+secretbox_verify(unsigned char *box, int box_len, unsigned char *key)
+{
+        struct secretbox_ctx     stack;
+        struct secretbox_ctx    *ctx;
+        int                      match = 0;
+
+        if (NULL != (ctx = secretbox_ctx_temp(&stack, key))) {
+                match = secretbox_ctx_verify(ctx, box, box_len);
+                secretbox_ctx_temp_free(ctx, &stack);
+        }
+        return match;
+}
+
+
+/*
+ * Recover the message from a box.
+ */
+unsigned char *
+secretbox_open(unsigned char *box, int box_len, unsigned char *key)
+{
+        struct secretbox_ctx     stack;
+        struct secretbox_ctx    *ctx;
+        unsigned char           *message = NULL;
+
+        if (NULL != (ctx = secretbox_ctx_temp(&stack, key))) {
+                message = secretbox_ctx_open(ctx, box, box_len);
+                secretbox_ctx_temp_free(ctx, &stack);
+        }
+        return message;
+}
+
+
+/*
+ * Seal a message into a box using a context, authenticating aadlen
+ * bytes of associated data at aad along with it. The associated data
+ * is not encrypted and is not part of the box; the same data must be
+ * given to open the box. With no associated data the box is an
+ * ordinary one.
+ */
+unsigned char *
+secretbox_ctx_seal_aad(struct secretbox_ctx *ctx, unsigned char *m, int mlen,
+                       unsigned char *aad, size_t aadlen, int *box_len)
+{
+        struct iovec     iov;
+
+        iov.iov_base = aad;
+        iov.iov_len = aadlen;
+        return secretbox_ctx_seal_aadv(ctx, m, mlen, &iov, 1, box_len);
+}
+
+
+/*
+ * As secretbox_ctx_seal_aad, with the associated data gathered from
+ * iovcnt buffers. The data is authenticated as if the buffers were
+ * concatenated.
+ */
+unsigned char *
+secretbox_ctx_seal_aadv(struct secretbox_ctx *ctx, unsigned char *m,
+                        int mlen, const struct iovec *iov, int iovcnt,
+                        int *box_len)
+{
+        struct box_aad   aad;
+
+	if (NULL != box_len)
+		*box_len = 0;
+        if (!box_aad_init(&aad, iov, iovcnt))
+                return NULL;
+        return secretbox_seal_box(ctx, &aad, m, mlen, box_len);
+}
+
+
+/*
+ * Recover the message from a box sealed with associated data, which
+ * must match the data given when it was sealed.
+ */
+unsigned char *
+secretbox_ctx_open_aad(struct secretbox_ctx *ctx, unsigned char *box,
+                       int box_len, unsigned char *aad, size_t aadlen)
+{
+        struct iovec     iov;
+
+        iov.iov_base = aad;
+        iov.iov_len = aadlen;
+        return secretbox_ctx_open_aadv(ctx, box, box_len, &iov, 1);
+}
+
+
+unsigned char *
+secretbox_ctx_open_aadv(struct secretbox_ctx *ctx, unsigned char *box,
+                        int box_len, const struct iovec *iov, int iovcnt)
+{
+        struct box_aad   aad;
+
+        if (!box_aad_init(&aad, iov, iovcnt))
+                return NULL;
+        return secretbox_open_box(ctx, &aad, box, box_len);
+}
+
+
+/*
+ * Check that a box sealed with associated data is authentic, without
+ * decrypting it.
+ */
+int
+secretbox_ctx_verify_aad(struct secretbox_ctx *ctx, unsigned char *box,
+                         int box_len, unsigned char *aad, size_t aadlen)
+{
+        struct iovec     iov;
+
+        iov.iov_base = aad;
+        iov.iov_len = aadlen;
+        return secretbox_ctx_verify_aadv(ctx, box, box_len, &iov, 1);
+}
+
+
+int
+secretbox_ctx_verify_aadv(struct secretbox_ctx *ctx, unsigned char *box,
+                          int box_len, const struct iovec *iov, int iovcnt)
+{
+        struct box_aad   aad;
+
+        if (!box_aad_init(&aad, iov, iovcnt))
+                return 0;
+        return secretbox_verify_box(ctx, &aad, box, box_len);
+}
+
+
+/*
+ * Seal a message into a box with associated data.
+ */
+unsigned char *
+secretbox_seal_aad(unsigned char *m, int mlen, unsigned char *aad,
+                   size_t aadlen, int *box_len, unsigned char *key)
+{
+        struct secretbox_ctx     stack;
+        struct secretbox_ctx    *ctx;
+        unsigned char           *box = NULL;
+
+	if (NULL != box_len)
+		*box_len = 0;
+        if (NULL != (ctx = secretbox_ctx_temp(&stack, key))) {
+                box = secretbox_ctx_seal_aad(ctx, m, mlen, aad, aadlen,
+                                             box_len);
+                secretbox_ctx_temp_free(ctx, &stack);
+        }
+        return box;
+}
+
+
+/*
+ * Recover the message from a box sealed with associated data.
+ */
+unsigned char *
+secretbox_open_aad(unsigned char *box, int box_len, unsigned char *aad,
+                   size_t aadlen, unsigned char *key)
+{
+        struct secretbox_ctx     stack;
+        struct secretbox_ctx    *ctx;
+        unsigned char           *message = NULL;
+
+        if (NULL != (ctx = secretbox_ctx_temp(&stack, key))) {
+                message = secretbox_ctx_open_aad(ctx, box, box_len, aad,
+                                                 aadlen);
+                secretbox_ctx_temp_free(ctx, &stack);
+        }
+        return message;
+}
+
+
+/*
+ * Seal the file at in into a box written to the file at out, working
+ * through memory mappings rather than reading the file into memory.
+ * Returns 1 on success and 0 on failure.
+ */
+int
+secretbox_seal_file(const char *in, const char *out, unsigned char *key)
+{
+        return mapfile_seal(&secretbox_ops, in, out, key);
+}
+
+
+/*
+ * Open the box in the file at in, writing the message to the file at
+ * out. The output is only created once the box has been found to be
+ * authentic. Returns 1 on success and 0 on failure.
+ */
+int
+secretbox_open_file(const char *in, const char *out, unsigned char *key)
+{
+        return mapfile_open(&secretbox_ops, in, out, key);
+}
+
+
+/*
+ * Seal mlen bytes from m into out, which may be m, with the ciphertext
+ * exactly as long as the message. The IV and tag are written to meta,
+ * which must hold SECRETBOX_OVERHEAD bytes. Returns 1 on success and
+ * 0 on failure.
+ */
+int
+secretbox_ctx_seal_detached(struct secretbox_ctx *ctx, unsigned char *m,
+                            size_t mlen, unsigned char *out,
+                            unsigned char *meta)
+{
+        return detached_seal(&secretbox_ops, ctx, m, mlen, out, meta);
+}
+
+
+/*
+ * Check ciphertext sealed with secretbox_ctx_seal_detached against its
+ * metadata and decrypt it into out, which may be ct. Nothing is
+ * written unless the ciphertext is authentic. Returns 1 on success
+ * and 0 on failure.
+ */
+int
+secretbox_ctx_open_detached(struct secretbox_ctx *ctx, unsigned char *ct,
+                            size_t len, unsigned char *meta,
+                            unsigned char *out)
+{
+        return detached_open(&secretbox_ops, ctx, ct, len, meta, out);
+}
+
+
+int
+secretbox_seal_detached(unsigned char *m, size_t mlen, unsigned char *out,
+                        unsigned char *meta, unsigned char *key)
+{
+        struct secretbox_ctx     stack;
+        struct secretbox_ctx    *ctx;
+        int                      res = 0;
+
+        if (NULL != (ctx = secretbox_ctx_temp(&stack, key))) {
+                res = secretbox_ctx_seal_detached(ctx, m, mlen, out, meta);
+                secretbox_ctx_temp_free(ctx, &stack);
+        }
+        return res;
+}
+
+
+int
+secretbox_open_detached(unsigned char *ct, size_t len, unsigned char *meta,
+                        unsigned char *out, unsigned char *key)
+{
+        struct secretbox_ctx     stack;
+        struct secretbox_ctx    *ctx;
+        int                      res = 0;
+
+        if (NULL != (ctx = secretbox_ctx_temp(&stack, key))) {
+                res = secretbox_ctx_open_detached(ctx, ct, len, meta, out);
+                secretbox_ctx_temp_free(ctx, &stack);
+        }
+        return res;
+}
+
+
+/*
+ * The remaining functions adapt the context functions to the generic
+ * box operations.
+ */
+void *
+secretbox_ops_ctx_new(unsigned char *key)
+{
+        return secretbox_ctx_new(key);
+}
+
+
+void
+secretbox_ops_ctx_free(void *ctx)
+{
+        secretbox_ctx_free(ctx);
+}
+
+
+unsigned char *
+secretbox_ops_ctx_seal(void *ctx, unsigned char *m, int mlen, int *box_len)
+{
+        return secretbox_ctx_seal(ctx, m, mlen, box_len);
+}
+
+
+unsigned char *
+secretbox_ops_ctx_open(void *ctx, unsigned char *box, int box_len)
+{
+        return secretbox_ctx_open(ctx, box, box_len);
+}
+
+
+int
+secretbox_ops_ctx_verify(void *ctx, unsigned char *box, int box_len)
+{
+        return secretbox_ctx_verify(ctx, box, box_len);
+}
+
+
+unsigned char *
+secretbox_ops_ctx_seal_aadv(void *ctx, unsigned char *m, int mlen,
+                            const struct iovec *iov, int iovcnt,
+                            int *box_len)
+{
+        return secretbox_ctx_seal_aadv(ctx, m, mlen, iov, iovcnt, box_len);
+}
+
+
+unsigned char *
+secretbox_ops_ctx_open_aadv(void *ctx, unsigned char *box, int box_len,
+                            const struct iovec *iov, int iovcnt)
+{
+        return secretbox_ctx_open_aadv(ctx, box, box_len, iov, iovcnt);
+}
+
+
+int
+secretbox_ops_ctx_verify_aadv(void *ctx, unsigned char *box, int box_len,
+                              const struct iovec *iov, int iovcnt)
+{
+        return secretbox_ctx_verify_aadv(ctx, box, box_len, iov, iovcnt);
+}
+
+
+unsigned char *
+secretbox_ops_ctx_alloc(void *vctx, size_t len)
+{
+        struct secretbox_ctx    *ctx = vctx;
+
+        return box_alloc(&ctx->mem, len);
+}
+
+
+void
+secretbox_ops_ctx_release(void *vctx, unsigned char *buf, size_t len)
+{
+        struct secretbox_ctx    *ctx = vctx;
+
+        box_release(&ctx->mem, buf, len);
+}
+
+
+/*
+ * Apply the AES-128 CTR key stream for iv to len bytes, starting block
+ * blocks into the stream.
+ */
+int
+secretbox_ops_crypt(void *vctx, unsigned char *iv, size_t block,
+                    unsigned char *in, unsigned char *out, size_t len)
+{
+        struct secretbox_ctx    *ctx = vctx;
+        EVP_CIPHER_CTX           crypt;
+        unsigned char            ctr[BOX_BLOCK_SIZE];
+        int                      outlen = 0;
+        int                      res = 0;
+
+        box_ctr_offset(ctr, iv, block);
+        EVP_CIPHER_CTX_init(&crypt);
+        if (EVP_EncryptInit_ex(&crypt, EVP_aes_128_ctr(), NULL, ctx->cryptkey,
+                               ctr))
+        if (EVP_EncryptUpdate(&crypt, out, &outlen, in, (int)len))
+        if (outlen == (int)len)
+                res = 1;
+        EVP_CIPHER_CTX_cleanup(&crypt);
+        return res;
+}
+
+
+int
+secretbox_ops_mac_key(void *vctx, const char *label,
+                      struct box_mac_key *mk)
+{
+        mk->type = CRYPTOBOX_SECRETBOX;
+        return secretbox_mac_key(vctx, label, &mk->key.sha256);
+}
+
+
+void
+secretbox_ops_tag_start(void *vctx, union box_mac_state *state)
+{
+        struct secretbox_ctx    *ctx = vctx;
+
+        hmac_sha256_start(&ctx->tagkey, &state->sha256);
+}
+
+
+int
+secretbox_ops_tag_update(union box_mac_state *state, unsigned char *in,
+                         size_t inlen)
+{
+        return SHA256_Update(&state->sha256, in, inlen);
+}
+
+
+int
+secretbox_ops_tag_finish(void *vctx, union box_mac_state *state,
+                         unsigned char *tag)
+{
+        struct secretbox_ctx    *ctx = vctx;
+
+        return hmac_sha256_finish(&ctx->tagkey, &state->sha256, tag);
+}
@@ -0,0 +1,507 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * The body of cryptoboxd. Each client is given a shared memory region
+ * holding its request slots and a pair of queues, so that neither side
+ * has to be woken while the other is busy. The daemon gathers
+ * whatever every client has queued, sorts it by operation and key,
+ * and hands each run to the batch interface, so that requests from
+ * many callers share the worker pool. When there is nothing to do it
+ * spins for a short while, then sleeps in poll on the clients'
+ * request notifiers, their sockets, and the listening socket. A
+ * client's socket is only used to pass it the region and notifiers;
+ * when it closes, the client is gone.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "box.h"
+#include "server.h"
+#include "shmring.h"
+#include <cryptobox/batch.h>
+
+
+#define SERVER_SPIN     256
+#define SERVER_BACKLOG  16
+#define SERVER_POLL_MS  1000
+
+
+struct server_client {
+        int                      sock;
+        struct shmring          *ring;
+        struct shmring_notify    req;
+        struct shmring_notify    resp;
+        int                      notify;
+};
+
+struct server_req {
+        struct server_client    *client;
+        uint32_t                 slot;
+        uint32_t                 op;
+        uint32_t                 key;
+        int                      len;
+};
+
+struct server {
+        struct server_key       *keys;
+        int                      nkeys;
+        struct server_client   **clients;
+        int                      nclients;
+        int                      cap;
+        struct server_req       *reqs;
+        int                      nreqs;
+        struct cryptobox_msg    *msgs;
+        struct pollfd           *pfds;
+};
+
+
+static void      server_client_free(struct server_client *);
+static int       server_grow(struct server *);
+static int       server_accept(struct server *, int);
+static void      server_drop(struct server *, int);
+static void      server_respond(struct server_client *, uint32_t, int,
+                                uint32_t);
+static int       server_collect(struct server *);
+static int       server_req_cmp(const void *, const void *);
+static void      server_batch(struct server *, int, int);
+static void      server_process(struct server *);
+static int       server_wait(struct server *, int);
+
+
+/*
+ * Create the daemon's listening socket at path, replacing a stale
+ * socket left by an earlier run. Returns the socket, or -1 on failure.
+ */
+int
+server_listen(const char *path)
+{
+        struct sockaddr_un       addr;
+        struct stat              st;
+        int                      fd;
+
+        if (strlen(path) >= sizeof addr.sun_path) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+        memset(&addr, 0, sizeof addr);
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+        if (0 == lstat(path, &st) && S_ISSOCK(st.st_mode))
+                unlink(path);
+
+        if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0)))
+                return -1;
+        if (-1 == bind(fd, (struct sockaddr *)&addr, sizeof addr) ||
+            -1 == listen(fd, SERVER_BACKLOG)) {
+                close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+
+void
+server_client_free(struct server_client *c)
+{
+        if (NULL == c)
+                return;
+        if (-1 != c->sock)
+                close(c->sock);
+        shmring_notify_close(&c->req);
+        shmring_notify_close(&c->resp);
+        shmring_unmap(c->ring);
+        box_free(c);
+}
+
+
+/*
+ * Make room for one more client. Every client can have all of its
+ * slots queued at once, and needs two entries in the poll set.
+ */
+int
+server_grow(struct server *srv)
+{
+        struct server_client   **clients;
+        struct server_req       *reqs;
+        struct cryptobox_msg    *msgs;
+        struct pollfd           *pfds;
+        int                      cap;
+
+        if (srv->nclients < srv->cap)
+                return 1;
+        cap = 0 == srv->cap ? 8 : srv->cap * 2;
+        clients = box_malloc(cap * sizeof(struct server_client *));
+        reqs = box_malloc(cap * SHMRING_SLOTS * sizeof(struct server_req));
+        msgs = box_malloc(cap * SHMRING_SLOTS * sizeof(struct cryptobox_msg));
+        pfds = box_malloc((1 + 2 * cap) * sizeof(struct pollfd));
+        if (NULL == clients || NULL == reqs || NULL == msgs ||
+            NULL == pfds) {
+                box_free(clients);
+                box_free(reqs);
+                box_free(msgs);
+                box_free(pfds);
+                return 0;
+        }
+        if (srv->nclients > 0)
+                memcpy(clients, srv->clients,
+                       srv->nclients * sizeof(struct server_client *));
+        box_free(srv->clients);
+        box_free(srv->reqs);
+        box_free(srv->msgs);
+        box_free(srv->pfds);
+        srv->clients = clients;
+        srv->reqs = reqs;
+        srv->msgs = msgs;
+        srv->pfds = pfds;
+        srv->cap = cap;
+        return 1;
+}
+
+
+/*
+ * Accept a client, and pass it a fresh region and its notifiers.
+ */
+int
+server_accept(struct server *srv, int lfd)
+{
+        struct server_client    *c;
+        int                      fds[SHMRING_NFDS];
+        int                      shm = -1;
+        int                      sock, i;
+
+        do {
+                sock = accept(lfd, NULL, NULL);
+        } while (-1 == sock && EINTR == errno);
+        if (-1 == sock)
+                return 0;
+        if (!server_grow(srv) ||
+            NULL == (c = box_malloc(sizeof(struct server_client)))) {
+                close(sock);
+                return 0;
+        }
+        memset(c, 0, sizeof(struct server_client));
+        c->sock = sock;
+        c->req.rfd = c->req.wfd = -1;
+        c->resp.rfd = c->resp.wfd = -1;
+
+        if (NULL == (c->ring = shmring_create(&shm)) ||
+            !shmring_notify_new(&c->req) || !shmring_notify_new(&c->resp))
+                goto fail;
+        c->ring->nkeys = (uint32_t)srv->nkeys;
+        for (i = 0; i < srv->nkeys; i++)
+                c->ring->key_types[i] = (unsigned char)srv->keys[i].type;
+        __atomic_store_n(&c->ring->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+        fds[SHMRING_FD_SHM] = shm;
+        fds[SHMRING_FD_REQ_R] = c->req.rfd;
+        fds[SHMRING_FD_REQ_W] = c->req.wfd;
+        fds[SHMRING_FD_RESP_R] = c->resp.rfd;
+        fds[SHMRING_FD_RESP_W] = c->resp.wfd;
+        if (!shmring_send_fds(sock, fds, SHMRING_NFDS))
+                goto fail;
+        close(shm);
+        srv->clients[srv->nclients++] = c;
+        return 1;
+
+fail:
+        if (-1 != shm)
+                close(shm);
+        server_client_free(c);
+        return 0;
+}
+
+
+void
+server_drop(struct server *srv, int i)
+{
+        server_client_free(srv->clients[i]);
+        srv->clients[i] = srv->clients[--srv->nclients];
+}
+
+
+/*
+ * Hand a slot back to its client. The client is notified once all of
+ * the responses in a round have been queued.
+ */
+void
+server_respond(struct server_client *c, uint32_t slot, int status,
+               uint32_t len)
+{
+        struct shmring_slot     *s = &c->ring->slots[slot];
+
+        s->status = status;
+        s->len = len;
+        if (shmring_push(&c->ring->resp, slot))
+                c->notify = 1;
+}
+
+
+/*
+ * Take every queued request from every client. The slots are written
+ * by the client, so each field is read once and checked before it is
+ * used; anything malformed is failed at once. Returns the number of
+ * slots taken, including those that were failed.
+ */
+int
+server_collect(struct server *srv)
+{
+        struct server_client    *c;
+        struct server_req       *r;
+        struct shmring_slot     *s;
+        uint32_t                 slot, op, key, len;
+        int                      taken = 0;
+        int                      i, n;
+
+        srv->nreqs = 0;
+        for (i = 0; i < srv->nclients; i++) {
+                c = srv->clients[i];
+                for (n = 0; n < SHMRING_SLOTS &&
+                     shmring_pop(&c->ring->req, &slot); n++) {
+                        taken++;
+                        if (slot >= SHMRING_SLOTS)
+                                continue;
+                        s = &c->ring->slots[slot];
+                        op = __atomic_load_n(&s->op, __ATOMIC_RELAXED);
+                        key = __atomic_load_n(&s->key, __ATOMIC_RELAXED);
+                        len = __atomic_load_n(&s->len, __ATOMIC_RELAXED);
+                        if (op < SHMRING_SEAL || op > SHMRING_VERIFY ||
+                            key >= (uint32_t)srv->nkeys ||
+                            len > (SHMRING_SEAL == op ? SHMRING_MAX_MSG :
+                                                        SHMRING_SLOT_DATA)) {
+                                server_respond(c, slot, 0, 0);
+                                continue;
+                        }
+                        r = &srv->reqs[srv->nreqs++];
+                        r->client = c;
+                        r->slot = slot;
+                        r->op = op;
+                        r->key = key;
+                        r->len = (int)len;
+                }
+        }
+        return taken;
+}
+
+
+int
+server_req_cmp(const void *a, const void *b)
+{
+        const struct server_req *ra = a;
+        const struct server_req *rb = b;
+
+        if (ra->op != rb->op)
+                return ra->op < rb->op ? -1 : 1;
+        if (ra->key != rb->key)
+                return ra->key < rb->key ? -1 : 1;
+        return 0;
+}
+
+
+/*
+ * Run the requests from first up to last, which share an operation
+ * and a key, as one batch, and write each result back into its slot.
+ */
+void
+server_batch(struct server *srv, int first, int last)
+{
+        struct server_req       *r;
+        struct server_key       *k = &srv->keys[srv->reqs[first].key];
+        struct cryptobox_msg    *m;
+        int                      n = last - first;
+        int                      i;
+
+        for (i = 0; i < n; i++) {
+                r = &srv->reqs[first + i];
+                srv->msgs[i].in = r->client->ring->slots[r->slot].data;
+                srv->msgs[i].in_len = r->len;
+        }
+        switch (srv->reqs[first].op) {
+        case SHMRING_SEAL:
+                cryptobox_seal_batch(k->type, srv->msgs, n, k->key);
+                break;
+        case SHMRING_OPEN:
+                cryptobox_open_batch(k->type, srv->msgs, n, k->key);
+                break;
+        default:
+                cryptobox_verify_batch(k->type, srv->msgs, n, k->key);
+                break;
+        }
+
+        for (i = 0; i < n; i++) {
+                r = &srv->reqs[first + i];
+                m = &srv->msgs[i];
+                if (SHMRING_VERIFY == r->op) {
+                        server_respond(r->client, r->slot, m->out_len, 0);
+                } else if (NULL == m->out || m->out_len < 0 ||
+                           m->out_len > (int)SHMRING_SLOT_DATA) {
+                        server_respond(r->client, r->slot, 0, 0);
+                } else {
+                        memcpy(r->client->ring->slots[r->slot].data, m->out,
+                               (size_t)m->out_len);
+                        server_respond(r->client, r->slot, 1,
+                                       (uint32_t)m->out_len);
+                }
+                if (NULL != m->out) {
+                        memset(m->out, 0x0, (size_t)m->out_len);
+                        box_free(m->out);
+                }
+        }
+}
+
+
+/*
+ * Run everything gathered by server_collect, one batch per operation
+ * and key, and wake the clients that are waiting for their results.
+ */
+void
+server_process(struct server *srv)
+{
+        struct server_client    *c;
+        int                      first, last, i;
+
+        qsort(srv->reqs, (size_t)srv->nreqs, sizeof(struct server_req),
+              server_req_cmp);
+        for (first = 0; first < srv->nreqs; first = last) {
+                for (last = first + 1; last < srv->nreqs &&
+                     0 == server_req_cmp(&srv->reqs[first],
+                                         &srv->reqs[last]); last++)
+                        ;
+                server_batch(srv, first, last);
+        }
+
+        for (i = 0; i < srv->nclients; i++) {
+                c = srv->clients[i];
+                if (c->notify) {
+                        c->notify = 0;
+                        shmring_notify(c->resp.wfd);
+                }
+        }
+}
+
+
+/*
+ * Sleep until a client queues a request, connects, or goes away.
+ * Returns 0 if poll fails.
+ */
+int
+server_wait(struct server *srv, int lfd)
+{
+        struct server_client    *c;
+        int                      busy = 0;
+        int                      n = 0;
+        int                      i;
+
+        for (i = 0; i < srv->nclients; i++)
+                if (!shmring_sleep(&srv->clients[i]->ring->req))
+                        busy = 1;
+        if (!busy) {
+                srv->pfds[0].fd = lfd;
+                srv->pfds[0].events = POLLIN;
+                for (i = 0; i < srv->nclients; i++) {
+                        c = srv->clients[i];
+                        srv->pfds[1 + 2 * i].fd = c->sock;
+                        srv->pfds[1 + 2 * i].events = POLLIN;
+                        srv->pfds[2 + 2 * i].fd = c->req.rfd;
+                        srv->pfds[2 + 2 * i].events = POLLIN;
+                }
+                n = poll(srv->pfds, (nfds_t)(1 + 2 * srv->nclients),
+                         SERVER_POLL_MS);
+                if (-1 == n && EINTR != errno)
+                        return 0;
+        }
+        for (i = 0; i < srv->nclients; i++)
+                shmring_awake(&srv->clients[i]->ring->req);
+        if (n <= 0)
+                return 1;
+
+        for (i = srv->nclients - 1; i >= 0; i--) {
+                if (srv->pfds[2 + 2 * i].revents & POLLIN)
+                        shmring_drain(srv->clients[i]->req.rfd);
+                if (srv->pfds[1 + 2 * i].revents & (POLLIN | POLLHUP |
+                                                    POLLERR | POLLNVAL))
+                        server_drop(srv, i);
+        }
+        if (srv->pfds[0].revents & POLLIN)
+                server_accept(srv, lfd);
+        return 1;
+}
+
+
+/*
+ * Serve clients connecting to lfd with the given keys until stop is
+ * set. Returns 1 when stopped, and 0 if the keys are unusable or the
+ * daemon fails.
+ */
+int
+server_run(int lfd, struct server_key *keys, int nkeys,
+           volatile sig_atomic_t *stop)
+{
+        struct server    srv;
+        int              idle = 0;
+        int              res = 0;
+        int              i;
+
+        if (nkeys <= 0 || nkeys > SHMRING_MAX_KEYS)
+                return 0;
+        for (i = 0; i < nkeys; i++)
+                if (NULL == box_ops_lookup(keys[i].type))
+                        return 0;
+
+        memset(&srv, 0, sizeof srv);
+        srv.keys = keys;
+        srv.nkeys = nkeys;
+        if (!server_grow(&srv))
+                return 0;
+
+        while (!*stop) {
+                if (server_collect(&srv) > 0) {
+                        server_process(&srv);
+                        idle = 0;
+                        continue;
+                }
+                if (idle++ < SERVER_SPIN) {
+                        sched_yield();
+                        continue;
+                }
+                idle = 0;
+                if (!server_wait(&srv, lfd))
+                        goto out;
+        }
+        res = 1;
+
+out:
+        while (srv.nclients > 0)
+                server_drop(&srv, srv.nclients - 1);
+        box_free(srv.clients);
+        box_free(srv.reqs);
+        box_free(srv.msgs);
+        box_free(srv.pfds);
+        return res;
+}
@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * The shared-memory queues between cryptoboxd and its clients, and the
+ * plumbing to set them up: creating and mapping the shared region,
+ * the wakeup channels, and passing descriptors over the daemon's
+ * socket.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/rand.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "shmring.h"
+
+
+static int       shmring_shm_open(void);
+
+
+/*
+ * Create an anonymous shared memory object: a memfd where there is
+ * one, or a POSIX shared memory object that is unlinked at once.
+ */
+int
+shmring_shm_open(void)
+{
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+        return memfd_create("cryptoboxd", MFD_CLOEXEC);
+#else
+        unsigned char    rnd[8];
+        char             name[64];
+        int              fd;
+
+        if (!RAND_bytes(rnd, sizeof rnd))
+                return -1;
+        snprintf(name, sizeof name, "/cryptoboxd.%ld.%02x%02x%02x%02x%02x%02x",
+                 (long)getpid(), rnd[0], rnd[1], rnd[2], rnd[3], rnd[4],
+                 rnd[5]);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (-1 != fd)
+                shm_unlink(name);
+        return fd;
+#endif
+}
+
+
+/*
+ * Create and map a region for one client, storing its descriptor in
+ * fd. Returns NULL on failure.
+ */
+struct shmring *
+shmring_create(int *fd)
+{
+        struct shmring  *ring;
+
+        if (-1 == (*fd = shmring_shm_open()))
+                return NULL;
+        if (-1 == ftruncate(*fd, sizeof(struct shmring)) ||
+            NULL == (ring = shmring_map(*fd))) {
+                close(*fd);
+                *fd = -1;
+                return NULL;
+        }
+        memset(ring, 0, sizeof(struct shmring));
+        ring->nslots = SHMRING_SLOTS;
+        ring->max_msg = SHMRING_MAX_MSG;
+        return ring;
+}
+
+
+struct shmring *
+shmring_map(int fd)
+{
+        struct stat      st;
+        void            *p;
+
+        if (-1 == fstat(fd, &st) || st.st_size != sizeof(struct shmring))
+                return NULL;
+        p = mmap(NULL, sizeof(struct shmring), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+        return MAP_FAILED == p ? NULL : p;
+}
+
+
+void
+shmring_unmap(struct shmring *ring)
+{
+        if (NULL != ring)
+                munmap(ring, sizeof(struct shmring));
+}
+
+
+/*
+ * Add a slot number to a queue. Returns 1 if the consumer is asleep
+ * and must be notified. The fence pairs with the one in shmring_sleep:
+ * either the consumer sees the new entry, or the producer sees that it
+ * is waiting.
+ */
+int
+shmring_push(struct shmring_queue *q, uint32_t v)
+{
+        uint32_t        tail;
+
+        tail = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        q->ents[tail % SHMRING_SLOTS] = v;
+        __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return 0 != __atomic_load_n(&q->waiting, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Take the next slot number from a queue. Returns 0 if it is empty.
+ */
+int
+shmring_pop(struct shmring_queue *q, uint32_t *v)
+{
+        uint32_t        head;
+
+        head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+                return 0;
+        *v = __atomic_load_n(&q->ents[head % SHMRING_SLOTS],
+                             __ATOMIC_RELAXED);
+        __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+        return 1;
+}
+
+
+/*
+ * Announce that the consumer is about to sleep. Returns 1 if it may,
+ * and 0, with the announcement withdrawn, if something arrived in the
+ * meantime.
+ */
+int
+shmring_sleep(struct shmring_queue *q)
+{
+        __atomic_store_n(&q->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->head, __ATOMIC_RELAXED) !=
+            __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+                shmring_awake(q);
+                return 0;
+        }
+        return 1;
+}
+
+
+void
+shmring_awake(struct shmring_queue *q)
+{
+        __atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Set up a wakeup channel. Both ends are non-blocking; the reader is
+ * woken through poll.
+ */
+int
+shmring_notify_new(struct shmring_notify *n)
+{
+        int      fds[2];
+
+#ifdef __linux__
+        if (-1 != (n->rfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))) {
+                n->wfd = n->rfd;
+                return 1;
+        }
+#endif
+        n->rfd = n->wfd = -1;
+        if (-1 == pipe(fds))
+                return 0;
+        if (-1 == fcntl(fds[0], F_SETFL, O_NONBLOCK) ||
+            -1 == fcntl(fds[1], F_SETFL, O_NONBLOCK) ||
+            -1 == fcntl(fds[0], F_SETFD, FD_CLOEXEC) ||
+            -1 == fcntl(fds[1], F_SETFD, FD_CLOEXEC)) {
+                close(fds[0]);
+                close(fds[1]);
+                return 0;
+        }
+        n->rfd = fds[0];
+        n->wfd = fds[1];
+        return 1;
+}
+
+
+void
+shmring_notify_close(struct shmring_notify *n)
+{
+        if (-1 != n->rfd)
+                close(n->rfd);
+        if (-1 != n->wfd && n->wfd != n->rfd)
+                close(n->wfd);
+        n->rfd = n->wfd = -1;
+}
+
+
+/*
+ * Signal a channel. A full pipe or eventfd already has a wakeup
+ * pending, so the write is allowed to fail.
+ */
+void
+shmring_notify(int wfd)
+{
+        uint64_t         one = 1;
+        ssize_t          n;
+
+        do {
+                n = write(wfd, &one, sizeof one);
+        } while (n < 0 && EINTR == errno);
+}
+
+
+/*
+ * Clear any pending wakeups on a channel.
+ */
+void
+shmring_drain(int rfd)
+{
+        unsigned char   buf[64];
+        ssize_t         n;
+
+        do {
+                n = read(rfd, buf, sizeof buf);
+        } while (n > 0 || (n < 0 && EINTR == errno));
+}
+
+
+/*
+ * Pass n descriptors over a Unix socket, along with one byte.
+ */
+int
+shmring_send_fds(int sock, int *fds, int n)
+{
+        union {
+                struct cmsghdr   hdr;
+                char             buf[CMSG_SPACE(SHMRING_NFDS * sizeof(int))];
+        }                        control;
+        struct msghdr            msg;
+        struct cmsghdr          *cm;
+        struct iovec             iov;
+        unsigned char            byte = 0;
+        ssize_t                  r;
+
+        if (n > SHMRING_NFDS)
+                return 0;
+        memset(&msg, 0, sizeof msg);
+        memset(&control, 0, sizeof control);
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE((size_t)n * sizeof(int));
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN((size_t)n * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, (size_t)n * sizeof(int));
+        do {
+                r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (r < 0 && EINTR == errno);
+        return 1 == r;
+}
+
+
+/*
+ * Receive n descriptors passed with shmring_send_fds. Returns 0, with
+ * nothing left open, unless exactly n arrived.
+ */
+int
+shmring_recv_fds(int sock, int *fds, int n)
+{
+        union {
+                struct cmsghdr   hdr;
+                char             buf[CMSG_SPACE(SHMRING_NFDS * sizeof(int))];
+        }                        control;
+        struct msghdr            msg;
+        struct cmsghdr          *cm;
+        struct iovec             iov;
+        unsigned char            byte;
+        ssize_t                  r;
+        int                      got = 0, i;
+
+        if (n > SHMRING_NFDS)
+                return 0;
+        memset(&msg, 0, sizeof msg);
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof control.buf;
+        do {
+                r = recvmsg(sock, &msg, 0);
+        } while (r < 0 && EINTR == errno);
+        if (1 != r)
+                return 0;
+        for (cm = CMSG_FIRSTHDR(&msg); NULL != cm;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+                if (SOL_SOCKET != cm->cmsg_level ||
+                    SCM_RIGHTS != cm->cmsg_type)
+                        continue;
+                got = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                if (got > n) {
+                        memcpy(fds, CMSG_DATA(cm), (size_t)n * sizeof(int));
+                        for (i = 0; i < n; i++)
+                                close(fds[i]);
+                        return 0;
+                }
+                memcpy(fds, CMSG_DATA(cm), (size_t)got * sizeof(int));
+                break;
+        }
+        if (got != n || (msg.msg_flags & MSG_CTRUNC)) {
+                for (i = 0; i < got; i++)
+                        close(fds[i]);
+                return 0;
+        }
+        return 1;
+}
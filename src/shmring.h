@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+
+/*
+ * The memory shared between cryptoboxd and one client. The client owns
+ * a fixed set of slots, each holding one request's input and then its
+ * result. It passes slot numbers to the daemon through the request
+ * queue and gets them back through the response queue; each queue has
+ * one producer and one consumer, and as many entries as there are
+ * slots, so neither can overflow.
+ */
+#define SHMRING_MAGIC           0x43424431
+#define SHMRING_SLOTS           64
+#define SHMRING_MAX_MSG         65536
+#define SHMRING_SLOT_DATA       (SHMRING_MAX_MSG + 64)
+#define SHMRING_MAX_KEYS        64
+#define SHMRING_CACHE_LINE      64
+
+#define SHMRING_SEAL            1
+#define SHMRING_OPEN            2
+#define SHMRING_VERIFY          3
+
+/*
+ * The descriptors passed to a client when it connects: the shared
+ * memory, and the read and write ends of the request and response
+ * notifiers.
+ */
+#define SHMRING_FD_SHM          0
+#define SHMRING_FD_REQ_R        1
+#define SHMRING_FD_REQ_W        2
+#define SHMRING_FD_RESP_R       3
+#define SHMRING_FD_RESP_W       4
+#define SHMRING_NFDS            5
+
+
+/*
+ * The consumer sets waiting before it sleeps, and the producer only
+ * signals the notifier when it is set, so a busy peer costs no system
+ * calls.
+ */
+struct shmring_queue {
+        uint32_t                 head;
+        char                     pad0[SHMRING_CACHE_LINE - 4];
+        uint32_t                 tail;
+        char                     pad1[SHMRING_CACHE_LINE - 4];
+        uint32_t                 waiting;
+        char                     pad2[SHMRING_CACHE_LINE - 4];
+        uint32_t                 ents[SHMRING_SLOTS];
+};
+
+struct shmring_slot {
+        uint32_t                 op;
+        uint32_t                 key;
+        int32_t                  status;
+        uint32_t                 len;
+        char                     pad[SHMRING_CACHE_LINE - 16];
+        unsigned char            data[SHMRING_SLOT_DATA];
+};
+
+struct shmring {
+        uint32_t                 magic;
+        uint32_t                 nslots;
+        uint32_t                 max_msg;
+        uint32_t                 nkeys;
+        unsigned char            key_types[SHMRING_MAX_KEYS];
+        char                     pad[SHMRING_CACHE_LINE - 16];
+        struct shmring_queue     req;
+        struct shmring_queue     resp;
+        struct shmring_slot      slots[SHMRING_SLOTS];
+};
+
+/*
+ * A wakeup channel: an eventfd where there is one, in which case both
+ * descriptors are the same, or a pipe.
+ */
+struct shmring_notify {
+        int      rfd;
+        int      wfd;
+};
+
+
+struct shmring  *shmring_create(int *);
+struct shmring  *shmring_map(int);
+void             shmring_unmap(struct shmring *);
+int              shmring_push(struct shmring_queue *, uint32_t);
+int              shmring_pop(struct shmring_queue *, uint32_t *);
+int              shmring_sleep(struct shmring_queue *);
+void             shmring_awake(struct shmring_queue *);
+int              shmring_notify_new(struct shmring_notify *);
+void             shmring_notify_close(struct shmring_notify *);
+void             shmring_notify(int);
+void             shmring_drain(int);
+int              shmring_send_fds(int, int *, int);
+int              shmring_recv_fds(int, int *, int);
+
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * The chunked streaming format. A stream is a header followed by a
+ * sequence of chunks; each chunk is sealed separately, so that a
+ * stream can be written and read in constant memory. The header is
+ *
+ *      magic (4) | type (1) | zero (3) | chunk size (4) | IV
+ *
+ * and chunk i is its ciphertext followed by a tag. The message is
+ * encrypted in CTR mode as one run from the IV, chunk i starting i
+ * times the chunk size into the key stream. Every chunk but the last
+ * holds exactly a chunk's worth of message, and the last holds less,
+ * possibly nothing, so a reader can always tell where a stream ends.
+ * The tag of a chunk covers the header, the chunk's index, whether it
+ * is the last chunk, and its ciphertext, which rules out reordering,
+ * truncation and splicing chunks between streams. Chunks are tagged
+ * under a key of their own, expanded from the box type's tag key, so
+ * that a chunk rearranged as a box does not open as one.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "box.h"
+#include "constant_time.h"
+#include <cryptobox/stream.h>
+
+
+#define STREAM_MAGIC            "CBST"
+#define STREAM_FIXED            12
+#define STREAM_HEAD_MAX         (STREAM_FIXED + 32)
+#define STREAM_LABEL            "cryptobox-stream"
+
+
+struct cryptobox_stream {
+        const struct box_ops    *ops;
+        void                    *ctx;
+        struct box_mac_key       mac;
+        unsigned char            head[STREAM_HEAD_MAX];
+        size_t                   head_size;
+        size_t                   chunk_size;
+};
+
+
+static int       stream_tag(struct cryptobox_stream *, uint64_t, int,
+                            unsigned char *, size_t, unsigned char *);
+static size_t    stream_block(struct cryptobox_stream *, uint64_t);
+
+
+/*
+ * Set up a stream for sealing or opening with the key for a box type.
+ * Returns NULL on failure; the stream should be released with
+ * cryptobox_stream_free.
+ */
+struct cryptobox_stream *
+cryptobox_stream_new(int type, unsigned char *key)
+{
+        struct cryptobox_stream *s;
+        const struct box_ops    *ops;
+
+        if (NULL == (ops = box_ops_lookup(type)))
+                return NULL;
+        if (NULL == (s = box_malloc(sizeof(struct cryptobox_stream))))
+                return NULL;
+        memset(s, 0, sizeof(struct cryptobox_stream));
+        s->ops = ops;
+        s->head_size = STREAM_FIXED + ops->iv_size;
+        if (NULL == (s->ctx = ops->ctx_new(key))) {
+                box_free(s);
+                return NULL;
+        }
+        if (!ops->mac_key(s->ctx, STREAM_LABEL, &s->mac)) {
+                ops->ctx_free(s->ctx);
+                box_free(s);
+                return NULL;
+        }
+        return s;
+}
+
+
+void
+cryptobox_stream_free(struct cryptobox_stream *s)
+{
+        if (NULL == s)
+                return;
+        box_mac_zero(&s->mac);
+        s->ops->ctx_free(s->ctx);
+        box_free(s);
+}
+
+
+/*
+ * Return the size of a stream header for a box type, or 0 if the type
+ * is not known.
+ */
+size_t
+cryptobox_stream_head_size(int type)
+{
+        const struct box_ops    *ops;
+
+        if (NULL == (ops = box_ops_lookup(type)))
+                return 0;
+        return STREAM_FIXED + ops->iv_size;
+}
+
+
+/*
+ * Return the number of bytes a tag adds to each chunk, or 0 if the
+ * type is not known.
+ */
+size_t
+cryptobox_stream_tag_size(int type)
+{
+        const struct box_ops    *ops;
+
+        if (NULL == (ops = box_ops_lookup(type)))
+                return 0;
+        return ops->tag_size;
+}
+
+
+/*
+ * Return the chunk size of a stream, or 0 if its header has not been
+ * written or read yet.
+ */
+size_t
+cryptobox_stream_chunk_size(struct cryptobox_stream *s)
+{
+        return s->chunk_size;
+}
+
+
+/*
+ * Start a new stream with chunks of chunk_size bytes, which must be a
+ * multiple of 16 no larger than CRYPTOBOX_STREAM_MAX_CHUNK; 0 selects
+ * CRYPTOBOX_STREAM_CHUNK. A fresh IV is chosen and the header is
+ * written to head, which must have room for cryptobox_stream_head_size
+ * bytes. Returns 1 on success and 0 on failure.
+ */
+int
+cryptobox_stream_seal_head(struct cryptobox_stream *s, size_t chunk_size,
+                           unsigned char *head)
+{
+        if (0 == chunk_size)
+                chunk_size = CRYPTOBOX_STREAM_CHUNK;
+        if (0 != chunk_size % BOX_BLOCK_SIZE ||
+            chunk_size > CRYPTOBOX_STREAM_MAX_CHUNK)
+                return 0;
+
+        memcpy(s->head, STREAM_MAGIC, 4);
+        s->head[4] = (unsigned char)s->ops->type;
+        s->head[5] = s->head[6] = s->head[7] = 0;
+        s->head[8] = (unsigned char)(chunk_size >> 24);
+        s->head[9] = (unsigned char)(chunk_size >> 16);
+        s->head[10] = (unsigned char)(chunk_size >> 8);
+        s->head[11] = (unsigned char)chunk_size;
+        if (!RAND_bytes(s->head + STREAM_FIXED, s->ops->iv_size)) {
+                s->chunk_size = 0;
+                return 0;
+        }
+        s->chunk_size = chunk_size;
+        memcpy(head, s->head, s->head_size);
+        return 1;
+}
+
+
+/*
+ * Read the header of a stream to be opened. The header is checked
+ * along with each chunk. Returns 1 if it is well formed and 0
+ * otherwise.
+ */
+int
+cryptobox_stream_open_head(struct cryptobox_stream *s, unsigned char *head)
+{
+        size_t  chunk_size;
+
+        s->chunk_size = 0;
+        if (0 != memcmp(head, STREAM_MAGIC, 4) || head[4] != s->ops->type)
+                return 0;
+        if (0 != head[5] || 0 != head[6] || 0 != head[7])
+                return 0;
+        chunk_size = ((size_t)head[8] << 24) | ((size_t)head[9] << 16) |
+                     ((size_t)head[10] << 8) | (size_t)head[11];
+        if (0 == chunk_size || 0 != chunk_size % BOX_BLOCK_SIZE ||
+            chunk_size > CRYPTOBOX_STREAM_MAX_CHUNK)
+                return 0;
+        memcpy(s->head, head, s->head_size);
+        s->chunk_size = chunk_size;
+        return 1;
+}
+
+
+/*
+ * The key stream block at which chunk index starts.
+ */
+size_t
+stream_block(struct cryptobox_stream *s, uint64_t index)
+{
+        return (size_t)index * (s->chunk_size / BOX_BLOCK_SIZE);
+}
+
+
+int
+stream_tag(struct cryptobox_stream *s, uint64_t index, int final,
+           unsigned char *ct, size_t len, unsigned char *tag)
+{
+        union box_mac_state     mac;
+        unsigned char           prefix[9];
+        int                     i;
+
+        for (i = 0; i < 8; i++)
+                prefix[i] = (unsigned char)(index >> (56 - 8 * i));
+        prefix[8] = (unsigned char)final;
+        box_mac_start(&s->mac, &mac);
+        if (s->ops->tag_update(&mac, s->head, s->head_size))
+        if (s->ops->tag_update(&mac, prefix, sizeof prefix))
+        if (s->ops->tag_update(&mac, ct, len))
+                return box_mac_finish(&s->mac, &mac, tag);
+        memset(&mac, 0, sizeof mac);
+        return 0;
+}
+
+
+/*
+ * Seal chunk index of a stream. in holds len bytes of message, which
+ * is the chunk size for every chunk but the last, and less for the
+ * last. The ciphertext and tag, len + cryptobox_stream_tag_size bytes,
+ * are written to out, which may be the same buffer as in. Returns 1
+ * on success and 0 on failure.
+ */
+int
+cryptobox_stream_seal_chunk(struct cryptobox_stream *s, uint64_t index,
+                            unsigned char *in, size_t len, unsigned char *out)
+{
+        if (0 == s->chunk_size || len > s->chunk_size)
+                return 0;
+        if (len > 0 && !s->ops->crypt(s->ctx, s->head + STREAM_FIXED,
+                                      stream_block(s, index), in, out, len))
+                return 0;
+        return stream_tag(s, index, len < s->chunk_size, out, len, out + len);
+}
+
+
+/*
+ * Check and open chunk index of a stream. in holds the chunk as
+ * sealed, in_len bytes including the tag; a chunk shorter than a full
+ * one is taken to be the last. The message, in_len less the tag size
+ * bytes, is written to out, which may be the same buffer as in; it is
+ * only written once the tag has been checked. Returns 1 if the chunk
+ * is authentic and 0 otherwise.
+ */
+int
+cryptobox_stream_open_chunk(struct cryptobox_stream *s, uint64_t index,
+                            unsigned char *in, size_t in_len,
+                            unsigned char *out)
+{
+        unsigned char    tag[SHA512_DIGEST_LENGTH];
+        size_t           ts = s->ops->tag_size;
+        size_t           len;
+        int              match = 0;
+
+        if (0 == s->chunk_size || in_len < ts || in_len - ts > s->chunk_size)
+                return 0;
+        len = in_len - ts;
+        if (stream_tag(s, index, len < s->chunk_size, in, len, tag))
+        if (1 == constant_time_equals(tag, (int)ts, in + len, (int)ts))
+                match = 1;
+        memset(tag, 0, sizeof tag);
+        if (match && len > 0)
+                match = s->ops->crypt(s->ctx, s->head + STREAM_FIXED,
+                                      stream_block(s, index), in, out, len);
+        return match;
+}
@@ -18,27 +18,124 @@
 #include <sys/types.h>
 #include <string.h>
 #include <openssl/evp.h>
-#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <stdio.h>
 
+#include "box.h"
 #include "constant_time.h"
+#include "detached.h"
+#include "hmac_sha2.h"
+#include "keystream.h"
+#include "mapfile.h"
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secmem.h>
 #include <cryptobox/strongbox.h>
 
 
-static int       strongbox_decrypt(unsigned char *, unsigned char *,
+#define STRONGBOX_IV_SIZE       16
+#define STRONGBOX_CRYPT_SIZE    32
+#define STRONGBOX_AAD_LABEL     "cryptobox-strongbox-aad"
+#define STRONGBOX_TAG_SIZE      48
+
+
+/*
+ * A strongbox context holds the expanded form of a key: the AES key
+ * and the HMAC midstates, for boxes alone and for boxes tagged along
+ * with associated data. It is not modified after it is set up, so a
+ * single context may be used from several threads at once. Boxes and
+ * messages are allocated with mem; self is the allocator the context
+ * itself came from. If ks is set, seals draw on its precomputed key
+ * stream; the keystream does its own locking.
+ */
+struct strongbox_ctx {
+        unsigned char           cryptkey[STRONGBOX_CRYPT_SIZE];
+        struct hmac_sha384      tagkey;
+        struct hmac_sha384      aadkey;
+        struct box_allocator    mem;
+        struct box_allocator    self;
+        struct keystream        *ks;
+};
+
+
+static int       strongbox_ctx_init(struct strongbox_ctx *, unsigned char *);
+static int       strongbox_mac_key(struct strongbox_ctx *, const char *,
+                                   struct hmac_sha384 *);
+static void      strongbox_ctx_zero(struct strongbox_ctx *);
+static struct strongbox_ctx
+                *strongbox_ctx_temp(struct strongbox_ctx *, unsigned char *);
+static void      strongbox_ctx_temp_free(struct strongbox_ctx *,
+                                         struct strongbox_ctx *);
+static int       strongbox_decrypt(struct strongbox_ctx *, unsigned char *,
                                    unsigned char *, int);
-static int       strongbox_encrypt(unsigned char *, unsigned char *,
+static int       strongbox_encrypt(struct strongbox_ctx *, unsigned char *,
                                    unsigned char *, int);
 static int       strongbox_generate_nonce(unsigned char *);
-static int       strongbox_tag(unsigned char *, unsigned char *, int,
-                               unsigned char *);
-static int       strongbox_check_tag(unsigned char *, unsigned char *, int);
+static int       strongbox_tag(struct strongbox_ctx *, struct box_aad *,
+                               unsigned char *, int, unsigned char *);
+static int       strongbox_check_tag(struct strongbox_ctx *, struct box_aad *,
+                                     unsigned char *, int);
+static unsigned char
+                *strongbox_seal_box(struct strongbox_ctx *, struct box_aad *,
+                                    unsigned char *, int, int *);
+static unsigned char
+                *strongbox_open_box(struct strongbox_ctx *, struct box_aad *,
+                                    unsigned char *, int);
+static int       strongbox_verify_box(struct strongbox_ctx *, struct box_aad *,
+                                      unsigned char *, int);
+static void     *strongbox_ops_ctx_new(unsigned char *);
+static void      strongbox_ops_ctx_free(void *);
+static unsigned char
+                *strongbox_ops_ctx_seal(void *, unsigned char *, int, int *);
+static unsigned char
+                *strongbox_ops_ctx_open(void *, unsigned char *, int);
+static int       strongbox_ops_ctx_verify(void *, unsigned char *, int);
+static unsigned char
+                *strongbox_ops_ctx_seal_aadv(void *, unsigned char *, int,
+                                             const struct iovec *, int,
+                                             int *);
+static unsigned char
+                *strongbox_ops_ctx_open_aadv(void *, unsigned char *, int,
+                                             const struct iovec *, int);
+static int       strongbox_ops_ctx_verify_aadv(void *, unsigned char *, int,
+                                               const struct iovec *, int);
+static unsigned char
+                *strongbox_ops_ctx_alloc(void *, size_t);
+static void      strongbox_ops_ctx_release(void *, unsigned char *, size_t);
+static int       strongbox_ops_crypt(void *, unsigned char *, size_t,
+                                     unsigned char *, unsigned char *, size_t);
+static int       strongbox_ops_mac_key(void *, const char *,
+                                     struct box_mac_key *);
+static void      strongbox_ops_tag_start(void *, union box_mac_state *);
+static int       strongbox_ops_tag_update(union box_mac_state *,
+                                          unsigned char *, size_t);
+static int       strongbox_ops_tag_finish(void *, union box_mac_state *,
+                                          unsigned char *);
 
 
-const size_t STRONGBOX_IV_SIZE  = 16;
-const size_t STRONGBOX_CRYPT_SIZE = 32;
-const size_t STRONGBOX_TAG_SIZE = 48;
+const struct box_ops strongbox_ops = {
+        CRYPTOBOX_STRONGBOX,
+        80,                     /* STRONGBOX_KEY_SIZE */
+        64,                     /* STRONGBOX_OVERHEAD */
+        STRONGBOX_IV_SIZE,
+        STRONGBOX_TAG_SIZE,
+        strongbox_seal,
+        strongbox_open,
+        strongbox_ops_ctx_new,
+        strongbox_ops_ctx_free,
+        strongbox_ops_ctx_seal,
+        strongbox_ops_ctx_open,
+        strongbox_ops_ctx_verify,
+        strongbox_ops_ctx_seal_aadv,
+        strongbox_ops_ctx_open_aadv,
+        strongbox_ops_ctx_verify_aadv,
+        strongbox_ops_ctx_alloc,
+        strongbox_ops_ctx_release,
+        strongbox_ops_crypt,
+        strongbox_ops_mac_key,
+        strongbox_ops_tag_start,
+        strongbox_ops_tag_update,
+        strongbox_ops_tag_finish
+};
 
 
 /*
@@ -64,16 +161,254 @@ strongbox_generate_nonce(unsigned char *nonce)
 }
 
 
+/*
+ * Expand a key into a context. Returns 1 on success and 0 on failure.
+ */
+int
+strongbox_ctx_init(struct strongbox_ctx *ctx, unsigned char *key)
+{
+        memcpy(ctx->cryptkey, key, STRONGBOX_CRYPT_SIZE);
+        box_allocator_get(&ctx->mem);
+        ctx->ks = NULL;
+        if (!hmac_sha384_init(&ctx->tagkey, key+STRONGBOX_CRYPT_SIZE,
+                              STRONGBOX_TAG_SIZE) ||
+            !strongbox_mac_key(ctx, STRONGBOX_AAD_LABEL, &ctx->aadkey)) {
+                strongbox_ctx_zero(ctx);
+                return 0;
+        }
+        return 1;
+}
+
+
+/*
+ * Wipe the key material in a context.
+ */
+void
+strongbox_ctx_zero(struct strongbox_ctx *ctx)
+{
+        memset(ctx->cryptkey, 0x0, STRONGBOX_CRYPT_SIZE);
+        hmac_sha384_zero(&ctx->tagkey);
+        hmac_sha384_zero(&ctx->aadkey);
+}
+
+
+/*
+ * Derive a MAC key of its own for label from the tag key. This is HKDF
+ * expansion with the tag key as the pseudorandom key; one block of
+ * output is enough, so it comes down to an HMAC over the label and a
+ * 0x01 byte. Boxes with associated data are tagged under such a key, so
+ * that one cannot be passed off as a box without any, or the reverse,
+ * however the data and ciphertext are split; the formats built on boxes
+ * use one each for the same reason.
+ */
+int
+strongbox_mac_key(struct strongbox_ctx *ctx, const char *label,
+                  struct hmac_sha384 *hkey)
+{
+        SHA512_CTX       state;
+        unsigned char    key[STRONGBOX_TAG_SIZE];
+        unsigned char    ctr = 0x01;
+        int              res = 0;
+
+        hmac_sha384_start(&ctx->tagkey, &state);
+        if (SHA384_Update(&state, label, strlen(label)))
+        if (SHA384_Update(&state, &ctr, 1))
+        if (hmac_sha384_finish(&ctx->tagkey, &state, key))
+                res = hmac_sha384_init(hkey, key, STRONGBOX_TAG_SIZE);
+        memset(&state, 0x0, sizeof(SHA512_CTX));
+        memset(key, 0x0, STRONGBOX_TAG_SIZE);
+        return res;
+}
+
+
+/*
+ * Allocate a context for the key, which must be STRONGBOX_KEY_SIZE
+ * bytes. Sealing and opening through a context skips the per-call key
+ * setup that strongbox_seal and strongbox_open carry out. Returns NULL
+ * on failure; the context should be released with strongbox_ctx_free.
+ */
+struct strongbox_ctx *
+strongbox_ctx_new(unsigned char *key)
+{
+        struct strongbox_ctx    *ctx;
+        struct box_allocator     self;
+
+        box_allocator_get(&self);
+        if (NULL == (ctx = box_alloc(&self, sizeof(struct strongbox_ctx))))
+                return NULL;
+        if (!strongbox_ctx_init(ctx, key)) {
+                box_release(&self, ctx, sizeof(struct strongbox_ctx));
+                return NULL;
+        }
+        memcpy(&ctx->self, &self, sizeof(struct box_allocator));
+        return ctx;
+}
+
+
+/*
+ * Allocate a context in the locked arena, setting the arena up with
+ * the default size if need be. Boxes sealed and messages opened with
+ * a secure context are allocated from the arena as well, and must be
+ * released with cryptobox_secmem_free. Returns NULL on failure.
+ */
+struct strongbox_ctx *
+strongbox_ctx_new_secure(unsigned char *key)
+{
+        struct strongbox_ctx    *ctx;
+        struct box_allocator     self;
+
+        box_allocator_secure(&self);
+        if (NULL == (ctx = box_alloc(&self, sizeof(struct strongbox_ctx))))
+                return NULL;
+        if (!strongbox_ctx_init(ctx, key)) {
+                box_release(&self, ctx, sizeof(struct strongbox_ctx));
+                return NULL;
+        }
+        memcpy(&ctx->mem, &self, sizeof(struct box_allocator));
+        memcpy(&ctx->self, &self, sizeof(struct box_allocator));
+        return ctx;
+}
+
+
+/*
+ * Allocate the boxes and messages from a context with alloc and free
+ * instead of the library-wide allocator; passing NULL for either
+ * restores the library-wide allocator. This must be done before the
+ * context is shared between threads.
+ */
+void
+strongbox_ctx_set_allocator(struct strongbox_ctx *ctx, cryptobox_alloc_fn alloc,
+                            cryptobox_free_fn release, void *opaque)
+{
+        if (NULL == alloc || NULL == release) {
+                box_allocator_get(&ctx->mem);
+                return;
+        }
+        ctx->mem.alloc = alloc;
+        ctx->mem.free = release;
+        ctx->mem.opaque = opaque;
+}
+
+
+/*
+ * Wipe and release a context.
+ */
+void
+strongbox_ctx_free(struct strongbox_ctx *ctx)
+{
+        struct box_allocator     self;
+
+        if (NULL == ctx)
+                return;
+        keystream_free(ctx->ks);
+        memcpy(&self, &ctx->self, sizeof(struct box_allocator));
+        box_release(&self, ctx, sizeof(struct strongbox_ctx));
+}
+
+
+/*
+ * Keep depth fresh nonces in reserve, each with the key stream for a
+ * message of up to max_len bytes precomputed, so that sealing a short
+ * message costs only an XOR and the tag. The reserve is filled by
+ * strongbox_ctx_refill. A depth of 0 turns precomputation off. This
+ * must be done before the context is shared between threads. Returns
+ * 1 on success and 0 on failure.
+ */
+int
+strongbox_ctx_keystream(struct strongbox_ctx *ctx, int depth, size_t max_len)
+{
+        struct keystream        *ks = NULL;
+
+        if (depth < 0)
+                return 0;
+        if (depth > 0 && NULL == (ks = keystream_new(&ctx->self, depth,
+                                                     max_len,
+                                                     STRONGBOX_IV_SIZE)))
+                return 0;
+        keystream_free(ctx->ks);
+        ctx->ks = ks;
+        return 1;
+}
+
+
+/*
+ * Refill the nonces used since the last refill. This is meant to be
+ * called when the application is idle, or from a thread of its own;
+ * it may run at the same time as seals on the context. Returns the
+ * number of nonces added to the reserve.
+ */
+int
+strongbox_ctx_refill(struct strongbox_ctx *ctx)
+{
+        if (NULL == ctx->ks)
+                return 0;
+        return keystream_refill(ctx->ks, EVP_aes_256_ctr(), ctx->cryptkey);
+}
+
+
+/*
+ * Report how many seals were served from the reserve and how many had
+ * to compute their key stream because the reserve was empty or the
+ * message was longer than max_len.
+ */
+void
+strongbox_ctx_keystream_stats(struct strongbox_ctx *ctx, uint64_t *hits,
+                              uint64_t *misses)
+{
+        if (NULL != ctx->ks) {
+                keystream_stats(ctx->ks, hits, misses);
+                return;
+        }
+        if (NULL != hits)
+                *hits = 0;
+        if (NULL != misses)
+                *misses = 0;
+}
+
+
+/*
+ * Set up a context for a single call to strongbox_seal or
+ * strongbox_open. Once the arena is in use the context is taken from
+ * it, so the expanded key is never left on the stack; otherwise the
+ * caller's stack context is used.
+ */
+struct strongbox_ctx *
+strongbox_ctx_temp(struct strongbox_ctx *stack, unsigned char *key)
+{
+        struct strongbox_ctx    *ctx = NULL;
+
+        if (cryptobox_secmem_enabled())
+                ctx = cryptobox_secmem_alloc(sizeof(struct strongbox_ctx));
+        if (NULL == ctx)
+                ctx = stack;
+        if (!strongbox_ctx_init(ctx, key)) {
+                if (ctx != stack)
+                        cryptobox_secmem_free(ctx);
+                return NULL;
+        }
+        return ctx;
+}
+
+
+void
+strongbox_ctx_temp_free(struct strongbox_ctx *ctx, struct strongbox_ctx *stack)
+{
+        if (ctx != stack)
+                cryptobox_secmem_free(ctx);
+        else
+                strongbox_ctx_zero(ctx);
+}
+
+
 /*
  * Encrypt the plaintext input using AES-256 in CTR mode.
  */
 int
-strongbox_encrypt(unsigned char *key, unsigned char *in, unsigned char *out,
-                  int data_len)
+strongbox_encrypt(struct strongbox_ctx *ctx, unsigned char *in,
+                  unsigned char *out, int data_len)
 {
         EVP_CIPHER_CTX   crypt;
         unsigned char    nonce[STRONGBOX_IV_SIZE];
-        unsigned char    cryptkey[STRONGBOX_CRYPT_SIZE];
         int              ctlen = 0;
 	int		 finale = 0;
         int              res = 0;
@@ -82,97 +417,139 @@ strongbox_encrypt(unsigned char *key, unsigned char *in, unsigned char *out,
                 return -1;
         }
 	memcpy(out, nonce, STRONGBOX_IV_SIZE);
-        memcpy(cryptkey, key, STRONGBOX_CRYPT_SIZE);
 
         EVP_CIPHER_CTX_init(&crypt);
-        if (EVP_EncryptInit_ex(&crypt, EVP_aes_256_ctr(), NULL, cryptkey, nonce))
+        if (EVP_EncryptInit_ex(&crypt, EVP_aes_256_ctr(), NULL, ctx->cryptkey,
+                               nonce))
         if (EVP_EncryptUpdate(&crypt, out+STRONGBOX_IV_SIZE, &ctlen, in, data_len))
         if (EVP_EncryptFinal_ex(&crypt, out+STRONGBOX_IV_SIZE+ctlen, &finale))
         if (ctlen+finale == data_len)
                 res = 1;
         EVP_CIPHER_CTX_cleanup(&crypt);
-        memset(cryptkey, 0x0, STRONGBOX_CRYPT_SIZE);
         return res;
 }
 
 
 /*
- * Compute the message tag for buffer passed in.
+ * Compute the message tag for the IV and ciphertext passed in,
+ * starting from the HMAC midstates in the context. If there is any
+ * associated data, the tag is taken under the associated data key
+ * over the data, the IV and ciphertext, and the lengths of both.
  */
 int
-strongbox_tag(unsigned char *key, unsigned char *in, int inlen,
-              unsigned char *tag)
+strongbox_tag(struct strongbox_ctx *ctx, struct box_aad *aad,
+              unsigned char *in, int inlen, unsigned char *tag)
 {
-        unsigned char    tagkey[STRONGBOX_TAG_SIZE+1];
-        unsigned int     md_len;
-        int              res = 0;
+        SHA512_CTX       state;
+        unsigned char    trailer[BOX_AAD_TRAILER];
+        int              ok = 1;
+        int              i;
 
-        memcpy(tagkey, key+STRONGBOX_CRYPT_SIZE, STRONGBOX_TAG_SIZE);
-        tag = HMAC(EVP_sha384(), tagkey, STRONGBOX_TAG_SIZE, in, inlen,
-                   tag, &md_len);
-        memset(tagkey, 0x0, STRONGBOX_TAG_SIZE);
-        if (NULL != tag)
-                res = 1;
-        return res;
+        if (NULL == aad || 0 == aad->len)
+                return hmac_sha384(&ctx->tagkey, in, inlen, tag);
+
+        box_aad_trailer(trailer, aad->len, (size_t)inlen);
+        hmac_sha384_start(&ctx->aadkey, &state);
+        for (i = 0; ok && i < aad->iovcnt; i++)
+                ok = SHA384_Update(&state, aad->iov[i].iov_base,
+                                   aad->iov[i].iov_len);
+        if (ok)
+        if (SHA384_Update(&state, in, inlen))
+        if (SHA384_Update(&state, trailer, BOX_AAD_TRAILER))
+                return hmac_sha384_finish(&ctx->aadkey, &state, tag);
+        memset(&state, 0x0, sizeof(SHA512_CTX));
+        return 0;
 }
 
 
 /*
- * Seal a message into a box.
+ * Seal a message into a box, tagged along with any associated data.
  */
 unsigned char *
-strongbox_seal(unsigned char *m, int mlen, int *box_len, unsigned char *key)
+strongbox_seal_box(struct strongbox_ctx *ctx, struct box_aad *aad,
+                   unsigned char *m, int mlen, int *box_len)
 {
         unsigned char           *box;
 	int			 ctlen;
+        int                      ok;
 
+	if (NULL != box_len)
+		*box_len = 0;
 	ctlen = mlen+STRONGBOX_IV_SIZE;
-        if (NULL == (box = malloc(mlen+STRONGBOX_OVERHEAD)))
+        if (NULL == (box = box_alloc(&ctx->mem, mlen+STRONGBOX_OVERHEAD)))
                 return NULL;
 
-        if (strongbox_encrypt(key, m, box, mlen))
-        if (strongbox_tag(key, box, ctlen, box+ctlen)) {
+        if (NULL != ctx->ks && keystream_seal(ctx->ks, m, (size_t)mlen, box))
+                ok = 1;
+        else
+                ok = strongbox_encrypt(ctx, m, box, mlen);
+        if (1 == ok)
+        if (strongbox_tag(ctx, aad, box, ctlen, box+ctlen)) {
 		if (NULL != box_len)
 			*box_len = mlen+STRONGBOX_OVERHEAD;
 		return box;
         }
 
-        if (NULL != box) {
-                memset(box, 0, mlen+STRONGBOX_OVERHEAD);
-                free(box);
-	}
-	*box_len = 0;
+        box_release(&ctx->mem, box, mlen+STRONGBOX_OVERHEAD);
         return NULL;
 }
 
 
+/*
+ * Seal a message into a box using a context.
+ */
+unsigned char *
+strongbox_ctx_seal(struct strongbox_ctx *ctx, unsigned char *m, int mlen,
+                   int *box_len)
+{
+        return strongbox_seal_box(ctx, NULL, m, mlen, box_len);
+}
+
+
+/*
+ * Seal a message into a box.
+ */
+unsigned char *
+strongbox_seal(unsigned char *m, int mlen, int *box_len, unsigned char *key)
+{
+        struct strongbox_ctx     stack;
+        struct strongbox_ctx    *ctx;
+        unsigned char           *box = NULL;
+
+	if (NULL != box_len)
+		*box_len = 0;
+        if (NULL != (ctx = strongbox_ctx_temp(&stack, key))) {
+                box = strongbox_ctx_seal(ctx, m, mlen, box_len);
+                strongbox_ctx_temp_free(ctx, &stack);
+        }
+        return box;
+}
+
+
 /*
  * Decrypt the ciphertext input using AES-256 in CTR mode.
  */
 int
-strongbox_decrypt(unsigned char *key, unsigned char *in, unsigned char *out,
-                  int data_len)
+strongbox_decrypt(struct strongbox_ctx *ctx, unsigned char *in,
+                  unsigned char *out, int data_len)
 {
         EVP_CIPHER_CTX   crypt;
-
         unsigned char    nonce[STRONGBOX_IV_SIZE];
-        unsigned char    cryptkey[STRONGBOX_CRYPT_SIZE];
         int              ptlen = 0;
         int              res = 0;
 	int		 finale = 0;
 
         memcpy(nonce, in, STRONGBOX_IV_SIZE);
-        memcpy(cryptkey, key, STRONGBOX_CRYPT_SIZE);
 
         EVP_CIPHER_CTX_init(&crypt);
-        if (EVP_DecryptInit_ex(&crypt, EVP_aes_256_ctr(), NULL, cryptkey, nonce))
+        if (EVP_DecryptInit_ex(&crypt, EVP_aes_256_ctr(), NULL, ctx->cryptkey,
+                               nonce))
         if (EVP_DecryptUpdate(&crypt, out, &ptlen, in+STRONGBOX_IV_SIZE,
                               data_len))
         if (EVP_DecryptFinal_ex(&crypt, out, &finale))
         if (ptlen+finale == data_len)
                 res = 1;
         EVP_CIPHER_CTX_cleanup(&crypt);
-        memset(cryptkey, 0x0, STRONGBOX_CRYPT_SIZE);
         return res;
 }
 
@@ -182,46 +559,484 @@ strongbox_decrypt(unsigned char *key, unsigned char *in, unsigned char *out,
  * there is a failure.
  */
 int
-strongbox_check_tag(unsigned char *key, unsigned char *in, int inlen)
+strongbox_check_tag(struct strongbox_ctx *ctx, struct box_aad *aad,
+                    unsigned char *in, int inlen)
 {
-        unsigned char    tagkey[STRONGBOX_TAG_SIZE];
-        unsigned char    tag[STRONGBOX_TAG_SIZE];
         unsigned char    atag[STRONGBOX_TAG_SIZE];
         int              msglen = 0;
         int              match = 0;
 
         msglen = inlen - STRONGBOX_TAG_SIZE;
-        memcpy(tagkey, key+STRONGBOX_CRYPT_SIZE, STRONGBOX_TAG_SIZE);
-        memcpy(tag, in+msglen, STRONGBOX_TAG_SIZE);
-        if (strongbox_tag(key, in, msglen, atag))
-	if (constant_time_equals(atag, STRONGBOX_TAG_SIZE, tag, STRONGBOX_TAG_SIZE) == 1)
+        if (strongbox_tag(ctx, aad, in, msglen, atag))
+	if (constant_time_equals(atag, STRONGBOX_TAG_SIZE, in+msglen,
+				 STRONGBOX_TAG_SIZE) == 1)
 		match = 1;
-        memset(tagkey, 0, STRONGBOX_TAG_SIZE);
+        memset(atag, 0, STRONGBOX_TAG_SIZE);
         return match;
 }
 
 
 /*
- * Recover the message from a box. Returns the message (which is
- * box_len - STRONGBOX_OVERHEAD bytes) or NULL if the message could not
- * be recovered. The caller is responsible for freeing the returned value.
+ * Recover the message from a box tagged along with any associated
+ * data. The tag is checked before anything is decrypted.
  */
 unsigned char *
-strongbox_open(unsigned char *box, int box_len, unsigned char *key)
+strongbox_open_box(struct strongbox_ctx *ctx, struct box_aad *aad,
+                   unsigned char *box, int box_len)
 {
         unsigned char   *message = NULL;
 	int		 decryptlen = 0;
 
-	if (box == NULL)
+	if (box == NULL || box_len < (int)STRONGBOX_OVERHEAD)
 		return NULL;
-
 	decryptlen = box_len - STRONGBOX_OVERHEAD;
-        if (NULL != (message = malloc(decryptlen)))
-        if (strongbox_decrypt(key, box, message, decryptlen))
-	if (strongbox_check_tag(key, box, box_len))
+	if (!strongbox_check_tag(ctx, aad, box, box_len))
+		return NULL;
+        if (NULL == (message = box_alloc(&ctx->mem, decryptlen)))
+                return NULL;
+        if (strongbox_decrypt(ctx, box, message, decryptlen))
 		return message;
-        if (NULL != message)
-                memset(message, 0, decryptlen+1);
-        free(message);
+        box_release(&ctx->mem, message, decryptlen);
         return NULL;
 }
+
+
+/*
+ * Recover the message from a box using a context.
+ */
+unsigned char *
+strongbox_ctx_open(struct strongbox_ctx *ctx, unsigned char *box, int box_len)
+{
+        return strongbox_open_box(ctx, NULL, box, box_len);
+}
+
+
+/*
+ * Check a box tagged along with any associated data, without
+ * decrypting it.
+ */
+int
+strongbox_verify_box(struct strongbox_ctx *ctx, struct box_aad *aad,
+                     unsigned char *box, int box_len)
+{
+	if (box == NULL || box_len < (int)STRONGBOX_OVERHEAD)
+		return 0;
+        return strongbox_check_tag(ctx, aad, box, box_len);
+}
+
+
+/*
+ * Check that a box is authentic using a context, without decrypting
+ * it or allocating memory. Returns 1 if the tag matches and 0 if not.
+ */
+int
+strongbox_ctx_verify(struct strongbox_ctx *ctx, unsigned char *box,
+                     int box_len)
+{
+        return strongbox_verify_box(ctx, NULL, box, box_len);
+}
+
+
+/*
+ * Check that a box is authentic.
+ */
+int
+strongbox_verify(unsigned char *box, int box_len, unsigned char *key)
+{
+        struct strongbox_ctx     stack;
+        struct strongbox_ctx    *ctx;
+        int                      match = 0;
+
+        if (NULL != (ctx = strongbox_ctx_temp(&stack, key))) {
+                match = strongbox_ctx_verify(ctx, box, box_len);
+                strongbox_ctx_temp_free(ctx, &stack);
+        }
+        return match;
+}
+
+
+/*
+ * Recover the message from a box. Returns the message (which is
+ * box_len - STRONGBOX_OVERHEAD bytes) or NULL if the message could not
+ * be recovered. The caller is responsible for freeing the returned value.
+ */
+unsigned char *
+strongbox_open(unsigned char *box, int box_len, unsigned char *key)
+{
+        struct strongbox_ctx     stack;
+        struct strongbox_ctx    *ctx;
+        unsigned char           *message = NULL;
+
+        if (NULL != (ctx = strongbox_ctx_temp(&stack, key))) {
+                message = strongbox_ctx_open(ctx, box, box_len);
+                strongbox_ctx_temp_free(ctx, &stack);
+        }
+        return message;
+}
+
+
+/*
+ * Seal a message into a box using a context, authenticating aadlen
+ * bytes of associated data at aad along with it. The associated data
+ * is not encrypted and is not part of the box; the same data must be
+ * given to open the box. With no associated data the box is an
+ * ordinary one.
+ */
+unsigned char *
+strongbox_ctx_seal_aad(struct strongbox_ctx *ctx, unsigned char *m, int mlen,
+                       unsigned char *aad, size_t aadlen, int *box_len)
+{
+        struct iovec     iov;
+
+        iov.iov_base = aad;
+        iov.iov_len = aadlen;
+        return strongbox_ctx_seal_aadv(ctx, m, mlen, &iov, 1, box_len);
+}
+
+
+/*
+ * As strongbox_ctx_seal_aad, with the associated data gathered from
+ * iovcnt buffers. The data is authenticated as if the buffers were
+ * concatenated.
+ */
+unsigned char *
+strongbox_ctx_seal_aadv(struct strongbox_ctx *ctx, unsigned char *m,
+                        int mlen, const struct iovec *iov, int iovcnt,
+                        int *box_len)
+{
+        struct box_aad   aad;
+
+	if (NULL != box_len)
+		*box_len = 0;
+        if (!box_aad_init(&aad, iov, iovcnt))
+                return NULL;
+        return strongbox_seal_box(ctx, &aad, m, mlen, box_len);
+}
+
+
+/*
+ * Recover the message from a box sealed with associated data, which
+ * must match the data given when it was sealed.
+ */
+unsigned char *
+strongbox_ctx_open_aad(struct strongbox_ctx *ctx, unsigned char *box,
+                       int box_len, unsigned char *aad, size_t aadlen)
+{
+        struct iovec     iov;
+
+        iov.iov_base = aad;
+        iov.iov_len = aadlen;
+        return strongbox_ctx_open_aadv(ctx, box, box_len, &iov, 1);
+}
+
+
+unsigned char *
+strongbox_ctx_open_aadv(struct strongbox_ctx *ctx, unsigned char *box,
+                        int box_len, const struct iovec *iov, int iovcnt)
+{
+        struct box_aad   aad;
+
+        if (!box_aad_init(&aad, iov, iovcnt))
+                return NULL;
+        return strongbox_open_box(ctx, &aad, box, box_len);
+}
+
+
+/*
+ * Check that a box sealed with associated data is authentic, without
+ * decrypting it.
+ */
+int
+strongbox_ctx_verify_aad(struct strongbox_ctx *ctx, unsigned char *box,
+                         int box_len, unsigned char *aad, size_t aadlen)
+{
+        struct iovec     iov;
+
+        iov.iov_base = aad;
+        iov.iov_len = aadlen;
+        return strongbox_ctx_verify_aadv(ctx, box, box_len, &iov, 1);
+}
+
+
+int
+strongbox_ctx_verify_aadv(struct strongbox_ctx *ctx, unsigned char *box,
+                          int box_len, const struct iovec *iov, int iovcnt)
+{
+        struct box_aad   aad;
+
+        if (!box_aad_init(&aad, iov, iovcnt))
+                return 0;
+        return strongbox_verify_box(ctx, &aad, box, box_len);
+}
+
+
+/*
+ * Seal a message into a box with associated data.
+ */
+unsigned char *
+strongbox_seal_aad(unsigned char *m, int mlen, unsigned char *aad,
+                   size_t aadlen, int *box_len, unsigned char *key)
+{
+        struct strongbox_ctx     stack;
+        struct strongbox_ctx    *ctx;
+        unsigned char           *box = NULL;
+
+	if (NULL != box_len)
+		*box_len = 0;
+        if (NULL != (ctx = strongbox_ctx_temp(&stack, key))) {
+                box = strongbox_ctx_seal_aad(ctx, m, mlen, aad, aadlen,
+                                             box_len);
+                strongbox_ctx_temp_free(ctx, &stack);
+        }
+        return box;
+}
+
+
+/*
+ * Recover the message from a box sealed with associated data.
+ */
+unsigned char *
+strongbox_open_aad(unsigned char *box, int box_len, unsigned char *aad,
+                   size_t aadlen, unsigned char *key)
+{
+        struct strongbox_ctx     stack;
+        struct strongbox_ctx    *ctx;
+        unsigned char           *message = NULL;
+
+        if (NULL != (ctx = strongbox_ctx_temp(&stack, key))) {
+                message = strongbox_ctx_open_aad(ctx, box, box_len, aad,
+                                                 aadlen);
+                strongbox_ctx_temp_free(ctx, &stack);
+        }
+        return message;
+}
+
+
+/*
+ * Seal the file at in into a box written to the file at out, working
+ * through memory mappings rather than reading the file into memory.
+ * Returns 1 on success and 0 on failure.
+ */
+int
+strongbox_seal_file(const char *in, const char *out, unsigned char *key)
+{
+        return mapfile_seal(&strongbox_ops, in, out, key);
+}
+
+
+/*
+ * Open the box in the file at in, writing the message to the file at
+ * out. The output is only created once the box has been found to be
+ * authentic. Returns 1 on success and 0 on failure.
+ */
+int
+strongbox_open_file(const char *in, const char *out, unsigned char *key)
+{
+        return mapfile_open(&strongbox_ops, in, out, key);
+}
+
+
+/*
+ * Seal mlen bytes from m into out, which may be m, with the ciphertext
+ * exactly as long as the message. The IV and tag are written to meta,
+ * which must hold STRONGBOX_OVERHEAD bytes. Returns 1 on success and
+ * 0 on failure.
+ */
+int
+strongbox_ctx_seal_detached(struct strongbox_ctx *ctx, unsigned char *m,
+                            size_t mlen, unsigned char *out,
+                            unsigned char *meta)
+{
+        return detached_seal(&strongbox_ops, ctx, m, mlen, out, meta);
+}
+
+
+/*
+ * Check ciphertext sealed with strongbox_ctx_seal_detached against its
+ * metadata and decrypt it into out, which may be ct. Nothing is
+ * written unless the ciphertext is authentic. Returns 1 on success
+ * and 0 on failure.
+ */
+int
+strongbox_ctx_open_detached(struct strongbox_ctx *ctx, unsigned char *ct,
+                            size_t len, unsigned char *meta,
+                            unsigned char *out)
+{
+        return detached_open(&strongbox_ops, ctx, ct, len, meta, out);
+}
+
+
+int
+strongbox_seal_detached(unsigned char *m, size_t mlen, unsigned char *out,
+                        unsigned char *meta, unsigned char *key)
+{
+        struct strongbox_ctx     stack;
+        struct strongbox_ctx    *ctx;
+        int                      res = 0;
+
+        if (NULL != (ctx = strongbox_ctx_temp(&stack, key))) {
+                res = strongbox_ctx_seal_detached(ctx, m, mlen, out, meta);
+                strongbox_ctx_temp_free(ctx, &stack);
+        }
+        return res;
+}
+
+
+int
+strongbox_open_detached(unsigned char *ct, size_t len, unsigned char *meta,
+                        unsigned char *out, unsigned char *key)
+{
+        struct strongbox_ctx     stack;
+        struct strongbox_ctx    *ctx;
+        int                      res = 0;
+
+        if (NULL != (ctx = strongbox_ctx_temp(&stack, key))) {
+                res = strongbox_ctx_open_detached(ctx, ct, len, meta, out);
+                strongbox_ctx_temp_free(ctx, &stack);
+        }
+        return res;
+}
+
+
+/*
+ * The remaining functions adapt the context functions to the generic
+ * box operations.
+ */
+void *
+strongbox_ops_ctx_new(unsigned char *key)
+{
+        return strongbox_ctx_new(key);
+}
+
+
+void
+strongbox_ops_ctx_free(void *ctx)
+{
+        strongbox_ctx_free(ctx);
+}
+
+
+unsigned char *
+strongbox_ops_ctx_seal(void *ctx, unsigned char *m, int mlen, int *box_len)
+{
+        return strongbox_ctx_seal(ctx, m, mlen, box_len);
+}
+
+
+unsigned char *
+strongbox_ops_ctx_open(void *ctx, unsigned char *box, int box_len)
+{
+        return strongbox_ctx_open(ctx, box, box_len);
+}
+
+
+int
+strongbox_ops_ctx_verify(void *ctx, unsigned char *box, int box_len)
+{
+        return strongbox_ctx_verify(ctx, box, box_len);
+}
+
+
+unsigned char *
+strongbox_ops_ctx_seal_aadv(void *ctx, unsigned char *m, int mlen,
+                            const struct iovec *iov, int iovcnt,
+                            int *box_len)
+{
+        return strongbox_ctx_seal_aadv(ctx, m, mlen, iov, iovcnt, box_len);
+}
+
+
+unsigned char *
+strongbox_ops_ctx_open_aadv(void *ctx, unsigned char *box, int box_len,
+                            const struct iovec *iov, int iovcnt)
+{
+        return strongbox_ctx_open_aadv(ctx, box, box_len, iov, iovcnt);
+}
+
+
+int
+strongbox_ops_ctx_verify_aadv(void *ctx, unsigned char *box, int box_len,
+                              const struct iovec *iov, int iovcnt)
+{
+        return strongbox_ctx_verify_aadv(ctx, box, box_len, iov, iovcnt);
+}
+
+
+unsigned char *
+strongbox_ops_ctx_alloc(void *vctx, size_t len)
+{
+        struct strongbox_ctx    *ctx = vctx;
+
+        return box_alloc(&ctx->mem, len);
+}
+
+
+void
+strongbox_ops_ctx_release(void *vctx, unsigned char *buf, size_t len)
+{
+        struct strongbox_ctx    *ctx = vctx;
+
+        box_release(&ctx->mem, buf, len);
+}
+
+
+/*
+ * Apply the AES-256 CTR key stream for iv to len bytes, starting block
+ * blocks into the stream.
+ */
+int
+strongbox_ops_crypt(void *vctx, unsigned char *iv, size_t block,
+                    unsigned char *in, unsigned char *out, size_t len)
+{
+        struct strongbox_ctx    *ctx = vctx;
+        EVP_CIPHER_CTX           crypt;
+        unsigned char            ctr[BOX_BLOCK_SIZE];
+        int                      outlen = 0;
+        int                      res = 0;
+
+        box_ctr_offset(ctr, iv, block);
+        EVP_CIPHER_CTX_init(&crypt);
+        if (EVP_EncryptInit_ex(&crypt, EVP_aes_256_ctr(), NULL, ctx->cryptkey,
+                               ctr))
+        if (EVP_EncryptUpdate(&crypt, out, &outlen, in, (int)len))
+        if (outlen == (int)len)
+                res = 1;
+        EVP_CIPHER_CTX_cleanup(&crypt);
+        return res;
+}
+
+
+int
+strongbox_ops_mac_key(void *vctx, const char *label,
+                      struct box_mac_key *mk)
+{
+        mk->type = CRYPTOBOX_STRONGBOX;
+        return strongbox_mac_key(vctx, label, &mk->key.sha384);
+}
+
+
+void
+strongbox_ops_tag_start(void *vctx, union box_mac_state *state)
+{
+        struct strongbox_ctx    *ctx = vctx;
+
+        hmac_sha384_start(&ctx->tagkey, &state->sha512);
+}
+
+
+int
+strongbox_ops_tag_update(union box_mac_state *state, unsigned char *in,
+                         size_t inlen)
+{
+        return SHA384_Update(&state->sha512, in, inlen);
+}
+
+
+int
+strongbox_ops_tag_finish(void *vctx, union box_mac_state *state,
+                         unsigned char *tag)
+{
+        struct strongbox_ctx    *ctx = vctx;
+
+        return hmac_sha384_finish(&ctx->tagkey, &state->sha512, tag);
+}
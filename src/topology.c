@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2013 by Kyle Isom <kyle@tyrfingr.is>.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND INTERNET SOFTWARE CONSORTIUM DISCLAIMS
+ * ALL WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL INTERNET SOFTWARE
+ * CONSORTIUM BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR
+ * PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS
+ * ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+ * SOFTWARE.
+ */
+
+
+/*
+ * The machine's NUMA layout, as far as the worker pool needs it: how
+ * many memory nodes there are, which node a page of memory lives on,
+ * and how to keep a thread on the CPUs of one node. On Linux the
+ * nodes and their CPUs are read from sysfs and pages are located with
+ * get_mempolicy(2), called directly so that libnuma is not needed.
+ * Elsewhere the machine is treated as a single node.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include "topology.h"
+
+
+static void      topo_load(void);
+
+
+static pthread_once_t    topo_once = PTHREAD_ONCE_INIT;
+static int               topo_nnodes = 1;
+
+#ifdef __linux__
+static cpu_set_t         topo_cpus[TOPO_MAX_NODES];
+
+
+/*
+ * Read a node's CPU list, such as "0-7,16-23", into its CPU set.
+ * Returns 0 if the node has no CPUs or the list can't be read.
+ */
+static int
+topo_load_cpus(int node)
+{
+        FILE    *f;
+        char     path[64];
+        int      lo, hi, c, n = 0;
+
+        snprintf(path, sizeof path,
+                 "/sys/devices/system/node/node%d/cpulist", node);
+        if (NULL == (f = fopen(path, "r")))
+                return 0;
+        CPU_ZERO(&topo_cpus[node]);
+        while (1 == fscanf(f, "%d", &lo)) {
+                hi = lo;
+                if ('-' == (c = fgetc(f))) {
+                        if (1 != fscanf(f, "%d", &hi))
+                                break;
+                        c = fgetc(f);
+                }
+                for (; lo <= hi && lo < CPU_SETSIZE; lo++, n++)
+                        CPU_SET(lo, &topo_cpus[node]);
+                if (',' != c)
+                        break;
+        }
+        fclose(f);
+        return n > 0;
+}
+
+
+/*
+ * Count the nodes, which must be numbered densely from zero and all
+ * have CPUs; anything else is treated as a single node.
+ */
+void
+topo_load(void)
+{
+        int     n;
+
+        for (n = 0; n < TOPO_MAX_NODES; n++)
+                if (!topo_load_cpus(n))
+                        break;
+        if (n > 1)
+                topo_nnodes = n;
+}
+
+
+/*
+ * Return the number of memory nodes, which is at least one.
+ */
+int
+topo_nodes(void)
+{
+        pthread_once(&topo_once, topo_load);
+        return topo_nnodes;
+}
+
+
+/*
+ * Return the node holding the page at addr, faulting it in if need
+ * be, or -1 if it is not known.
+ */
+int
+topo_node_of(const void *addr)
+{
+        int     node = -1;
+
+        if (1 == topo_nodes())
+                return 0;
+        if (0 != syscall(SYS_get_mempolicy, &node, NULL, 0UL, addr,
+                         MPOL_F_NODE | MPOL_F_ADDR))
+                return -1;
+        if (node < 0 || node >= topo_nnodes)
+                return -1;
+        return node;
+}
+
+
+/*
+ * Restrict the calling thread to the CPUs of a node. Returns 1 on
+ * success and 0 on failure.
+ */
+int
+topo_bind(int node)
+{
+        if (node < 0 || node >= topo_nodes())
+                return 0;
+        return 0 == pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                           &topo_cpus[node]);
+}
+
+#else
+
+void
+topo_load(void)
+{
+        topo_nnodes = 1;
+}
+
+
+int
+topo_nodes(void)
+{
+        pthread_once(&topo_once, topo_load);
+        return topo_nnodes;
+}
+
+
+int
+topo_node_of(const void *addr)
+{
+        (void)addr;
+        return 0;
+}
+
+
+int
+topo_bind(int node)
+{
+        (void)node;
+        return 0;
+}
+
+#endif
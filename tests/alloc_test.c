@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+
+#include <cryptobox/batch.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_ARENA      (64 * 1024)
+#define TEST_MSGS       8
+#define TEST_LARGE      (3 * 1024 * 1024)
+
+
+static unsigned char global_test_key[80];
+
+
+/*
+ * A counting allocator, which marks its blocks so that they can be
+ * recognised.
+ */
+struct counter {
+	int	allocs;
+	int	frees;
+	int	large;
+};
+
+#define COUNT_MAGIC     0x636f756e74UL
+
+static void *
+count_alloc(size_t len, void *opaque)
+{
+	struct counter	*c = opaque;
+	uint64_t	*p;
+
+	if (NULL == (p = malloc(len + 16)))
+		return NULL;
+	p[0] = COUNT_MAGIC;
+	__atomic_add_fetch(&c->allocs, 1, __ATOMIC_SEQ_CST);
+	if (len >= TEST_LARGE)
+		__atomic_add_fetch(&c->large, 1, __ATOMIC_SEQ_CST);
+	return p + 2;
+}
+
+static void
+count_free(void *block, void *opaque)
+{
+	struct counter	*c = opaque;
+	uint64_t	*p = (uint64_t *)block - 2;
+
+	CU_ASSERT(COUNT_MAGIC == p[0]);
+	__atomic_add_fetch(&c->frees, 1, __ATOMIC_SEQ_CST);
+	free(p);
+}
+
+static int
+counted(void *block)
+{
+	return COUNT_MAGIC == ((uint64_t *)block - 2)[0];
+}
+
+
+/*
+ * A bump allocator over a fixed arena, released all at once.
+ */
+struct bump {
+	unsigned char	arena[TEST_ARENA];
+	size_t		used;
+};
+
+static void *
+bump_alloc(size_t len, void *opaque)
+{
+	struct bump	*b = opaque;
+	void		*p;
+
+	len = (len + 15) & ~(size_t)15;
+	if (b->used + len > TEST_ARENA)
+		return NULL;
+	p = b->arena + b->used;
+	b->used += len;
+	return p;
+}
+
+static void
+bump_free(void *block, void *opaque)
+{
+	(void)block;
+	(void)opaque;
+}
+
+
+/*
+ * Every box, message and context must come from the library-wide
+ * hooks once they are set.
+ */
+static void
+test_global(void)
+{
+	struct counter		 c = { 0, 0, 0 };
+	struct secretbox_ctx	*ctx;
+	unsigned char		 message[] = "Hello, world.";
+	unsigned char		*box, *out;
+	int			 box_len;
+
+	cryptobox_set_allocator(count_alloc, count_free, &c);
+	box = strongbox_seal(message, sizeof message, &box_len,
+			     global_test_key);
+	CU_ASSERT(NULL != box && counted(box));
+	out = strongbox_open(box, box_len, global_test_key);
+	CU_ASSERT(NULL != out && counted(out));
+	count_free(box, &c);
+	count_free(out, &c);
+
+	ctx = secretbox_ctx_new(global_test_key);
+	CU_ASSERT(NULL != ctx && counted(ctx));
+	box = secretbox_ctx_seal(ctx, message, sizeof message, &box_len);
+	CU_ASSERT(NULL != box && counted(box));
+	box[0] ^= 1;
+	CU_ASSERT(NULL == secretbox_ctx_open(ctx, box, box_len));
+	count_free(box, &c);
+	secretbox_ctx_free(ctx);
+
+	cryptobox_set_allocator(NULL, NULL, NULL);
+	CU_ASSERT(c.allocs == c.frees);
+	CU_ASSERT(c.allocs == 4);
+}
+
+
+/*
+ * A context's own allocator serves its boxes and messages, which can
+ * then be released in bulk.
+ */
+static void
+test_context(void)
+{
+	struct strongbox_ctx	*ctx;
+	struct bump		*b;
+	unsigned char		 message[] = "Hello, world.";
+	unsigned char		*box, *out;
+	int			 box_len;
+
+	b = calloc(1, sizeof(struct bump));
+	ctx = strongbox_ctx_new(global_test_key);
+	CU_ASSERT(NULL != ctx);
+	strongbox_ctx_set_allocator(ctx, bump_alloc, bump_free, b);
+	box = strongbox_ctx_seal(ctx, message, sizeof message, &box_len);
+	CU_ASSERT(box >= b->arena && box < b->arena + TEST_ARENA);
+	out = strongbox_ctx_open(ctx, box, box_len);
+	CU_ASSERT(out >= b->arena && out < b->arena + TEST_ARENA);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, message, sizeof message));
+	strongbox_ctx_free(ctx);
+	free(b);
+}
+
+
+/*
+ * The batch interface allocates its results, and its own bookkeeping,
+ * through the hooks, including for messages large enough to be split.
+ */
+static void
+test_batch(void)
+{
+	struct counter		 c = { 0, 0, 0 };
+	struct cryptobox_msg	 msgs[TEST_MSGS];
+	unsigned char		*data;
+	int			 i;
+
+	data = calloc(1, 3 * 1024 * 1024);
+	for (i = 0; i < TEST_MSGS; i++) {
+		msgs[i].in = data;
+		msgs[i].in_len = i ? i * 100 : 3 * 1024 * 1024;
+	}
+	cryptobox_set_allocator(count_alloc, count_free, &c);
+	CU_ASSERT(TEST_MSGS == cryptobox_seal_batch(CRYPTOBOX_SECRETBOX,
+	    msgs, TEST_MSGS, global_test_key));
+	for (i = 0; i < TEST_MSGS; i++) {
+		CU_ASSERT(NULL != msgs[i].out && counted(msgs[i].out));
+		count_free(msgs[i].out, &c);
+	}
+	cryptobox_set_allocator(NULL, NULL, NULL);
+	CU_ASSERT(c.allocs == c.frees);
+	CU_ASSERT(c.allocs > TEST_MSGS);
+	free(data);
+}
+
+
+/*
+ * A message large enough to be split is opened only once its tag has
+ * been checked, so a forged box never has room made for its plaintext.
+ */
+static void
+test_forged(void)
+{
+	struct counter		 c = { 0, 0, 0 };
+	struct cryptobox_msg	 msg;
+	unsigned char		*data;
+	int			 len;
+
+	data = calloc(1, TEST_LARGE);
+	msg.in = secretbox_seal(data, TEST_LARGE, &len, global_test_key);
+	CU_ASSERT(NULL != msg.in);
+	msg.in_len = len;
+	msg.in[len - 1] ^= 0x01;
+	cryptobox_set_allocator(count_alloc, count_free, &c);
+	CU_ASSERT(0 == cryptobox_open_batch(CRYPTOBOX_SECRETBOX, &msg, 1,
+	    global_test_key));
+	cryptobox_set_allocator(NULL, NULL, NULL);
+	CU_ASSERT(NULL == msg.out);
+	CU_ASSERT(0 == c.large);
+	CU_ASSERT(c.allocs == c.frees);
+	free(msg.in);
+	free(data);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	tsuite = CU_add_suite("alloc_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "global hooks", test_global))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "context hooks", test_context))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "batch hooks", test_batch))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "forged large box", test_forged))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/archive.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_MEMBERS    100
+#define TEST_BATCH      1000
+#define TEST_THREADS    4
+#define TEST_PER_THREAD 250
+
+
+static unsigned char global_key[80];
+static unsigned char global_bad_key[80];
+static char global_path[] = "/tmp/cryptobox_archive_test.XXXXXX";
+
+
+/*
+ * Fill buf with the contents of member i, which is i * 7 bytes long.
+ */
+static size_t
+member_data(size_t i, unsigned char *buf)
+{
+	size_t	j, len = i * 7;
+
+	for (j = 0; j < len; j++)
+		buf[j] = (unsigned char)(i * 31 + j);
+	return len;
+}
+
+
+static int
+check_member(struct cryptobox_archive *ar, const char *name, size_t i)
+{
+	unsigned char	 want[TEST_PER_THREAD * 4 * 7 + TEST_BATCH * 7];
+	unsigned char	*m;
+	size_t		 len, want_len;
+	int		 ok;
+
+	want_len = member_data(i, want);
+	if (NULL == (m = cryptobox_archive_get(ar, name, &len)))
+		return 0;
+	ok = len == want_len && 0 == memcmp(m, want, len);
+	free(m);
+	return ok;
+}
+
+
+/*
+ * Flip a byte of the file at off.
+ */
+static int
+flip_byte(off_t off)
+{
+	unsigned char	c;
+	int		fd, ok = 0;
+
+	if (-1 == (fd = open(global_path, O_RDWR)))
+		return 0;
+	if (1 == pread(fd, &c, 1, off)) {
+		c ^= 1;
+		ok = 1 == pwrite(fd, &c, 1, off);
+	}
+	close(fd);
+	return ok;
+}
+
+
+static void
+test_round_trip(void)
+{
+	unsigned char			 buf[TEST_MEMBERS * 7];
+	struct cryptobox_archive	*ar;
+	char				 name[32];
+	size_t				 i, len;
+	int				 ok = 1;
+
+	ar = cryptobox_archive_create(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key);
+	CU_ASSERT(NULL != ar);
+	if (NULL == ar)
+		return;
+	for (i = 0; i < TEST_MEMBERS; i++) {
+		snprintf(name, sizeof name, "member-%zu", i);
+		len = member_data(i, buf);
+		ok &= cryptobox_archive_add(ar, name, buf, len);
+	}
+	CU_ASSERT(1 == ok);
+	CU_ASSERT(0 == cryptobox_archive_add(ar, "member-3", buf, 1));
+	CU_ASSERT(0 == cryptobox_archive_add(ar, "", buf, 1));
+	CU_ASSERT(TEST_MEMBERS == cryptobox_archive_count(ar));
+	CU_ASSERT(1 == check_member(ar, "member-42", 42));
+	CU_ASSERT(1 == cryptobox_archive_close(ar));
+
+	ar = cryptobox_archive_open(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 0);
+	CU_ASSERT(NULL != ar);
+	if (NULL == ar)
+		return;
+	CU_ASSERT(TEST_MEMBERS == cryptobox_archive_count(ar));
+	for (i = 0; i < TEST_MEMBERS; i++) {
+		snprintf(name, sizeof name, "member-%zu", i);
+		ok &= check_member(ar, name, i);
+		ok &= 0 == strcmp(name, cryptobox_archive_name(ar, i));
+	}
+	CU_ASSERT(1 == ok);
+	CU_ASSERT(NULL == cryptobox_archive_name(ar, TEST_MEMBERS));
+	CU_ASSERT(NULL == cryptobox_archive_get(ar, "member-100", &len));
+	CU_ASSERT(0 == len);
+	CU_ASSERT(0 == cryptobox_archive_add(ar, "read-only", buf, 1));
+	CU_ASSERT(1 == cryptobox_archive_close(ar));
+
+	CU_ASSERT(NULL == cryptobox_archive_open(global_path,
+	    CRYPTOBOX_SECRETBOX, global_bad_key, 0));
+	CU_ASSERT(NULL == cryptobox_archive_open(global_path,
+	    CRYPTOBOX_STRONGBOX, global_key, 0));
+}
+
+
+static void
+test_append(void)
+{
+	static unsigned char		 data[TEST_BATCH][TEST_BATCH * 7];
+	static char			 names[TEST_BATCH][32];
+	struct cryptobox_archive_member	 members[TEST_BATCH];
+	struct cryptobox_archive	*ar;
+	size_t				 i;
+	int				 ok = 1;
+
+	ar = cryptobox_archive_open(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 1);
+	CU_ASSERT(NULL != ar);
+	if (NULL == ar)
+		return;
+	for (i = 0; i < TEST_BATCH; i++) {
+		snprintf(names[i], sizeof names[i], "batch-%zu", i);
+		members[i].name = names[i];
+		members[i].data = data[i];
+		members[i].len = member_data(i, data[i]);
+	}
+	CU_ASSERT(1 == cryptobox_archive_add_batch(ar, members, TEST_BATCH));
+	for (i = 0; i < TEST_BATCH; i++)
+		ok &= members[i].ok;
+	CU_ASSERT(1 == ok);
+
+	/* A name already in the archive fails only its own member. */
+	members[0].name = "member-7";
+	members[1].name = "batch-extra";
+	CU_ASSERT(0 == cryptobox_archive_add_batch(ar, members, 2));
+	CU_ASSERT(0 == members[0].ok && 1 == members[1].ok);
+	CU_ASSERT(TEST_MEMBERS + TEST_BATCH + 1 ==
+	    cryptobox_archive_count(ar));
+	CU_ASSERT(1 == cryptobox_archive_close(ar));
+
+	ar = cryptobox_archive_open(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 0);
+	CU_ASSERT(NULL != ar);
+	if (NULL == ar)
+		return;
+	CU_ASSERT(TEST_MEMBERS + TEST_BATCH + 1 ==
+	    cryptobox_archive_count(ar));
+	for (i = 0; i < TEST_BATCH; i++)
+		ok &= check_member(ar, names[i], i);
+	ok &= check_member(ar, "member-7", 7);
+	ok &= check_member(ar, "batch-extra", 1);
+	CU_ASSERT(1 == ok);
+	CU_ASSERT(1 == cryptobox_archive_close(ar));
+}
+
+
+struct adder {
+	struct cryptobox_archive	*ar;
+	int				 id;
+	int				 ok;
+};
+
+
+static void *
+add_many(void *arg)
+{
+	struct adder	*a = arg;
+	unsigned char	 buf[TEST_PER_THREAD * 7];
+	char		 name[32];
+	size_t		 i, len;
+
+	a->ok = 1;
+	for (i = 0; i < TEST_PER_THREAD; i++) {
+		snprintf(name, sizeof name, "thread-%d-%zu", a->id, i);
+		len = member_data(i, buf);
+		a->ok &= cryptobox_archive_add(a->ar, name, buf, len);
+		a->ok &= check_member(a->ar, name, i);
+	}
+	return NULL;
+}
+
+
+static void
+test_threads(void)
+{
+	struct cryptobox_archive	*ar;
+	struct adder			 adders[TEST_THREADS];
+	pthread_t			 threads[TEST_THREADS];
+	char				 name[32];
+	size_t				 i;
+	int				 j, ok = 1;
+
+	ar = cryptobox_archive_create(global_path, CRYPTOBOX_STRONGBOX,
+	    global_key);
+	CU_ASSERT(NULL != ar);
+	if (NULL == ar)
+		return;
+	for (j = 0; j < TEST_THREADS; j++) {
+		adders[j].ar = ar;
+		adders[j].id = j;
+		adders[j].ok = 0;
+		CU_ASSERT(0 == pthread_create(&threads[j], NULL, add_many,
+		    &adders[j]));
+	}
+	for (j = 0; j < TEST_THREADS; j++) {
+		pthread_join(threads[j], NULL);
+		ok &= adders[j].ok;
+	}
+	CU_ASSERT(1 == ok);
+	CU_ASSERT(1 == cryptobox_archive_close(ar));
+
+	ar = cryptobox_archive_open(global_path, CRYPTOBOX_STRONGBOX,
+	    global_key, 0);
+	CU_ASSERT(NULL != ar);
+	if (NULL == ar)
+		return;
+	CU_ASSERT(TEST_THREADS * TEST_PER_THREAD ==
+	    cryptobox_archive_count(ar));
+	for (j = 0; j < TEST_THREADS; j++) {
+		for (i = 0; i < TEST_PER_THREAD; i++) {
+			snprintf(name, sizeof name, "thread-%d-%zu", j, i);
+			ok &= check_member(ar, name, i);
+		}
+	}
+	CU_ASSERT(1 == ok);
+	CU_ASSERT(1 == cryptobox_archive_close(ar));
+}
+
+
+static void
+test_tamper(void)
+{
+	unsigned char			 buf[64 * 7];
+	unsigned char			 box[64 * 7 + 48];
+	struct cryptobox_archive	*ar;
+	struct stat			 st;
+	char				 name[32];
+	size_t				 i, len;
+	int				 fd;
+
+	ar = cryptobox_archive_create(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key);
+	CU_ASSERT(NULL != ar);
+	if (NULL == ar)
+		return;
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof name, "m%zu", i);
+		len = member_data(64, buf);
+		CU_ASSERT(1 == cryptobox_archive_add(ar, name, buf, len));
+	}
+	CU_ASSERT(1 == cryptobox_archive_close(ar));
+
+	/*
+	 * Members are laid out after the 24-byte header in the order they
+	 * were added, all the same length. Copying the first over the
+	 * second must not make the second open as the first.
+	 */
+	len = 64 * 7 + SECRETBOX_OVERHEAD;
+	CU_ASSERT(-1 != (fd = open(global_path, O_RDWR)));
+	CU_ASSERT((ssize_t)len == pread(fd, box, len, 24));
+	CU_ASSERT((ssize_t)len == pwrite(fd, box, len, 24 + (off_t)len));
+	CU_ASSERT(0 == fstat(fd, &st));
+	close(fd);
+	CU_ASSERT(1 == flip_byte(24 + 2 * (off_t)len + 30));
+
+	ar = cryptobox_archive_open(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 0);
+	CU_ASSERT(NULL != ar);
+	if (NULL != ar) {
+		CU_ASSERT(1 == check_member(ar, "m0", 64));
+		CU_ASSERT(0 == check_member(ar, "m1", 64));
+		CU_ASSERT(0 == check_member(ar, "m2", 64));
+		CU_ASSERT(1 == check_member(ar, "m3", 64));
+		CU_ASSERT(1 == cryptobox_archive_close(ar));
+	}
+
+	/* The index itself, and the trailer, are checked on open. */
+	CU_ASSERT(1 == flip_byte(st.st_size - 40));
+	CU_ASSERT(NULL == cryptobox_archive_open(global_path,
+	    CRYPTOBOX_SECRETBOX, global_key, 0));
+	CU_ASSERT(1 == flip_byte(st.st_size - 40));
+	CU_ASSERT(1 == flip_byte(st.st_size - 20));
+	CU_ASSERT(NULL == cryptobox_archive_open(global_path,
+	    CRYPTOBOX_SECRETBOX, global_key, 0));
+	CU_ASSERT(1 == flip_byte(st.st_size - 20));
+	CU_ASSERT(0 == truncate(global_path, st.st_size - 1));
+	CU_ASSERT(NULL == cryptobox_archive_open(global_path,
+	    CRYPTOBOX_SECRETBOX, global_key, 0));
+
+	CU_ASSERT(NULL == cryptobox_archive_open("/nonexistent/archive",
+	    CRYPTOBOX_SECRETBOX, global_key, 0));
+	CU_ASSERT(NULL == cryptobox_archive_create(global_path, 0,
+	    global_key));
+	CU_ASSERT(0 == cryptobox_archive_close(NULL));
+	CU_ASSERT(0 == cryptobox_archive_count(NULL));
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	unlink(global_path);
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+	int		fd;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+	if (-1 == (fd = mkstemp(global_path)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+
+	tsuite = CU_add_suite("archive_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "round trip", test_round_trip))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "append", test_append))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "threads", test_threads))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "tampering", test_tamper))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	unlink(global_path);
+	return fails;
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/async.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_JOBS       64
+
+
+static unsigned char global_test_key[80];
+static unsigned char global_bad_key[80];
+
+
+/*
+ * Read completion counts from the notification pipe until n jobs
+ * have been reported.
+ */
+static void
+wait_for(int fd, uint64_t n)
+{
+	uint64_t	count;
+
+	while (n > 0) {
+		if (sizeof count != read(fd, &count, sizeof count))
+			break;
+		n -= count;
+	}
+}
+
+
+static void
+count_callback(struct cryptobox_job *job, void *arg)
+{
+	(void)job;
+	__atomic_add_fetch((int *)arg, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Seal and then open a batch of messages of mixed sizes through the
+ * engine, checking both the callbacks and the notification pipe.
+ */
+static void
+test_cycle(int type)
+{
+	struct cryptobox_job	 seal_jobs[TEST_JOBS];
+	struct cryptobox_job	 open_jobs[TEST_JOBS];
+	unsigned char		*messages[TEST_JOBS];
+	int			 lens[TEST_JOBS];
+	int			 pipefd[2];
+	int			 calls = 0;
+	int			 i;
+
+	CU_ASSERT(0 == pipe(pipefd));
+	for (i = 0; i < TEST_JOBS; i++) {
+		if (i == TEST_JOBS - 5)
+			lens[i] = 3 * 1024 * 1024 + i;
+		else
+			lens[i] = (i % 4) ? i * 3 : 65536 + i;
+		messages[i] = malloc(lens[i] + 1);
+		memset(messages[i], i, lens[i]);
+		cryptobox_job_init(&seal_jobs[i], count_callback, &calls,
+				   pipefd[1]);
+		CU_ASSERT(1 == cryptobox_submit_seal(&seal_jobs[i], type,
+		    messages[i], lens[i], global_test_key));
+	}
+	wait_for(pipefd[0], TEST_JOBS);
+	CU_ASSERT(TEST_JOBS == __atomic_load_n(&calls, __ATOMIC_SEQ_CST));
+
+	for (i = 0; i < TEST_JOBS; i++) {
+		CU_ASSERT(CRYPTOBOX_JOB_DONE ==
+			  cryptobox_job_status(&seal_jobs[i]));
+		cryptobox_job_init(&open_jobs[i], NULL, NULL, pipefd[1]);
+		CU_ASSERT(1 == cryptobox_submit_open(&open_jobs[i], type,
+		    seal_jobs[i].out, seal_jobs[i].out_len,
+		    (i % 2) ? global_test_key : global_bad_key));
+	}
+	wait_for(pipefd[0], TEST_JOBS);
+
+	for (i = 0; i < TEST_JOBS; i++) {
+		if (i % 2) {
+			CU_ASSERT(CRYPTOBOX_JOB_DONE ==
+				  cryptobox_job_status(&open_jobs[i]));
+			CU_ASSERT(open_jobs[i].out_len == lens[i]);
+			CU_ASSERT(NULL != open_jobs[i].out &&
+				  0 == memcmp(open_jobs[i].out, messages[i],
+					      lens[i]));
+		} else {
+			CU_ASSERT(CRYPTOBOX_JOB_FAILED ==
+				  cryptobox_job_status(&open_jobs[i]));
+			CU_ASSERT(NULL == open_jobs[i].out);
+		}
+		free(open_jobs[i].out);
+		free(seal_jobs[i].out);
+		free(messages[i]);
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+}
+
+
+static void
+test_secretbox(void)
+{
+	test_cycle(CRYPTOBOX_SECRETBOX);
+}
+
+
+static void
+test_strongbox(void)
+{
+	test_cycle(CRYPTOBOX_STRONGBOX);
+}
+
+
+/*
+ * Nothing may be queued while the engine is stopped, and stopping
+ * must complete jobs that are still queued.
+ */
+static void
+test_start_stop(void)
+{
+	struct cryptobox_job	 job;
+	unsigned char		 message[] = "Gorramit.";
+
+	cryptobox_async_stop();
+	cryptobox_job_init(&job, NULL, NULL, -1);
+	CU_ASSERT(0 == cryptobox_submit_seal(&job, CRYPTOBOX_SECRETBOX,
+	    message, sizeof message, global_test_key));
+	CU_ASSERT(0 == cryptobox_submit_seal(&job, 0, message,
+	    sizeof message, global_test_key));
+
+	CU_ASSERT(1 == cryptobox_async_start(2, 4));
+	CU_ASSERT(1 == cryptobox_submit_seal(&job, CRYPTOBOX_STRONGBOX,
+	    message, sizeof message, global_test_key));
+	cryptobox_async_stop();
+	CU_ASSERT(CRYPTOBOX_JOB_DONE == cryptobox_job_status(&job));
+	CU_ASSERT(job.out_len == (int)(sizeof message + STRONGBOX_OVERHEAD));
+	free(job.out);
+
+	CU_ASSERT(1 == cryptobox_async_start(4, 0));
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test keys");
+	if (!cryptobox_async_start(4, 0))
+		errx(EX_OSERR, "failed to start the job engine");
+
+	tsuite = CU_add_suite("async_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "secretbox jobs", test_secretbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "strongbox jobs", test_strongbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "start and stop", test_start_stop))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	cryptobox_async_stop();
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+
+#include <cryptobox/batch.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_MSGS       96
+#define TEST_LARGE      (5 * 1024 * 1024 + 17)
+
+
+static unsigned char global_test_key[80];
+
+
+/*
+ * A skewed batch: mostly tiny messages, a few medium ones, and two
+ * large enough to be split into segments.
+ */
+static int
+message_length(int i)
+{
+	if (i == 7 || i == 60)
+		return TEST_LARGE + i;
+	if (0 == i % 10)
+		return 100000 + i;
+	return i % 64;
+}
+
+
+/*
+ * Seal a batch, open each box with the single-message interface, then
+ * seal each message singly and verify and open the lot as a batch,
+ * tampering with some of the boxes on the way.
+ */
+static void
+test_cycle(int type)
+{
+	struct cryptobox_msg	 msgs[TEST_MSGS];
+	unsigned char		*messages[TEST_MSGS];
+	unsigned char		*out;
+	int			 lens[TEST_MSGS];
+	int			 i, j, len;
+
+	for (i = 0; i < TEST_MSGS; i++) {
+		lens[i] = message_length(i);
+		messages[i] = malloc(lens[i] + 1);
+		for (j = 0; j < lens[i]; j++)
+			messages[i][j] = (unsigned char)(i + j);
+		msgs[i].in = messages[i];
+		msgs[i].in_len = lens[i];
+	}
+
+	CU_ASSERT(TEST_MSGS == cryptobox_seal_batch(type, msgs, TEST_MSGS,
+	    global_test_key));
+	for (i = 0; i < TEST_MSGS; i++) {
+		CU_ASSERT(NULL != msgs[i].out);
+		if (CRYPTOBOX_SECRETBOX == type) {
+			CU_ASSERT(msgs[i].out_len ==
+				  lens[i] + (int)SECRETBOX_OVERHEAD);
+			out = secretbox_open(msgs[i].out, msgs[i].out_len,
+					     global_test_key);
+		} else {
+			CU_ASSERT(msgs[i].out_len ==
+				  lens[i] + (int)STRONGBOX_OVERHEAD);
+			out = strongbox_open(msgs[i].out, msgs[i].out_len,
+					     global_test_key);
+		}
+		CU_ASSERT(NULL != out &&
+			  0 == memcmp(out, messages[i], lens[i]));
+		free(out);
+		free(msgs[i].out);
+	}
+
+	for (i = 0; i < TEST_MSGS; i++) {
+		if (CRYPTOBOX_SECRETBOX == type)
+			msgs[i].in = secretbox_seal(messages[i], lens[i],
+						    &len, global_test_key);
+		else
+			msgs[i].in = strongbox_seal(messages[i], lens[i],
+						    &len, global_test_key);
+		msgs[i].in_len = len;
+		if (0 == i % 3)
+			msgs[i].in[len / 2] ^= 0x01;
+	}
+	CU_ASSERT(TEST_MSGS - TEST_MSGS / 3 == cryptobox_verify_batch(type,
+	    msgs, TEST_MSGS, global_test_key));
+	for (i = 0; i < TEST_MSGS; i++) {
+		CU_ASSERT(NULL == msgs[i].out);
+		CU_ASSERT(msgs[i].out_len == (0 == i % 3 ? 0 : 1));
+	}
+	CU_ASSERT(TEST_MSGS - TEST_MSGS / 3 == cryptobox_open_batch(type,
+	    msgs, TEST_MSGS, global_test_key));
+	for (i = 0; i < TEST_MSGS; i++) {
+		if (0 == i % 3) {
+			CU_ASSERT(NULL == msgs[i].out);
+		} else {
+			CU_ASSERT(msgs[i].out_len == lens[i]);
+			CU_ASSERT(NULL != msgs[i].out &&
+				  0 == memcmp(msgs[i].out, messages[i],
+					      lens[i]));
+		}
+		free(msgs[i].out);
+		free(msgs[i].in);
+		free(messages[i]);
+	}
+}
+
+
+static void
+test_secretbox(void)
+{
+	test_cycle(CRYPTOBOX_SECRETBOX);
+}
+
+
+static void
+test_strongbox(void)
+{
+	test_cycle(CRYPTOBOX_STRONGBOX);
+}
+
+
+static void
+test_invalid(void)
+{
+	struct cryptobox_msg	 msg;
+	unsigned char		 message[] = "Gorramit.";
+
+	msg.in = message;
+	msg.in_len = sizeof message;
+	CU_ASSERT(0 == cryptobox_seal_batch(0, &msg, 1, global_test_key));
+	CU_ASSERT(NULL == msg.out);
+	CU_ASSERT(0 == cryptobox_seal_batch(CRYPTOBOX_SECRETBOX, &msg, 0,
+	    global_test_key));
+	CU_ASSERT(0 == cryptobox_open_batch(CRYPTOBOX_SECRETBOX, &msg, 1,
+	    global_test_key));
+	CU_ASSERT(NULL == msg.out);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	tsuite = CU_add_suite("batch_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "secretbox batch", test_secretbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "strongbox batch", test_strongbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid batches", test_invalid))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
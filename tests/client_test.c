@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include "server.h"
+#include <cryptobox/batch.h>
+#include <cryptobox/client.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_BATCH      300
+#define TEST_ROUNDS     500
+
+
+static unsigned char		 global_secret_key[48];
+static unsigned char		 global_strong_key[80];
+static char			 global_path[64];
+static char			 global_dead_path[64];
+static pid_t			 global_pid = -1;
+static pid_t			 global_dead_pid = -1;
+static volatile sig_atomic_t	 global_stop;
+
+
+static void
+stop_daemon(int sig)
+{
+	(void)sig;
+	global_stop = 1;
+}
+
+
+/*
+ * Fork a daemon serving the test keys at path. The daemons are all
+ * started before any test runs, while the process has no threads.
+ */
+static pid_t
+start_daemon(const char *path)
+{
+	struct server_key	keys[2];
+	pid_t			pid;
+	int			fd;
+
+	if (-1 == (fd = server_listen(path)))
+		err(EX_OSERR, "%s", path);
+	if (-1 == (pid = fork()))
+		err(EX_OSERR, "fork");
+	if (0 == pid) {
+		signal(SIGTERM, stop_daemon);
+		keys[0].type = CRYPTOBOX_SECRETBOX;
+		keys[0].key = global_secret_key;
+		keys[1].type = CRYPTOBOX_STRONGBOX;
+		keys[1].key = global_strong_key;
+		_exit(server_run(fd, keys, 2, &global_stop) ? 0 : 1);
+	}
+	close(fd);
+	return pid;
+}
+
+
+static void
+stop(pid_t pid, const char *path, int sig)
+{
+	int	status;
+
+	if (-1 == pid)
+		return;
+	kill(pid, sig);
+	waitpid(pid, &status, 0);
+	unlink(path);
+}
+
+
+static unsigned char *
+test_message(int len, int seed)
+{
+	unsigned char	*m;
+	int		 i;
+
+	if (NULL == (m = malloc((size_t)len + 1)))
+		return NULL;
+	for (i = 0; i < len; i++)
+		m[i] = (unsigned char)(i * 7 + seed * 31);
+	return m;
+}
+
+
+/*
+ * Single requests under either key must agree with the library, and
+ * anything that is not a valid box must be refused.
+ */
+static void
+test_single(void)
+{
+	struct cryptobox_client	*c;
+	int			 lens[] = { 0, 1, 64, 1000, 65536 };
+	unsigned char		*m, *box, *out;
+	int			 blen, mlen, i;
+
+	c = cryptobox_client_connect(global_path);
+	CU_ASSERT(NULL != c);
+	if (NULL == c)
+		return;
+	CU_ASSERT(2 == cryptobox_client_keys(c));
+	CU_ASSERT(CRYPTOBOX_SECRETBOX == cryptobox_client_key_type(c, 0));
+	CU_ASSERT(CRYPTOBOX_STRONGBOX == cryptobox_client_key_type(c, 1));
+	CU_ASSERT(0 == cryptobox_client_key_type(c, 2));
+
+	for (i = 0; i < (int)(sizeof lens / sizeof lens[0]); i++) {
+		m = test_message(lens[i], i);
+		box = cryptobox_client_seal(c, 0, m, lens[i], &blen);
+		CU_ASSERT(NULL != box);
+		CU_ASSERT(lens[i] + (int)SECRETBOX_OVERHEAD == blen);
+		out = secretbox_open(box, blen, global_secret_key);
+		CU_ASSERT(NULL != out);
+		CU_ASSERT(0 == lens[i] || 0 == memcmp(out, m, lens[i]));
+		free(out);
+
+		out = cryptobox_client_open(c, 0, box, blen, &mlen);
+		CU_ASSERT(NULL != out);
+		CU_ASSERT(lens[i] == mlen);
+		CU_ASSERT(0 == lens[i] || 0 == memcmp(out, m, lens[i]));
+		free(out);
+		CU_ASSERT(1 == cryptobox_client_verify(c, 0, box, blen));
+		CU_ASSERT(NULL == cryptobox_client_open(c, 1, box, blen,
+		    &mlen));
+
+		box[blen / 2] ^= 0x01;
+		CU_ASSERT(NULL == cryptobox_client_open(c, 0, box, blen,
+		    &mlen));
+		CU_ASSERT(0 == cryptobox_client_verify(c, 0, box, blen));
+		free(box);
+
+		box = strongbox_seal(m, lens[i], &blen, global_strong_key);
+		CU_ASSERT(NULL != box);
+		out = cryptobox_client_open(c, 1, box, blen, &mlen);
+		CU_ASSERT(NULL != out);
+		CU_ASSERT(lens[i] == mlen);
+		CU_ASSERT(0 == lens[i] || 0 == memcmp(out, m, lens[i]));
+		free(out);
+		free(box);
+		free(m);
+	}
+
+	m = test_message(CRYPTOBOX_CLIENT_MAX + 1, 0);
+	CU_ASSERT(NULL == cryptobox_client_seal(c, 0, m,
+	    CRYPTOBOX_CLIENT_MAX + 1, &blen));
+	CU_ASSERT(NULL == cryptobox_client_seal(c, 2, m, 16, &blen));
+	CU_ASSERT(NULL == cryptobox_client_seal(c, -1, m, 16, &blen));
+	CU_ASSERT(NULL == cryptobox_client_open(c, 0, m, 16, &mlen));
+	CU_ASSERT(0 == cryptobox_client_verify(c, 0, m, 0));
+	free(m);
+	cryptobox_client_close(c);
+}
+
+
+/*
+ * Batches larger than the client's slots are pipelined through the
+ * daemon.
+ */
+static void
+test_batch(void)
+{
+	struct cryptobox_client	*c;
+	struct cryptobox_msg	 msgs[TEST_BATCH];
+	struct cryptobox_msg	 boxes[TEST_BATCH];
+	unsigned char		*m[TEST_BATCH];
+	unsigned char		*out;
+	int			 i;
+
+	c = cryptobox_client_connect(global_path);
+	CU_ASSERT(NULL != c);
+	if (NULL == c)
+		return;
+	for (i = 0; i < TEST_BATCH; i++) {
+		msgs[i].in_len = (i * 97) % 3000;
+		msgs[i].in = m[i] = test_message(msgs[i].in_len, i);
+	}
+	CU_ASSERT(TEST_BATCH == cryptobox_client_seal_batch(c, 1, msgs,
+	    TEST_BATCH));
+	for (i = 0; i < TEST_BATCH; i++) {
+		CU_ASSERT(NULL != msgs[i].out);
+		out = strongbox_open(msgs[i].out, msgs[i].out_len,
+		    global_strong_key);
+		CU_ASSERT(NULL != out);
+		CU_ASSERT(0 == msgs[i].in_len ||
+		    0 == memcmp(out, m[i], msgs[i].in_len));
+		free(out);
+		boxes[i].in = msgs[i].out;
+		boxes[i].in_len = msgs[i].out_len;
+	}
+
+	CU_ASSERT(TEST_BATCH == cryptobox_client_open_batch(c, 1, boxes,
+	    TEST_BATCH));
+	for (i = 0; i < TEST_BATCH; i++) {
+		CU_ASSERT(msgs[i].in_len == boxes[i].out_len);
+		CU_ASSERT(0 == msgs[i].in_len ||
+		    0 == memcmp(boxes[i].out, m[i], msgs[i].in_len));
+		free(boxes[i].out);
+	}
+
+	for (i = 0; i < TEST_BATCH; i += 10)
+		boxes[i].in[0] ^= 0x80;
+	CU_ASSERT(TEST_BATCH - TEST_BATCH / 10 ==
+	    cryptobox_client_verify_batch(c, 1, boxes, TEST_BATCH));
+	for (i = 0; i < TEST_BATCH; i++) {
+		CU_ASSERT((0 != i % 10) == boxes[i].out_len);
+		CU_ASSERT(NULL == boxes[i].out);
+	}
+	CU_ASSERT(TEST_BATCH / 10 == TEST_BATCH -
+	    cryptobox_client_open_batch(c, 1, boxes, TEST_BATCH));
+	for (i = 0; i < TEST_BATCH; i++) {
+		CU_ASSERT((0 == i % 10) == (NULL == boxes[i].out));
+		free(boxes[i].out);
+		free(msgs[i].out);
+		free(m[i]);
+	}
+	cryptobox_client_close(c);
+}
+
+
+/*
+ * Round trips on one connection, for the concurrent clients.
+ */
+static int
+round_trips(int seed)
+{
+	struct cryptobox_client	*c;
+	unsigned char		*m, *box, *out;
+	int			 blen, mlen, i, ok = 1;
+
+	if (NULL == (c = cryptobox_client_connect(global_path)))
+		return 0;
+	for (i = 0; ok && i < TEST_ROUNDS; i++) {
+		m = test_message(i % 200, seed + i);
+		box = cryptobox_client_seal(c, i % 2, m, i % 200, &blen);
+		out = NULL == box ? NULL :
+		    cryptobox_client_open(c, i % 2, box, blen, &mlen);
+		if (NULL == out || mlen != i % 200 ||
+		    (mlen > 0 && 0 != memcmp(out, m, mlen)))
+			ok = 0;
+		free(out);
+		free(box);
+		free(m);
+	}
+	cryptobox_client_close(c);
+	return ok;
+}
+
+
+/*
+ * Several processes talking to the daemon at once each get their own
+ * results back.
+ */
+static void
+test_clients(void)
+{
+	pid_t	pids[3];
+	int	i, status;
+
+	for (i = 0; i < 3; i++) {
+		pids[i] = fork();
+		CU_ASSERT(-1 != pids[i]);
+		if (0 == pids[i])
+			_exit(round_trips(i * 1000) ? 0 : 1);
+	}
+	CU_ASSERT(round_trips(7));
+	for (i = 0; i < 3; i++) {
+		if (-1 == pids[i])
+			continue;
+		CU_ASSERT(pids[i] == waitpid(pids[i], &status, 0));
+		CU_ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+	}
+}
+
+
+/*
+ * Once the daemon has gone, calls fail rather than hang.
+ */
+static void
+test_gone(void)
+{
+	struct cryptobox_client	*c;
+	unsigned char		 m[32];
+	int			 blen;
+
+	CU_ASSERT(NULL == cryptobox_client_connect("/nonexistent/socket"));
+	CU_ASSERT(NULL == cryptobox_client_connect(NULL));
+
+	memset(m, 0, sizeof m);
+	c = cryptobox_client_connect(global_dead_path);
+	CU_ASSERT(NULL != c);
+	if (NULL == c)
+		return;
+	blen = 0;
+	free(cryptobox_client_seal(c, 0, m, sizeof m, &blen));
+	CU_ASSERT(sizeof m + SECRETBOX_OVERHEAD == (size_t)blen);
+	stop(global_dead_pid, global_dead_path, SIGKILL);
+	global_dead_pid = -1;
+	CU_ASSERT(NULL == cryptobox_client_seal(c, 0, m, sizeof m, &blen));
+	CU_ASSERT(NULL == cryptobox_client_seal(c, 0, m, sizeof m, &blen));
+	cryptobox_client_close(c);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	stop(global_pid, global_path, SIGTERM);
+	stop(global_dead_pid, global_dead_path, SIGKILL);
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!secretbox_generate_key(global_secret_key) ||
+	    !strongbox_generate_key(global_strong_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	snprintf(global_path, sizeof global_path, "/tmp/cryptoboxd_test.%ld",
+	    (long)getpid());
+	snprintf(global_dead_path, sizeof global_dead_path,
+	    "/tmp/cryptoboxd_dead.%ld", (long)getpid());
+	global_pid = start_daemon(global_path);
+	global_dead_pid = start_daemon(global_dead_path);
+
+	tsuite = CU_add_suite("client_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "single requests", test_single))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "batched requests", test_batch))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "concurrent clients", test_clients))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "daemon gone", test_gone))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	stop(global_pid, global_path, SIGTERM);
+	stop(global_dead_pid, global_dead_path, SIGKILL);
+	CU_cleanup_registry();
+	return fails;
+}
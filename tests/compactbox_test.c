@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+
+#include <cryptobox/compactbox.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/keycache.h>
+#include <cryptobox/secretbox.h>
+
+
+#define TEST_THREADS    4
+#define TEST_SEALS      2000
+#define TEST_MAX        256
+
+
+static unsigned char global_test_key[48];
+static unsigned char global_bad_key[48];
+
+
+struct seal_run {
+	struct compactbox_ctx	*ctx;
+	unsigned char		 nonces[TEST_SEALS][12];
+	int			 ok;
+};
+
+
+/*
+ * Seal and open messages of every length up to TEST_MAX, and check
+ * that any change to a box is caught.
+ */
+static void
+test_round_trip(void)
+{
+	struct compactbox_ctx	*ctx;
+	unsigned char		 m[TEST_MAX];
+	unsigned char		*box, *out;
+	int			 blen, len, i;
+
+	for (i = 0; i < TEST_MAX; i++)
+		m[i] = (unsigned char)(i * 13 + 5);
+	ctx = compactbox_ctx_new(global_test_key);
+	CU_ASSERT(NULL != ctx);
+	if (NULL == ctx)
+		return;
+
+	for (len = 0; len < TEST_MAX; len++) {
+		box = compactbox_ctx_seal(ctx, m, len, &blen);
+		CU_ASSERT(NULL != box);
+		CU_ASSERT(len + 24 == blen);
+		out = compactbox_open(box, blen, global_test_key);
+		CU_ASSERT(NULL != out);
+		CU_ASSERT(0 == len || 0 == memcmp(out, m, len));
+		free(out);
+		CU_ASSERT(1 == compactbox_ctx_verify(ctx, box, blen));
+		CU_ASSERT(0 == compactbox_verify(box, blen, global_bad_key));
+		CU_ASSERT(NULL == compactbox_open(box, blen - 1,
+		    global_test_key));
+
+		for (i = 0; i < blen; i++) {
+			box[i] ^= 0x20;
+			CU_ASSERT(NULL == compactbox_ctx_open(ctx, box, blen));
+			box[i] ^= 0x20;
+		}
+		free(box);
+	}
+
+	box = compactbox_seal(m, 32, &blen, global_test_key);
+	CU_ASSERT(NULL != box);
+	out = compactbox_ctx_open(ctx, box, blen);
+	CU_ASSERT(NULL != out);
+	CU_ASSERT(0 == memcmp(out, m, 32));
+	free(out);
+	free(box);
+
+	CU_ASSERT(NULL == compactbox_ctx_open(ctx, NULL, 24));
+	CU_ASSERT(NULL == compactbox_ctx_open(ctx, m, 23));
+	CU_ASSERT(NULL == compactbox_ctx_seal(ctx, m, -1, &blen));
+	CU_ASSERT(0 == blen);
+	compactbox_ctx_free(ctx);
+}
+
+
+/*
+ * Rebuild a box from its documented construction with libcrypto
+ * alone: keys from HKDF-SHA-256, AES-128-CTR from the nonce and a zero
+ * block counter, and the tag as the leading bytes of HMAC-SHA-256.
+ */
+static void
+test_construction(void)
+{
+	EVP_CIPHER_CTX	*crypt;
+	unsigned char	 okm[48], ctr[16], tag[32];
+	unsigned char	 m[40], out[40];
+	unsigned char	*box;
+	unsigned int	 taglen = 0;
+	int		 blen, outlen = 0;
+
+	memset(m, 0x42, sizeof m);
+	box = compactbox_seal(m, sizeof m, &blen, global_test_key);
+	CU_ASSERT(NULL != box);
+	if (NULL == box)
+		return;
+	CU_ASSERT(sizeof m + 24 == (size_t)blen);
+	CU_ASSERT(cryptobox_hkdf(CRYPTOBOX_HKDF_SHA256, NULL, 0,
+	    global_test_key, sizeof global_test_key,
+	    (unsigned char *)"cryptobox-compactbox", 20, okm, sizeof okm));
+
+	CU_ASSERT(NULL != HMAC(EVP_sha256(), okm + 16, 32, box, 12 + sizeof m,
+	    tag, &taglen));
+	CU_ASSERT(0 == memcmp(tag, box + 12 + sizeof m, 12));
+
+	memset(ctr, 0, sizeof ctr);
+	memcpy(ctr, box, 12);
+	crypt = EVP_CIPHER_CTX_new();
+	CU_ASSERT(NULL != crypt);
+	CU_ASSERT(EVP_DecryptInit_ex(crypt, EVP_aes_128_ctr(), NULL, okm, ctr));
+	CU_ASSERT(EVP_DecryptUpdate(crypt, out, &outlen, box + 12, sizeof m));
+	CU_ASSERT(sizeof m == (size_t)outlen);
+	CU_ASSERT(0 == memcmp(out, m, sizeof m));
+	EVP_CIPHER_CTX_free(crypt);
+	free(box);
+}
+
+
+/*
+ * A key shared with a secretbox must not let either kind of box pass
+ * as the other.
+ */
+static void
+test_domains(void)
+{
+	unsigned char	 m[64];
+	unsigned char	*box;
+	int		 blen;
+
+	memset(m, 0x17, sizeof m);
+	box = secretbox_seal(m, sizeof m, &blen, global_test_key);
+	CU_ASSERT(NULL != box);
+	CU_ASSERT(0 == compactbox_verify(box, blen, global_test_key));
+	CU_ASSERT(0 == compactbox_verify(box, blen - 20, global_test_key));
+	free(box);
+
+	box = compactbox_seal(m, sizeof m, &blen, global_test_key);
+	CU_ASSERT(NULL != box);
+	CU_ASSERT(0 == secretbox_verify(box, blen, global_test_key));
+	free(box);
+}
+
+
+static void *
+seal_many(void *arg)
+{
+	struct seal_run	*run = arg;
+	unsigned char	 m[20];
+	unsigned char	*box;
+	int		 blen, i;
+
+	memset(m, 0x33, sizeof m);
+	run->ok = 1;
+	for (i = 0; i < TEST_SEALS; i++) {
+		if (NULL == (box = compactbox_ctx_seal(run->ctx, m, sizeof m,
+		    &blen))) {
+			run->ok = 0;
+			break;
+		}
+		memcpy(run->nonces[i], box, 12);
+		free(box);
+	}
+	return NULL;
+}
+
+
+static int
+nonce_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, 12);
+}
+
+
+/*
+ * Threads sealing on one context never share a nonce, and every nonce
+ * carries the context's prefix.
+ */
+static void
+test_nonces(void)
+{
+	struct compactbox_ctx	*ctx;
+	struct seal_run		*runs;
+	pthread_t		 threads[TEST_THREADS];
+	unsigned char		(*all)[12];
+	int			 i, n = 0;
+
+	runs = calloc(TEST_THREADS, sizeof(struct seal_run));
+	all = calloc(TEST_THREADS * TEST_SEALS, 12);
+	ctx = compactbox_ctx_new(global_test_key);
+	CU_ASSERT(NULL != runs && NULL != all && NULL != ctx);
+	if (NULL == runs || NULL == all || NULL == ctx)
+		goto out;
+
+	for (i = 0; i < TEST_THREADS; i++) {
+		runs[i].ctx = ctx;
+		CU_ASSERT(0 == pthread_create(&threads[i], NULL, seal_many,
+		    &runs[i]));
+	}
+	for (i = 0; i < TEST_THREADS; i++) {
+		CU_ASSERT(0 == pthread_join(threads[i], NULL));
+		CU_ASSERT(runs[i].ok);
+		memcpy(all[n], runs[i].nonces, sizeof runs[i].nonces);
+		n += TEST_SEALS;
+	}
+
+	qsort(all, n, 12, nonce_cmp);
+	for (i = 1; i < n; i++) {
+		CU_ASSERT(0 != memcmp(all[i - 1], all[i], 12));
+		CU_ASSERT(0 == memcmp(all[0], all[i], 4));
+	}
+
+out:
+	free(runs);
+	free(all);
+	compactbox_ctx_free(ctx);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!compactbox_generate_key(global_test_key) ||
+	    !compactbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	tsuite = CU_add_suite("compactbox_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "compact round trip",
+	    test_round_trip))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "compact construction",
+	    test_construction))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "compact key domains", test_domains))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "compact nonces", test_nonces))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+#include <utility>
+
+
+#include <cryptobox/cryptobox.hpp>
+
+
+using cryptobox::secretbox;
+using cryptobox::strongbox;
+
+
+static_assert(cryptobox::sealed_size<secretbox>(16) == 64,
+    "secretbox overhead");
+static_assert(cryptobox::sealed_size<strongbox>(16) == 80,
+    "strongbox overhead");
+static_assert(cryptobox::opened_size<secretbox>(47) == 0,
+    "short box");
+static_assert(sizeof(cryptobox::sealed_array<strongbox, 100>) == 164,
+    "sealed array");
+static_assert(sizeof(cryptobox::secretbox_key) == SECRETBOX_KEY_SIZE,
+    "secretbox key");
+
+
+static cryptobox::secretbox_key	global_secret_key;
+static cryptobox::strongbox_key	global_strong_key;
+
+
+/*
+ * A memory resource that counts what is outstanding and checks that
+ * every block has been wiped by the time it comes back.
+ */
+class counting_resource : public std::pmr::memory_resource {
+public:
+	std::size_t	outstanding = 0;
+	bool		wiped = true;
+
+private:
+	void *do_allocate(std::size_t len, std::size_t align) override
+	{
+		outstanding++;
+		return std::pmr::new_delete_resource()->allocate(len, align);
+	}
+
+	void do_deallocate(void *p, std::size_t len,
+	    std::size_t align) override
+	{
+		const unsigned char	*b = static_cast<unsigned char *>(p);
+		std::size_t		 i;
+
+		for (i = 0; i < len; i++)
+			if (0 != b[i])
+				wiped = false;
+		outstanding--;
+		std::pmr::new_delete_resource()->deallocate(p, len, align);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &o) const
+	    noexcept override
+	{
+		return this == &o;
+	}
+};
+
+
+template <class Box>
+static void
+check_arrays(const cryptobox::key<Box> &k)
+{
+	cryptobox::context<Box>			ctx(k);
+	cryptobox::key<Box>			bad;
+	std::array<unsigned char, 100>		m, out;
+	cryptobox::sealed_array<Box, 100>	b;
+	std::size_t				i;
+
+	CU_ASSERT(static_cast<bool>(ctx));
+	for (i = 0; i < m.size(); i++)
+		m[i] = static_cast<unsigned char>(i);
+	out.fill(0);
+	CU_ASSERT(ctx.seal(m, b));
+	CU_ASSERT(ctx.verify(b.data(), b.size()));
+	CU_ASSERT(ctx.open(b, out));
+	CU_ASSERT(m == out);
+
+	/* Nothing is written when a box does not open. */
+	out.fill(0);
+	b[Box::iv_size + 3] ^= 1;
+	CU_ASSERT(!ctx.verify(b.data(), b.size()));
+	CU_ASSERT(!ctx.open(b, out));
+	CU_ASSERT(0 == out[3]);
+	b[Box::iv_size + 3] ^= 1;
+
+	CU_ASSERT(cryptobox::generate_key<Box>(bad));
+	cryptobox::context<Box>	other(bad);
+	CU_ASSERT(!other.open(b, out));
+	CU_ASSERT(!ctx.open(b.data(), Box::overhead - 1, out.data()));
+}
+
+
+static void
+test_arrays(void)
+{
+	check_arrays<secretbox>(global_secret_key);
+	check_arrays<strongbox>(global_strong_key);
+}
+
+
+/*
+ * Boxes made by the wrapper are ordinary boxes, and the other way
+ * round.
+ */
+static void
+test_interop(void)
+{
+	cryptobox::secretbox_context	 ctx(global_secret_key, true);
+	unsigned char			 m[] = "a message in a box";
+	unsigned char			 b[sizeof m + SECRETBOX_OVERHEAD];
+	unsigned char			 out[sizeof m];
+	unsigned char			*cbox, *cm;
+	int				 len = 0;
+
+	CU_ASSERT(ctx.seal(m, sizeof m, b));
+	cm = secretbox_open(b, sizeof b, global_secret_key.data());
+	CU_ASSERT(NULL != cm);
+	if (NULL != cm) {
+		CU_ASSERT(0 == memcmp(cm, m, sizeof m));
+		free(cm);
+	}
+
+	cbox = secretbox_seal(m, sizeof m, &len, global_secret_key.data());
+	CU_ASSERT(NULL != cbox);
+	if (NULL == cbox)
+		return;
+	CU_ASSERT(ctx.open(cbox, static_cast<std::size_t>(len), out));
+	CU_ASSERT(0 == memcmp(out, m, sizeof m));
+	free(cbox);
+
+	/* An empty message has a box of its own. */
+	CU_ASSERT(ctx.seal(nullptr, 0, b));
+	CU_ASSERT(ctx.verify(b, SECRETBOX_OVERHEAD));
+	CU_ASSERT(ctx.open(b, SECRETBOX_OVERHEAD, out));
+}
+
+
+static void
+test_owning(void)
+{
+	counting_resource		res;
+	unsigned char			m[64];
+	unsigned char			arena[256];
+	cryptobox::strongbox_context	ctx(global_strong_key);
+
+	memset(m, 0x2a, sizeof m);
+	{
+		auto	b = ctx.seal_box(m, sizeof m, &res);
+		CU_ASSERT(static_cast<bool>(b));
+		CU_ASSERT(cryptobox::sealed_size<strongbox>(sizeof m) ==
+		    b.size());
+		CU_ASSERT(&res == b.resource());
+
+		auto	moved = std::move(b);
+		CU_ASSERT(!b);
+		CU_ASSERT(static_cast<bool>(moved));
+
+		auto	out = ctx.open_box(moved, &res);
+		CU_ASSERT(sizeof m == out.size());
+		CU_ASSERT(0 == memcmp(out.data(), m, sizeof m));
+		CU_ASSERT(2 == res.outstanding);
+
+		moved.data()[20] ^= 1;
+		CU_ASSERT(!ctx.open_box(moved, &res));
+		CU_ASSERT(2 == res.outstanding);
+
+		auto	empty = ctx.open_box(moved.data(), 0, &res);
+		CU_ASSERT(!empty);
+	}
+	CU_ASSERT(0 == res.outstanding);
+	CU_ASSERT(res.wiped);
+
+	/* A monotonic arena over a stack buffer keeps off the heap. */
+	std::pmr::monotonic_buffer_resource	 mono(arena, sizeof arena,
+	    std::pmr::null_memory_resource());
+	auto	b = ctx.seal_box(m, sizeof m, &mono);
+	CU_ASSERT(static_cast<bool>(b));
+	auto	out = ctx.open_box(b, &mono);
+	CU_ASSERT(static_cast<bool>(out));
+	auto	none = ctx.seal_box(m, sizeof m, &mono);
+	CU_ASSERT(!none);
+}
+
+
+static void
+test_move(void)
+{
+	cryptobox::secretbox_context	a(global_secret_key);
+	cryptobox::secretbox_context	b;
+	unsigned char			m[16] = { 0 };
+	unsigned char			box[16 + SECRETBOX_OVERHEAD];
+
+	CU_ASSERT(!b);
+	CU_ASSERT(!b.seal(m, sizeof m, box));
+	b = std::move(a);
+	CU_ASSERT(!a);
+	CU_ASSERT(static_cast<bool>(b));
+	CU_ASSERT(b.seal(m, sizeof m, box));
+	cryptobox::secretbox_context	c(std::move(b));
+	CU_ASSERT(c.verify(box, sizeof box));
+	CU_ASSERT(!c.verify(box, sizeof box - 1));
+}
+
+
+#ifdef __cpp_lib_span
+static void
+test_span(void)
+{
+	cryptobox::strongbox_context	ctx(global_strong_key);
+	std::array<unsigned char, 32>	m;
+	std::array<unsigned char, 200>	big;
+	std::array<unsigned char, 32>	out;
+	std::span<unsigned char>	b;
+
+	m.fill(7);
+	CU_ASSERT(ctx.seal(std::span<const unsigned char>(m), big));
+	b = std::span(big).first(cryptobox::sealed_size<strongbox>(m.size()));
+	CU_ASSERT(ctx.verify(b));
+	CU_ASSERT(ctx.open(b, out));
+	CU_ASSERT(m == out);
+	CU_ASSERT(!ctx.seal(std::span<const unsigned char>(m),
+	    std::span(big).first(m.size())));
+	CU_ASSERT(!ctx.open(b, std::span(out).first(4)));
+
+	auto	owned = ctx.seal_box(std::span<const unsigned char>(m));
+	auto	opened = ctx.open_box(std::span<const unsigned char>(owned));
+	CU_ASSERT(m.size() == opened.size());
+}
+#endif
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!cryptobox::generate_key<secretbox>(global_secret_key) ||
+	    !cryptobox::generate_key<strongbox>(global_strong_key))
+		errx(EX_SOFTWARE, "failed to generate test keys");
+
+	tsuite = CU_add_suite("cxx_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "arrays", test_arrays))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "interop", test_interop))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "owning buffers", test_owning))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "move", test_move))
+		fireball();
+#ifdef __cpp_lib_span
+	if (NULL == CU_add_test(tsuite, "spans", test_span))
+		fireball();
+#endif
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_PAGE       4096
+#define TEST_PAGES      16
+
+
+static unsigned char global_secret_key[48];
+static unsigned char global_strong_key[80];
+static char global_path[] = "/tmp/cryptobox_detached_test.XXXXXX";
+
+
+/*
+ * The two box types behind one set of pointers, with the contexts
+ * passed as void pointers.
+ */
+struct test_box {
+	size_t		  overhead;
+	void		*(*ctx_new)(unsigned char *);
+	void		 (*ctx_free)(void *);
+	int		 (*seal)(void *, unsigned char *, size_t,
+			    unsigned char *, unsigned char *);
+	int		 (*open)(void *, unsigned char *, size_t,
+			    unsigned char *, unsigned char *);
+	int		 (*seal_key)(unsigned char *, size_t, unsigned char *,
+			    unsigned char *, unsigned char *);
+	int		 (*open_key)(unsigned char *, size_t, unsigned char *,
+			    unsigned char *, unsigned char *);
+	unsigned char	*(*open_box)(unsigned char *, int, unsigned char *);
+	unsigned char	 *key;
+};
+
+
+static void *
+secret_new(unsigned char *key)
+{
+	return secretbox_ctx_new(key);
+}
+
+static void
+secret_free(void *ctx)
+{
+	secretbox_ctx_free(ctx);
+}
+
+static int
+secret_seal(void *ctx, unsigned char *m, size_t len, unsigned char *out,
+    unsigned char *meta)
+{
+	return secretbox_ctx_seal_detached(ctx, m, len, out, meta);
+}
+
+static int
+secret_open(void *ctx, unsigned char *ct, size_t len, unsigned char *meta,
+    unsigned char *out)
+{
+	return secretbox_ctx_open_detached(ctx, ct, len, meta, out);
+}
+
+static void *
+strong_new(unsigned char *key)
+{
+	return strongbox_ctx_new(key);
+}
+
+static void
+strong_free(void *ctx)
+{
+	strongbox_ctx_free(ctx);
+}
+
+static int
+strong_seal(void *ctx, unsigned char *m, size_t len, unsigned char *out,
+    unsigned char *meta)
+{
+	return strongbox_ctx_seal_detached(ctx, m, len, out, meta);
+}
+
+static int
+strong_open(void *ctx, unsigned char *ct, size_t len, unsigned char *meta,
+    unsigned char *out)
+{
+	return strongbox_ctx_open_detached(ctx, ct, len, meta, out);
+}
+
+
+static struct test_box	test_boxes[2] = {
+	{ 48, secret_new, secret_free, secret_seal, secret_open,
+	  secretbox_seal_detached, secretbox_open_detached, secretbox_open,
+	  global_secret_key },
+	{ 64, strong_new, strong_free, strong_seal, strong_open,
+	  strongbox_seal_detached, strongbox_open_detached, strongbox_open,
+	  global_strong_key }
+};
+
+
+static void
+fill_pages(unsigned char *pages)
+{
+	size_t	i;
+
+	for (i = 0; i < TEST_PAGES * TEST_PAGE; i++)
+		pages[i] = (unsigned char)(i * 7 + i / TEST_PAGE);
+}
+
+
+/*
+ * Seal pages in place with their metadata in a dense table, and check
+ * that each page and its metadata make up an ordinary box, and that
+ * they open in place again.
+ */
+static void
+detached_pages(struct test_box *tb)
+{
+	unsigned char	*pages, *want, *meta, *box, *m;
+	void		*ctx;
+	size_t		 ov = tb->overhead;
+	int		 i;
+
+	CU_ASSERT(0 == posix_memalign((void **)&pages, TEST_PAGE,
+	    TEST_PAGES * TEST_PAGE));
+	want = malloc(TEST_PAGES * TEST_PAGE);
+	meta = malloc(TEST_PAGES * ov);
+	box = malloc(TEST_PAGE + ov);
+	ctx = tb->ctx_new(tb->key);
+	CU_ASSERT(NULL != want && NULL != meta && NULL != box && NULL != ctx);
+	if (NULL == want || NULL == meta || NULL == box || NULL == ctx)
+		return;
+	fill_pages(pages);
+	memcpy(want, pages, TEST_PAGES * TEST_PAGE);
+
+	for (i = 0; i < TEST_PAGES; i++)
+		CU_ASSERT(tb->seal(ctx, pages + i * TEST_PAGE, TEST_PAGE,
+		    pages + i * TEST_PAGE, meta + i * ov));
+	for (i = 0; i < TEST_PAGES; i++) {
+		CU_ASSERT(0 != memcmp(pages + i * TEST_PAGE,
+		    want + i * TEST_PAGE, TEST_PAGE));
+		memcpy(box, meta + i * ov, 16);
+		memcpy(box + 16, pages + i * TEST_PAGE, TEST_PAGE);
+		memcpy(box + 16 + TEST_PAGE, meta + i * ov + 16, ov - 16);
+		m = tb->open_box(box, TEST_PAGE + (int)ov, tb->key);
+		CU_ASSERT(NULL != m);
+		CU_ASSERT(NULL == m ||
+		    0 == memcmp(m, want + i * TEST_PAGE, TEST_PAGE));
+		free(m);
+	}
+
+	/* A page opened against another page's metadata is refused. */
+	memcpy(box, pages, TEST_PAGE);
+	CU_ASSERT(!tb->open(ctx, pages, TEST_PAGE, meta + ov, pages));
+	CU_ASSERT(0 == memcmp(box, pages, TEST_PAGE));
+
+	/* So is any change to the ciphertext, IV or tag. */
+	pages[100] ^= 0x01;
+	CU_ASSERT(!tb->open(ctx, pages, TEST_PAGE, meta, pages));
+	pages[100] ^= 0x01;
+	meta[3] ^= 0x01;
+	CU_ASSERT(!tb->open(ctx, pages, TEST_PAGE, meta, pages));
+	meta[3] ^= 0x01;
+	meta[ov - 1] ^= 0x01;
+	CU_ASSERT(!tb->open(ctx, pages, TEST_PAGE, meta, pages));
+	meta[ov - 1] ^= 0x01;
+	CU_ASSERT(!tb->open(ctx, pages, TEST_PAGE - 1, meta, pages));
+
+	for (i = 0; i < TEST_PAGES; i++)
+		CU_ASSERT(tb->open(ctx, pages + i * TEST_PAGE, TEST_PAGE,
+		    meta + i * ov, pages + i * TEST_PAGE));
+	CU_ASSERT(0 == memcmp(pages, want, TEST_PAGES * TEST_PAGE));
+
+	/* The one-shot calls and empty messages. */
+	CU_ASSERT(tb->seal_key(want, 100, box, meta, tb->key));
+	CU_ASSERT(tb->open(ctx, box, 100, meta, box));
+	CU_ASSERT(0 == memcmp(box, want, 100));
+	CU_ASSERT(tb->seal(ctx, NULL, 0, NULL, meta));
+	CU_ASSERT(tb->open_key(NULL, 0, meta, NULL, tb->key));
+	meta[0] ^= 0x01;
+	CU_ASSERT(!tb->open_key(NULL, 0, meta, NULL, tb->key));
+	CU_ASSERT(!tb->seal(ctx, want, 16, box, NULL));
+	CU_ASSERT(!tb->seal(ctx, NULL, 16, box, meta));
+
+	tb->ctx_free(ctx);
+	free(pages);
+	free(want);
+	free(meta);
+	free(box);
+}
+
+
+static void
+test_secretbox_pages(void)
+{
+	detached_pages(&test_boxes[0]);
+}
+
+
+static void
+test_strongbox_pages(void)
+{
+	detached_pages(&test_boxes[1]);
+}
+
+
+/*
+ * Sealed pages stay aligned and page-sized, so they can go through
+ * O_DIRECT. File systems that refuse O_DIRECT are skipped.
+ */
+static void
+test_direct_io(void)
+{
+#ifdef O_DIRECT
+	struct secretbox_ctx	*ctx;
+	unsigned char		*pages = NULL, *want, *meta;
+	int			 fd, i;
+
+	if (-1 == (fd = mkstemp(global_path)))
+		return;
+	close(fd);
+	fd = open(global_path, O_RDWR | O_DIRECT);
+	if (-1 == fd) {
+		unlink(global_path);
+		return;
+	}
+
+	CU_ASSERT(0 == posix_memalign((void **)&pages, TEST_PAGE,
+	    TEST_PAGES * TEST_PAGE));
+	want = malloc(TEST_PAGES * TEST_PAGE);
+	meta = malloc(TEST_PAGES * SECRETBOX_OVERHEAD);
+	ctx = secretbox_ctx_new(global_secret_key);
+	CU_ASSERT(NULL != want && NULL != meta && NULL != ctx);
+	if (NULL == want || NULL == meta || NULL == ctx)
+		goto out;
+	fill_pages(pages);
+	memcpy(want, pages, TEST_PAGES * TEST_PAGE);
+
+	for (i = 0; i < TEST_PAGES; i++)
+		CU_ASSERT(secretbox_ctx_seal_detached(ctx,
+		    pages + i * TEST_PAGE, TEST_PAGE, pages + i * TEST_PAGE,
+		    meta + i * SECRETBOX_OVERHEAD));
+	if (TEST_PAGES * TEST_PAGE != pwrite(fd, pages,
+	    TEST_PAGES * TEST_PAGE, 0) && EINVAL == errno)
+		goto out;
+	memset(pages, 0, TEST_PAGES * TEST_PAGE);
+	CU_ASSERT(TEST_PAGES * TEST_PAGE == pread(fd, pages,
+	    TEST_PAGES * TEST_PAGE, 0));
+	for (i = 0; i < TEST_PAGES; i++)
+		CU_ASSERT(secretbox_ctx_open_detached(ctx,
+		    pages + i * TEST_PAGE, TEST_PAGE,
+		    meta + i * SECRETBOX_OVERHEAD, pages + i * TEST_PAGE));
+	CU_ASSERT(0 == memcmp(pages, want, TEST_PAGES * TEST_PAGE));
+
+out:
+	secretbox_ctx_free(ctx);
+	free(pages);
+	free(want);
+	free(meta);
+	close(fd);
+	unlink(global_path);
+#endif
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!secretbox_generate_key(global_secret_key) ||
+	    !strongbox_generate_key(global_strong_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	tsuite = CU_add_suite("detached_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "secretbox detached pages",
+	    test_secretbox_pages))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "strongbox detached pages",
+	    test_strongbox_pages))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "detached pages with O_DIRECT",
+	    test_direct_io))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/envelope.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_KEYS       5
+#define TEST_LEN        (1024 * 1024 + 7)
+
+
+static unsigned char global_keys[TEST_KEYS][80];
+static unsigned char global_bad_key[80];
+
+
+struct env_box {
+	int	type;
+	size_t	overhead;
+};
+
+static struct env_box	env_boxes[] = {
+	{ CRYPTOBOX_SECRETBOX, 48 },
+	{ CRYPTOBOX_STRONGBOX, 64 },
+};
+
+
+static unsigned char *
+test_message(size_t len)
+{
+	unsigned char	*m;
+	size_t		 i;
+
+	if (NULL == (m = malloc(len + 1)))
+		return NULL;
+	for (i = 0; i < len; i++)
+		m[i] = (unsigned char)(i * 13 + 1);
+	return m;
+}
+
+
+/*
+ * Every recipient can open the envelope, and it costs 48 bytes per
+ * recipient over a single box.
+ */
+static void
+test_recipients(void)
+{
+	unsigned char	*keys[TEST_KEYS];
+	unsigned char	*m, *env, *out;
+	size_t		 lens[] = { 0, 1, 100, TEST_LEN };
+	size_t		 env_len, mlen;
+	size_t		 b, l;
+	int		 i;
+
+	for (i = 0; i < TEST_KEYS; i++)
+		keys[i] = global_keys[i];
+	m = test_message(TEST_LEN);
+	CU_ASSERT(NULL != m);
+
+	for (b = 0; b < sizeof env_boxes / sizeof env_boxes[0]; b++)
+	for (l = 0; l < sizeof lens / sizeof lens[0]; l++) {
+		env = cryptobox_envelope_seal(env_boxes[b].type, m, lens[l],
+		    &env_len, keys, TEST_KEYS);
+		CU_ASSERT(NULL != env);
+		CU_ASSERT(env_len == lens[l] + env_boxes[b].overhead + 8 +
+		    TEST_KEYS * CRYPTOBOX_ENVELOPE_WRAP);
+		CU_ASSERT(env_len == cryptobox_envelope_size(
+		    env_boxes[b].type, TEST_KEYS, lens[l]));
+		CU_ASSERT(TEST_KEYS == cryptobox_envelope_recipients(
+		    env_boxes[b].type, env, env_len));
+		for (i = 0; i < TEST_KEYS; i++) {
+			out = cryptobox_envelope_open(env_boxes[b].type, env,
+			    env_len, &mlen, keys[i]);
+			CU_ASSERT(NULL != out);
+			CU_ASSERT(lens[l] == mlen);
+			if (NULL != out)
+				CU_ASSERT(0 == memcmp(out, m, mlen));
+			free(out);
+		}
+		CU_ASSERT(NULL == cryptobox_envelope_open(env_boxes[b].type,
+		    env, env_len, &mlen, global_bad_key));
+		free(env);
+	}
+	free(m);
+}
+
+
+/*
+ * A change to any part of an envelope, including another recipient's
+ * wrapped key, stops it opening.
+ */
+static void
+test_tamper(void)
+{
+	unsigned char	*keys[TEST_KEYS];
+	unsigned char	 m[64];
+	unsigned char	*env, *out;
+	size_t		 env_len, i;
+	int		 k;
+
+	for (k = 0; k < TEST_KEYS; k++)
+		keys[k] = global_keys[k];
+	memset(m, 0x61, sizeof m);
+	env = cryptobox_envelope_seal(CRYPTOBOX_STRONGBOX, m, sizeof m,
+	    &env_len, keys, TEST_KEYS);
+	CU_ASSERT(NULL != env);
+	if (NULL == env)
+		return;
+
+	for (i = 0; i < env_len; i += 7) {
+		env[i] ^= 0x10;
+		out = cryptobox_envelope_open(CRYPTOBOX_STRONGBOX, env,
+		    env_len, NULL, keys[0]);
+		CU_ASSERT(NULL == out);
+		free(out);
+		env[i] ^= 0x10;
+	}
+	CU_ASSERT(NULL == cryptobox_envelope_open(CRYPTOBOX_STRONGBOX, env,
+	    env_len - 1, NULL, keys[0]));
+	CU_ASSERT(NULL == cryptobox_envelope_open(CRYPTOBOX_SECRETBOX, env,
+	    env_len, NULL, keys[0]));
+	out = cryptobox_envelope_open(CRYPTOBOX_STRONGBOX, env, env_len, NULL,
+	    keys[TEST_KEYS - 1]);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, m, sizeof m));
+	free(out);
+	free(env);
+}
+
+
+static void
+test_invalid(void)
+{
+	unsigned char	*keys[2];
+	unsigned char	 m[16];
+	size_t		 env_len;
+
+	keys[0] = global_keys[0];
+	keys[1] = NULL;
+	memset(m, 0, sizeof m);
+	CU_ASSERT(NULL == cryptobox_envelope_seal(0, m, sizeof m, &env_len,
+	    keys, 1));
+	CU_ASSERT(NULL == cryptobox_envelope_seal(CRYPTOBOX_SECRETBOX, m,
+	    sizeof m, &env_len, keys, 0));
+	CU_ASSERT(NULL == cryptobox_envelope_seal(CRYPTOBOX_SECRETBOX, m,
+	    sizeof m, &env_len, keys, 2));
+	CU_ASSERT(0 == env_len);
+	CU_ASSERT(0 == cryptobox_envelope_size(CRYPTOBOX_SECRETBOX,
+	    CRYPTOBOX_ENVELOPE_MAX_KEYS + 1, 0));
+	CU_ASSERT(0 == cryptobox_envelope_recipients(CRYPTOBOX_SECRETBOX, m,
+	    sizeof m));
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+	int		i;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < TEST_KEYS; i++)
+		if (!strongbox_generate_key(global_keys[i]))
+			errx(EX_SOFTWARE, "failed to generate test key");
+	if (!strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	tsuite = CU_add_suite("envelope_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "envelope recipients",
+	    test_recipients))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "envelope tampering", test_tamper))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid envelopes", test_invalid))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/file.h>
+#include <cryptobox/stream.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_LEN        (3 * 65536 + 1234)
+
+
+static unsigned char global_test_key[80];
+static unsigned char global_bad_key[80];
+static char global_path[] = "/tmp/cryptobox_file_test.XXXXXX";
+
+
+static unsigned char *
+test_message(size_t len)
+{
+	unsigned char	*m;
+	size_t		 i;
+
+	if (NULL == (m = malloc(len + 1)))
+		return NULL;
+	for (i = 0; i < len; i++)
+		m[i] = (unsigned char)(i * 31 + 5);
+	return m;
+}
+
+
+/*
+ * Write a file through stdio in uneven pieces, with a line of
+ * formatted output, and read it back with and without seeking.
+ */
+static void
+test_cycle(int type)
+{
+	unsigned char	*m, *out;
+	unsigned char	 buf[100];
+	size_t		 off, n, step = 1;
+	FILE		*fp;
+	long		 len;
+
+	m = test_message(TEST_LEN);
+	out = malloc(TEST_LEN + 64);
+	fp = cryptobox_fopen(global_path, "w", type, global_test_key);
+	CU_ASSERT(NULL != fp);
+	if (NULL == fp)
+		goto out;
+	for (off = 0; off < TEST_LEN; off += n) {
+		n = TEST_LEN - off < step ? TEST_LEN - off : step;
+		CU_ASSERT(n == fwrite(m + off, 1, n, fp));
+		step = step * 5 + 3;
+	}
+	CU_ASSERT(0 < fprintf(fp, "%s %d\n", "done", 42));
+	CU_ASSERT(TEST_LEN + 8 == ftell(fp));
+	CU_ASSERT(-1 == fseek(fp, 0, SEEK_SET));
+	CU_ASSERT(0 == fclose(fp));
+
+	fp = cryptobox_fopen(global_path, "rb", type, global_test_key);
+	CU_ASSERT(NULL != fp);
+	if (NULL == fp)
+		goto out;
+	CU_ASSERT(TEST_LEN + 8 == fread(out, 1, TEST_LEN + 64, fp));
+	CU_ASSERT(0 == memcmp(out, m, TEST_LEN));
+	CU_ASSERT(0 == memcmp(out + TEST_LEN, "done 42\n", 8));
+	CU_ASSERT(feof(fp));
+
+	/* Seek across chunk boundaries in both directions. */
+	CU_ASSERT(0 == fseek(fp, 65536 - 10, SEEK_SET));
+	CU_ASSERT(100 == fread(buf, 1, 100, fp));
+	CU_ASSERT(0 == memcmp(buf, m + 65536 - 10, 100));
+	CU_ASSERT(0 == fseek(fp, -8, SEEK_END));
+	CU_ASSERT(8 == fread(buf, 1, 100, fp));
+	CU_ASSERT(0 == memcmp(buf, "done 42\n", 8));
+	CU_ASSERT(0 == fseek(fp, 5, SEEK_SET));
+	CU_ASSERT(0 == fseek(fp, 2 * 65536, SEEK_CUR));
+	CU_ASSERT(10 == fread(buf, 1, 10, fp));
+	CU_ASSERT(0 == memcmp(buf, m + 2 * 65536 + 5, 10));
+	CU_ASSERT(0 == fseek(fp, 0, SEEK_END));
+	len = ftell(fp);
+	CU_ASSERT(TEST_LEN + 8 == len);
+	CU_ASSERT(0 == fseek(fp, len + 100, SEEK_SET));
+	CU_ASSERT(0 == fread(buf, 1, 10, fp));
+	CU_ASSERT(0 == fclose(fp));
+
+	CU_ASSERT(NULL == cryptobox_fopen(global_path, "r", type,
+	    global_bad_key));
+
+out:
+	free(out);
+	free(m);
+}
+
+
+/*
+ * A damaged chunk is reported as a read error; a truncated file does
+ * not open at all.
+ */
+static void
+test_damage(int type)
+{
+	unsigned char	*m, *out;
+	unsigned char	 byte;
+	size_t		 head_size = cryptobox_stream_head_size(type);
+	FILE		*fp;
+	int		 fd;
+
+	m = test_message(TEST_LEN);
+	out = malloc(TEST_LEN);
+	fp = cryptobox_fopen(global_path, "w", type, global_test_key);
+	CU_ASSERT(NULL != fp);
+	if (NULL == fp)
+		goto out;
+	CU_ASSERT(TEST_LEN == fwrite(m, 1, TEST_LEN, fp));
+	CU_ASSERT(0 == fclose(fp));
+
+	fd = open(global_path, O_RDWR);
+	CU_ASSERT(-1 != fd);
+	CU_ASSERT(1 == pread(fd, &byte, 1, (off_t)head_size + 70000));
+	byte ^= 0x01;
+	CU_ASSERT(1 == pwrite(fd, &byte, 1, (off_t)head_size + 70000));
+
+	fp = cryptobox_fopen(global_path, "r", type, global_test_key);
+	CU_ASSERT(NULL != fp);
+	if (NULL != fp) {
+		CU_ASSERT(TEST_LEN > fread(out, 1, TEST_LEN, fp));
+		CU_ASSERT(ferror(fp));
+		CU_ASSERT(0 == fseek(fp, 0, SEEK_SET));
+		clearerr(fp);
+		CU_ASSERT(65536 == fread(out, 1, 65536, fp));
+		fclose(fp);
+	}
+
+	byte ^= 0x01;
+	CU_ASSERT(1 == pwrite(fd, &byte, 1, (off_t)head_size + 70000));
+	CU_ASSERT(0 == ftruncate(fd, (off_t)head_size + 65536 +
+	    (off_t)cryptobox_stream_tag_size(type)));
+	close(fd);
+	CU_ASSERT(NULL == cryptobox_fopen(global_path, "r", type,
+	    global_test_key));
+
+out:
+	free(out);
+	free(m);
+}
+
+
+static void
+test_secretbox(void)
+{
+	test_cycle(CRYPTOBOX_SECRETBOX);
+	test_damage(CRYPTOBOX_SECRETBOX);
+}
+
+
+static void
+test_strongbox(void)
+{
+	test_cycle(CRYPTOBOX_STRONGBOX);
+	test_damage(CRYPTOBOX_STRONGBOX);
+}
+
+
+static void
+test_invalid(void)
+{
+	CU_ASSERT(NULL == cryptobox_fopen(global_path, "a", CRYPTOBOX_SECRETBOX,
+	    global_test_key));
+	CU_ASSERT(NULL == cryptobox_fopen(global_path, "r+",
+	    CRYPTOBOX_SECRETBOX, global_test_key));
+	CU_ASSERT(NULL == cryptobox_fopen(global_path, "w", 0,
+	    global_test_key));
+	CU_ASSERT(NULL == cryptobox_fopen("/nonexistent/cryptobox", "r",
+	    CRYPTOBOX_SECRETBOX, global_test_key));
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	unlink(global_path);
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+	int		fd;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+	if (-1 == (fd = mkstemp(global_path)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+
+	tsuite = CU_add_suite("file_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "secretbox files", test_secretbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "strongbox files", test_strongbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid files", test_invalid))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	unlink(global_path);
+	return fails;
+}
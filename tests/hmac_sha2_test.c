@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+
+#include "hmac_sha2.h"
+
+
+/*
+ * Test cases 1, 2 and 6 from RFC 4231.
+ */
+struct hmac_vector {
+	unsigned char	 key[131];
+	size_t		 keylen;
+	const char	*data;
+	unsigned char	 sha256[32];
+	unsigned char	 sha384[48];
+};
+
+static struct hmac_vector vectors[] = {
+	{
+		{0x0b}, 20, "Hi There",
+		{
+			0xb0, 0x34, 0x4c, 0x61, 0xd8, 0xdb, 0x38, 0x53,
+			0x5c, 0xa8, 0xaf, 0xce, 0xaf, 0x0b, 0xf1, 0x2b,
+			0x88, 0x1d, 0xc2, 0x00, 0xc9, 0x83, 0x3d, 0xa7,
+			0x26, 0xe9, 0x37, 0x6c, 0x2e, 0x32, 0xcf, 0xf7,
+		},
+		{
+			0xaf, 0xd0, 0x39, 0x44, 0xd8, 0x48, 0x95, 0x62,
+			0x6b, 0x08, 0x25, 0xf4, 0xab, 0x46, 0x90, 0x7f,
+			0x15, 0xf9, 0xda, 0xdb, 0xe4, 0x10, 0x1e, 0xc6,
+			0x82, 0xaa, 0x03, 0x4c, 0x7c, 0xeb, 0xc5, 0x9c,
+			0xfa, 0xea, 0x9e, 0xa9, 0x07, 0x6e, 0xde, 0x7f,
+			0x4a, 0xf1, 0x52, 0xe8, 0xb2, 0xfa, 0x9c, 0xb6,
+		},
+	},
+	{
+		{'J', 'e', 'f', 'e'}, 4, "what do ya want for nothing?",
+		{
+			0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e,
+			0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+			0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83,
+			0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43,
+		},
+		{
+			0xaf, 0x45, 0xd2, 0xe3, 0x76, 0x48, 0x40, 0x31,
+			0x61, 0x7f, 0x78, 0xd2, 0xb5, 0x8a, 0x6b, 0x1b,
+			0x9c, 0x7e, 0xf4, 0x64, 0xf5, 0xa0, 0x1b, 0x47,
+			0xe4, 0x2e, 0xc3, 0x73, 0x63, 0x22, 0x44, 0x5e,
+			0x8e, 0x22, 0x40, 0xca, 0x5e, 0x69, 0xe2, 0xc7,
+			0x8b, 0x32, 0x39, 0xec, 0xfa, 0xb2, 0x16, 0x49,
+		},
+	},
+	{
+		{0xaa}, 131,
+		"Test Using Larger Than Block-Size Key - Hash Key First",
+		{
+			0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f,
+			0x0d, 0x8a, 0x26, 0xaa, 0xcb, 0xf5, 0xb7, 0x7f,
+			0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28, 0xc5, 0x14,
+			0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54,
+		},
+		{
+			0x4e, 0xce, 0x08, 0x44, 0x85, 0x81, 0x3e, 0x90,
+			0x88, 0xd2, 0xc6, 0x3a, 0x04, 0x1b, 0xc5, 0xb4,
+			0x4f, 0x9e, 0xf1, 0x01, 0x2a, 0x2b, 0x58, 0x8f,
+			0x3c, 0xd1, 0x1f, 0x05, 0x03, 0x3a, 0xc4, 0xc6,
+			0x0c, 0x2e, 0xf6, 0xab, 0x40, 0x30, 0xfe, 0x82,
+			0x96, 0x24, 0x8d, 0xf1, 0x63, 0xf4, 0x49, 0x52,
+		},
+	},
+};
+static size_t nvectors = sizeof vectors / sizeof vectors[0];
+
+
+/*
+ * The vectors repeat a single key byte; fill out the rest of the key.
+ */
+static void
+fill_key(struct hmac_vector *v)
+{
+	if (v->keylen > 4)
+		memset(v->key, v->key[0], v->keylen);
+}
+
+
+static void
+test_sha256_vectors(void)
+{
+	struct hmac_sha256	 hkey;
+	unsigned char		 tag[32];
+	size_t			 i;
+
+	for (i = 0; i < nvectors; i++) {
+		fill_key(&vectors[i]);
+		CU_ASSERT(1 == hmac_sha256_init(&hkey, vectors[i].key,
+						vectors[i].keylen));
+		CU_ASSERT(1 == hmac_sha256(&hkey,
+					   (unsigned char *)vectors[i].data,
+					   strlen(vectors[i].data), tag));
+		CU_ASSERT(0 == memcmp(tag, vectors[i].sha256, 32));
+		hmac_sha256_zero(&hkey);
+	}
+}
+
+
+static void
+test_sha384_vectors(void)
+{
+	struct hmac_sha384	 hkey;
+	unsigned char		 tag[48];
+	size_t			 i;
+
+	for (i = 0; i < nvectors; i++) {
+		fill_key(&vectors[i]);
+		CU_ASSERT(1 == hmac_sha384_init(&hkey, vectors[i].key,
+						vectors[i].keylen));
+		CU_ASSERT(1 == hmac_sha384(&hkey,
+					   (unsigned char *)vectors[i].data,
+					   strlen(vectors[i].data), tag));
+		CU_ASSERT(0 == memcmp(tag, vectors[i].sha384, 48));
+		hmac_sha384_zero(&hkey);
+	}
+}
+
+
+/*
+ * A cached key must give the same tags as HMAC() over many calls and
+ * message lengths that straddle the block boundaries, whether the
+ * message is passed in one piece or several.
+ */
+static void
+test_cached_key(void)
+{
+	unsigned char		 key[48];
+	unsigned char		 msg[300];
+	unsigned char		 tag[48];
+	unsigned char		 expected[48];
+	unsigned int		 md_len;
+	struct hmac_sha256	 key256;
+	struct hmac_sha384	 key384;
+	SHA256_CTX		 state256;
+	SHA512_CTX		 state384;
+	size_t			 i;
+
+	for (i = 0; i < sizeof key; i++)
+		key[i] = (unsigned char)(i * 7);
+	for (i = 0; i < sizeof msg; i++)
+		msg[i] = (unsigned char)(i * 13);
+
+	CU_ASSERT(1 == hmac_sha256_init(&key256, key, 32));
+	CU_ASSERT(1 == hmac_sha384_init(&key384, key, 48));
+	for (i = 0; i < sizeof msg; i++) {
+		HMAC(EVP_sha256(), key, 32, msg, i, expected, &md_len);
+		CU_ASSERT(1 == hmac_sha256(&key256, msg, i, tag));
+		CU_ASSERT(0 == memcmp(tag, expected, 32));
+
+		hmac_sha256_start(&key256, &state256);
+		SHA256_Update(&state256, msg, i / 2);
+		SHA256_Update(&state256, msg + i / 2, i - i / 2);
+		CU_ASSERT(1 == hmac_sha256_finish(&key256, &state256, tag));
+		CU_ASSERT(0 == memcmp(tag, expected, 32));
+
+		HMAC(EVP_sha384(), key, 48, msg, i, expected, &md_len);
+		CU_ASSERT(1 == hmac_sha384(&key384, msg, i, tag));
+		CU_ASSERT(0 == memcmp(tag, expected, 48));
+
+		hmac_sha384_start(&key384, &state384);
+		SHA384_Update(&state384, msg, i / 2);
+		SHA384_Update(&state384, msg + i / 2, i - i / 2);
+		CU_ASSERT(1 == hmac_sha384_finish(&key384, &state384, tag));
+		CU_ASSERT(0 == memcmp(tag, expected, 48));
+	}
+	hmac_sha256_zero(&key256);
+	hmac_sha384_zero(&key384);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	tsuite = CU_add_suite("hmac_sha2_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "HMAC-SHA-256 vectors",
+		test_sha256_vectors))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "HMAC-SHA-384 vectors",
+		test_sha384_vectors))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "cached keys", test_cached_key))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/keycache.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_THREADS    4
+#define TEST_LOOKUPS    5000
+#define TEST_TENANTS    64
+
+
+static unsigned char global_master[32];
+
+
+/*
+ * RFC 5869, test cases 1 and 3.
+ */
+static void
+test_hkdf_rfc5869(void)
+{
+	unsigned char	ikm[22], salt[13], info[10], okm[42];
+	unsigned char	big[255 * 32 + 1];
+	unsigned char	okm1[42] = {
+		0x3c, 0xb2, 0x5f, 0x25, 0xfa, 0xac, 0xd5, 0x7a,
+		0x90, 0x43, 0x4f, 0x64, 0xd0, 0x36, 0x2f, 0x2a,
+		0x2d, 0x2d, 0x0a, 0x90, 0xcf, 0x1a, 0x5a, 0x4c,
+		0x5d, 0xb0, 0x2d, 0x56, 0xec, 0xc4, 0xc5, 0xbf,
+		0x34, 0x00, 0x72, 0x08, 0xd5, 0xb8, 0x87, 0x18,
+		0x58, 0x65
+	};
+	unsigned char	okm3[42] = {
+		0x8d, 0xa4, 0xe7, 0x75, 0xa5, 0x63, 0xc1, 0x8f,
+		0x71, 0x5f, 0x80, 0x2a, 0x06, 0x3c, 0x5a, 0x31,
+		0xb8, 0xa1, 0x1f, 0x5c, 0x5e, 0xe1, 0x87, 0x9e,
+		0xc3, 0x45, 0x4e, 0x5f, 0x3c, 0x73, 0x8d, 0x2d,
+		0x9d, 0x20, 0x13, 0x95, 0xfa, 0xa4, 0xb6, 0x1a,
+		0x96, 0xc8
+	};
+	int		i;
+
+	memset(ikm, 0x0b, sizeof ikm);
+	for (i = 0; i < (int)sizeof salt; i++)
+		salt[i] = (unsigned char)i;
+	for (i = 0; i < (int)sizeof info; i++)
+		info[i] = (unsigned char)(0xf0 + i);
+
+	CU_ASSERT(cryptobox_hkdf(CRYPTOBOX_HKDF_SHA256, salt, sizeof salt,
+	    ikm, sizeof ikm, info, sizeof info, okm, sizeof okm));
+	CU_ASSERT(0 == memcmp(okm, okm1, sizeof okm));
+	CU_ASSERT(cryptobox_hkdf(CRYPTOBOX_HKDF_SHA256, NULL, 0, ikm,
+	    sizeof ikm, NULL, 0, okm, sizeof okm));
+	CU_ASSERT(0 == memcmp(okm, okm3, sizeof okm));
+
+	CU_ASSERT(!cryptobox_hkdf(0, NULL, 0, ikm, sizeof ikm, NULL, 0, okm,
+	    sizeof okm));
+	CU_ASSERT(!cryptobox_hkdf(CRYPTOBOX_HKDF_SHA256, NULL, 0, ikm,
+	    sizeof ikm, NULL, 0, big, sizeof big));
+	CU_ASSERT(cryptobox_hkdf(CRYPTOBOX_HKDF_SHA256, NULL, 0, ikm,
+	    sizeof ikm, NULL, 0, big, sizeof big - 1));
+	CU_ASSERT(0 == memcmp(big, okm3, sizeof okm3));
+}
+
+
+/*
+ * Check HKDF-SHA-384 against the construction computed with the
+ * libcrypto HMAC interface.
+ */
+static void
+test_hkdf_sha384(void)
+{
+	unsigned char	salt[20], ikm[40], info[9], prk[48];
+	unsigned char	want[100], got[100], t[48 + sizeof info + 1];
+	unsigned int	len;
+	size_t		off, n, tlen = 0;
+	unsigned char	ctr;
+
+	memset(salt, 0xa5, sizeof salt);
+	memset(ikm, 0x3c, sizeof ikm);
+	memcpy(info, "some info", sizeof info);
+
+	CU_ASSERT(NULL != HMAC(EVP_sha384(), salt, sizeof salt, ikm,
+	    sizeof ikm, prk, &len));
+	for (off = 0, ctr = 1; off < sizeof want; off += n, ctr++) {
+		memcpy(t + tlen, info, sizeof info);
+		t[tlen + sizeof info] = ctr;
+		CU_ASSERT(NULL != HMAC(EVP_sha384(), prk, sizeof prk, t,
+		    tlen + sizeof info + 1, t, &len));
+		tlen = 48;
+		n = sizeof want - off < 48 ? sizeof want - off : 48;
+		memcpy(want + off, t, n);
+	}
+
+	CU_ASSERT(cryptobox_hkdf(CRYPTOBOX_HKDF_SHA384, salt, sizeof salt,
+	    ikm, sizeof ikm, info, sizeof info, got, sizeof got));
+	CU_ASSERT(0 == memcmp(want, got, sizeof got));
+}
+
+
+/*
+ * Boxes sealed through the cache open with the derived key, and the
+ * other way round, and tenants do not share keys.
+ */
+static void
+test_round_trip(void)
+{
+	struct cryptobox_keycache	*c;
+	unsigned char			 key[80], other[80];
+	unsigned char			 m[] = "the tenant's message";
+	unsigned char			*box, *out;
+	int				 blen;
+
+	c = cryptobox_keycache_new(CRYPTOBOX_SECRETBOX, global_master,
+	    sizeof global_master, 16, 0);
+	CU_ASSERT(NULL != c);
+	CU_ASSERT(cryptobox_keycache_derive(c, (unsigned char *)"acme", 4,
+	    key));
+	CU_ASSERT(cryptobox_keycache_derive(c, (unsigned char *)"acme2", 5,
+	    other));
+	CU_ASSERT(0 != memcmp(key, other, SECRETBOX_KEY_SIZE));
+
+	box = cryptobox_keycache_seal(c, (unsigned char *)"acme", 4, m,
+	    sizeof m, &blen);
+	CU_ASSERT(NULL != box);
+	out = secretbox_open(box, blen, key);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, m, sizeof m));
+	free(out);
+	CU_ASSERT(NULL == cryptobox_keycache_open(c,
+	    (unsigned char *)"acme2", 5, box, blen));
+	free(box);
+
+	box = secretbox_seal(m, sizeof m, &blen, key);
+	out = cryptobox_keycache_open(c, (unsigned char *)"acme", 4, box,
+	    blen);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, m, sizeof m));
+	free(out);
+	free(box);
+	cryptobox_keycache_free(c);
+
+	c = cryptobox_keycache_new(CRYPTOBOX_STRONGBOX, global_master,
+	    sizeof global_master, 16, 4);
+	CU_ASSERT(NULL != c);
+	CU_ASSERT(cryptobox_keycache_derive(c, (unsigned char *)"acme", 4,
+	    other));
+	CU_ASSERT(0 != memcmp(key, other, SECRETBOX_KEY_SIZE));
+	box = cryptobox_keycache_seal(c, (unsigned char *)"acme", 4, m,
+	    sizeof m, &blen);
+	CU_ASSERT(NULL != box);
+	out = strongbox_open(box, blen, other);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, m, sizeof m));
+	free(out);
+	free(box);
+	memset(key, 0x0, sizeof key);
+	memset(other, 0x0, sizeof other);
+	cryptobox_keycache_free(c);
+}
+
+
+/*
+ * The least recently used tenants are evicted once the cache is full,
+ * but an entry in use stays valid until it is put back.
+ */
+static void
+test_eviction(void)
+{
+	struct cryptobox_keycache	*c;
+	struct cryptobox_tenant		*held, *t;
+	unsigned char			 id[8], m[16], *box, *out;
+	uint64_t			 hits, misses, evictions;
+	int				 i, blen;
+
+	c = cryptobox_keycache_new(CRYPTOBOX_STRONGBOX, global_master,
+	    sizeof global_master, 4, 1);
+	CU_ASSERT(NULL != c);
+	held = cryptobox_keycache_get(c, (unsigned char *)"held", 4);
+	CU_ASSERT(NULL != held);
+
+	for (i = 0; i < 10; i++) {
+		snprintf((char *)id, sizeof id, "t%d", i);
+		t = cryptobox_keycache_get(c, id, strlen((char *)id));
+		CU_ASSERT(NULL != t);
+		cryptobox_keycache_put(c, t);
+	}
+	cryptobox_keycache_stats(c, &hits, &misses, &evictions);
+	CU_ASSERT(0 == hits);
+	CU_ASSERT(11 == misses);
+	CU_ASSERT(7 == evictions);
+
+	/* t9 is still cached; t0 is not. */
+	t = cryptobox_keycache_get(c, (unsigned char *)"t9", 2);
+	cryptobox_keycache_put(c, t);
+	t = cryptobox_keycache_get(c, (unsigned char *)"t0", 2);
+	cryptobox_keycache_put(c, t);
+	cryptobox_keycache_stats(c, &hits, &misses, &evictions);
+	CU_ASSERT(1 == hits);
+	CU_ASSERT(12 == misses);
+
+	memset(m, 0x42, sizeof m);
+	box = strongbox_ctx_seal(cryptobox_keycache_ctx(held), m, sizeof m,
+	    &blen);
+	CU_ASSERT(NULL != box);
+	cryptobox_keycache_put(c, held);
+	out = cryptobox_keycache_open(c, (unsigned char *)"held", 4, box,
+	    blen);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, m, sizeof m));
+	free(out);
+	free(box);
+	cryptobox_keycache_free(c);
+}
+
+
+static void *
+lookup_thread(void *arg)
+{
+	struct cryptobox_keycache	*c = arg;
+	unsigned char			 id[16], m[32], *box, *out;
+	int				 i, blen, failed = 0;
+
+	for (i = 0; i < TEST_LOOKUPS; i++) {
+		snprintf((char *)id, sizeof id, "tenant-%d",
+		    (i * 7919) % TEST_TENANTS);
+		memset(m, i & 0xff, sizeof m);
+		box = cryptobox_keycache_seal(c, id, strlen((char *)id), m,
+		    sizeof m, &blen);
+		out = NULL;
+		if (NULL != box)
+			out = cryptobox_keycache_open(c, id,
+			    strlen((char *)id), box, blen);
+		if (NULL == out || 0 != memcmp(out, m, sizeof m))
+			failed++;
+		free(box);
+		free(out);
+	}
+	return failed ? arg : NULL;
+}
+
+
+/*
+ * Several threads working a cache too small for their tenants, so
+ * that lookups, insertions and evictions race.
+ */
+static void
+test_concurrent(void)
+{
+	struct cryptobox_keycache	*c;
+	pthread_t			 threads[TEST_THREADS];
+	void				*res;
+	uint64_t			 hits, misses, evictions;
+	int				 i;
+
+	c = cryptobox_keycache_new(CRYPTOBOX_SECRETBOX, global_master,
+	    sizeof global_master, TEST_TENANTS / 2, 8);
+	CU_ASSERT(NULL != c);
+	for (i = 0; i < TEST_THREADS; i++)
+		CU_ASSERT(0 == pthread_create(&threads[i], NULL,
+		    lookup_thread, c));
+	for (i = 0; i < TEST_THREADS; i++) {
+		CU_ASSERT(0 == pthread_join(threads[i], &res));
+		CU_ASSERT(NULL == res);
+	}
+	cryptobox_keycache_stats(c, &hits, &misses, &evictions);
+	CU_ASSERT(2 * TEST_THREADS * TEST_LOOKUPS == hits + misses);
+	CU_ASSERT(evictions > 0);
+	cryptobox_keycache_free(c);
+}
+
+
+static void
+test_invalid(void)
+{
+	struct cryptobox_keycache	*c;
+	struct cryptobox_tenant		*t;
+	unsigned char			 id[300], key[80];
+
+	CU_ASSERT(NULL == cryptobox_keycache_new(0, global_master,
+	    sizeof global_master, 16, 0));
+	CU_ASSERT(NULL == cryptobox_keycache_new(CRYPTOBOX_SECRETBOX,
+	    global_master, 0, 16, 0));
+	CU_ASSERT(NULL == cryptobox_keycache_new(CRYPTOBOX_SECRETBOX,
+	    global_master, sizeof global_master, 0, 0));
+
+	c = cryptobox_keycache_new(CRYPTOBOX_SECRETBOX, global_master,
+	    sizeof global_master, 16, 0);
+	memset(id, 'x', sizeof id);
+	CU_ASSERT(NULL == cryptobox_keycache_get(c, id, 0));
+	CU_ASSERT(NULL == cryptobox_keycache_get(c, id, sizeof id));
+	CU_ASSERT(!cryptobox_keycache_derive(c, id, sizeof id, key));
+	t = cryptobox_keycache_get(c, id, CRYPTOBOX_KEYCACHE_MAX_ID);
+	CU_ASSERT(NULL != t);
+	cryptobox_keycache_put(c, t);
+	cryptobox_keycache_free(c);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+	memset(global_master, 0x5a, sizeof global_master);
+
+	tsuite = CU_add_suite("keycache_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "HKDF-SHA-256 vectors",
+	    test_hkdf_rfc5869))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "HKDF-SHA-384", test_hkdf_sha384))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "tenant round trip", test_round_trip))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "tenant eviction", test_eviction))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "concurrent lookups",
+	    test_concurrent))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid keycache", test_invalid))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,535 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/log.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_RECORDS    100
+#define TEST_INTERVAL   16
+#define TEST_THREADS    4
+#define TEST_PER_THREAD 250
+
+/*
+ * The tampering test uses 32-byte records with a checkpoint every four.
+ * A checkpoint holds a 32-byte secretbox tag, so every frame is the same
+ * size: a five-byte frame header and a box of 32 bytes plus the 48
+ * bytes of secretbox overhead.
+ */
+#define TAMPER_RECORDS  20
+#define TAMPER_LEN      32
+#define TAMPER_FRAME    (5 + TAMPER_LEN + 48)
+
+
+static unsigned char global_key[80];
+static unsigned char global_bad_key[80];
+static char global_path[] = "/tmp/cryptobox_log_test.XXXXXX";
+
+
+/*
+ * Fill buf with record i, which is i * 3 bytes long.
+ */
+static size_t
+record_data(uint64_t i, unsigned char *buf)
+{
+	size_t	j, len = (size_t)i * 3;
+
+	for (j = 0; j < len; j++)
+		buf[j] = (unsigned char)(i * 31 + j);
+	return len;
+}
+
+
+struct reader {
+	uint64_t	next;
+	uint64_t	stop;
+	int		ok;
+};
+
+
+/*
+ * Check that records arrive in order with the right contents, and stop
+ * the read once the stop'th record has been seen.
+ */
+static int
+check_record(void *arg, uint64_t seq, unsigned char *rec, size_t len)
+{
+	struct reader	*r = arg;
+	unsigned char	 want[TEST_RECORDS * 2 * 3];
+	size_t		 want_len;
+
+	want_len = record_data(seq, want);
+	if (seq != r->next || len != want_len || 0 != memcmp(rec, want, len))
+		r->ok = 0;
+	r->next++;
+	return r->next != r->stop;
+}
+
+
+static int
+read_from(int type, uint64_t from, uint64_t stop, uint64_t *next)
+{
+	struct reader	r;
+
+	r.next = from;
+	r.stop = stop;
+	r.ok = 1;
+	if (!cryptobox_log_read(global_path, type, global_key, from,
+	    check_record, &r))
+		return 0;
+	*next = r.next;
+	return r.ok;
+}
+
+
+static int
+append_records(struct cryptobox_log *log, uint64_t first, uint64_t n)
+{
+	unsigned char	buf[TEST_RECORDS * 2 * 3];
+	uint64_t	i;
+	size_t		len;
+	int		ok = 1;
+
+	for (i = first; i < first + n; i++) {
+		len = record_data(i, buf);
+		ok &= cryptobox_log_append(log, buf, len);
+	}
+	return ok;
+}
+
+
+static void
+test_round_trip(void)
+{
+	struct cryptobox_log	*log;
+	uint64_t		 count = 0, next = 0;
+
+	log = cryptobox_log_create(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, TEST_INTERVAL);
+	CU_ASSERT(NULL != log);
+	if (NULL == log)
+		return;
+	CU_ASSERT(1 == append_records(log, 0, TEST_RECORDS));
+	CU_ASSERT(TEST_RECORDS == cryptobox_log_records(log));
+	CU_ASSERT(0 == cryptobox_log_append(log, NULL, 1));
+	CU_ASSERT(1 == cryptobox_log_close(log));
+
+	CU_ASSERT(1 == cryptobox_log_verify(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 0, &count));
+	CU_ASSERT(TEST_RECORDS == count);
+	CU_ASSERT(1 == read_from(CRYPTOBOX_SECRETBOX, 0, 0, &next));
+	CU_ASSERT(TEST_RECORDS == next);
+
+	/* Reading from the middle of a segment starts at its checkpoint. */
+	CU_ASSERT(1 == read_from(CRYPTOBOX_SECRETBOX, 50, 0, &next));
+	CU_ASSERT(TEST_RECORDS == next);
+	CU_ASSERT(1 == read_from(CRYPTOBOX_SECRETBOX, 10, 15, &next));
+	CU_ASSERT(15 == next);
+	CU_ASSERT(1 == read_from(CRYPTOBOX_SECRETBOX, TEST_RECORDS, 0,
+	    &next));
+	CU_ASSERT(TEST_RECORDS == next);
+	CU_ASSERT(1 == cryptobox_log_verify(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 70, NULL));
+	CU_ASSERT(0 == cryptobox_log_verify(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, TEST_RECORDS + 1, NULL));
+
+	CU_ASSERT(0 == cryptobox_log_verify(global_path, CRYPTOBOX_SECRETBOX,
+	    global_bad_key, 0, NULL));
+	CU_ASSERT(0 == cryptobox_log_verify(global_path, CRYPTOBOX_STRONGBOX,
+	    global_key, 0, NULL));
+	CU_ASSERT(NULL == cryptobox_log_open(global_path, CRYPTOBOX_SECRETBOX,
+	    global_bad_key, 0));
+}
+
+
+static void
+test_reopen(void)
+{
+	struct cryptobox_log	*log;
+	uint64_t		 count = 0, next = 0;
+
+	log = cryptobox_log_open(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, TEST_INTERVAL);
+	CU_ASSERT(NULL != log);
+	if (NULL == log)
+		return;
+	CU_ASSERT(TEST_RECORDS == cryptobox_log_records(log));
+	CU_ASSERT(1 == append_records(log, TEST_RECORDS, TEST_RECORDS / 2));
+	CU_ASSERT(1 == cryptobox_log_checkpoint(log));
+	CU_ASSERT(1 == append_records(log, TEST_RECORDS + TEST_RECORDS / 2,
+	    TEST_RECORDS / 2));
+	CU_ASSERT(1 == cryptobox_log_close(log));
+
+	CU_ASSERT(1 == cryptobox_log_verify(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 0, &count));
+	CU_ASSERT(2 * TEST_RECORDS == count);
+	CU_ASSERT(1 == read_from(CRYPTOBOX_SECRETBOX, 0, 0, &next));
+	CU_ASSERT(2 * TEST_RECORDS == next);
+	CU_ASSERT(1 == read_from(CRYPTOBOX_SECRETBOX, TEST_RECORDS + 1, 0,
+	    &next));
+	CU_ASSERT(2 * TEST_RECORDS == next);
+}
+
+
+struct appender {
+	struct cryptobox_log	*log;
+	uint32_t		 id;
+	int			 ok;
+};
+
+
+/*
+ * Each thread's records are its id followed by a counter.
+ */
+static void *
+append_many(void *arg)
+{
+	struct appender	*a = arg;
+	unsigned char	 buf[8];
+	uint32_t	 i;
+
+	a->ok = 1;
+	for (i = 0; i < TEST_PER_THREAD; i++) {
+		memcpy(buf, &a->id, 4);
+		memcpy(buf + 4, &i, 4);
+		a->ok &= cryptobox_log_append(a->log, buf, sizeof buf);
+	}
+	return NULL;
+}
+
+
+/*
+ * Check that each thread's records come back in the order it wrote
+ * them.
+ */
+static int
+check_threads(void *arg, uint64_t seq, unsigned char *rec, size_t len)
+{
+	uint32_t	*next = arg;
+	uint32_t	 id, i;
+
+	(void)seq;
+	if (8 != len)
+		return 0;
+	memcpy(&id, rec, 4);
+	memcpy(&i, rec + 4, 4);
+	if (id >= TEST_THREADS || i != next[id])
+		return 0;
+	next[id]++;
+	return 1;
+}
+
+
+static void
+test_threads(void)
+{
+	struct cryptobox_log	*log;
+	struct appender		 appenders[TEST_THREADS];
+	pthread_t		 threads[TEST_THREADS];
+	uint32_t		 next[TEST_THREADS];
+	uint64_t		 count = 0;
+	int			 j, ok = 1;
+
+	log = cryptobox_log_create(global_path, CRYPTOBOX_STRONGBOX,
+	    global_key, 0);
+	CU_ASSERT(NULL != log);
+	if (NULL == log)
+		return;
+	for (j = 0; j < TEST_THREADS; j++) {
+		appenders[j].log = log;
+		appenders[j].id = (uint32_t)j;
+		appenders[j].ok = 0;
+		CU_ASSERT(0 == pthread_create(&threads[j], NULL, append_many,
+		    &appenders[j]));
+	}
+	for (j = 0; j < TEST_THREADS; j++) {
+		pthread_join(threads[j], NULL);
+		ok &= appenders[j].ok;
+	}
+	CU_ASSERT(1 == ok);
+	CU_ASSERT(1 == cryptobox_log_close(log));
+
+	CU_ASSERT(1 == cryptobox_log_verify(global_path, CRYPTOBOX_STRONGBOX,
+	    global_key, 0, &count));
+	CU_ASSERT(TEST_THREADS * TEST_PER_THREAD == count);
+	memset(next, 0, sizeof next);
+	CU_ASSERT(1 == cryptobox_log_read(global_path, CRYPTOBOX_STRONGBOX,
+	    global_key, 0, check_threads, next));
+	for (j = 0; j < TEST_THREADS; j++)
+		CU_ASSERT(TEST_PER_THREAD == next[j]);
+}
+
+
+/*
+ * Return the offset of record seq's frame in the tampering log.
+ */
+static off_t
+tamper_frame(uint64_t seq)
+{
+	return 24 + (off_t)(seq + seq / 4 + 1) * TAMPER_FRAME;
+}
+
+
+/*
+ * Replace the log with len bytes of buf, leaving out the skip bytes at
+ * off.
+ */
+static int
+write_log(unsigned char *buf, size_t len, off_t off, size_t skip)
+{
+	FILE	*f;
+	int	 ok;
+
+	if (NULL == (f = fopen(global_path, "w")))
+		return 0;
+	ok = (size_t)off == fwrite(buf, 1, (size_t)off, f) &&
+	    len - (size_t)off - skip == fwrite(buf + off + skip, 1,
+	    len - (size_t)off - skip, f);
+	return 0 == fclose(f) && ok;
+}
+
+
+static int
+verify(uint64_t from)
+{
+	return cryptobox_log_verify(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, from, NULL);
+}
+
+
+static void
+test_tamper(void)
+{
+	static unsigned char	 saved[24 + 32 * TAMPER_FRAME];
+	unsigned char		 rec[TAMPER_LEN];
+	unsigned char		 torn[10];
+	struct cryptobox_log	*log;
+	uint64_t		 count = 0;
+	size_t			 len;
+	off_t			 off;
+	FILE			*f;
+	int			 i, ok = 1;
+
+	log = cryptobox_log_create(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 4);
+	CU_ASSERT(NULL != log);
+	if (NULL == log)
+		return;
+	for (i = 0; i < TAMPER_RECORDS; i++) {
+		memset(rec, i, sizeof rec);
+		ok &= cryptobox_log_append(log, rec, sizeof rec);
+	}
+	CU_ASSERT(1 == ok);
+	CU_ASSERT(1 == cryptobox_log_close(log));
+
+	CU_ASSERT(NULL != (f = fopen(global_path, "r")));
+	if (NULL == f)
+		return;
+	len = fread(saved, 1, sizeof saved, f);
+	fclose(f);
+	CU_ASSERT((size_t)tamper_frame(TAMPER_RECORDS) - TAMPER_FRAME == len);
+	CU_ASSERT(1 == verify(0));
+
+	/*
+	 * A changed record fails its own segment, but not a read that
+	 * starts at a later checkpoint.
+	 */
+	off = tamper_frame(10) + 20;
+	saved[off] ^= 1;
+	CU_ASSERT(1 == write_log(saved, len, 0, 0));
+	CU_ASSERT(0 == verify(0));
+	CU_ASSERT(0 == verify(9));
+	CU_ASSERT(1 == verify(12));
+	CU_ASSERT(NULL != (log = cryptobox_log_open(global_path,
+	    CRYPTOBOX_SECRETBOX, global_key, 4)));
+	CU_ASSERT(1 == cryptobox_log_close(log));
+	saved[off] ^= 1;
+
+	/* Swapping two records within a segment breaks the chain. */
+	CU_ASSERT(1 == write_log(saved, len, 0, 0));
+	CU_ASSERT(NULL != (f = fopen(global_path, "r+")));
+	if (NULL != f) {
+		fseeko(f, tamper_frame(5), SEEK_SET);
+		fwrite(saved + tamper_frame(6), 1, TAMPER_FRAME, f);
+		fwrite(saved + tamper_frame(5), 1, TAMPER_FRAME, f);
+		fclose(f);
+	}
+	CU_ASSERT(0 == verify(0));
+
+	/* So does leaving out a record, or a whole segment. */
+	CU_ASSERT(1 == write_log(saved, len, tamper_frame(6),
+	    TAMPER_FRAME));
+	CU_ASSERT(0 == verify(0));
+	CU_ASSERT(1 == write_log(saved, len, tamper_frame(8) - TAMPER_FRAME,
+	    5 * TAMPER_FRAME));
+	CU_ASSERT(0 == verify(0));
+
+	/* A change in the last segment stops the log being reopened. */
+	off = tamper_frame(TAMPER_RECORDS - 1) + 20;
+	saved[off] ^= 1;
+	CU_ASSERT(1 == write_log(saved, len, 0, 0));
+	CU_ASSERT(NULL == cryptobox_log_open(global_path,
+	    CRYPTOBOX_SECRETBOX, global_key, 4));
+	saved[off] ^= 1;
+
+	/*
+	 * A frame cut short at the end is ignored by readers and cut off
+	 * when the log is reopened.
+	 */
+	memset(torn, 0, sizeof torn);
+	torn[0] = 1;
+	torn[3] = 1;
+	CU_ASSERT(1 == write_log(saved, len, 0, 0));
+	CU_ASSERT(NULL != (f = fopen(global_path, "a")));
+	if (NULL != f) {
+		fwrite(torn, 1, sizeof torn, f);
+		fclose(f);
+	}
+	CU_ASSERT(1 == cryptobox_log_verify(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 0, &count));
+	CU_ASSERT(TAMPER_RECORDS == count);
+	log = cryptobox_log_open(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 4);
+	CU_ASSERT(NULL != log);
+	if (NULL != log) {
+		CU_ASSERT(1 == cryptobox_log_append(log, rec, 0));
+		CU_ASSERT(1 == cryptobox_log_close(log));
+	}
+	CU_ASSERT(1 == cryptobox_log_verify(global_path, CRYPTOBOX_SECRETBOX,
+	    global_key, 0, &count));
+	CU_ASSERT(TAMPER_RECORDS + 1 == count);
+
+	/* A frame of an unknown kind is not skipped over. */
+	torn[0] = 3;
+	CU_ASSERT(NULL != (f = fopen(global_path, "a")));
+	if (NULL != f) {
+		fwrite(torn, 1, 5, f);
+		fwrite(saved + 24, 1, 0x100, f);
+		fclose(f);
+	}
+	CU_ASSERT(0 == verify(0));
+
+	CU_ASSERT(0 == cryptobox_log_verify("/nonexistent/log",
+	    CRYPTOBOX_SECRETBOX, global_key, 0, NULL));
+	CU_ASSERT(NULL == cryptobox_log_create(global_path, 0, global_key,
+	    0));
+	CU_ASSERT(NULL == cryptobox_log_create(global_path,
+	    CRYPTOBOX_SECRETBOX, global_key, -1));
+	CU_ASSERT(0 == cryptobox_log_close(NULL));
+	CU_ASSERT(0 == cryptobox_log_records(NULL));
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	unlink(global_path);
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+	int		fd;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+	if (-1 == (fd = mkstemp(global_path)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+
+	tsuite = CU_add_suite("log_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "round trip", test_round_trip))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "reopen", test_reopen))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "threads", test_threads))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "tampering", test_tamper))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	unlink(global_path);
+	return fails;
+}
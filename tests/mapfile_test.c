@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+/* Long enough to take more than one mapping window. */
+#define TEST_LEN        (9 * 1024 * 1024 + 1234)
+
+
+struct file_box {
+	size_t		  overhead;
+	int		(*seal_file)(const char *, const char *,
+			    unsigned char *);
+	int		(*open_file)(const char *, const char *,
+			    unsigned char *);
+	unsigned char	*(*open)(unsigned char *, int, unsigned char *);
+};
+
+
+static const struct file_box	secretbox_file = {
+	48, secretbox_seal_file, secretbox_open_file, secretbox_open
+};
+
+static const struct file_box	strongbox_file = {
+	64, strongbox_seal_file, strongbox_open_file, strongbox_open
+};
+
+
+static unsigned char global_test_key[80];
+static unsigned char global_bad_key[80];
+static char global_in[] = "/tmp/cryptobox_mapfile_in.XXXXXX";
+static char global_box[] = "/tmp/cryptobox_mapfile_box.XXXXXX";
+static char global_out[] = "/tmp/cryptobox_mapfile_out.XXXXXX";
+
+
+static unsigned char *
+read_file(const char *path, size_t *len)
+{
+	unsigned char	*buf;
+	struct stat	 st;
+	ssize_t		 n;
+	size_t		 off = 0;
+	int		 fd;
+
+	if (-1 == (fd = open(path, O_RDONLY)))
+		return NULL;
+	if (-1 == fstat(fd, &st) ||
+	    NULL == (buf = malloc((size_t)st.st_size + 1))) {
+		close(fd);
+		return NULL;
+	}
+	while (off < (size_t)st.st_size) {
+		n = read(fd, buf + off, (size_t)st.st_size - off);
+		if (n <= 0)
+			break;
+		off += (size_t)n;
+	}
+	close(fd);
+	*len = off;
+	return buf;
+}
+
+
+static int
+write_file(const char *path, unsigned char *buf, size_t len)
+{
+	ssize_t	n;
+	int	fd;
+
+	if (-1 == (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)))
+		return 0;
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) <= 0)
+			break;
+		buf += n;
+		len -= (size_t)n;
+	}
+	close(fd);
+	return 0 == len;
+}
+
+
+/*
+ * Seal a file, check that the box is the one the in-memory functions
+ * would open, and open it back into a file.
+ */
+static void
+test_cycle(const struct file_box *fb, size_t len)
+{
+	unsigned char	*m, *box, *out;
+	size_t		 box_len = 0, out_len = 0, i;
+
+	m = malloc(len + 1);
+	for (i = 0; i < len; i++)
+		m[i] = (unsigned char)(i * 31 + 5);
+	CU_ASSERT(write_file(global_in, m, len));
+
+	CU_ASSERT(1 == fb->seal_file(global_in, global_box, global_test_key));
+	box = read_file(global_box, &box_len);
+	CU_ASSERT(NULL != box);
+	CU_ASSERT(len + fb->overhead == box_len);
+	out = fb->open(box, (int)box_len, global_test_key);
+	CU_ASSERT(NULL != out);
+	if (NULL != out)
+		CU_ASSERT(0 == memcmp(out, m, len));
+	free(out);
+
+	CU_ASSERT(1 == fb->open_file(global_box, global_out, global_test_key));
+	out = read_file(global_out, &out_len);
+	CU_ASSERT(NULL != out);
+	CU_ASSERT(len == out_len);
+	if (NULL != out)
+		CU_ASSERT(0 == memcmp(out, m, len));
+	free(out);
+	unlink(global_out);
+
+	/* No output is left behind for a box that does not open. */
+	CU_ASSERT(0 == fb->open_file(global_box, global_out, global_bad_key));
+	CU_ASSERT(-1 == access(global_out, F_OK));
+	if (NULL != box && box_len > 0) {
+		box[box_len / 2] ^= 0x01;
+		CU_ASSERT(write_file(global_box, box, box_len));
+		CU_ASSERT(0 == fb->open_file(global_box, global_out,
+		    global_test_key));
+		CU_ASSERT(-1 == access(global_out, F_OK));
+		CU_ASSERT(write_file(global_box, box, fb->overhead - 1));
+		CU_ASSERT(0 == fb->open_file(global_box, global_out,
+		    global_test_key));
+	}
+
+	free(box);
+	free(m);
+}
+
+
+static void
+test_secretbox(void)
+{
+	test_cycle(&secretbox_file, TEST_LEN);
+	test_cycle(&secretbox_file, 0);
+	test_cycle(&secretbox_file, 1);
+}
+
+
+static void
+test_strongbox(void)
+{
+	test_cycle(&strongbox_file, TEST_LEN);
+	test_cycle(&strongbox_file, 0);
+	test_cycle(&strongbox_file, 1);
+}
+
+
+static void
+test_invalid(void)
+{
+	CU_ASSERT(0 == secretbox_seal_file("/nonexistent/cryptobox",
+	    global_box, global_test_key));
+	CU_ASSERT(0 == secretbox_seal_file("/tmp", global_box,
+	    global_test_key));
+	CU_ASSERT(0 == strongbox_open_file("/nonexistent/cryptobox",
+	    global_out, global_test_key));
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+static void
+remove_files(void)
+{
+	unlink(global_in);
+	unlink(global_box);
+	unlink(global_out);
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	remove_files();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+	int		fd;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+	if (-1 == (fd = mkstemp(global_in)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	if (-1 == (fd = mkstemp(global_box)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	if (-1 == (fd = mkstemp(global_out)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	unlink(global_out);
+
+	tsuite = CU_add_suite("mapfile_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "secretbox files", test_secretbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "strongbox files", test_strongbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid files", test_invalid))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	remove_files();
+	return fails;
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/merkle.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_CHUNK      4096
+#define TEST_LARGE      (5 * 1024 * 1024 + 17)
+
+
+static unsigned char global_test_key[80];
+static unsigned char global_bad_key[80];
+
+
+static unsigned char *
+test_message(size_t len)
+{
+	unsigned char	*m;
+	size_t		 i;
+
+	if (NULL == (m = malloc(len + 1)))
+		return NULL;
+	for (i = 0; i < len; i++)
+		m[i] = (unsigned char)(i * 7 + 3);
+	return m;
+}
+
+
+/*
+ * Seal and open objects of awkward lengths, including one large
+ * enough to be hashed on the worker pool, and check that any change
+ * to the object is caught.
+ */
+static void
+test_cycle(int type)
+{
+	size_t		 lens[] = { 0, 1, 100, TEST_CHUNK, 7 * TEST_CHUNK + 5,
+				    TEST_LARGE };
+	unsigned char	*m, *obj, *out;
+	size_t		 obj_len, len, chunk_size, mlen;
+	size_t		 i;
+
+	for (i = 0; i < sizeof lens / sizeof lens[0]; i++) {
+		len = lens[i];
+		m = test_message(len);
+		obj = cryptobox_merkle_seal(type, m, len, TEST_CHUNK, &obj_len,
+					    global_test_key);
+		CU_ASSERT(NULL != obj);
+		if (NULL == obj) {
+			free(m);
+			continue;
+		}
+		CU_ASSERT(obj_len == len + cryptobox_merkle_head_size(type));
+		CU_ASSERT(1 == cryptobox_merkle_info(type, obj, &chunk_size,
+						     &mlen));
+		CU_ASSERT(TEST_CHUNK == chunk_size && len == mlen);
+
+		out = cryptobox_merkle_open(type, obj, obj_len, &mlen,
+					    global_test_key);
+		CU_ASSERT(NULL != out && mlen == len);
+		CU_ASSERT(NULL != out && 0 == memcmp(out, m, len));
+		free(out);
+
+		CU_ASSERT(NULL == cryptobox_merkle_open(type, obj, obj_len,
+		    &mlen, global_bad_key));
+		obj[obj_len - 1] ^= 0x01;
+		CU_ASSERT(NULL == cryptobox_merkle_open(type, obj, obj_len,
+		    &mlen, global_test_key));
+		obj[obj_len - 1] ^= 0x01;
+		obj[11] ^= 0x10;
+		CU_ASSERT(NULL == cryptobox_merkle_open(type, obj, obj_len,
+		    &mlen, global_test_key));
+		CU_ASSERT(NULL == cryptobox_merkle_open(type, obj,
+		    obj_len - 1, &mlen, global_test_key));
+		free(obj);
+		free(m);
+	}
+}
+
+
+/*
+ * Open every chunk of an object on its own, with its proof and no
+ * other part of the object beyond the header.
+ */
+static void
+test_chunks(int type)
+{
+	size_t		 len = 13 * TEST_CHUNK + 100;
+	size_t		 nchunks = 14;
+	size_t		 head_size = cryptobox_merkle_head_size(type);
+	unsigned char	 out[TEST_CHUNK];
+	unsigned char	*m, *obj, *proof, *chunk;
+	size_t		 obj_len, proof_len, chunk_len;
+	size_t		 i;
+
+	m = test_message(len);
+	obj = cryptobox_merkle_seal(type, m, len, TEST_CHUNK, &obj_len,
+				    global_test_key);
+	CU_ASSERT(NULL != obj);
+	if (NULL == obj) {
+		free(m);
+		return;
+	}
+
+	for (i = 0; i < nchunks; i++) {
+		proof = cryptobox_merkle_proof(type, obj, obj_len, i,
+					       &proof_len, global_test_key);
+		CU_ASSERT(NULL != proof && proof_len > 0);
+		if (NULL == proof)
+			continue;
+		chunk = obj + head_size + i * TEST_CHUNK;
+		chunk_len = i < nchunks - 1 ? TEST_CHUNK : 100;
+		CU_ASSERT(1 == cryptobox_merkle_open_chunk(type, obj, i, chunk,
+		    chunk_len, proof, proof_len, out, global_test_key));
+		CU_ASSERT(0 == memcmp(out, m + i * TEST_CHUNK, chunk_len));
+
+		/* The proof is only good for its own chunk and key. */
+		CU_ASSERT(0 == cryptobox_merkle_open_chunk(type, obj,
+		    (i + 1) % nchunks, chunk, chunk_len, proof, proof_len,
+		    NULL, global_test_key));
+		CU_ASSERT(0 == cryptobox_merkle_open_chunk(type, obj, i, chunk,
+		    chunk_len, proof, proof_len, NULL, global_bad_key));
+		CU_ASSERT(0 == cryptobox_merkle_open_chunk(type, obj, i, chunk,
+		    chunk_len, proof, proof_len - 1, NULL, global_test_key));
+		proof[0] ^= 0x01;
+		CU_ASSERT(0 == cryptobox_merkle_open_chunk(type, obj, i, chunk,
+		    chunk_len, proof, proof_len, NULL, global_test_key));
+		proof[0] ^= 0x01;
+		chunk[0] ^= 0x01;
+		CU_ASSERT(0 == cryptobox_merkle_open_chunk(type, obj, i, chunk,
+		    chunk_len, proof, proof_len, NULL, global_test_key));
+		chunk[0] ^= 0x01;
+		free(proof);
+	}
+
+	CU_ASSERT(NULL == cryptobox_merkle_proof(type, obj, obj_len, nchunks,
+	    &proof_len, global_test_key));
+	obj[head_size] ^= 0x01;
+	CU_ASSERT(NULL == cryptobox_merkle_proof(type, obj, obj_len, 0,
+	    &proof_len, global_test_key));
+	free(obj);
+	free(m);
+}
+
+
+static void
+test_secretbox(void)
+{
+	test_cycle(CRYPTOBOX_SECRETBOX);
+	test_chunks(CRYPTOBOX_SECRETBOX);
+}
+
+
+static void
+test_strongbox(void)
+{
+	test_cycle(CRYPTOBOX_STRONGBOX);
+	test_chunks(CRYPTOBOX_STRONGBOX);
+}
+
+
+static void
+test_invalid(void)
+{
+	unsigned char	message[] = "Gorramit.";
+	size_t		obj_len;
+
+	CU_ASSERT(NULL == cryptobox_merkle_seal(0, message, sizeof message,
+	    0, &obj_len, global_test_key));
+	CU_ASSERT(NULL == cryptobox_merkle_seal(CRYPTOBOX_SECRETBOX, message,
+	    sizeof message, 100, &obj_len, global_test_key));
+	CU_ASSERT(0 == obj_len);
+	CU_ASSERT(NULL == cryptobox_merkle_open(CRYPTOBOX_SECRETBOX, message,
+	    sizeof message, NULL, global_test_key));
+	CU_ASSERT(0 == cryptobox_merkle_info(CRYPTOBOX_SECRETBOX, message,
+	    &obj_len, &obj_len));
+	CU_ASSERT(0 == cryptobox_merkle_head_size(0));
+}
+
+
+/*
+ * A proof publishes leaf hashes over public chunks. Laid out as the
+ * leaf's input followed by the hash, one must not open as a box under
+ * the same key.
+ */
+static void
+test_proof_not_box(void)
+{
+	unsigned char	*m, *obj, *proof, *box;
+	size_t		 obj_len, proof_len, head_size, box_len;
+
+	head_size = cryptobox_merkle_head_size(CRYPTOBOX_SECRETBOX);
+	m = test_message(2 * TEST_CHUNK);
+	CU_ASSERT(NULL != m);
+	if (NULL == m)
+		return;
+	obj = cryptobox_merkle_seal(CRYPTOBOX_SECRETBOX, m, 2 * TEST_CHUNK,
+	    TEST_CHUNK, &obj_len, global_test_key);
+	CU_ASSERT(NULL != obj);
+	free(m);
+	if (NULL == obj)
+		return;
+	proof = cryptobox_merkle_proof(CRYPTOBOX_SECRETBOX, obj, obj_len, 1,
+	    &proof_len, global_test_key);
+	CU_ASSERT(NULL != proof);
+	CU_ASSERT(SECRETBOX_OVERHEAD - 16 == proof_len);
+
+	/* 0x00 | index 0 | chunk 0 | the leaf hash of chunk 0 */
+	box_len = 9 + TEST_CHUNK + proof_len;
+	box = calloc(1, box_len);
+	CU_ASSERT(NULL != box);
+	if (NULL != proof && NULL != box) {
+		memcpy(box + 9, obj + head_size, TEST_CHUNK);
+		memcpy(box + 9 + TEST_CHUNK, proof, proof_len);
+		CU_ASSERT(0 == secretbox_verify(box, (int)box_len,
+		    global_test_key));
+		CU_ASSERT(NULL == secretbox_open(box, (int)box_len,
+		    global_test_key));
+	}
+	free(box);
+	free(proof);
+	free(obj);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	tsuite = CU_add_suite("merkle_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "secretbox objects", test_secretbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "strongbox objects", test_strongbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid objects", test_invalid))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "proofs are not boxes",
+	    test_proof_not_box))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/file.h>
+#include <cryptobox/pipeline.h>
+#include <cryptobox/stream.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_LEN        (1024 * 1024 + 123)
+
+
+static unsigned char global_test_key[80];
+static unsigned char global_bad_key[80];
+static char global_in[] = "/tmp/cryptobox_pipeline_in.XXXXXX";
+static char global_box[] = "/tmp/cryptobox_pipeline_box.XXXXXX";
+static char global_out[] = "/tmp/cryptobox_pipeline_out.XXXXXX";
+
+
+static unsigned char *
+test_message(size_t len)
+{
+	unsigned char	*m;
+	size_t		 i;
+
+	if (NULL == (m = malloc(len + 1)))
+		return NULL;
+	for (i = 0; i < len; i++)
+		m[i] = (unsigned char)(i * 31 + 5);
+	return m;
+}
+
+
+static int
+write_file(const char *path, unsigned char *buf, size_t len)
+{
+	ssize_t	n;
+	int	fd;
+
+	if (-1 == (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)))
+		return 0;
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) <= 0)
+			break;
+		buf += n;
+		len -= (size_t)n;
+	}
+	close(fd);
+	return 0 == len;
+}
+
+
+static int
+run_fd(int sealing, int type, const char *in, const char *out,
+    size_t chunk_size, int depth, int flags, unsigned char *key)
+{
+	int	ifd, ofd, res;
+
+	if (-1 == (ifd = open(in, O_RDONLY)))
+		return 0;
+	if (-1 == (ofd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0600))) {
+		close(ifd);
+		return 0;
+	}
+	if (sealing)
+		res = cryptobox_stream_seal_fd(type, ifd, ofd, chunk_size,
+		    depth, flags, key);
+	else
+		res = cryptobox_stream_open_fd(type, ifd, ofd, depth, flags,
+		    key);
+	close(ofd);
+	close(ifd);
+	return res;
+}
+
+
+/*
+ * Seal a file with one engine and open it with the other, checking
+ * that the stream is the one cryptobox_fopen reads.
+ */
+static void
+test_cycle(int type, size_t len, size_t chunk_size, int depth,
+    int seal_flags, int open_flags)
+{
+	unsigned char	*m, *out;
+	FILE		*fp;
+	size_t		 n;
+	int		 fd;
+
+	m = test_message(len);
+	out = malloc(len + 1);
+	CU_ASSERT(write_file(global_in, m, len));
+
+	CU_ASSERT(1 == run_fd(1, type, global_in, global_box, chunk_size,
+	    depth, seal_flags, global_test_key));
+	fp = cryptobox_fopen(global_box, "r", type, global_test_key);
+	CU_ASSERT(NULL != fp);
+	if (NULL != fp) {
+		CU_ASSERT(len == fread(out, 1, len + 1, fp));
+		CU_ASSERT(0 == memcmp(out, m, len));
+		fclose(fp);
+	}
+
+	CU_ASSERT(1 == run_fd(0, type, global_box, global_out, 0, depth,
+	    open_flags, global_test_key));
+	fd = open(global_out, O_RDONLY);
+	CU_ASSERT(-1 != fd);
+	memset(out, 0, len + 1);
+	n = 0;
+	if (-1 != fd) {
+		n = (size_t)read(fd, out, len + 1);
+		close(fd);
+	}
+	CU_ASSERT(len == n);
+	CU_ASSERT(0 == memcmp(out, m, len));
+
+	CU_ASSERT(0 == run_fd(0, type, global_box, global_out, 0, depth,
+	    open_flags, global_bad_key));
+
+	free(out);
+	free(m);
+}
+
+
+/*
+ * A damaged or truncated stream does not open.
+ */
+static void
+test_damage(int type, int flags)
+{
+	unsigned char	*m;
+	unsigned char	 byte;
+	struct stat	 st;
+	int		 fd;
+
+	m = test_message(TEST_LEN);
+	CU_ASSERT(write_file(global_in, m, TEST_LEN));
+	CU_ASSERT(1 == run_fd(1, type, global_in, global_box, 4096, 4,
+	    flags, global_test_key));
+
+	fd = open(global_box, O_RDWR);
+	CU_ASSERT(-1 != fd);
+	CU_ASSERT(1 == pread(fd, &byte, 1, 100000));
+	byte ^= 0x01;
+	CU_ASSERT(1 == pwrite(fd, &byte, 1, 100000));
+	CU_ASSERT(0 == run_fd(0, type, global_box, global_out, 0, 4, flags,
+	    global_test_key));
+	byte ^= 0x01;
+	CU_ASSERT(1 == pwrite(fd, &byte, 1, 100000));
+	CU_ASSERT(1 == run_fd(0, type, global_box, global_out, 0, 4, flags,
+	    global_test_key));
+
+	CU_ASSERT(0 == fstat(fd, &st));
+	CU_ASSERT(0 == ftruncate(fd, st.st_size - 1));
+	CU_ASSERT(0 == run_fd(0, type, global_box, global_out, 0, 4, flags,
+	    global_test_key));
+	CU_ASSERT(0 == ftruncate(fd, cryptobox_stream_head_size(type) +
+	    4096 + cryptobox_stream_tag_size(type)));
+	CU_ASSERT(0 == run_fd(0, type, global_box, global_out, 0, 4, flags,
+	    global_test_key));
+	close(fd);
+	free(m);
+}
+
+
+static void
+test_type(int type)
+{
+	test_cycle(type, TEST_LEN, 4096, 4, 0, CRYPTOBOX_PIPE_NO_URING);
+	test_cycle(type, TEST_LEN, 4096, 1, CRYPTOBOX_PIPE_NO_URING, 0);
+	test_cycle(type, TEST_LEN, 0, 0, 0, 0);
+	test_cycle(type, 3 * 4096, 4096, 64, 0, 0);
+	test_cycle(type, 0, 0, 0, 0, CRYPTOBOX_PIPE_NO_URING);
+	test_cycle(type, 1, 0, 1000, CRYPTOBOX_PIPE_NO_URING, 0);
+	test_damage(type, 0);
+	test_damage(type, CRYPTOBOX_PIPE_NO_URING);
+}
+
+
+static void
+test_secretbox(void)
+{
+	test_type(CRYPTOBOX_SECRETBOX);
+}
+
+
+static void
+test_strongbox(void)
+{
+	test_type(CRYPTOBOX_STRONGBOX);
+}
+
+
+static void
+test_invalid(void)
+{
+	int	fds[2];
+	int	fd;
+
+	CU_ASSERT(0 == pipe(fds));
+	fd = open(global_box, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	CU_ASSERT(0 == cryptobox_stream_seal_fd(CRYPTOBOX_SECRETBOX, fds[0],
+	    fd, 0, 0, 0, global_test_key));
+	CU_ASSERT(0 == cryptobox_stream_seal_fd(0, fd, fds[1], 0, 0, 0,
+	    global_test_key));
+	CU_ASSERT(0 == cryptobox_stream_seal_fd(CRYPTOBOX_SECRETBOX, fd,
+	    fds[1], CRYPTOBOX_STREAM_MAX_CHUNK + 1, 0, 0, global_test_key));
+	CU_ASSERT(0 == cryptobox_stream_open_fd(CRYPTOBOX_SECRETBOX, fd,
+	    fds[1], 0, 0, global_test_key));
+	close(fd);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+static void
+remove_files(void)
+{
+	unlink(global_in);
+	unlink(global_box);
+	unlink(global_out);
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	remove_files();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+	int		fd;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+	if (-1 == (fd = mkstemp(global_in)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	if (-1 == (fd = mkstemp(global_box)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	if (-1 == (fd = mkstemp(global_out)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+
+	tsuite = CU_add_suite("pipeline_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "secretbox pipeline", test_secretbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "strongbox pipeline", test_strongbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid pipeline", test_invalid))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	remove_files();
+	return fails;
+}
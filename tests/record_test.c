@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/record.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_RECORDS    200
+#define TEST_MAX        4096
+#define TEST_DEPTH      8
+
+
+static unsigned char global_test_key[80];
+static unsigned char global_bad_key[80];
+static int global_enobufs;
+static int global_enobufs_hits;
+
+
+/*
+ * While global_enobufs is set, fail every fifth zero-copy send with
+ * ENOBUFS, as the kernel does when it has no memory left for the
+ * notifications of sends still in flight.
+ */
+ssize_t
+send(int fd, const void *buf, size_t len, int flags)
+{
+	static int	n;
+
+#ifdef MSG_ZEROCOPY
+	if (global_enobufs && (flags & MSG_ZEROCOPY) && 0 == ++n % 5) {
+		global_enobufs_hits++;
+		errno = ENOBUFS;
+		return -1;
+	}
+#else
+	(void)n;
+#endif
+	return sendto(fd, buf, len, flags, NULL, 0);
+}
+
+
+/*
+ * Record i holds i % (TEST_MAX + 1) bytes, so that the empty and full
+ * records both turn up.
+ */
+static size_t
+record_len(int i)
+{
+	return (size_t)i % (TEST_MAX + 1);
+}
+
+
+static void
+record_fill(unsigned char *m, int i)
+{
+	size_t	j, len = record_len(i);
+
+	for (j = 0; j < len; j++)
+		m[j] = (unsigned char)(i * 7 + j * 31);
+}
+
+
+/*
+ * Receive TEST_RECORDS records and check their contents, followed by a
+ * clean end of stream. Returns 1 if everything arrived intact.
+ */
+static int
+receive_all(int fd, int type, int role, unsigned char *key)
+{
+	struct cryptobox_record	*r;
+	unsigned char		 want[TEST_MAX];
+	unsigned char		*m;
+	size_t			 len;
+	int			 i, ok = 1;
+
+	if (NULL == (r = cryptobox_record_new(fd, type, role, key, TEST_MAX,
+	    TEST_DEPTH)))
+		return 0;
+	for (i = 0; ok && i < TEST_RECORDS; i++) {
+		record_fill(want, i);
+		if (1 != cryptobox_record_recv(r, &m, &len))
+			ok = 0;
+		else if (len != record_len(i) ||
+		    (len > 0 && 0 != memcmp(m, want, len)))
+			ok = 0;
+	}
+	if (ok && 0 != cryptobox_record_recv(r, &m, &len))
+		ok = 0;
+	cryptobox_record_free(r);
+	return ok;
+}
+
+
+/*
+ * Send TEST_RECORDS records, flush them and close the connection.
+ */
+static int
+send_all(int fd, int type, int role, unsigned char *key, uint64_t *copied)
+{
+	struct cryptobox_record	*r;
+	unsigned char		 m[TEST_MAX];
+	uint64_t		 sent;
+	int			 i, ok = 1;
+
+	if (NULL == (r = cryptobox_record_new(fd, type, role, key, TEST_MAX,
+	    TEST_DEPTH)))
+		return 0;
+	for (i = 0; ok && i < TEST_RECORDS; i++) {
+		record_fill(m, i);
+		ok = cryptobox_record_send(r, m, record_len(i));
+	}
+	if (ok)
+		ok = cryptobox_record_flush(r);
+	cryptobox_record_stats(r, &sent, copied);
+	if (sent != TEST_RECORDS)
+		ok = 0;
+	cryptobox_record_free(r);
+	shutdown(fd, SHUT_WR);
+	return ok;
+}
+
+
+/*
+ * Run a receiver in a child process on fds[1] while sending on fds[0].
+ * Returns 1 if both ends succeeded.
+ */
+static int
+exchange(int fds[2], int type, unsigned char *key, unsigned char *rkey,
+	 int role, uint64_t *copied)
+{
+	pid_t	pid;
+	int	status, sent, peer;
+
+	peer = CRYPTOBOX_RECORD_CLIENT == role ? CRYPTOBOX_RECORD_SERVER :
+	    CRYPTOBOX_RECORD_CLIENT;
+	if (-1 == (pid = fork()))
+		return 0;
+	if (0 == pid) {
+		close(fds[0]);
+		_exit(receive_all(fds[1], type, peer, rkey) ? 0 : 1);
+	}
+	close(fds[1]);
+	sent = send_all(fds[0], type, role, key, copied);
+	close(fds[0]);
+	if (-1 == waitpid(pid, &status, 0))
+		return 0;
+	return sent && WIFEXITED(status) && 0 == WEXITSTATUS(status);
+}
+
+
+/*
+ * Connect a pair of TCP sockets over loopback.
+ */
+static int
+tcp_pair(int fds[2])
+{
+	struct sockaddr_in	 sin;
+	socklen_t		 slen = sizeof sin;
+	int			 lfd;
+
+	if (-1 == (lfd = socket(AF_INET, SOCK_STREAM, 0)))
+		return 0;
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fds[0] = fds[1] = -1;
+	if (0 == bind(lfd, (struct sockaddr *)&sin, sizeof sin))
+	if (0 == listen(lfd, 1))
+	if (0 == getsockname(lfd, (struct sockaddr *)&sin, &slen))
+	if (-1 != (fds[0] = socket(AF_INET, SOCK_STREAM, 0)))
+	if (0 == connect(fds[0], (struct sockaddr *)&sin, sizeof sin))
+		fds[1] = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (-1 == fds[1]) {
+		if (-1 != fds[0])
+			close(fds[0]);
+		return 0;
+	}
+	return 1;
+}
+
+
+static void
+test_socketpair(void)
+{
+	uint64_t	copied;
+	int		fds[2];
+
+	CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	CU_ASSERT(exchange(fds, CRYPTOBOX_STRONGBOX, global_test_key,
+	    global_test_key, CRYPTOBOX_RECORD_CLIENT, &copied));
+	CU_ASSERT(TEST_RECORDS == copied);
+}
+
+
+static void
+test_tcp(void)
+{
+	unsigned char	 key[48];
+	uint64_t	 copied;
+	int		 fds[2];
+
+	memcpy(key, global_test_key, sizeof key);
+	CU_ASSERT(tcp_pair(fds));
+	CU_ASSERT(exchange(fds, CRYPTOBOX_SECRETBOX, key, key,
+	    CRYPTOBOX_RECORD_SERVER, &copied));
+	CU_ASSERT(copied <= TEST_RECORDS);
+	CU_ASSERT(tcp_pair(fds));
+	CU_ASSERT(exchange(fds, CRYPTOBOX_STRONGBOX, global_test_key,
+	    global_test_key, CRYPTOBOX_RECORD_CLIENT, &copied));
+}
+
+
+/*
+ * A zero-copy send refused for want of notification memory must wait
+ * for the sends before it and go out, not fail the connection.
+ */
+static void
+test_enobufs(void)
+{
+	uint64_t	copied;
+	int		fds[2];
+
+	CU_ASSERT(tcp_pair(fds));
+	global_enobufs = 1;
+	global_enobufs_hits = 0;
+	CU_ASSERT(exchange(fds, CRYPTOBOX_SECRETBOX, global_test_key,
+	    global_test_key, CRYPTOBOX_RECORD_CLIENT, &copied));
+	global_enobufs = 0;
+#ifdef MSG_ZEROCOPY
+	CU_ASSERT(global_enobufs_hits > 0);
+#endif
+}
+
+
+/*
+ * Records sealed under another key, or reflected back by a peer with
+ * the same role, must not be accepted.
+ */
+static void
+test_reject(void)
+{
+	struct cryptobox_record	*r;
+	unsigned char		 m[16];
+	unsigned char		 wire[256];
+	unsigned char		*out;
+	size_t			 len;
+	ssize_t			 n;
+	uint64_t		 copied;
+	int			 fds[2];
+
+	CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	CU_ASSERT(!exchange(fds, CRYPTOBOX_STRONGBOX, global_test_key,
+	    global_bad_key, CRYPTOBOX_RECORD_CLIENT, &copied));
+
+	CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	r = cryptobox_record_new(fds[0], CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_CLIENT, global_test_key, 0, 0);
+	CU_ASSERT(NULL != r);
+	memset(m, 0x2a, sizeof m);
+	CU_ASSERT(cryptobox_record_send(r, m, sizeof m));
+	cryptobox_record_free(r);
+	r = cryptobox_record_new(fds[1], CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_CLIENT, global_test_key, 0, 0);
+	CU_ASSERT(-1 == cryptobox_record_recv(r, &out, &len));
+	cryptobox_record_free(r);
+
+	/* A record with one ciphertext bit flipped on the way. */
+	r = cryptobox_record_new(fds[0], CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_CLIENT, global_test_key, 0, 0);
+	CU_ASSERT(cryptobox_record_send(r, m, sizeof m));
+	cryptobox_record_free(r);
+	close(fds[0]);
+	n = recv(fds[1], wire, sizeof wire, 0);
+	close(fds[1]);
+	CU_ASSERT(4 + 64 + sizeof m == (size_t)n);
+	wire[4 + 16 + 5] ^= 0x01;
+	CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	CU_ASSERT(n == write(fds[0], wire, (size_t)n));
+	close(fds[0]);
+	r = cryptobox_record_new(fds[1], CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_SERVER, global_test_key, 0, 0);
+	CU_ASSERT(-1 == cryptobox_record_recv(r, &out, &len));
+	cryptobox_record_free(r);
+	close(fds[1]);
+
+	/* The untouched record opens, and the stream then ends cleanly. */
+	wire[4 + 16 + 5] ^= 0x01;
+	CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	CU_ASSERT(n == write(fds[0], wire, (size_t)n));
+	close(fds[0]);
+	r = cryptobox_record_new(fds[1], CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_SERVER, global_test_key, 0, 0);
+	CU_ASSERT(1 == cryptobox_record_recv(r, &out, &len));
+	CU_ASSERT(sizeof m == len);
+	CU_ASSERT(0 == memcmp(out, m, sizeof m));
+	CU_ASSERT(0 == cryptobox_record_recv(r, &out, &len));
+	cryptobox_record_free(r);
+	close(fds[1]);
+
+	/* A stream cut off inside a record. */
+	CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	CU_ASSERT(n - 1 == write(fds[0], wire, (size_t)n - 1));
+	close(fds[0]);
+	r = cryptobox_record_new(fds[1], CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_SERVER, global_test_key, 0, 0);
+	CU_ASSERT(-1 == cryptobox_record_recv(r, &out, &len));
+	cryptobox_record_free(r);
+	close(fds[1]);
+}
+
+
+/*
+ * A record's tag covers the role, the sequence number, the length, the
+ * IV and the ciphertext. Put together from a record on the wire, those
+ * must not open as a box under the connection key.
+ */
+static void
+test_not_box(void)
+{
+	struct cryptobox_record	*r;
+	unsigned char		 m[16];
+	unsigned char		 box[9 + 256];
+	ssize_t			 n;
+	int			 fds[2];
+
+	CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	r = cryptobox_record_new(fds[0], CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_CLIENT, global_test_key, 0, 0);
+	CU_ASSERT(NULL != r);
+	memset(m, 0x2a, sizeof m);
+	CU_ASSERT(cryptobox_record_send(r, m, sizeof m));
+	cryptobox_record_free(r);
+	close(fds[0]);
+	memset(box, 0, sizeof box);
+	box[0] = CRYPTOBOX_RECORD_CLIENT;
+	n = recv(fds[1], box + 9, sizeof box - 9, 0);
+	close(fds[1]);
+	CU_ASSERT(4 + 64 + sizeof m == (size_t)n);
+	if (n <= 0)
+		return;
+	CU_ASSERT(0 == strongbox_verify(box, 9 + (int)n, global_test_key));
+	CU_ASSERT(NULL == strongbox_open(box, 9 + (int)n, global_test_key));
+}
+
+
+static void
+test_invalid(void)
+{
+	struct cryptobox_record	*r;
+	unsigned char		 m[32];
+	int			 fds[2];
+
+	CU_ASSERT(NULL == cryptobox_record_new(0, 0, CRYPTOBOX_RECORD_CLIENT,
+	    global_test_key, 0, 0));
+	CU_ASSERT(NULL == cryptobox_record_new(0, CRYPTOBOX_STRONGBOX, 0,
+	    global_test_key, 0, 0));
+	CU_ASSERT(NULL == cryptobox_record_new(0, CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_CLIENT, global_test_key,
+	    CRYPTOBOX_RECORD_LIMIT + 1, 0));
+
+	CU_ASSERT(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	r = cryptobox_record_new(fds[0], CRYPTOBOX_STRONGBOX,
+	    CRYPTOBOX_RECORD_CLIENT, global_test_key, 16, 1);
+	CU_ASSERT(NULL != r);
+	CU_ASSERT(!cryptobox_record_send(r, m, sizeof m));
+	CU_ASSERT(cryptobox_record_send(r, m, 16));
+	CU_ASSERT(cryptobox_record_send(r, NULL, 0));
+	cryptobox_record_free(r);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	tsuite = CU_add_suite("record_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "record over socketpair",
+	    test_socketpair))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "record over tcp", test_tcp))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "record after ENOBUFS", test_enobufs))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "rejected records", test_reject))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid records", test_invalid))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "records are not boxes",
+	    test_not_box))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
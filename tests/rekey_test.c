@@ -0,0 +1,503 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/pipeline.h>
+#include <cryptobox/rekey.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/stream.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_BOXES      20
+#define TEST_CHUNK      4096
+#define TEST_LEN        (200 * TEST_CHUNK + 99)
+
+
+static unsigned char global_old_key[80];
+static unsigned char global_new_key[80];
+static unsigned char global_bad_key[80];
+static char global_in[] = "/tmp/cryptobox_rekey_in.XXXXXX";
+static char global_box[] = "/tmp/cryptobox_rekey_box.XXXXXX";
+static char global_out[] = "/tmp/cryptobox_rekey_out.XXXXXX";
+static char global_ckpt[] = "/tmp/cryptobox_rekey_ckpt.XXXXXX";
+
+
+static unsigned char *
+test_message(size_t len)
+{
+	unsigned char	*m;
+	size_t		 i;
+
+	if (NULL == (m = malloc(len + 1)))
+		return NULL;
+	for (i = 0; i < len; i++)
+		m[i] = (unsigned char)(i * 29 + 3);
+	return m;
+}
+
+
+static int
+write_file(const char *path, unsigned char *buf, size_t len)
+{
+	ssize_t	n;
+	int	fd;
+
+	if (-1 == (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)))
+		return 0;
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) <= 0)
+			break;
+		buf += n;
+		len -= (size_t)n;
+	}
+	close(fd);
+	return 0 == len;
+}
+
+
+/*
+ * Seal or open a file with the pipelined stream functions.
+ */
+static int
+run_fd(int sealing, int type, const char *in, const char *out,
+    unsigned char *key)
+{
+	int	ifd, ofd, res;
+
+	if (-1 == (ifd = open(in, O_RDONLY)))
+		return 0;
+	if (-1 == (ofd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0600))) {
+		close(ifd);
+		return 0;
+	}
+	if (sealing)
+		res = cryptobox_stream_seal_fd(type, ifd, ofd, TEST_CHUNK, 0,
+		    0, key);
+	else
+		res = cryptobox_stream_open_fd(type, ifd, ofd, 0, 0, key);
+	close(ofd);
+	close(ifd);
+	return res;
+}
+
+
+/*
+ * Re-key the stream in global_box into global_out. The output is not
+ * truncated, as a resumed rotation needs what is already there.
+ */
+static int
+rekey_file(struct cryptobox_rekey *rk, const char *checkpoint)
+{
+	int	ifd, ofd, res;
+
+	if (-1 == (ifd = open(global_box, O_RDONLY)))
+		return 0;
+	if (-1 == (ofd = open(global_out, O_RDWR | O_CREAT, 0600))) {
+		close(ifd);
+		return 0;
+	}
+	res = cryptobox_rekey_stream_fd(rk, ifd, ofd, checkpoint);
+	close(ofd);
+	close(ifd);
+	return res;
+}
+
+
+/*
+ * Open global_out under the new key into global_in and compare it with
+ * the message.
+ */
+static int
+check_output(int type, unsigned char *m, size_t len)
+{
+	unsigned char	*out;
+	ssize_t		 n = -1;
+	int		 fd, ok = 0;
+
+	if (!run_fd(0, type, global_out, global_in, global_new_key))
+		return 0;
+	if (NULL == (out = malloc(len + 1)))
+		return 0;
+	if (-1 != (fd = open(global_in, O_RDONLY))) {
+		n = read(fd, out, len + 1);
+		close(fd);
+	}
+	if (n >= 0 && (size_t)n == len && 0 == memcmp(out, m, len))
+		ok = 1;
+	free(out);
+	return ok;
+}
+
+
+static void
+test_box(int old_type, int new_type, size_t len)
+{
+	struct cryptobox_rekey	*rk;
+	unsigned char		*m, *box, *out, *opened;
+	uint64_t		 done, total;
+	size_t			 out_len;
+	int			 blen;
+
+	m = test_message(len);
+	if (CRYPTOBOX_SECRETBOX == old_type)
+		box = secretbox_seal(m, (int)len, &blen, global_old_key);
+	else
+		box = strongbox_seal(m, (int)len, &blen, global_old_key);
+	CU_ASSERT(NULL != box);
+
+	rk = cryptobox_rekey_new(old_type, global_old_key, new_type,
+	    global_new_key);
+	CU_ASSERT(NULL != rk);
+	out = cryptobox_rekey_box(rk, box, (size_t)blen, &out_len);
+	CU_ASSERT(NULL != out);
+	cryptobox_rekey_progress(rk, &done, &total);
+	CU_ASSERT(done == (uint64_t)blen && total == (uint64_t)blen);
+	if (CRYPTOBOX_SECRETBOX == new_type) {
+		CU_ASSERT(out_len == len + SECRETBOX_OVERHEAD);
+		opened = secretbox_open(out, (int)out_len, global_new_key);
+	} else {
+		CU_ASSERT(out_len == len + STRONGBOX_OVERHEAD);
+		opened = strongbox_open(out, (int)out_len, global_new_key);
+	}
+	CU_ASSERT(NULL != opened);
+	if (NULL != opened)
+		CU_ASSERT(0 == memcmp(opened, m, len));
+	free(opened);
+	free(out);
+
+	box[blen - 1] ^= 0x01;
+	CU_ASSERT(NULL == cryptobox_rekey_box(rk, box, (size_t)blen,
+	    &out_len));
+	CU_ASSERT(0 == out_len);
+	cryptobox_rekey_free(rk);
+	free(box);
+	free(m);
+}
+
+
+static void
+test_boxes(void)
+{
+	test_box(CRYPTOBOX_SECRETBOX, CRYPTOBOX_SECRETBOX, 1000);
+	test_box(CRYPTOBOX_SECRETBOX, CRYPTOBOX_STRONGBOX, 300000);
+	test_box(CRYPTOBOX_STRONGBOX, CRYPTOBOX_SECRETBOX, 65536);
+	test_box(CRYPTOBOX_STRONGBOX, CRYPTOBOX_STRONGBOX, 0);
+}
+
+
+/*
+ * Re-key a batch in parallel, one box of which is damaged.
+ */
+static void
+test_batch(void)
+{
+	struct cryptobox_rekey	*rk;
+	unsigned char		*m, *boxes[TEST_BOXES], *out[TEST_BOXES];
+	unsigned char		*opened;
+	size_t			 lens[TEST_BOXES], out_lens[TEST_BOXES];
+	uint64_t		 done, total;
+	int			 i, blen;
+
+	m = test_message(200000);
+	for (i = 0; i < TEST_BOXES; i++) {
+		boxes[i] = secretbox_seal(m, i * 10000, &blen,
+		    global_old_key);
+		lens[i] = (size_t)blen;
+	}
+	boxes[7][20] ^= 0x01;
+
+	rk = cryptobox_rekey_new(CRYPTOBOX_SECRETBOX, global_old_key,
+	    CRYPTOBOX_STRONGBOX, global_new_key);
+	CU_ASSERT(0 == cryptobox_rekey_boxes(rk, boxes, lens, TEST_BOXES, out,
+	    out_lens));
+	cryptobox_rekey_progress(rk, &done, &total);
+	CU_ASSERT(done == total - lens[7]);
+	for (i = 0; i < TEST_BOXES; i++) {
+		if (7 == i) {
+			CU_ASSERT(NULL == out[i]);
+			continue;
+		}
+		CU_ASSERT(NULL != out[i]);
+		opened = strongbox_open(out[i], (int)out_lens[i],
+		    global_new_key);
+		CU_ASSERT(NULL != opened);
+		if (NULL != opened)
+			CU_ASSERT(0 == memcmp(opened, m, (size_t)i * 10000));
+		free(opened);
+		free(out[i]);
+	}
+
+	boxes[7][20] ^= 0x01;
+	CU_ASSERT(1 == cryptobox_rekey_boxes(rk, boxes, lens, TEST_BOXES, out,
+	    out_lens));
+	for (i = 0; i < TEST_BOXES; i++) {
+		free(out[i]);
+		free(boxes[i]);
+	}
+	cryptobox_rekey_free(rk);
+	free(m);
+}
+
+
+static void
+test_stream(void)
+{
+	struct cryptobox_rekey	*rk;
+	unsigned char		*m;
+	uint64_t		 done, total;
+	struct stat		 st;
+
+	m = test_message(TEST_LEN);
+	CU_ASSERT(write_file(global_in, m, TEST_LEN));
+	CU_ASSERT(run_fd(1, CRYPTOBOX_SECRETBOX, global_in, global_box,
+	    global_old_key));
+
+	rk = cryptobox_rekey_new(CRYPTOBOX_SECRETBOX, global_old_key,
+	    CRYPTOBOX_STRONGBOX, global_new_key);
+	unlink(global_out);
+	CU_ASSERT(rekey_file(rk, NULL));
+	CU_ASSERT(check_output(CRYPTOBOX_STRONGBOX, m, TEST_LEN));
+
+	unlink(global_out);
+	CU_ASSERT(rekey_file(rk, global_ckpt));
+	CU_ASSERT(-1 == stat(global_ckpt, &st));
+	CU_ASSERT(check_output(CRYPTOBOX_STRONGBOX, m, TEST_LEN));
+	cryptobox_rekey_progress(rk, &done, &total);
+	CU_ASSERT(0 == stat(global_box, &st));
+	CU_ASSERT(done == total && total == (uint64_t)st.st_size);
+	cryptobox_rekey_free(rk);
+
+	rk = cryptobox_rekey_new(CRYPTOBOX_SECRETBOX, global_new_key,
+	    CRYPTOBOX_SECRETBOX, global_old_key);
+	CU_ASSERT(0 == rekey_file(rk, NULL));
+	cryptobox_rekey_free(rk);
+	free(m);
+}
+
+
+/*
+ * Interrupt a rotation with a damaged chunk near the end, repair it,
+ * and check that the rotation resumes under the same header rather
+ * than starting over.
+ */
+static void
+test_resume(void)
+{
+	struct cryptobox_rekey	*rk, *other;
+	unsigned char		*m;
+	unsigned char		 head[64], head2[64], ckpt[256], byte;
+	size_t			 head_size;
+	ssize_t			 ckpt_len;
+	off_t			 off;
+	struct stat		 st;
+	int			 fd;
+
+	m = test_message(TEST_LEN);
+	CU_ASSERT(write_file(global_in, m, TEST_LEN));
+	CU_ASSERT(run_fd(1, CRYPTOBOX_STRONGBOX, global_in, global_box,
+	    global_old_key));
+	head_size = cryptobox_stream_head_size(CRYPTOBOX_SECRETBOX);
+	off = (off_t)cryptobox_stream_head_size(CRYPTOBOX_STRONGBOX) +
+	    190 * (TEST_CHUNK + (off_t)cryptobox_stream_tag_size(
+	    CRYPTOBOX_STRONGBOX)) + 10;
+
+	fd = open(global_box, O_RDWR);
+	CU_ASSERT(1 == pread(fd, &byte, 1, off));
+	byte ^= 0x01;
+	CU_ASSERT(1 == pwrite(fd, &byte, 1, off));
+
+	rk = cryptobox_rekey_new(CRYPTOBOX_STRONGBOX, global_old_key,
+	    CRYPTOBOX_SECRETBOX, global_new_key);
+	unlink(global_out);
+	CU_ASSERT(0 == rekey_file(rk, global_ckpt));
+	CU_ASSERT(0 == stat(global_ckpt, &st));
+	fd = open(global_out, O_RDONLY);
+	CU_ASSERT((ssize_t)head_size == pread(fd, head, head_size, 0));
+	close(fd);
+
+	/* The checkpoint must not pass for a box under the new key. */
+	fd = open(global_ckpt, O_RDONLY);
+	ckpt_len = read(fd, ckpt, sizeof ckpt);
+	close(fd);
+	CU_ASSERT(ckpt_len > 0);
+	CU_ASSERT(0 == secretbox_verify(ckpt, (int)ckpt_len, global_new_key));
+	CU_ASSERT(NULL == secretbox_open(ckpt, (int)ckpt_len, global_new_key));
+
+	/* A rotation to another key must not take the checkpoint over. */
+	other = cryptobox_rekey_new(CRYPTOBOX_STRONGBOX, global_old_key,
+	    CRYPTOBOX_SECRETBOX, global_bad_key);
+	CU_ASSERT(0 == rekey_file(other, global_ckpt));
+	cryptobox_rekey_free(other);
+
+	fd = open(global_box, O_RDWR);
+	byte ^= 0x01;
+	CU_ASSERT(1 == pwrite(fd, &byte, 1, off));
+	close(fd);
+	CU_ASSERT(1 == rekey_file(rk, global_ckpt));
+	CU_ASSERT(-1 == stat(global_ckpt, &st));
+	fd = open(global_out, O_RDONLY);
+	CU_ASSERT((ssize_t)head_size == pread(fd, head2, head_size, 0));
+	close(fd);
+	CU_ASSERT(0 == memcmp(head, head2, head_size));
+	CU_ASSERT(check_output(CRYPTOBOX_SECRETBOX, m, TEST_LEN));
+
+	cryptobox_rekey_free(rk);
+	free(m);
+}
+
+
+static void
+test_invalid(void)
+{
+	struct cryptobox_rekey	*rk;
+	int			 fds[2];
+
+	CU_ASSERT(NULL == cryptobox_rekey_new(0, global_old_key,
+	    CRYPTOBOX_SECRETBOX, global_new_key));
+	CU_ASSERT(NULL == cryptobox_rekey_new(CRYPTOBOX_SECRETBOX,
+	    global_old_key, CRYPTOBOX_SECRETBOX, NULL));
+	rk = cryptobox_rekey_new(CRYPTOBOX_SECRETBOX, global_old_key,
+	    CRYPTOBOX_SECRETBOX, global_new_key);
+	CU_ASSERT(NULL == cryptobox_rekey_box(rk, global_old_key, 10, NULL));
+	CU_ASSERT(0 == pipe(fds));
+	CU_ASSERT(0 == cryptobox_rekey_stream_fd(rk, fds[0], fds[1], NULL));
+	close(fds[0]);
+	close(fds[1]);
+	cryptobox_rekey_free(rk);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+static void
+remove_files(void)
+{
+	unlink(global_in);
+	unlink(global_box);
+	unlink(global_out);
+	unlink(global_ckpt);
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	remove_files();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+	int		fd;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_old_key) ||
+	    !strongbox_generate_key(global_new_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+	if (-1 == (fd = mkstemp(global_in)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	if (-1 == (fd = mkstemp(global_box)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	if (-1 == (fd = mkstemp(global_out)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	if (-1 == (fd = mkstemp(global_ckpt)))
+		err(EX_CANTCREAT, "failed to create test file");
+	close(fd);
+	unlink(global_ckpt);
+
+	tsuite = CU_add_suite("rekey_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "re-key boxes", test_boxes))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "re-key batch", test_batch))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "re-key stream", test_stream))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "resume re-key", test_resume))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "invalid re-key", test_invalid))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	remove_files();
+	return fails;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+
+#include <cryptobox/secmem.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/strongbox.h>
+
+
+static unsigned char global_test_key[80];
+
+
+/*
+ * Blocks of every class, and larger ones, must be usable up to their
+ * full size, aligned, and wiped when they come back; impossible sizes
+ * must be refused.
+ */
+static void
+test_alloc(void)
+{
+	unsigned char	*blocks[20];
+	unsigned char	*p;
+	size_t		 len;
+	size_t		 i, j;
+
+	CU_ASSERT(1 == cryptobox_secmem_enabled());
+	for (i = 0, len = 1; i < 20; i++, len <<= 1) {
+		blocks[i] = cryptobox_secmem_alloc(len);
+		CU_ASSERT(NULL != blocks[i]);
+		CU_ASSERT(0 == ((uintptr_t)blocks[i] & 15));
+		memset(blocks[i], 0xa5, len);
+	}
+	for (i = 0; i < 20; i++)
+		cryptobox_secmem_free(blocks[i]);
+
+	p = cryptobox_secmem_alloc(100);
+	CU_ASSERT(NULL != p);
+	for (j = 0; j < 100; j++)
+		if (0 != p[j])
+			break;
+	CU_ASSERT(100 == j);
+	cryptobox_secmem_free(p);
+
+	/* Sizes that cannot be mapped must fail rather than wrap. */
+	CU_ASSERT(NULL == cryptobox_secmem_alloc(SIZE_MAX));
+	CU_ASSERT(NULL == cryptobox_secmem_alloc(SIZE_MAX - 100));
+}
+
+
+/*
+ * Exhausting a class must fall back to separate mappings.
+ */
+static void
+test_exhaust(void)
+{
+	unsigned char	*blocks[64];
+	int		 i;
+
+	for (i = 0; i < 64; i++) {
+		blocks[i] = cryptobox_secmem_alloc(65536);
+		CU_ASSERT(NULL != blocks[i]);
+		if (NULL != blocks[i])
+			memset(blocks[i], i, 65536);
+	}
+	for (i = 0; i < 64; i++)
+		cryptobox_secmem_free(blocks[i]);
+}
+
+
+static void
+test_secretbox(void)
+{
+	struct secretbox_ctx	*ctx;
+	unsigned char		 message[] = "Hello, world.";
+	unsigned char		*box, *out;
+	int			 box_len;
+
+	ctx = secretbox_ctx_new_secure(global_test_key);
+	CU_ASSERT(NULL != ctx);
+	box = secretbox_ctx_seal(ctx, message, sizeof message, &box_len);
+	CU_ASSERT(NULL != box);
+	out = secretbox_ctx_open(ctx, box, box_len);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, message, sizeof message));
+	cryptobox_secmem_free(out);
+	cryptobox_secmem_free(box);
+	secretbox_ctx_free(ctx);
+
+	box = secretbox_seal(message, sizeof message, &box_len,
+			     global_test_key);
+	CU_ASSERT(NULL != box);
+	out = secretbox_open(box, box_len, global_test_key);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, message, sizeof message));
+	free(out);
+	free(box);
+}
+
+
+static void
+test_strongbox(void)
+{
+	struct strongbox_ctx	*ctx;
+	unsigned char		 message[] = "Hello, world.";
+	unsigned char		*box, *out;
+	int			 box_len;
+
+	ctx = strongbox_ctx_new_secure(global_test_key);
+	CU_ASSERT(NULL != ctx);
+	box = strongbox_ctx_seal(ctx, message, sizeof message, &box_len);
+	CU_ASSERT(NULL != box);
+	box[box_len - 1] ^= 1;
+	CU_ASSERT(NULL == strongbox_ctx_open(ctx, box, box_len));
+	box[box_len - 1] ^= 1;
+	out = strongbox_ctx_open(ctx, box, box_len);
+	CU_ASSERT(NULL != out && 0 == memcmp(out, message, sizeof message));
+	cryptobox_secmem_free(out);
+	cryptobox_secmem_free(box);
+	strongbox_ctx_free(ctx);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+	if (!cryptobox_secmem_init(256 * 1024))
+		errx(EX_OSERR, "failed to lock the arena");
+
+	tsuite = CU_add_suite("secmem_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "allocation", test_alloc))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "exhaustion", test_exhaust))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "secure secretbox", test_secretbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "secure strongbox", test_strongbox))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	cryptobox_secmem_destroy();
+	CU_cleanup_registry();
+	return fails;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2013 Kyle Isom <kyle@tyrfingr.is>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL
+ * DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA
+ * OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ * ---------------------------------------------------------------------
+ */
+
+
+#include <sys/types.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <openssl/bio.h>
+
+
+#include <cryptobox/bio.h>
+#include <cryptobox/cryptobox.h>
+#include <cryptobox/secretbox.h>
+#include <cryptobox/stream.h>
+#include <cryptobox/strongbox.h>
+
+
+#define TEST_CHUNK      1024
+
+
+static unsigned char global_test_key[80];
+static unsigned char global_bad_key[80];
+
+
+static unsigned char *
+test_message(size_t len)
+{
+	unsigned char	*m;
+	size_t		 i;
+
+	if (NULL == (m = malloc(len + 1)))
+		return NULL;
+	for (i = 0; i < len; i++)
+		m[i] = (unsigned char)(i * 13 + 1);
+	return m;
+}
+
+
+/*
+ * Seal a message through a filter onto a memory BIO, writing it in
+ * uneven pieces. Returns the memory BIO, which holds the stream.
+ */
+static BIO *
+test_bio_seal(int type, unsigned char *m, size_t len, unsigned char *key)
+{
+	BIO	*f, *mem;
+	size_t	 off, n;
+	int	 step = 1;
+
+	f = BIO_new(BIO_f_cryptobox());
+	mem = BIO_new(BIO_s_mem());
+	CU_ASSERT(NULL != f && NULL != mem);
+	CU_ASSERT(1 == BIO_set_cryptobox(f, type, key, TEST_CHUNK));
+	BIO_push(f, mem);
+	for (off = 0; off < len; off += n) {
+		n = len - off < (size_t)step ? len - off : (size_t)step;
+		CU_ASSERT((int)n == BIO_write(f, m + off, (int)n));
+		step = step * 3 + 1;
+	}
+	CU_ASSERT(1 == BIO_flush(f));
+	BIO_pop(f);
+	BIO_free(f);
+	return mem;
+}
+
+
+/*
+ * Open a stream held in a buffer through a filter, reading it in
+ * uneven pieces. Returns the number of bytes read, or -1 if the
+ * filter reported an error.
+ */
+static int
+test_bio_open(int type, unsigned char *sealed, size_t sealed_len,
+	      unsigned char *out, size_t len, unsigned char *key)
+{
+	BIO	*f, *mem;
+	size_t	 off = 0;
+	int	 n, step = 7;
+
+	f = BIO_new(BIO_f_cryptobox());
+	mem = BIO_new_mem_buf(sealed, (int)sealed_len);
+	CU_ASSERT(1 == BIO_set_cryptobox(f, type, key, 0));
+	BIO_push(f, mem);
+	for (;;) {
+		n = BIO_read(f, out + off, step);
+		if (n <= 0)
+			break;
+		off += (size_t)n;
+		CU_ASSERT(off <= len);
+		step = step * 2 + 3;
+		if (off + (size_t)step > len + 1)
+			step = (int)(len + 1 - off);
+	}
+	if (n < 0 || !BIO_eof(f))
+		off = (size_t)-1;
+	BIO_free_all(f);
+	return (int)off;
+}
+
+
+static void
+test_bio(int type)
+{
+	size_t		 lens[] = { 0, 1, TEST_CHUNK - 1, TEST_CHUNK,
+				    3 * TEST_CHUNK, 10 * TEST_CHUNK + 77 };
+	size_t		 head_size = cryptobox_stream_head_size(type);
+	size_t		 ts = cryptobox_stream_tag_size(type);
+	unsigned char	*m, *out, *sealed, *copy;
+	size_t		 len, sealed_len, i;
+	long		 n;
+	BIO		*mem;
+
+	for (i = 0; i < sizeof lens / sizeof lens[0]; i++) {
+		len = lens[i];
+		m = test_message(len);
+		out = malloc(len + 1);
+		mem = test_bio_seal(type, m, len, global_test_key);
+		n = BIO_get_mem_data(mem, (char **)&sealed);
+		sealed_len = (size_t)n;
+		CU_ASSERT(sealed_len == head_size + len +
+			  (len / TEST_CHUNK + 1) * ts);
+
+		CU_ASSERT((int)len == test_bio_open(type, sealed, sealed_len,
+		    out, len, global_test_key));
+		CU_ASSERT(0 == memcmp(out, m, len));
+		CU_ASSERT(-1 == test_bio_open(type, sealed, sealed_len, out,
+		    len, global_bad_key));
+
+		/* Damage, truncation and extension are all caught. */
+		copy = malloc(sealed_len + 1);
+		memcpy(copy, sealed, sealed_len);
+		copy[sealed_len / 2] ^= 0x01;
+		CU_ASSERT(-1 == test_bio_open(type, copy, sealed_len, out,
+		    len, global_test_key));
+		memcpy(copy, sealed, sealed_len);
+		CU_ASSERT(-1 == test_bio_open(type, copy, sealed_len - 1, out,
+		    len, global_test_key));
+		if (len >= TEST_CHUNK)
+			CU_ASSERT(-1 == test_bio_open(type, copy,
+			    sealed_len - ts, out, len, global_test_key));
+		CU_ASSERT(-1 == test_bio_open(type, copy, head_size - 1, out,
+		    len, global_test_key));
+		free(copy);
+
+		BIO_free(mem);
+		free(out);
+		free(m);
+	}
+}
+
+
+/*
+ * Seal and open chunks directly, in place, and check that chunks
+ * cannot be moved within or between streams.
+ */
+static void
+test_chunks(int type)
+{
+	struct cryptobox_stream	*s, *t;
+	unsigned char		 head[64], head2[64];
+	unsigned char		 a[TEST_CHUNK + 64], b[TEST_CHUNK + 64];
+	unsigned char		 c[TEST_CHUNK + 64];
+	size_t			 ts = cryptobox_stream_tag_size(type);
+
+	s = cryptobox_stream_new(type, global_test_key);
+	t = cryptobox_stream_new(type, global_test_key);
+	CU_ASSERT(NULL != s && NULL != t);
+	if (NULL == s || NULL == t)
+		return;
+	CU_ASSERT(0 == cryptobox_stream_seal_head(s, 100, head));
+	CU_ASSERT(1 == cryptobox_stream_seal_head(s, TEST_CHUNK, head));
+	CU_ASSERT(1 == cryptobox_stream_seal_head(t, TEST_CHUNK, head2));
+	CU_ASSERT(TEST_CHUNK == cryptobox_stream_chunk_size(s));
+
+	memset(a, 'a', TEST_CHUNK);
+	memset(b, 'b', TEST_CHUNK);
+	memset(c, 'c', 10);
+	CU_ASSERT(1 == cryptobox_stream_seal_chunk(s, 0, a, TEST_CHUNK, a));
+	CU_ASSERT(1 == cryptobox_stream_seal_chunk(s, 1, b, TEST_CHUNK, b));
+	CU_ASSERT(1 == cryptobox_stream_seal_chunk(s, 2, c, 10, c));
+	CU_ASSERT(0 == cryptobox_stream_seal_chunk(s, 3, c,
+	    TEST_CHUNK + 1, c));
+
+	CU_ASSERT(1 == cryptobox_stream_open_head(t, head));
+	CU_ASSERT(0 == cryptobox_stream_open_chunk(t, 0, b, TEST_CHUNK + ts,
+	    b));
+	CU_ASSERT(0 == cryptobox_stream_open_chunk(t, 1, c, 10 + ts, c));
+	CU_ASSERT(1 == cryptobox_stream_open_chunk(t, 1, b, TEST_CHUNK + ts,
+	    b));
+	CU_ASSERT(1 == cryptobox_stream_open_chunk(t, 2, c, 10 + ts, c));
+	CU_ASSERT(1 == cryptobox_stream_open_chunk(t, 0, a, TEST_CHUNK + ts,
+	    a));
+	CU_ASSERT('a' == a[0] && 'a' == a[TEST_CHUNK - 1]);
+	CU_ASSERT('b' == b[0] && 'b' == b[TEST_CHUNK - 1]);
+	CU_ASSERT('c' == c[0] && 'c' == c[9]);
+
+	head[8] ^= 0x01;
+	CU_ASSERT(0 == cryptobox_stream_open_head(t, head));
+	CU_ASSERT(0 == cryptobox_stream_open_head(t, head2 + 1));
+
+	cryptobox_stream_free(s);
+	cryptobox_stream_free(t);
+}
+
+
+/*
+ * A chunk's tag covers the header, the index, the final flag and the
+ * ciphertext, all of which a reader of the stream sees. Laid out in
+ * that order with the tag after it, a chunk must not open as a box
+ * under the same key.
+ */
+static void
+test_chunk_not_box(void)
+{
+	struct cryptobox_stream	*s;
+	unsigned char		 box[64 + 9 + TEST_CHUNK + 64];
+	size_t			 hs, ts, len;
+
+	hs = cryptobox_stream_head_size(CRYPTOBOX_SECRETBOX);
+	ts = cryptobox_stream_tag_size(CRYPTOBOX_SECRETBOX);
+	s = cryptobox_stream_new(CRYPTOBOX_SECRETBOX, global_test_key);
+	CU_ASSERT(NULL != s);
+	if (NULL == s)
+		return;
+	memset(box, 0, sizeof box);
+	memset(box + hs + 9, 'a', TEST_CHUNK);
+	CU_ASSERT(1 == cryptobox_stream_seal_head(s, TEST_CHUNK, box));
+	CU_ASSERT(1 == cryptobox_stream_seal_chunk(s, 0, box + hs + 9,
+	    TEST_CHUNK, box + hs + 9));
+	len = hs + 9 + TEST_CHUNK + ts;
+	CU_ASSERT(0 == secretbox_verify(box, (int)len, global_test_key));
+	CU_ASSERT(NULL == secretbox_open(box, (int)len, global_test_key));
+	cryptobox_stream_free(s);
+}
+
+
+static void
+test_secretbox(void)
+{
+	test_chunks(CRYPTOBOX_SECRETBOX);
+	test_bio(CRYPTOBOX_SECRETBOX);
+}
+
+
+static void
+test_strongbox(void)
+{
+	test_chunks(CRYPTOBOX_STRONGBOX);
+	test_bio(CRYPTOBOX_STRONGBOX);
+}
+
+
+/*
+ * init_test is called each time a test is run, and cleanup is run after
+ * every test.
+ */
+int init_test(void)
+{
+	return 0;
+}
+
+int cleanup_test(void)
+{
+	return 0;
+}
+
+
+/*
+ * fireball is the code called when adding test fails: cleanup the test
+ * registry and exit.
+ */
+void
+fireball(void)
+{
+	int	error = 0;
+
+	error = CU_get_error();
+	if (error == 0)
+		error = -1;
+
+	fprintf(stderr, "fatal error in tests\n");
+	CU_cleanup_registry();
+	exit(error);
+}
+
+
+/*
+ * The main function sets up the test suite, registers the test cases,
+ * runs through them, and hopefully doesn't explode.
+ */
+int
+main(void)
+{
+	CU_pSuite       tsuite = NULL;
+	unsigned int    fails;
+
+	if (!(CUE_SUCCESS == CU_initialize_registry())) {
+		errx(EX_CONFIG, "failed to initialise test registry");
+		return EXIT_FAILURE;
+	}
+
+	if (!strongbox_generate_key(global_test_key) ||
+	    !strongbox_generate_key(global_bad_key))
+		errx(EX_SOFTWARE, "failed to generate test key");
+
+	tsuite = CU_add_suite("stream_test", init_test, cleanup_test);
+	if (NULL == tsuite)
+		fireball();
+
+	if (NULL == CU_add_test(tsuite, "secretbox streams", test_secretbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "strongbox streams", test_strongbox))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "chunks are not boxes",
+	    test_chunk_not_box))
+		fireball();
+
+	CU_basic_set_mode(CU_BRM_VERBOSE);
+	CU_basic_run_tests();
+	fails = CU_get_number_of_tests_failed();
+	warnx("%u tests failed", fails);
+
+	CU_cleanup_registry();
+	return fails;
+}
@@ -21,6 +21,7 @@
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
 #include <err.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -502,6 +503,260 @@ test_vector9(void)
 }
 
 
+/*
+ * Boxes sealed through a context must open with the plain key, and
+ * the other way around; a context for the wrong key must not open
+ * them.
+ */
+static void
+test_ctx(void)
+{
+        unsigned char            message[] = "Shiny. Let's be bad guys.";
+        int                      message_len = sizeof message;
+        struct strongbox_ctx    *ctx = NULL;
+        struct strongbox_ctx    *bad_ctx = NULL;
+        unsigned char           *box = NULL;
+        unsigned char           *msg = NULL;
+        int                      box_len = 0;
+
+        ctx = strongbox_ctx_new(global_test_key);
+        bad_ctx = strongbox_ctx_new(global_bad_key);
+        CU_ASSERT(NULL != ctx && NULL != bad_ctx);
+        if (NULL == ctx || NULL == bad_ctx)
+                goto out;
+
+        box = strongbox_ctx_seal(ctx, message, message_len, &box_len);
+        CU_ASSERT(NULL != box);
+        CU_ASSERT(box_len == message_len + (int)STRONGBOX_OVERHEAD);
+        if (NULL != box) {
+                msg = strongbox_open(box, box_len, global_test_key);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, message,
+                                                     message_len));
+                free(msg);
+                msg = strongbox_ctx_open(bad_ctx, box, box_len);
+                CU_ASSERT(NULL == msg);
+                free(box);
+        }
+
+        box = strongbox_seal(message, message_len, &box_len, global_test_key);
+        CU_ASSERT(NULL != box);
+        if (NULL != box) {
+                msg = strongbox_ctx_open(ctx, box, box_len);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, message,
+                                                     message_len));
+                free(msg);
+                box[box_len - 1] ^= 1;
+                msg = strongbox_ctx_open(ctx, box, box_len);
+                CU_ASSERT(NULL == msg);
+                free(box);
+        }
+
+        CU_ASSERT(NULL == strongbox_ctx_open(ctx, message, 4));
+
+out:
+        strongbox_ctx_free(ctx);
+        strongbox_ctx_free(bad_ctx);
+}
+
+
+static void
+test_verify(void)
+{
+        unsigned char            message[] = "Shiny. Let's be bad guys.";
+        int                      message_len = sizeof message;
+        struct strongbox_ctx    *ctx = NULL;
+        unsigned char           *box = NULL;
+        int                      box_len = 0;
+
+        box = strongbox_seal(message, message_len, &box_len, global_test_key);
+        CU_ASSERT(NULL != box);
+        if (NULL == box)
+                return;
+        CU_ASSERT(1 == strongbox_verify(box, box_len, global_test_key));
+        CU_ASSERT(0 == strongbox_verify(box, box_len, global_bad_key));
+        ctx = strongbox_ctx_new(global_test_key);
+        CU_ASSERT(NULL != ctx);
+        if (NULL != ctx) {
+                CU_ASSERT(1 == strongbox_ctx_verify(ctx, box, box_len));
+                box[box_len / 2] ^= 1;
+                CU_ASSERT(0 == strongbox_ctx_verify(ctx, box, box_len));
+                CU_ASSERT(0 == strongbox_ctx_verify(ctx, box, 4));
+                CU_ASSERT(0 == strongbox_ctx_verify(ctx, NULL, box_len));
+                strongbox_ctx_free(ctx);
+        }
+        free(box);
+}
+
+
+static void
+test_keystream(void)
+{
+        unsigned char            message[] = "Shiny. Let's be bad guys.";
+        int                      message_len = sizeof message;
+        unsigned char            ivs[4][16];
+        unsigned char            big[128];
+        struct strongbox_ctx    *ctx = NULL;
+        unsigned char           *box = NULL;
+        unsigned char           *msg = NULL;
+        uint64_t                 hits, misses;
+        int                      box_len = 0;
+        int                      i;
+
+        ctx = strongbox_ctx_new(global_test_key);
+        CU_ASSERT(NULL != ctx);
+        if (NULL == ctx)
+                return;
+        CU_ASSERT(0 == strongbox_ctx_refill(ctx));
+        CU_ASSERT(1 == strongbox_ctx_keystream(ctx, 4, 64));
+        CU_ASSERT(4 == strongbox_ctx_refill(ctx));
+        CU_ASSERT(0 == strongbox_ctx_refill(ctx));
+
+        /* Each reserved nonce is used for one box only. */
+        for (i = 0; i < 4; i++) {
+                box = strongbox_ctx_seal(ctx, message, message_len, &box_len);
+                CU_ASSERT(NULL != box);
+                if (NULL == box)
+                        continue;
+                memcpy(ivs[i], box, 16);
+                msg = strongbox_open(box, box_len, global_test_key);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, message,
+                                                     message_len));
+                free(msg);
+                free(box);
+        }
+        CU_ASSERT(0 != memcmp(ivs[0], ivs[1], 16));
+        CU_ASSERT(0 != memcmp(ivs[2], ivs[3], 16));
+        strongbox_ctx_keystream_stats(ctx, &hits, &misses);
+        CU_ASSERT(4 == hits && 0 == misses);
+
+        /* An empty reserve and a long message both fall back. */
+        memset(big, 0xa5, sizeof big);
+        box = strongbox_ctx_seal(ctx, message, message_len, &box_len);
+        CU_ASSERT(NULL != box);
+        free(box);
+        CU_ASSERT(4 == strongbox_ctx_refill(ctx));
+        box = strongbox_ctx_seal(ctx, big, sizeof big, &box_len);
+        CU_ASSERT(NULL != box);
+        if (NULL != box) {
+                msg = strongbox_ctx_open(ctx, box, box_len);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, big, sizeof big));
+                free(msg);
+                free(box);
+        }
+        strongbox_ctx_keystream_stats(ctx, &hits, &misses);
+        CU_ASSERT(4 == hits && 2 == misses);
+
+        CU_ASSERT(1 == strongbox_ctx_keystream(ctx, 0, 0));
+        CU_ASSERT(0 == strongbox_ctx_refill(ctx));
+        strongbox_ctx_free(ctx);
+}
+
+
+static void
+test_aad(void)
+{
+        unsigned char            message[] = "Shiny. Let's be bad guys.";
+        int                      message_len = sizeof message;
+        unsigned char            route[] = "route: /ships/serenity";
+        unsigned char            other[] = "route: /ships/serenitz";
+        struct strongbox_ctx    *ctx = NULL;
+        struct iovec             iov[3];
+        unsigned char           *box = NULL;
+        unsigned char           *msg = NULL;
+        int                      box_len = 0;
+
+        ctx = strongbox_ctx_new(global_test_key);
+        CU_ASSERT(NULL != ctx);
+        if (NULL == ctx)
+                return;
+
+        box = strongbox_ctx_seal_aad(ctx, message, message_len, route,
+                                     sizeof route, &box_len);
+        CU_ASSERT(NULL != box);
+        CU_ASSERT(box_len == message_len + (int)STRONGBOX_OVERHEAD);
+        if (NULL != box) {
+                msg = strongbox_ctx_open_aad(ctx, box, box_len, route,
+                                             sizeof route);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, message,
+                                                     message_len));
+                free(msg);
+
+                /* The data may be split any way across the vector. */
+                iov[0].iov_base = route;
+                iov[0].iov_len = 7;
+                iov[1].iov_base = NULL;
+                iov[1].iov_len = 0;
+                iov[2].iov_base = route + 7;
+                iov[2].iov_len = sizeof route - 7;
+                msg = strongbox_ctx_open_aadv(ctx, box, box_len, iov, 3);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, message,
+                                                     message_len));
+                free(msg);
+                CU_ASSERT(1 == strongbox_ctx_verify_aadv(ctx, box, box_len,
+                                                         iov, 3));
+                CU_ASSERT(1 == strongbox_ctx_verify_aad(ctx, box, box_len,
+                                                        route, sizeof route));
+
+                CU_ASSERT(NULL == strongbox_ctx_open_aad(ctx, box, box_len,
+                    other, sizeof other));
+                CU_ASSERT(NULL == strongbox_ctx_open_aad(ctx, box, box_len,
+                    route, sizeof route - 1));
+                CU_ASSERT(0 == strongbox_ctx_verify_aad(ctx, box, box_len,
+                    other, sizeof other));
+                CU_ASSERT(NULL == strongbox_ctx_open(ctx, box, box_len));
+                CU_ASSERT(0 == strongbox_ctx_verify(ctx, box, box_len));
+
+                iov[1].iov_len = 1;
+                CU_ASSERT(NULL == strongbox_ctx_open_aadv(ctx, box, box_len,
+                    iov, 3));
+                CU_ASSERT(NULL == strongbox_ctx_open_aadv(ctx, box, box_len,
+                    iov, -1));
+
+                msg = strongbox_open_aad(box, box_len, route, sizeof route,
+                                         global_test_key);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, message,
+                                                     message_len));
+                free(msg);
+                CU_ASSERT(NULL == strongbox_open_aad(box, box_len, route,
+                    sizeof route, global_bad_key));
+                free(box);
+        }
+
+        /* Boxes without associated data do not open with some. */
+        box = strongbox_seal(message, message_len, &box_len, global_test_key);
+        CU_ASSERT(NULL != box);
+        if (NULL != box) {
+                CU_ASSERT(NULL == strongbox_ctx_open_aad(ctx, box, box_len,
+                    route, sizeof route));
+                msg = strongbox_ctx_open_aad(ctx, box, box_len, NULL, 0);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, message,
+                                                     message_len));
+                free(msg);
+                free(box);
+        }
+
+        box = strongbox_seal_aad(message, message_len, route, sizeof route,
+                                 &box_len, global_test_key);
+        CU_ASSERT(NULL != box);
+        if (NULL != box) {
+                msg = strongbox_ctx_open_aad(ctx, box, box_len, route,
+                                             sizeof route);
+                CU_ASSERT(NULL != msg && 0 == memcmp(msg, message,
+                                                     message_len));
+                free(msg);
+                box[box_len - 1] ^= 1;
+                CU_ASSERT(NULL == strongbox_ctx_open_aad(ctx, box, box_len,
+                    route, sizeof route));
+                free(box);
+        }
+
+        CU_ASSERT(NULL == strongbox_ctx_seal_aadv(ctx, message, message_len,
+            NULL, 1, &box_len));
+        CU_ASSERT(0 == box_len);
+        strongbox_ctx_free(ctx);
+}
+
+
 /*
  * init_test is called each time a test is run, and cleanup is run after
  * every test.
@@ -577,6 +832,14 @@ main(void)
 		fireball();
 	if (NULL == CU_add_test(tsuite, "test vector #9", test_vector9))
 		fireball();
+	if (NULL == CU_add_test(tsuite, "contexts", test_ctx))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "verify", test_verify))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "keystream", test_keystream))
+		fireball();
+	if (NULL == CU_add_test(tsuite, "associated data", test_aad))
+		fireball();
 
 	CU_basic_set_mode(CU_BRM_VERBOSE);
 	CU_basic_run_tests();